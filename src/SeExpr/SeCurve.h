@@ -92,6 +92,9 @@ public:
     //! point, in which case it returns the right point or nothing 
     CV getLowerBoundCV(const double param) const;
 
+    //! Bytes allocated for the control points
+    size_t cvBytes() const { return _cvData.capacity() * sizeof(CV); }
+
     //! Returns whether the given interpolation type is supported
     static bool interpTypeValid(InterpType interp);
 
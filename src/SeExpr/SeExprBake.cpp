@@ -0,0 +1,589 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+/**
+   @file SeExprBake.cpp
+*/
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include "SePlatform.h"
+#include "SeExpression.h"
+#include "SeExprFunc.h"
+#include "SeExprBake.h"
+#include "SeExprStats.h"
+#include "SeExprTrace.h"
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // Acquire loads and release stores of tile states.  These are plain
+    // moves on x86; elsewhere without the builtins, volatile accesses with
+    // a compiler barrier.
+#if defined(__ATOMIC_ACQUIRE)
+    inline char loadAcquire(const char* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+    template<class T> inline void storeRelease(T* p, T value) { __atomic_store_n(p, value, __ATOMIC_RELEASE); }
+#else
+#ifdef WINDOWS
+#define SE_COMPILER_BARRIER() _ReadWriteBarrier()
+#else
+#define SE_COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#endif
+    inline char loadAcquire(const char* p)
+    {
+	char value = *(const volatile char*)p;
+	SE_COMPILER_BARRIER();
+	return value;
+    }
+    template<class T> inline void storeRelease(T* p, T value)
+    {
+	SE_COMPILER_BARRIER();
+	*(volatile T*)p = value;
+    }
+#endif
+
+    const char magic[8] = { 'S', 'E', 'B', 'A', 'K', 'E', '0', '1' };
+    const int headerSize = 64;
+    const int defaultTileSize = 64;
+
+    //! Fields of the header after the magic
+    struct Header
+    {
+	unsigned long long key;
+	uint32_t resolution, tileSize, numLevels, numTiles;
+    };
+
+    inline unsigned long long hashBytes(unsigned long long h, const void* data, size_t n)
+    {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < n; i++) h = (h ^ bytes[i]) * 0x100000001b3ULL;
+	return h;
+    }
+
+    //! Part of a level baked by one thread
+    struct BakeTask
+    {
+	SeExprBake* bake;
+	int level;
+	int* next;
+    };
+
+    void yieldThread()
+    {
+#ifndef WINDOWS
+	sched_yield();
+#else
+	Sleep(0);
+#endif
+    }
+}
+
+
+//! Expression of $u and $v evaluated a tile at a time
+class SeExprBake::Expr : public SeExpression
+{
+ public:
+    Expr(const std::string& expr) : SeExpression(expr) {}
+
+    //! evaluate side x side texels from (x0,y0) of a level 0 of resolution texels
+    void evalTile(int x0, int y0, int side, int resolution, float* out)
+    {
+	int n = side * side;
+	_us.resize(n);
+	_vs.resize(n);
+	_results.resize(n);
+	for (int y = 0; y < side; y++)
+	    for (int x = 0; x < side; x++) {
+		_us[y*side+x] = (x0 + x + .5) / resolution;
+		_vs[y*side+x] = (y0 + y + .5) / resolution;
+	    }
+	_u.setPtr(&_us[0]);
+	_v.setPtr(&_vs[0]);
+	evaluateBatch(n, &_results[0]);
+	for (int i = 0; i < n; i++)
+	    for (int c = 0; c < 3; c++) out[3*i+c] = float(_results[i][c]);
+    }
+
+ private:
+    SeExprVarRef* resolveVar(const std::string& name) const
+    {
+	if (name == "u") return &_u;
+	if (name == "v") return &_v;
+	return 0;
+    }
+
+    mutable SeExprPtrVarRef _u, _v;
+    std::vector<double> _us, _vs;
+    std::vector<SeVec3d> _results;
+};
+
+
+SeExprBake::SeExprBake(const std::string& dir, const std::string& expr, int resolution)
+    : _expr(expr), _resolution(1), _numTiles(0), _map(0), _mapSize(0), _flags(0),
+      _numTilesMade(0)
+{
+    if (resolution > maxResolution) {
+	_tileSize = 1;
+	_error = "Resolution is larger than 65536";
+	return;
+    }
+    while (_resolution < resolution) _resolution *= 2;
+    _tileSize = std::min(_resolution, defaultTileSize);
+
+    _exprs.push_back(new Expr(expr));
+    if (!_exprs[0]->isValid()) {
+	_error = _exprs[0]->parseError();
+	return;
+    }
+    _idleExprs.push_back(_exprs[0]);
+
+    // lay out the levels, with the tile flags and then the tiles after the header
+    for (int size = _resolution; size >= 1; size /= 2) {
+	Level level;
+	level.size = size;
+	level.tileSide = std::min(size, _tileSize);
+	level.tilesPerSide = size / level.tileSide;
+	level.firstTile = int(_numTiles);
+	level.tileBytes = size_t(level.tileSide) * level.tileSide * 3 * sizeof(float);
+	_numTiles += size_t(level.tilesPerSide) * level.tilesPerSide;
+	_levels.push_back(level);
+    }
+    size_t flagsSize = (_numTiles + headerSize - 1) / headerSize * headerSize;
+    size_t offset = headerSize + flagsSize;
+    for (size_t l = 0; l < _levels.size(); l++) {
+	_levels[l].offset = offset;
+	offset += _levels[l].tileBytes * size_t(_levels[l].tilesPerSide) * _levels[l].tilesPerSide;
+    }
+    _mapSize = offset;
+
+    unsigned long long k = key(expr, _resolution);
+    char name[64];
+    snprintf(name, sizeof(name), "seexpr-%016llx.bake", k);
+    _path = dir + "/" + name;
+    if (!mapFile(k)) return;
+
+    _flags = (unsigned char*)_map + headerSize;
+    _state.resize(_numTiles);
+    int found = 0;
+    for (size_t t = 0; t < _numTiles; t++) {
+	_state[t] = _flags[t] ? made : absent;
+	found += _flags[t];
+    }
+    // tiles found in the file are hits, and each tile made later a miss
+    if (SeExprStats::enabled()) SeExprStats::cache(SeExprStats::bakeCache, found, found);
+}
+
+
+SeExprBake::~SeExprBake()
+{
+#ifndef WINDOWS
+    if (_map) munmap(_map, _mapSize);
+#else
+    free(_map);
+#endif
+    for (size_t i = 0; i < _exprs.size(); i++) delete _exprs[i];
+}
+
+
+unsigned long long
+SeExprBake::key(const std::string& expr, int resolution)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    h = hashBytes(h, expr.c_str(), expr.size() + 1);
+    h = hashBytes(h, &resolution, sizeof(resolution));
+
+    // the versions of the functions used
+    SeExpression parsed(expr);
+    std::vector<std::string> names;
+    SeExprFunc::getFunctionNames(names);
+    for (size_t i = 0; i < names.size(); i++) {
+	if (!parsed.usesFunc(names[i])) continue;
+	const SeExprFunc* func = SeExprFunc::lookup(names[i]);
+	int version = func ? func->version() : 0;
+	h = hashBytes(h, names[i].c_str(), names[i].size() + 1);
+	h = hashBytes(h, &version, sizeof(version));
+    }
+    return h;
+}
+
+
+bool
+SeExprBake::mapFile(unsigned long long key)
+{
+    Header header;
+    header.key = key;
+    header.resolution = _resolution;
+    header.tileSize = _tileSize;
+    header.numLevels = uint32_t(_levels.size());
+    header.numTiles = uint32_t(_numTiles);
+
+#ifndef WINDOWS
+    // a complete cache file of this bake, as another process may be
+    // writing tiles into it: its flags say which are made
+    int fd = open(_path.c_str(), O_RDWR);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && size_t(st.st_size) == _mapSize) {
+	void* map = mmap(0, _mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) {
+	    if (!memcmp(map, magic, sizeof(magic)) &&
+		!memcmp((char*)map + sizeof(magic), &header, sizeof(header))) {
+		close(fd);
+		_map = (char*)map;
+		return true;
+	    }
+	    munmap(map, _mapSize);
+	}
+    }
+    if (fd >= 0) close(fd);
+
+    // otherwise make a new file and rename it over whatever was there, so a
+    // file at the path always has its size and header, and a process still
+    // mapping the old file keeps it
+    std::vector<char> temp(_path.begin(), _path.end());
+    const char suffix[] = ".XXXXXX";
+    temp.insert(temp.end(), suffix, suffix + sizeof(suffix));
+    fd = mkstemp(&temp[0]);
+    if (fd < 0) {
+	_error = "Can't open bake cache " + _path;
+	return false;
+    }
+    fchmod(fd, 0644);
+    if (ftruncate(fd, _mapSize) != 0) {
+	close(fd);
+	remove(&temp[0]);
+	_error = "Can't size bake cache " + _path;
+	return false;
+    }
+    void* map = mmap(0, _mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	remove(&temp[0]);
+	_error = "Can't map bake cache " + _path;
+	return false;
+    }
+    _map = (char*)map;
+#else
+    // no cache file, tiles live as long as the bake
+    _map = (char*)calloc(_mapSize, 1);
+#endif
+
+    // (a new file reads as zeros, so no tiles are made)
+    memcpy(_map, magic, sizeof(magic));
+    memcpy(_map + sizeof(magic), &header, sizeof(header));
+#ifndef WINDOWS
+    if (rename(&temp[0], _path.c_str()) != 0) {
+	// still usable, just not shared
+	remove(&temp[0]);
+    }
+#endif
+    return true;
+}
+
+
+float*
+SeExprBake::tile(int level, int tile) const
+{
+    const Level& l = _levels[level];
+    return (float*)(_map + l.offset + size_t(tile - l.firstTile) * l.tileBytes);
+}
+
+
+SeExprBake::TileState
+SeExprBake::tileState(int t) const
+{
+    // the texels are read after the state
+    return TileState(loadAcquire(&_state[t]));
+}
+
+
+void
+SeExprBake::publishTile(int t)
+{
+    // the texels are written before the flag and state
+    storeRelease(&_flags[t], (unsigned char)1);
+    storeRelease(&_state[t], char(made));
+    _numTilesMade++;
+}
+
+
+SeExprBake::Expr*
+SeExprBake::acquireExpr()
+{
+    if (!_exprs[0]->isThreadSafe()) {
+	_evalMutex.lock();
+	return _exprs[0];
+    }
+    Expr* expr = 0;
+    _mutex.lock();
+    if (!_idleExprs.empty()) {
+	expr = _idleExprs.back();
+	_idleExprs.pop_back();
+    }
+    _mutex.unlock();
+    if (expr) return expr;
+
+    // one more thread is evaluating at once; prep it without the lock
+    expr = new Expr(_expr);
+    expr->isValid();
+    _mutex.lock();
+    _exprs.push_back(expr);
+    _mutex.unlock();
+    return expr;
+}
+
+
+void
+SeExprBake::releaseExpr(Expr* expr)
+{
+    if (!_exprs[0]->isThreadSafe()) {
+	_evalMutex.unlock();
+	return;
+    }
+    _mutex.lock();
+    _idleExprs.push_back(expr);
+    _mutex.unlock();
+}
+
+
+void
+SeExprBake::makeTile(int level, int t)
+{
+    SeExprTrace::Scope trace("bakeTile", _expr.c_str());
+    if (SeExprStats::enabled()) SeExprStats::cache(SeExprStats::bakeCache, 1, 0);
+    const Level& l = _levels[level];
+    int index = t - l.firstTile;
+    int x0 = index % l.tilesPerSide * l.tileSide;
+    int y0 = index / l.tilesPerSide * l.tileSide;
+    float* out = tile(level, t);
+    if (level == 0) {
+	Expr* expr = acquireExpr();
+	expr->evalTile(x0, y0, l.tileSide, _resolution, out);
+	releaseExpr(expr);
+	return;
+    }
+
+    // average 2x2 texels of the level below, whose tiles are made
+    const Level& below = _levels[level-1];
+    for (int y = 0; y < l.tileSide; y++)
+	for (int x = 0; x < l.tileSide; x++) {
+	    float sum[3] = { 0, 0, 0 };
+	    for (int j = 0; j < 2; j++)
+		for (int i = 0; i < 2; i++) {
+		    int bx = 2 * (x0 + x) + i, by = 2 * (y0 + y) + j;
+		    int bt = below.firstTile + by / below.tileSide * below.tilesPerSide +
+			bx / below.tileSide;
+		    const float* p = tile(level-1, bt) +
+			3 * (by % below.tileSide * below.tileSide + bx % below.tileSide);
+		    for (int c = 0; c < 3; c++) sum[c] += p[c];
+		}
+	    for (int c = 0; c < 3; c++) out[3*(y*l.tileSide+x)+c] = sum[c] * .25f;
+	}
+}
+
+
+void
+SeExprBake::ensureTile(int level, int t)
+{
+    if (tileState(t) == made) return;
+
+    if (level > 0) {
+	const Level& l = _levels[level];
+	const Level& below = _levels[level-1];
+	int index = t - l.firstTile;
+	// the tiles below covering this one
+	int perTile = l.tileSide * 2 / below.tileSide;
+	int bx0 = index % l.tilesPerSide * perTile, by0 = index / l.tilesPerSide * perTile;
+	for (int by = by0; by < by0 + perTile; by++)
+	    for (int bx = bx0; bx < bx0 + perTile; bx++)
+		ensureTile(level-1, below.firstTile + by * below.tilesPerSide + bx);
+    }
+
+    _mutex.lock();
+    bool claimed = _state[t] == absent;
+    if (claimed) _state[t] = making;
+    _mutex.unlock();
+    if (!claimed) {
+	// being made by another thread
+	while (tileState(t) != made) yieldThread();
+	return;
+    }
+    makeTile(level, t);
+    _mutex.lock();
+    publishTile(t);
+    _mutex.unlock();
+}
+
+
+void
+SeExprBake::texel(int level, int x, int y, double* result)
+{
+    const Level& l = _levels[level];
+    int t = l.firstTile + y / l.tileSide * l.tilesPerSide + x / l.tileSide;
+    ensureTile(level, t);
+    const float* p = tile(level, t) + 3 * (y % l.tileSide * l.tileSide + x % l.tileSide);
+    for (int c = 0; c < 3; c++) result[c] = p[c];
+}
+
+
+SeVec3d
+SeExprBake::lookup(double u, double v, double level)
+{
+    double result[3] = { 0, 0, 0 };
+    if (!isValid()) return SeVec3d(result);
+
+    int numLevels = int(_levels.size());
+    level = std::max(0., std::min(level, numLevels - 1.));
+    int l0 = int(level);
+    double lf = level - l0;
+    for (int l = l0; l <= l0 + 1 && l < numLevels; l++) {
+	double lw = l == l0 ? 1 - lf : lf;
+	if (!lw) continue;
+	int size = _levels[l].size;
+	double s = std::max(0., std::min(u, 1.)) * size - .5;
+	double t = std::max(0., std::min(v, 1.)) * size - .5;
+	int x0 = int(floor(s)), y0 = int(floor(t));
+	double fx = s - x0, fy = t - y0;
+	for (int j = 0; j < 2; j++)
+	    for (int i = 0; i < 2; i++) {
+		double w = lw * (i ? fx : 1 - fx) * (j ? fy : 1 - fy);
+		if (!w) continue;
+		int x = std::max(0, std::min(x0 + i, size - 1));
+		int y = std::max(0, std::min(y0 + j, size - 1));
+		double val[3];
+		texel(l, x, y, val);
+		for (int c = 0; c < 3; c++) result[c] += w * val[c];
+	    }
+    }
+    return SeVec3d(result);
+}
+
+
+void*
+SeExprBake::runBakeTask(void* arg)
+{
+    BakeTask& task = *(BakeTask*)arg;
+    SeExprBake& bake = *task.bake;
+    const Level& l = bake._levels[task.level];
+    int end = l.firstTile + l.tilesPerSide * l.tilesPerSide;
+    while (1) {
+	// claim the next tile not made yet
+	bake._mutex.lock();
+	int t = *task.next;
+	while (t < end && bake._state[t] != absent) t++;
+	*task.next = t + 1;
+	if (t < end) bake._state[t] = making;
+	bake._mutex.unlock();
+	if (t >= end) break;
+
+	bake.makeTile(task.level, t);
+
+	bake._mutex.lock();
+	bake.publishTile(t);
+	bake._mutex.unlock();
+    }
+    return 0;
+}
+
+
+void
+SeExprBake::bakeAll(int numThreads)
+{
+    if (!isValid()) return;
+    if (numThreads <= 0) {
+#ifndef WINDOWS
+	numThreads = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+#else
+	numThreads = 1;
+#endif
+    }
+    if (!_exprs[0]->isThreadSafe()) numThreads = 1;
+
+    // a level at a time, since each level is made from the one below
+    for (int level = 0; level < int(_levels.size()); level++) {
+	const Level& l = _levels[level];
+	int n = std::max(1, std::min(numThreads, l.tilesPerSide * l.tilesPerSide));
+	int next = l.firstTile;
+	std::vector<BakeTask> tasks(n);
+	for (int t = 0; t < n; t++) {
+	    BakeTask task = { this, level, &next };
+	    tasks[t] = task;
+	}
+#ifndef WINDOWS
+	std::vector<pthread_t> threads(n);
+	std::vector<bool> started(n, false);
+	for (int t = 1; t < n; t++)
+	    started[t] = pthread_create(&threads[t], 0, runBakeTask, &tasks[t]) == 0;
+	runBakeTask(&tasks[0]);
+	for (int t = 1; t < n; t++)
+	    if (started[t]) pthread_join(threads[t], 0);
+#else
+	runBakeTask(&tasks[0]);
+#endif
+	// tiles lookups were making when the tasks passed them
+	for (int t = l.firstTile; t < l.firstTile + l.tilesPerSide * l.tilesPerSide; t++)
+	    while (tileState(t) != made) yieldThread();
+    }
+}
+
+
+SeExprBake*
+SeExprBake::shared(const std::string& expr, int resolution)
+{
+    static SeExprInternal::Mutex mutex;
+    static std::map<std::pair<std::string, int>, SeExprBake*> bakes;
+
+    const char* dir = getenv("SE_EXPR_BAKE_DIR");
+    if (!dir || !*dir) return 0;
+    std::pair<std::string, int> name(expr, resolution);
+    mutex.lock();
+    SeExprBake* bake = bakes[name];
+    mutex.unlock();
+    if (bake) return bake;
+
+    // made without the lock, as prepping expr may look up other bakes
+    bake = new SeExprBake(dir, expr, resolution);
+    mutex.lock();
+    SeExprBake*& entry = bakes[name];
+    if (entry) delete bake;
+    else entry = bake;
+    bake = entry;
+    mutex.unlock();
+    return bake;
+}
@@ -0,0 +1,168 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+#ifndef SeExprBake_h
+#define SeExprBake_h
+
+#include <string>
+#include <vector>
+#include "SeVec3d.h"
+#include "SeMutex.h"
+
+class SeExpression;
+
+//! An expression of $u and $v baked into a tiled, mipmapped cache file.
+/** Texel (x,y) of the finest level is the expression at
+    u=(x+.5)/resolution, v=(y+.5)/resolution, and each coarser level
+    averages 2x2 texels of the one below.  Tiles are made when a lookup
+    first needs them, or all at once by bakeAll().  They are written
+    straight into the memory mapped cache file, so a later bake of the
+    same expression (even in another process) reuses them.
+
+    The cache file is named after a key hashed from the expression text,
+    the resolution, and the version (SeExprFunc::setVersion()) of each
+    function the expression calls.  Its layout, in native byte order:
+
+    @verbatim
+    header, 64 bytes:
+        char     magic[8]      "SEBAKE01"
+        uint64   key
+        uint32   resolution    texels along a side of level 0, a power of two
+        uint32   tileSize      texels along a side of a tile, a power of two
+        uint32   numLevels     levels, down to a single texel
+        uint32   numTiles      tiles of all levels
+        zero padding
+    tile flags, numTiles bytes padded to a multiple of 64:
+        1 once the tile has been written, else 0
+    tiles, level 0 first, the tiles of each level in rows from v=0:
+        min(tileSize, level size)^2 texels in rows from v=0,
+        each 3 floats
+    @endverbatim
+
+    Tiles are listed in the flags in the same order as they are stored.
+    A new cache file is sized and given its header under a temporary
+    name and then renamed into place, so the file at the cache path is
+    always complete and is never truncated; processes sharing it only
+    set the flags of tiles they have written.
+    Lookups are thread safe, and take no lock once the tiles they read
+    are made.  A missing tile is made by the thread that first needs it,
+    outside the lock and with an expression of its own; threads needing
+    the same tile wait for it. */
+class SeExprBake
+{
+ public:
+    //! Largest resolution a bake can have
+    enum { maxResolution = 65536 };
+
+    //! Bake expr at resolution (rounded up to a power of two, and at most
+    //! maxResolution) into a cache file in dir
+    SeExprBake(const std::string& dir, const std::string& expr, int resolution);
+    ~SeExprBake();
+
+    //! Whether the expression could be baked, and why not
+    bool isValid() const { return _error.empty(); }
+    const std::string& error() const { return _error; }
+
+    const std::string& path() const { return _path; }
+    int resolution() const { return _resolution; }
+    int numLevels() const { return int(_levels.size()); }
+
+    //! Make every tile not made yet, on numThreads threads (zero uses
+    //! one thread per cpu)
+    void bakeAll(int numThreads=0);
+
+    //! Bilinear lookup at a level, blending the nearest two levels for
+    //! a fractional level.  u and v are clamped to [0,1].
+    SeVec3d lookup(double u, double v, double level=0);
+
+    //! Tiles made by this object (the others were read from the cache)
+    int numTilesMade() const { return _numTilesMade; }
+
+    //! Key of an expression baked at a resolution
+    static unsigned long long key(const std::string& expr, int resolution);
+
+    //! Shared bake of expr in the directory named by the SE_EXPR_BAKE_DIR
+    //! environment variable, made on first use and kept for the life of
+    //! the process.  Null if the variable isn't set.
+    static SeExprBake* shared(const std::string& expr, int resolution);
+
+ private:
+    SeExprBake(const SeExprBake&);
+    SeExprBake& operator=(const SeExprBake&);
+
+    class Expr;
+    struct Level
+    {
+	int size, tileSide, tilesPerSide, firstTile;
+	size_t offset, tileBytes;
+    };
+    enum TileState { absent, making, made };
+
+    bool mapFile(unsigned long long key);
+    float* tile(int level, int tile) const;
+    //! state of a tile, its texels readable once made
+    TileState tileState(int tile) const;
+    //! mark a tile made by this thread (with the lock held)
+    void publishTile(int tile);
+    //! make a tile and those below it if needed
+    void ensureTile(int level, int tile);
+    void makeTile(int level, int tile);
+    //! an expression for this thread to evaluate, and its return
+    Expr* acquireExpr();
+    void releaseExpr(Expr* expr);
+    void texel(int level, int x, int y, double* result);
+    static void* runBakeTask(void* arg);
+
+    std::string _expr;
+    std::string _error;
+    std::string _path;
+    int _resolution, _tileSize;
+    std::vector<Level> _levels;
+    size_t _numTiles;
+    //! mapped cache file: header, flags and tiles
+    char* _map;
+    size_t _mapSize;
+    unsigned char* _flags;
+    //! TileStates, read without the lock
+    std::vector<char> _state;
+    //! every expression made, and those no thread is evaluating
+    std::vector<Expr*> _exprs, _idleExprs;
+    int _numTilesMade;
+    //! guards claiming tiles, the counts and the expression lists
+    SeExprInternal::Mutex _mutex;
+    //! serializes evaluations of an expression that isn't thread safe
+    SeExprInternal::Mutex _evalMutex;
+};
+
+#endif
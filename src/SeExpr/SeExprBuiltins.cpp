@@ -47,6 +47,7 @@
 #include "SeExprBuiltins.h"
 #include "SePlatform.h"
 #include "SeNoise.h"
+#include "SeExprBake.h"
 
 namespace SeExpr {
 
@@ -113,6 +114,18 @@ static const char* turbulence_docstring="float turbulence(vector v,int octaves=6
 static const char* cturbulence_docstring="color cturbulence(vector v,int octaves=6,float lacunarity=2,float gain=.5)\nAbsolute value of each noise term is taken. This gives billowy appearance";
 static const char* vturbulence_docstring="vector vturbulence(vector v,int octaves=6,float lacunarity=2,float gain=.5)\nAbsolute value of each noise term is taken. This gives billowy appearance";
 
+// array forms of the math.h functions, see SeExprMath
+static void sinKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+{ SeExprMath::sin(accuracy, n, args[0], results); }
+static void cosKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+{ SeExprMath::cos(accuracy, n, args[0], results); }
+static void expKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+{ SeExprMath::exp(accuracy, n, args[0], results); }
+static void logKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+{ SeExprMath::log(accuracy, n, args[0], results); }
+static void powKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+{ SeExprMath::pow(accuracy, n, args[0], args[1], results); }
+
 
 
 
@@ -153,6 +166,40 @@ static const char* vturbulence_docstring="vector vturbulence(vector v,int octave
     }
     static const char* bias_docstring="float bias(float x, float g)\nVariation of gamma where values less than 0.5 pull the curve down\nand values greater than 0.5 pull the curve up\npow(x,log(b)/log(0.5))";
 
+    //! Array forms of gamma() and bias(); the exponents are computed in a
+    //! chunk so the powers can go through SeExprMath::pow together.
+    static const int kernelChunk = 64;
+
+    static void gammaKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+    {
+	if (accuracy == SeExprMath::exact) {
+	    for (int i = 0; i < n; i++) results[i] = gamma(args[0][i], args[1][i]);
+	    return;
+	}
+	double e[kernelChunk];
+	for (int base = 0; base < n; base += kernelChunk) {
+	    int m = std::min(n - base, kernelChunk);
+	    for (int i = 0; i < m; i++) e[i] = 1/args[1][base+i];
+	    SeExprMath::pow(accuracy, m, args[0] + base, e, results + base);
+	}
+    }
+
+    static void biasKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+    {
+	if (accuracy == SeExprMath::exact) {
+	    for (int i = 0; i < n; i++) results[i] = bias(args[0][i], args[1][i]);
+	    return;
+	}
+	static const double C = 1/log(0.5);
+	double e[kernelChunk];
+	for (int base = 0; base < n; base += kernelChunk) {
+	    int m = std::min(n - base, kernelChunk);
+	    SeExprMath::log(accuracy, m, args[1] + base, e);
+	    for (int i = 0; i < m; i++) e[i] *= C;
+	    SeExprMath::pow(accuracy, m, args[0] + base, e, results + base);
+	}
+    }
+
 
     double contrast(double x, double c)
     {
@@ -213,6 +260,45 @@ static const char* vturbulence_docstring="vector vturbulence(vector v,int octave
     }
     static const char* gaussstep_docstring="float gasussstep(float x,float a,float b)\n if x &lt; a then 0, if x &gt; b then 1, and\nx transitions smoothly (exponentially) when &lt; x &lt; b";
 
+    //! Array form of smoothstep(); there's no library call to speed up so
+    //! every accuracy gives the same results.
+    static void smoothstepKernel(SeExprMath::Accuracy, int n, const double* const* args, double* results)
+    {
+	for (int i = 0; i < n; i++) results[i] = smoothstep(args[0][i], args[1][i], args[2][i]);
+    }
+
+    //! Array form of gaussstep(); the steps are found per element and the
+    //! falloffs of those in transition computed together.
+    static void gaussstepKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results)
+    {
+	if (accuracy == SeExprMath::exact) {
+	    for (int i = 0; i < n; i++) results[i] = gaussstep(args[0][i], args[1][i], args[2][i]);
+	    return;
+	}
+	double t[kernelChunk], f[kernelChunk];
+	int idx[kernelChunk];
+	for (int base = 0; base < n; base += kernelChunk) {
+	    int m = std::min(n - base, kernelChunk), k = 0;
+	    for (int i = 0; i < m; i++) {
+		double x = args[0][base+i], a = args[1][base+i], b = args[2][base+i];
+		double* r = results + base + i;
+		if (a < b) {
+		    if (x < a) { *r = 0; continue; }
+		    if (x >= b) { *r = 1; continue; }
+		    x = 1 - (x - a)/(b - a);
+		} else if (a > b) {
+		    if (x <= b) { *r = 1; continue; }
+		    if (x > a) { *r = 0; continue; }
+		    x = (x - b)/(a - b);
+		} else { *r = boxstep(x, a); continue; }
+		t[k] = -8*x*x;
+		idx[k++] = i;
+	    }
+	    SeExprMath::exp2(accuracy, k, t, f);
+	    for (int j = 0; j < k; j++) results[base + idx[j]] = f[j];
+	}
+    }
+
 
 
     double remap(double x, double source, double range, double falloff,
@@ -478,58 +564,370 @@ static const char* vturbulence_docstring="vector vturbulence(vector v,int octave
         "The color is scaled around the rec709 luminance value,\n"
         "and negative results are clamped at zero.\n";
 
-    double hash(int n, double* args)
+
+    // Batch forms of the color functions.  These convert blocks of
+    // points held as separate r, g and b (or h, s and l) arrays, and
+    // compute every branch of the scalar code and select per point, so
+    // the inner loops have no data dependent branches and can be
+    // vectorized.  Results match the scalar functions exactly.
+    namespace {
+	enum { colorBlockSize = 64 };
+
+	struct ColorBlock
+	{
+	    double c[3][colorBlockSize];
+
+	    void load(int m, const SeVec3d* v)
+	    {
+		for (int i = 0; i < m; i++) {
+		    c[0][i] = v[i][0]; c[1][i] = v[i][1]; c[2][i] = v[i][2];
+		}
+	    }
+	    void store(int m, SeVec3d* v) const
+	    {
+		for (int i = 0; i < m; i++)
+		    v[i].setValue(c[0][i], c[1][i], c[2][i]);
+	    }
+	};
+
+	void rgbtohslBlock(int m, const ColorBlock& rgb, ColorBlock& hsl)
+	{
+	    const double *R = rgb.c[0], *G = rgb.c[1], *B = rgb.c[2];
+	    double *H = hsl.c[0], *S = hsl.c[1], *L = hsl.c[2];
+	    for (int i = 0; i < m; i++) {
+		double r = R[i], g = G[i], b = B[i];
+		double x = r<g? (r<b? r:b) : (g<b? g:b);
+		double y = r>g? (r>b? r:b) : (g>b? g:b);
+		double sum = x+y, diff = y-x;
+		double l = sum/2;
+		double s = l <= .5 ? (x < 0 ? 1-x : diff/sum)
+		                   : (y > 1 ? y : diff/(2-sum));
+		double h = r == y ? (g - b) / diff
+		         : g == y ? (b - r) / diff + 2
+		         :          (r - g) / diff + 4;
+		h *= 1/6.;
+		h = (h < 0 || h > 1) ? h - floor(h) : h;
+		bool achromatic = diff < 1e-6;
+		H[i] = achromatic ? 0 : h;
+		S[i] = achromatic ? 0 : s;
+		L[i] = l;
+	    }
+	}
+
+	inline double hslvalueSelect(double x, double y, double H)
+	{
+	    H = (H < 0 || H > 1) ? H - floor(H) : H;
+	    return H < 1/6. ? x+(y-x)*H*6
+		 : H < 3/6. ? y
+		 : H < 4/6. ? x+(y-x)*(4/6.-H)*6
+		 : x;
+	}
+
+	void hsltorgbBlock(int m, const ColorBlock& hsl, ColorBlock& rgb)
+	{
+	    const double *H = hsl.c[0], *S = hsl.c[1], *L = hsl.c[2];
+	    double *R = rgb.c[0], *G = rgb.c[1], *B = rgb.c[2];
+	    for (int i = 0; i < m; i++) {
+		double h = H[i], s = S[i], l = L[i];
+		double y = l < 0.5 ? (s > 1 ? 2*l + s - 1 : l + l*s)
+		                   : (s > 1 ? s : l + s - l*s);
+		double x = 2*l-y;
+		bool achromatic = s <= 0;
+		R[i] = achromatic ? l : hslvalueSelect(x,y,h+(1/3.));
+		G[i] = achromatic ? l : hslvalueSelect(x,y,h);
+		B[i] = achromatic ? l : hslvalueSelect(x,y,h-(1/3.));
+	    }
+	}
+
+	void satAdjustBlock(int m, const ColorBlock& rgb, const double* sat,
+			    const double* inten, ColorBlock& out)
+	{
+	    const double *R = rgb.c[0], *G = rgb.c[1], *B = rgb.c[2];
+	    for (int i = 0; i < m; i++) {
+		double r = R[i], g = G[i], b = B[i];
+		double x = std::min(std::min(r,g),b);
+		double y = std::max(std::max(r,g),b);
+		double L = 0.5 * (x+y);
+		double Slo = (x < 0 ? 1-x : (y-x)/(y+x)) * sat[i];
+		double Shi = (y > 1 ? y : (y-x)/(2-(y+x))) * sat[i];
+		double y2 = L <= .5 ? (Slo > 1 ? 2*L + Slo - 1 : L + L*Slo)
+		                    : (Shi > 1 ? Shi : L + Shi - L*Shi);
+		double x2 = 2*L-y2;
+		double t = inten[i]/(y-x);
+		double scale = (y2-x2)*t, offset = (y*x2 - x*y2)*t;
+		bool achromatic = x == y;
+		out.c[0][i] = achromatic ? r*inten[i] : scale*r + offset;
+		out.c[1][i] = achromatic ? g*inten[i] : scale*g + offset;
+		out.c[2][i] = achromatic ? b*inten[i] : scale*b + offset;
+	    }
+	}
+
+	/// hsiAdjust of a block; the hue and saturation paths are skipped
+	/// for blocks that don't need them
+	void hsiAdjustBlock(int m, const ColorBlock& rgb, double* h,
+			    const double* s, const double* inten, ColorBlock& out)
+	{
+	    bool anyHue = false, anySat = false;
+	    for (int i = 0; i < m; i++) {
+		anyHue |= h[i] != 0;
+		anySat |= h[i] == 0 && s[i] != 1;
+	    }
+
+	    ColorBlock full, sat;
+	    if (anyHue) {
+		ColorBlock hsl;
+		rgbtohslBlock(m, rgb, hsl);
+		for (int i = 0; i < m; i++) {
+		    hsl.c[0][i] += h[i] * (1.0/360);
+		    hsl.c[1][i] *= s[i];
+		}
+		hsltorgbBlock(m, hsl, full);
+	    }
+	    if (anySat) satAdjustBlock(m, rgb, s, inten, sat);
+
+	    for (int c = 0; c < 3; c++) {
+		const double* in = rgb.c[c];
+		const double* f = full.c[c];
+		const double* a = sat.c[c];
+		double* o = out.c[c];
+		for (int i = 0; i < m; i++) {
+		    double v = h[i] != 0 ? f[i] : s[i] == 1 ? in[i] : a[i];
+		    o[i] = h[i] != 0 || s[i] == 1 ? v * inten[i] : v;
+		}
+	    }
+	}
+    }
+
+    void hsiBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results)
     {
-	// combine args into a single seed
-	uint32_t seed = 0;
-	for (int i = 0; i < n; i++) {
-	    // make irrational to generate fraction and combine xor into 32 bits
-	    int exp;
-	    double frac = frexp(args[i] * (M_E*M_PI), &exp);
-	    uint32_t s = (uint32_t) (frac * UINT32_MAX) ^ (uint32_t) exp;
+	double h[colorBlockSize], s[colorBlockSize], i[colorBlockSize];
+	ColorBlock rgb, out;
+	for (int base = 0; base < n; base += colorBlockSize) {
+	    int m = std::min(n - base, (int)colorBlockSize);
+	    if (nargs < 4) {
+		for (int k = 0; k < m; k++) results[base+k] = 0.0;
+		continue;
+	    }
+	    for (int k = 0; k < m; k++) {
+		h[k] = args[1][base+k][0];
+		s[k] = args[2][base+k][0];
+		i[k] = args[3][base+k][0];
+	    }
+	    if (nargs >= 5) {
+		// apply mask
+		for (int k = 0; k < m; k++) {
+		    double mask = args[4][base+k][0];
+		    h[k] *= mask;
+		    s[k] = (s[k] - 1) * mask + 1;
+		    i[k] = (i[k] - 1) * mask + 1;
+		}
+	    }
+	    rgb.load(m, args[0] + base);
+	    hsiAdjustBlock(m, rgb, h, s, i, out);
+	    out.store(m, results + base);
+	}
+    }
 
-	    // blend with seed (constants from Numerical Recipes, attrib. from Knuth)
-	    static const uint32_t M = 1664525, C = 1013904223;
-	    seed = seed * M + s + C;
+    void midhsiBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	double h[colorBlockSize], s[colorBlockSize], i[colorBlockSize];
+	ColorBlock rgb, out;
+	for (int base = 0; base < n; base += colorBlockSize) {
+	    int m = std::min(n - base, (int)colorBlockSize);
+	    if (nargs < 4) {
+		for (int k = 0; k < m; k++) results[base+k] = 0.0;
+		continue;
+	    }
+	    for (int k = 0; k < m; k++) {
+		h[k] = args[1][base+k][0];
+		s[k] = args[2][base+k][0];
+		i[k] = args[3][base+k][0];
+	    }
+	    if (nargs >= 5) {
+		// remap and apply the mask as midhsi does
+		for (int k = 0; k < m; k++) {
+		    double mask = args[4][base+k][0] * 2 - 1;
+		    double falloff = nargs >= 6 ? args[5][base+k][0] : 1;
+		    double interp = nargs >= 7 ? args[6][base+k][0] : 0;
+		    if (mask < 0) mask = -remap(-mask, 1, 0, falloff, interp);
+		    else          mask =  remap( mask, 1, 0, falloff, interp);
+		    h[k] *= mask;
+		    float absm = fabs(mask);
+		    s[k] = s[k] * absm + 1 - absm;
+		    i[k] = i[k] * absm + 1 - absm;
+		    if (mask < 0) {
+			s[k] = 1/s[k];
+			i[k] = 1/i[k];
+		    }
+		}
+	    }
+	    rgb.load(m, args[0] + base);
+	    hsiAdjustBlock(m, rgb, h, s, i, out);
+	    out.store(m, results + base);
 	}
+    }
 
-	// tempering (from Matsumoto)
+    void rgbtohslBatch(int, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	ColorBlock rgb, hsl;
+	for (int base = 0; base < n; base += colorBlockSize) {
+	    int m = std::min(n - base, (int)colorBlockSize);
+	    rgb.load(m, args[0] + base);
+	    rgbtohslBlock(m, rgb, hsl);
+	    hsl.store(m, results + base);
+	}
+    }
+
+    void hsltorgbBatch(int, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	ColorBlock hsl, rgb;
+	for (int base = 0; base < n; base += colorBlockSize) {
+	    int m = std::min(n - base, (int)colorBlockSize);
+	    hsl.load(m, args[0] + base);
+	    hsltorgbBlock(m, hsl, rgb);
+	    rgb.store(m, results + base);
+	}
+    }
+
+    void saturateBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	if (nargs < 2) {
+	    for (int k = 0; k < n; k++) results[k] = 0.0;
+	    return;
+	}
+	ColorBlock in;
+	for (int base = 0; base < n; base += colorBlockSize) {
+	    int m = std::min(n - base, (int)colorBlockSize);
+	    in.load(m, args[0] + base);
+	    double lum[colorBlockSize], amt[colorBlockSize];
+	    for (int k = 0; k < m; k++) {
+		// rec709 luminance
+		lum[k] = in.c[0][k]*.2126 + in.c[1][k]*.7152 + in.c[2][k]*.0722;
+		amt[k] = args[1][base+k][0];
+	    }
+	    for (int c = 0; c < 3; c++) {
+		double* v = in.c[c];
+		for (int k = 0; k < m; k++) {
+		    double r = lum[k] * (1-amt[k]) + v[k] * amt[k];
+		    v[k] = r < 0 ? 0 : r;
+		}
+	    }
+	    in.store(m, results + base);
+	}
+    }
+
+    // permutation table for hash()
+    static const unsigned char hashPermTable[256] = {
+	148,201,203,34,85,225,163,200,174,137,51,24,19,252,107,173,
+	110,251,149,69,180,152,141,132,22,20,147,219,37,46,154,114,
+	59,49,155,161,239,77,47,10,70,227,53,235,30,188,143,73,
+	88,193,214,194,18,120,176,36,212,84,211,142,167,57,153,71,
+	159,151,126,115,229,124,172,101,79,183,32,38,68,11,67,109,
+	221,3,4,61,122,94,72,117,12,240,199,76,118,5,48,197,
+	128,62,119,89,14,45,226,195,80,50,40,192,60,65,166,106,
+	90,215,213,232,250,207,104,52,182,29,157,103,242,97,111,17,
+	8,175,254,108,208,224,191,112,105,187,43,56,185,243,196,156,
+	246,249,184,7,135,6,158,82,130,234,206,255,160,236,171,230,
+	42,98,54,74,209,205,33,177,15,138,178,44,116,96,140,253,
+	233,125,21,133,136,86,245,58,23,1,75,165,92,217,39,0,
+	218,91,179,55,238,170,134,83,25,189,216,100,129,150,241,210,
+	123,99,2,164,16,220,121,139,168,64,190,9,31,228,95,247,
+	244,81,102,145,204,146,26,87,113,198,181,127,237,169,28,93,
+	27,41,231,248,78,162,13,186,63,66,131,202,35,144,222,223};
+
+    //! hash() seed for one argument: make irrational to generate fraction
+    //! and combine xor into 32 bits
+    inline uint32_t hashSeed(double arg)
+    {
+	// frexp, done on the bits for normal numbers so it can be inlined
+	// (zero, denormals, inf and nan go through the library)
+	union { double d; uint64_t i; } u;
+	u.d = arg * (M_E*M_PI);
+	int exp;
+	double frac;
+	uint32_t biased = uint32_t(u.i >> 52) & 0x7ff;
+	if (biased != 0 && biased != 0x7ff) {
+	    exp = int(biased) - 1022;
+	    u.i = (u.i & ~(uint64_t(0x7ff) << 52)) | (uint64_t(1022) << 52);
+	    frac = u.d;
+	} else {
+	    // inf and nan seed 0, as the conversion below gave them on x86
+	    if (u.d - u.d != 0) return 0;
+	    frac = frexp(u.d, &exp);
+	}
+	// through int64 so negative fractions wrap the same way everywhere
+	// (a direct conversion to unsigned is undefined for them)
+	return (uint32_t) (int64_t) (frac * UINT32_MAX) ^ (uint32_t) exp;
+    }
+
+    //! blend a seed into the hash (constants from Numerical Recipes, attrib. from Knuth)
+    inline uint32_t hashBlend(uint32_t seed, uint32_t s)
+    {
+	static const uint32_t M = 1664525, C = 1013904223;
+	return seed * M + s + C;
+    }
+
+    //! temper (from Matsumoto), permute and scale to [0.0 .. 1.0]
+    inline double hashFinish(uint32_t seed)
+    {
 	seed ^= (seed >> 11);
 	seed ^= (seed << 7) & 0x9d2c5680UL;
 	seed ^= (seed << 15) & 0xefc60000UL;
 	seed ^= (seed >> 18);
 
-	// permute 
-	static unsigned char p[256] = {
-	    148,201,203,34,85,225,163,200,174,137,51,24,19,252,107,173,
-	    110,251,149,69,180,152,141,132,22,20,147,219,37,46,154,114,
-	    59,49,155,161,239,77,47,10,70,227,53,235,30,188,143,73,
-	    88,193,214,194,18,120,176,36,212,84,211,142,167,57,153,71,
-	    159,151,126,115,229,124,172,101,79,183,32,38,68,11,67,109,
-	    221,3,4,61,122,94,72,117,12,240,199,76,118,5,48,197,
-	    128,62,119,89,14,45,226,195,80,50,40,192,60,65,166,106,
-	    90,215,213,232,250,207,104,52,182,29,157,103,242,97,111,17,
-	    8,175,254,108,208,224,191,112,105,187,43,56,185,243,196,156,
-	    246,249,184,7,135,6,158,82,130,234,206,255,160,236,171,230,
-	    42,98,54,74,209,205,33,177,15,138,178,44,116,96,140,253,
-	    233,125,21,133,136,86,245,58,23,1,75,165,92,217,39,0,
-	    218,91,179,55,238,170,134,83,25,189,216,100,129,150,241,210,
-	    123,99,2,164,16,220,121,139,168,64,190,9,31,228,95,247,
-	    244,81,102,145,204,146,26,87,113,198,181,127,237,169,28,93,
-	    27,41,231,248,78,162,13,186,63,66,131,202,35,144,222,223};
  	union {
 	    uint32_t i;
 	    unsigned char c[4];
 	} u1, u2;
 	u1.i = seed;
-	u2.c[3] = p[u1.c[0]];
-	u2.c[2] = p[(u1.c[1]+u2.c[3])&0xff];
-	u2.c[1] = p[(u1.c[2]+u2.c[2])&0xff];
-	u2.c[0] = p[(u1.c[3]+u2.c[1])&0xff];
-
-	// scale to [0.0 .. 1.0]
+	u2.c[3] = hashPermTable[u1.c[0]];
+	u2.c[2] = hashPermTable[(u1.c[1]+u2.c[3])&0xff];
+	u2.c[1] = hashPermTable[(u1.c[2]+u2.c[2])&0xff];
+	u2.c[0] = hashPermTable[(u1.c[3]+u2.c[1])&0xff];
 	return u2.i * (1.0/UINT32_MAX);
     }
+
+    double hash(int n, double* args)
+    {
+	// combine args into a single seed
+	uint32_t seed = 0;
+	for (int i = 0; i < n; i++)
+	    seed = hashBlend(seed, hashSeed(args[i]));
+	return hashFinish(seed);
+    }
+
+    void hashBatch(int count, int n, const double* args, double* results)
+    {
+	// work across a block of calls at a time so each stage is a
+	// simple loop over independent values
+	const int block = 64;
+	uint32_t seeds[block];
+	for (int start = 0; start < count; start += block) {
+	    int num = std::min(block, count - start);
+	    const double* blockArgs = args + start * n;
+	    for (int j = 0; j < num; j++) seeds[j] = 0;
+	    for (int i = 0; i < n; i++)
+		for (int j = 0; j < num; j++)
+		    seeds[j] = hashBlend(seeds[j], hashSeed(blockArgs[j*n+i]));
+	    for (int j = 0; j < num; j++)
+		results[start+j] = hashFinish(seeds[j]);
+	}
+    }
+
+    static void hashFuncBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	const int block = 64;
+	double* blockArgs = (double*) alloca(sizeof(double) * block * nargs);
+	double vals[block];
+	for (int base = 0; base < n; base += block) {
+	    int m = std::min(n - base, block);
+	    for (int j = 0; j < m; j++)
+		for (int i = 0; i < nargs; i++) blockArgs[j*nargs+i] = args[i][base+j][0];
+	    hashBatch(m, nargs, blockArgs, vals);
+	    for (int j = 0; j < m; j++) results[base+j][0] = vals[j];
+	}
+    }
+
     static const char* hash_docstring=
         "float hash(float seed1,[float seed2, ...])\n"
         "Like rand, but with no internal seeds. Any number of seeds may be given\n"
@@ -799,6 +1197,173 @@ static const char* vnoise_docstring=
     static const char* cfbm4_docstring="color cfbm4(vector v,float time,int octaves=6,float lacunarity=2,float gain=.5)";
 
 
+    double simplex(int n, const SeVec3d* args)
+    {
+        if (n < 1) return 0;
+        double result;
+        if (n == 1) {
+            // 1 arg = vector arg
+            double p[3] = { args[0][0], args[0][1], args[0][2] };
+            Simplex<3,1>(p,&result);
+            return .5*result+.5;
+        }
+        // scalar args
+        if (n > 4) n = 4;
+        double p[4];
+        for (int i = 0; i < n; i++) p[i] = args[i][0];
+        switch(n){
+            case 2: Simplex<2,1>(p,&result);break;
+            case 3: Simplex<3,1>(p,&result);break;
+            case 4: Simplex<4,1>(p,&result);break;
+            default: result=0;break;
+        }
+        return .5*result+.5;
+    }
+    static const char* simplex_docstring=
+        "float simplex ( vector v ) <br>\n"
+        "float simplex ( float x, float y )\n"
+        "float simplex ( float x, float y, float z )\n"
+        "float simplex ( float x, float y, float z, float w )\n"
+        "Simplex noise at location. Similar in look to noise but blends d+1\n"
+        "lattice points instead of 2^d, so it is much cheaper in 4D";
+
+    double ssimplex(const SeVec3d& p)
+    {
+	double result;
+	double args[3] = { p[0], p[1], p[2] };
+        Simplex<3,1>(args,&result);
+        return result;
+    }
+    static const char* ssimplex_docstring=
+        "float ssimplex ( vector v)\n"
+        "signed simplex noise w/ range -1 to 1";
+
+    SeVec3d vsimplex(const SeVec3d& p)
+    {
+	double result[3];
+	double args[3] = { p[0], p[1], p[2] };
+        Simplex<3,3>(args,result);
+        return SeVec3d(result);
+    }
+    static const char* vsimplex_docstring=
+        "vector vsimplex ( vector v)\n"
+        "vector noise formed with simplex noise";
+
+    SeVec3d csimplex(const SeVec3d& p)
+    {
+        return (.5 * vsimplex(p)) + SeVec3d(.5);
+    }
+    static const char* csimplex_docstring="color csimplex ( vector v)\n"
+        "color noise formed with simplex noise";
+
+    double ssimplex4(int /*n*/, const SeVec3d* args)
+    {
+	double result;
+	double procargs[4] = { args[0][0], args[0][1], args[0][2], args[1][0] };
+        Simplex<4,1>(procargs,&result);
+        return result;
+    }
+    static const char* ssimplex4_docstring="float ssimplex4 ( vector v,float t)\n"
+        "4D signed simplex noise w/ range -1 to 1";
+
+    SeVec3d vsimplex4(int /*n*/, const SeVec3d* args)
+    {
+	double result[3];
+	double procargs[4] = { args[0][0], args[0][1], args[0][2], args[1][0] };
+        Simplex<4,3>(procargs,result);
+	return SeVec3d(result);
+    }
+    static const char* vsimplex4_docstring="vector vsimplex4 ( vector v,float t)\n"
+        "4D vector noise formed with simplex noise";
+
+    SeVec3d csimplex4(int n, const SeVec3d* args)
+    {
+        return (.5 * vsimplex4(n,args)) + SeVec3d(.5);
+    }
+    static const char* csimplex4_docstring="color csimplex4 ( vector v,float t)\n"
+        "4D color noise formed with simplex noise";
+
+    //! reads the arguments of the simplexfbm functions, d is 3 or 4 (with time)
+    static void simplexFbmArgs(int d, int n, const SeVec3d* args, double* P,
+			       int& octaves, double& lacunarity, double& gain)
+    {
+	octaves = 6;
+	lacunarity = 2;
+	gain = 0.5;
+	P[0] = P[1] = P[2] = P[3] = 0;
+	if (n > 0) { P[0] = args[0][0]; P[1] = args[0][1]; P[2] = args[0][2]; }
+	int first = 1;
+	if (d == 4) {
+	    if (n > 1) P[3] = args[1][0];
+	    first = 2;
+	}
+	if (n > first) octaves = int(clamp(args[first][0], 1, 8));
+	if (n > first+1) lacunarity = args[first+1][0];
+	if (n > first+2) gain = args[first+2][0];
+    }
+
+    double simplexfbm(int n, const SeVec3d* args)
+    {
+	double P[4], lacunarity, gain;
+	int octaves;
+	simplexFbmArgs(3, n, args, P, octaves, lacunarity, gain);
+	double result = 0.0;
+        SimplexFBM<3,1,false>(P,&result,octaves,lacunarity,gain);
+        return .5*result+.5;
+    }
+    static const char* simplexfbm_docstring=
+        "float simplexfbm(vector v,int octaves=6,float lacunarity=2,float gain=.5)\n"
+        "fbm formed with octaves of simplex noise instead of noise";
+
+    SeVec3d vsimplexfbm(int n, const SeVec3d* args)
+    {
+	double P[4], lacunarity, gain;
+	int octaves;
+	simplexFbmArgs(3, n, args, P, octaves, lacunarity, gain);
+	double result[3] = { 0, 0, 0 };
+        SimplexFBM<3,3,false>(P,result,octaves,lacunarity,gain);
+        return SeVec3d(result);
+    }
+    static const char* vsimplexfbm_docstring="vector vsimplexfbm(vector v,int octaves=6,float lacunarity=2,float gain=.5)";
+
+    SeVec3d csimplexfbm(int n, const SeVec3d* args)
+    {
+	return (vsimplexfbm(n, args) * .5) + SeVec3d(.5);
+    }
+    static const char* csimplexfbm_docstring="color csimplexfbm(vector v,int octaves=6,float lacunarity=2,float gain=.5)";
+
+    double simplexfbm4(int n, const SeVec3d* args)
+    {
+	double P[4], lacunarity, gain;
+	int octaves;
+	simplexFbmArgs(4, n, args, P, octaves, lacunarity, gain);
+	double result = 0.0;
+        SimplexFBM<4,1,false>(P,&result,octaves,lacunarity,gain);
+        return .5*result+.5;
+    }
+    static const char* simplexfbm4_docstring=
+        "float simplexfbm4(vector v,float time,int octaves=6,float lacunarity=2,float gain=.5)\n"
+        "fbm4 formed with octaves of simplex noise, blending 5 lattice points\n"
+        "per octave instead of 16";
+
+    SeVec3d vsimplexfbm4(int n, const SeVec3d* args)
+    {
+	double P[4], lacunarity, gain;
+	int octaves;
+	simplexFbmArgs(4, n, args, P, octaves, lacunarity, gain);
+	double result[3] = { 0, 0, 0 };
+        SimplexFBM<4,3,false>(P,result,octaves,lacunarity,gain);
+        return SeVec3d(result);
+    }
+    static const char* vsimplexfbm4_docstring="vector vsimplexfbm4(vector v,float time,int octaves=6,float lacunarity=2,float gain=.5)";
+
+    SeVec3d csimplexfbm4(int n, const SeVec3d* args)
+    {
+	return (vsimplexfbm4(n, args) * .5) + SeVec3d(.5);
+    }
+    static const char* csimplexfbm4_docstring="color csimplexfbm4(vector v,float time,int octaves=6,float lacunarity=2,float gain=.5)";
+
+
     double cellnoise(const SeVec3d& p)
     {
 	double result;
@@ -806,6 +1371,20 @@ static const char* vnoise_docstring=
 	CellNoise<3,1>(args,&result);
 	return result;
     }
+    void cellnoiseBatch(int n, const SeVec3d* p, double* results)
+    {
+	CellNoiseBatch<3,1>(n, p[0].getValue(), results);
+    }
+    static void cellnoiseFuncBatch(int, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	double vals[64];
+	for (int base = 0; base < n; base += 64) {
+	    int m = std::min(n - base, 64);
+	    cellnoiseBatch(m, args[0] + base, vals);
+	    for (int i = 0; i < m; i++) results[base+i][0] = vals[i];
+	}
+    }
+
    static const char* cellnoise_docstring=
         "float cellnoise(vector v)\n"
         "cellnoise generates a field of constant colored cubes based on the integer location.\n"
@@ -818,6 +1397,15 @@ static const char* vnoise_docstring=
 	CellNoise<3,3>(args,&result[0]);
 	return result;
     }
+    void ccellnoiseBatch(int n, const SeVec3d* p, SeVec3d* results)
+    {
+	CellNoiseBatch<3,3>(n, p[0].getValue(), &results[0][0]);
+    }
+    static void ccellnoiseFuncBatch(int, const SeVec3d* const* args, int n, SeVec3d* results)
+    {
+	ccellnoiseBatch(n, args[0], results);
+    }
+
    static const char* ccellnoise_docstring=
         "color cellnoise(vector v)\n"
         "cellnoise generates a field of constant colored cubes based on the integer location.\n"
@@ -841,6 +1429,7 @@ static const char* vnoise_docstring=
 	SeVec3d cell;
 	double jitter;
 	VoronoiPointData() : jitter(-1) {}
+	virtual size_t memoryUsage() const { return sizeof(*this); }
     };    
 
     static SeVec3d* voronoi_points(VoronoiPointData& data, const SeVec3d& cell, double jitter)
@@ -1067,7 +1656,7 @@ static const char* vnoise_docstring=
     {
      public:
 	typedef SeVec3d VoronoiFunc(VoronoiPointData& data, int n, const SeVec3d* args);
-	CachedVoronoiFunc(VoronoiFunc* vfunc) : SeExprFuncX(true),_vfunc(vfunc) {}
+	CachedVoronoiFunc(VoronoiFunc* vfunc) : SeExprFuncX(true, true),_vfunc(vfunc) {}
 
 	virtual bool prep(SeExprFuncNode* node, bool /*wantVec*/)
 	{
@@ -1323,6 +1912,265 @@ static const char* vnoise_docstring=
         "Chooses one of the supplied choices based on the index (assumed to be in range[0..1]).\n"
         "The values will be distributed according to the supplied weights.";
 
+    //! True if node always evaluates to the same value: literals and
+    //! operators on literals (no variables or function calls)
+    static bool isConstantNode(const SeExprNode* node)
+    {
+	if (dynamic_cast<const SeExprVarNode*>(node) ||
+	    dynamic_cast<const SeExprFuncNode*>(node) ||
+	    dynamic_cast<const SeExprStrNode*>(node))
+	    return false;
+	for (int i = 0; i < node->numChildren(); i++)
+	    if (!isConstantNode(node->child(i))) return false;
+	return true;
+    }
+
+    //! Cumulative weight table shared by pick and wchoose, built once per
+    //! call site when all of the weights are constant.
+    /** lookup() returns the same entry as the cutoff binary search and
+	zero-weight skipping done by pick() and wchoose(), but a guide
+	table (one starting entry per equal slice of the total) makes
+	it O(1) on average. */
+    struct ChoiceTable : public SeExprFuncNode::Data
+    {
+	std::vector<double> cutoffs; // running total of the weights
+	std::vector<int> guide;      // lowest entry reaching each slice
+	std::vector<int> resolved;   // entry chosen after skipping zero weights
+	double total;
+	double sliceScale;           // slices per unit of weight
+
+	//! Build from non-negative weights, returns false if any is negative
+	bool build(const std::vector<double>& weights)
+	{
+	    int n = weights.size();
+	    cutoffs.resize(n);
+	    total = 0;
+	    for (int i = 0; i < n; i++) {
+		if (weights[i] < 0) return false;
+		total += weights[i];
+		cutoffs[i] = total;
+	    }
+	    if (total == 0) return true;
+
+	    // skip zero-length intervals (as in pick and wchoose)
+	    resolved.resize(n);
+	    for (int i = 0; i < n; i++) {
+		int lo = i;
+		if (weights[lo] == 0) {
+		    if (lo > 0 && cutoffs[lo] > 0)
+			while (--lo > 0 && weights[lo] == 0);
+		    else if (lo < n-1)
+			while (++lo < n-1 && weights[lo] == 0);
+		}
+		resolved[i] = lo;
+	    }
+
+	    guide.resize(n);
+	    sliceScale = n / total;
+	    for (int j = 0, i = 0; j < n; j++) {
+		double start = j / sliceScale;
+		while (i < n-1 && cutoffs[i] < start) i++;
+		guide[j] = i;
+	    }
+	    return true;
+	}
+
+	//! Bytes of the table's entries
+	size_t entryBytes() const
+	{
+	    return cutoffs.capacity() * sizeof(double)
+		+ (guide.capacity() + resolved.capacity()) * sizeof(int);
+	}
+	virtual size_t memoryUsage() const { return sizeof(*this) + entryBytes(); }
+
+	//! Entry for a key scaled to [0..total] (total must be nonzero)
+	int lookup(double key) const
+	{
+	    int n = cutoffs.size();
+	    double slice = key * sliceScale;
+	    int i = guide[slice > 0 ? (slice < n ? int(slice) : n-1) : 0];
+	    // the guide is only a starting point, settle on the first
+	    // cutoff at or above the key
+	    while (i > 0 && key <= cutoffs[i-1]) i--;
+	    while (i < n-1 && !(key <= cutoffs[i])) i++;
+	    return resolved[i];
+	}
+    };
+
+    //! Base for the choice functions: scalar arguments, and a vector
+    //! result (one choice per component) if any argument is a vector
+    class ChoiceFuncX : public SeExprFuncX
+    {
+    public:
+	ChoiceFuncX(SeExprFunc::Funcn* func) : SeExprFuncX(true, true), _func(func) {}
+
+    protected:
+	bool prepArgs(SeExprFuncNode* node, bool wantVec) const
+	{
+	    if (!node->SeExprNode::prep(wantVec)) return false;
+	    node->setIsVec(wantVec && node->isVec());
+	    return true;
+	}
+
+	//! value of a constant argument (after prep)
+	static double constArgValue(const SeExprFuncNode* node, int i)
+	{
+	    SeVec3d val;
+	    node->child(i)->eval(val);
+	    return val[0];
+	}
+
+	//! evaluate every argument and call the plain function per component
+	void evalAll(const SeExprFuncNode* node, SeVec3d& result) const
+	{
+	    int n = node->nargs();
+	    SeVec3d* a = node->evalArgs();
+	    double* d = (double*) alloca(sizeof(double) * n);
+	    int niter = node->isVec() ? 3 : 1;
+	    for (int c = 0; c < niter; c++) {
+		for (int i = 0; i < n; i++) d[i] = a[i][c];
+		result[c] = _func(n, d);
+	    }
+	}
+
+    private:
+	SeExprFunc::Funcn* _func;
+    };
+
+    //! pick() with a table built at prep when the range and weights are constant
+    class PickFuncX : public ChoiceFuncX
+    {
+	struct Data : public ChoiceTable
+	{
+	    int loRange;
+	    virtual size_t memoryUsage() const { return sizeof(*this) + entryBytes(); }
+	};
+
+    public:
+	PickFuncX() : ChoiceFuncX(pick) {}
+
+	virtual bool prep(SeExprFuncNode* node, bool wantVec)
+	{
+	    if (!prepArgs(node, wantVec)) return false;
+	    int n = node->nargs();
+	    for (int i = 1; i < n; i++)
+		if (!isConstantNode(node->child(i))) return true;
+
+	    // an unchanged call keeps the table it built before an edit
+	    if (SeExprFuncNode::Data* prev = node->takePrevData()) {
+		node->setData(prev);
+		return true;
+	    }
+
+	    int loRange = int(constArgValue(node, 1));
+	    int hiRange = int(constArgValue(node, 2));
+	    int range = hiRange-loRange+1;
+	    if (range <= 0) return true;
+	    int numWeights = std::min(n-3, range);
+	    std::vector<double> weights(range, 1.0);
+	    for (int i = 0; i < numWeights; i++)
+		weights[i] = constArgValue(node, i+3);
+
+	    Data* data = new Data;
+	    data->loRange = loRange;
+	    if (data->build(weights)) node->setData(data);
+	    else delete data;
+	    return true;
+	}
+
+	virtual void eval(const SeExprFuncNode* node, SeVec3d& result) const
+	{
+	    const Data* data = static_cast<const Data*>(node->getData());
+	    if (!data) { evalAll(node, result); return; }
+
+	    SeVec3d key = node->evalArg(0);
+	    int niter = node->isVec() ? 3 : 1;
+	    for (int c = 0; c < niter; c++) {
+		if (data->total == 0) result[c] = data->loRange;
+		else result[c] = data->loRange +
+			 data->lookup(hash(1, &key[c]) * data->total);
+	    }
+	}
+    } pickFunc;
+
+    //! choose() evaluating only the chosen argument
+    class ChooseFuncX : public ChoiceFuncX
+    {
+    public:
+	ChooseFuncX() : ChoiceFuncX(choose) {}
+
+	virtual bool prep(SeExprFuncNode* node, bool wantVec)
+	{
+	    return prepArgs(node, wantVec);
+	}
+
+	virtual void eval(const SeExprFuncNode* node, SeVec3d& result) const
+	{
+	    SeVec3d key = node->evalArg(0);
+	    int nvals = node->nargs() - 1;
+	    int niter = node->isVec() ? 3 : 1;
+	    int last = -1;
+	    SeVec3d val;
+	    for (int c = 0; c < niter; c++) {
+		int i = 1 + int(clamp(key[c] * nvals, 0, nvals-1));
+		if (i != last) {
+		    val = node->evalArg(i);
+		    last = i;
+		}
+		result[c] = val[c];
+	    }
+	}
+    } chooseFunc;
+
+    //! wchoose() with a table built at prep when the weights are constant,
+    //! evaluating only the chosen value
+    class WChooseFuncX : public ChoiceFuncX
+    {
+    public:
+	WChooseFuncX() : ChoiceFuncX(wchoose) {}
+
+	virtual bool prep(SeExprFuncNode* node, bool wantVec)
+	{
+	    if (!prepArgs(node, wantVec)) return false;
+	    int n = node->nargs();
+	    if (n < 5) return true;
+	    int nvals = (n - 1) / 2;
+	    std::vector<double> weights(nvals);
+	    for (int i = 0; i < nvals; i++) {
+		if (!isConstantNode(node->child(i*2+2))) return true;
+		weights[i] = constArgValue(node, i*2+2);
+	    }
+	    if (SeExprFuncNode::Data* prev = node->takePrevData()) {
+		node->setData(prev);
+		return true;
+	    }
+
+	    ChoiceTable* data = new ChoiceTable;
+	    if (data->build(weights)) node->setData(data);
+	    else delete data;
+	    return true;
+	}
+
+	virtual void eval(const SeExprFuncNode* node, SeVec3d& result) const
+	{
+	    const ChoiceTable* data = static_cast<const ChoiceTable*>(node->getData());
+	    if (!data) { evalAll(node, result); return; }
+
+	    SeVec3d key = node->evalArg(0);
+	    int niter = node->isVec() ? 3 : 1;
+	    int last = -1;
+	    SeVec3d val;
+	    for (int c = 0; c < niter; c++) {
+		int i = data->total == 0 ? 1 : data->lookup(key[c] * data->total)*2+1;
+		if (i != last) {
+		    val = node->evalArg(i);
+		    last = i;
+		}
+		result[c] = val[c];
+	    }
+	}
+    } wchooseFunc;
+
     double spline(int n, double* params)
     {
 	if (n < 5) return 0;
@@ -1350,8 +2198,19 @@ static const char* vnoise_docstring=
     {
         SeCurve<T> curve;
         virtual ~CurveData(){}
+        virtual size_t memoryUsage() const { return sizeof(*this) + curve.cvBytes(); }
     };
 
+    //! Data baked by an unchanged curve call before an edit, if its
+    //! points are constant (otherwise they may evaluate differently now)
+    template<class T>
+    CurveData<T>* prevCurveData(SeExprFuncNode* node)
+    {
+        for (int i = 1; i < node->nargs(); i++)
+            if (!isConstantNode(node->child(i))) return 0;
+        return static_cast<CurveData<T>*>(node->takePrevData());
+    }
+
 
     class CurveFuncX:public SeExprFuncX
     {
@@ -1367,7 +2226,9 @@ static const char* vnoise_docstring=
             bool noErrors=true;
             noErrors &= node->child(0)->prep(1);
             
-            CurveData<double>* data = new CurveData<double>;
+            CurveData<double>* data = prevCurveData<double>(node);
+            bool build = !data;
+            if (build) data = new CurveData<double>;
             for (int i = 1; i < nargs-2; i+=3) {
                 
                 SeVec3d pos;
@@ -1388,10 +2249,10 @@ static const char* vnoise_docstring=
                     noErrors=false;
                 }
 
-                data->curve.addPoint(pos[0], val[0], interpolant);
+                if (build) data->curve.addPoint(pos[0], val[0], interpolant);
             }
             
-            data->curve.preparePoints();
+            if (build) data->curve.preparePoints();
             
             node->setData((SeExprFuncNode::Data*)(data));
             return noErrors;
@@ -1414,7 +2275,7 @@ static const char* vnoise_docstring=
     
     
     public:
-        CurveFuncX():SeExprFuncX(true){} // Thread Safe
+        CurveFuncX():SeExprFuncX(true, true){} // Thread Safe, pure
         virtual ~CurveFuncX() {}
     
     
@@ -1439,7 +2300,9 @@ static const char* vnoise_docstring=
             bool noErrors=true;
             noErrors &= node->child(0)->prep(1); // parameter value
             
-            CurveData<SeVec3d>* data = new CurveData<SeVec3d>;
+            CurveData<SeVec3d>* data = prevCurveData<SeVec3d>(node);
+            bool build = !data;
+            if (build) data = new CurveData<SeVec3d>;
             for (int i = 1; i < nargs-2; i+=3) {
                 // position of cv
                 SeVec3d pos;
@@ -1463,10 +2326,10 @@ static const char* vnoise_docstring=
                     noErrors=false;
                 }
                 // add to list
-                data->curve.addPoint(pos[0], val, interpolant);
+                if (build) data->curve.addPoint(pos[0], val, interpolant);
             }
 
-            data->curve.preparePoints();
+            if (build) data->curve.preparePoints();
             node->setData((SeExprFuncNode::Data*)(data));
             return noErrors;
         }
@@ -1487,7 +2350,7 @@ static const char* vnoise_docstring=
         }
     
     public:
-        CCurveFuncX():SeExprFuncX(true){}  // Thread Safe
+        CCurveFuncX():SeExprFuncX(true, true){}  // Thread Safe, pure
         virtual ~CCurveFuncX() {}
     } ccurve;
     static const char *ccurve_docstring=
@@ -1503,6 +2366,11 @@ static const char* vnoise_docstring=
         {
             std::vector<std::pair<int,int> > ranges;
             std::string format;
+            virtual size_t memoryUsage() const
+            {
+                return sizeof(*this) + ranges.capacity() * sizeof(ranges[0])
+                    + SeExprMemory::stringBytes(format);
+            }
         };
             
         virtual bool prep(SeExprFuncNode* node, bool /*wantVec*/)
@@ -1606,129 +2474,348 @@ static const char* vnoise_docstring=
         "printf(string format,[vec0, vec1,  ...])\n"
         "Prints out a string to STDOUT, Format parameter allowed is %v";
 
+    //! Data of a baked() call: the bake it looks up
+    struct BakedData : public SeExprFuncNode::Data
+    {
+	SeExprBake* bake;
+	BakedData(SeExprBake* bakeIn) : bake(bakeIn) {}
+	// (the bake is shared between calls, so it isn't counted here)
+	virtual size_t memoryUsage() const { return sizeof(*this); }
+    };
+
+    class BakedFuncX : public SeExprFuncX
+    {
+    public:
+	BakedFuncX() : SeExprFuncX(true, true) {}
+
+	virtual bool prep(SeExprFuncNode* node, bool /*wantVec*/)
+	{
+	    if (!node->isStrArg(0)) {
+		node->addError("First argument must be the expression to bake");
+		return false;
+	    }
+	    bool noErrors = true;
+	    for (int i = 1; i < node->nargs(); i++)
+		noErrors &= node->child(i)->prep(0);
+	    if (!noErrors) return false;
+
+	    int resolution = 1024;
+	    if (node->nargs() > 4) {
+		if (!isConstantNode(node->child(4))) {
+		    node->child(4)->addError("Resolution must be constant");
+		    return false;
+		}
+		SeVec3d val;
+		node->child(4)->eval(val);
+		if (!(val[0] <= SeExprBake::maxResolution)) {
+		    node->child(4)->addError("Resolution must be at most 65536");
+		    return false;
+		}
+		resolution = int(std::max(1., val[0]));
+	    }
+
+	    SeExprBake* bake = SeExprBake::shared(node->getStrArg(0), resolution);
+	    if (!bake) {
+		node->addError("SE_EXPR_BAKE_DIR must name a directory to bake into");
+		return false;
+	    }
+	    if (!bake->isValid()) {
+		node->addError("Can't bake expression: " + bake->error());
+		return false;
+	    }
+	    node->setData(new BakedData(bake));
+	    return true;
+	}
+
+	virtual void eval(const SeExprFuncNode* node, SeVec3d& result) const
+	{
+	    SeExprBake* bake = static_cast<BakedData*>(node->getData())->bake;
+	    SeVec3d u, v, level(0.0);
+	    node->child(1)->eval(u);
+	    node->child(2)->eval(v);
+	    if (node->nargs() > 3) node->child(3)->eval(level);
+	    result = bake->lookup(u[0], v[0], level[0]);
+	}
+    } baked;
+    static const char* baked_docstring=
+        "color baked(string expr, float u, float v, float level=0, int resolution=1024)\n"
+        "Looks up expr, an expression of $u and $v, baked into a mipmapped\n"
+        "texture of resolution x resolution texels, at (u,v).  The resolution\n"
+        "is at most 65536.  Fractional levels blend between mipmap levels.\n"
+        "The bake is cached in the directory named by SE_EXPR_BAKE_DIR and\n"
+        "made as lookups need it.";
+
+    // Per-call costs for SeExpression::estimateCost().  Plain numbers are
+    // flops; the noise functions count the lattice corners they visit.
+    enum { Trivial = 1, Cheap = 4, LibCall = 20 };
+
+    //! value of argument i if it is a literal number, otherwise def
+    static double constArg(const SeExprFuncNode* node, int i, double def)
+    {
+	if (i >= node->numChildren()) return def;
+	const SeExprNumNode* num = dynamic_cast<const SeExprNumNode*>(node->child(i));
+	return num ? num->value() : def;
+    }
+
+    //! d dimensional perlin noise: hash and gradient dot product at each
+    //! of 2^d corners, then 2^d-1 interpolations of the corner values
+    static SeExprCost latticeNoiseCost(int d)
+    {
+	int corners = 1 << d;
+	return SeExprCost(corners * (10 + 5*d) + 3 * (corners-1) + 9*d,
+			  corners * d * sizeof(double));
+    }
+
+    //! d dimensional simplex noise: sorting the d offsets, then a hash,
+    //! falloff and gradient dot product at each of the d+1 corners
+    static SeExprCost simplexNoiseCost(int d)
+    {
+	int corners = d + 1;
+	return SeExprCost(d*(d-1)/2 + 6*d + corners * (20 + 10*d),
+			  corners * d * sizeof(double));
+    }
+
+    //! simplex() is 3d with a vector argument, otherwise 2d to 4d
+    static SeExprCost simplexCost(const SeExprFuncNode* node)
+    {
+	int n = node->numChildren();
+	return simplexNoiseCost(n <= 1 ? 3 : std::min(n, 4));
+    }
+
+    template<int d, int outputs>
+    static SeExprCost fixedSimplexCost(const SeExprFuncNode*)
+    {
+	return simplexNoiseCost(d) * outputs;
+    }
+
+    template<int d, int outputs, int octavesArg>
+    static SeExprCost simplexFbmCost(const SeExprFuncNode* node)
+    {
+	double octaves = clamp(constArg(node, octavesArg, 6), 1, 8);
+	return (simplexNoiseCost(d) + SeExprCost(6)) * (outputs * int(octaves));
+    }
+
+    //! d dimensional cellnoise: one hash and permutation lookup per output
+    static SeExprCost cellNoiseCost(int d, int outputs)
+    {
+	return SeExprCost(outputs * (3*d + 10), outputs * 4);
+    }
+
+    //! noise() is 3d with a vector argument, otherwise 1d to 4d
+    static SeExprCost noiseCost(const SeExprFuncNode* node)
+    {
+	int n = node->numChildren();
+	return latticeNoiseCost(n <= 1 ? 3 : std::min(n, 4));
+    }
+
+    template<int d, int outputs>
+    static SeExprCost fixedNoiseCost(const SeExprFuncNode*)
+    {
+	return latticeNoiseCost(d) * outputs;
+    }
+
+    //! fbm and turbulence: one noise per output per octave
+    template<int d, int outputs, int octavesArg>
+    static SeExprCost fbmCost(const SeExprFuncNode* node)
+    {
+	double octaves = clamp(constArg(node, octavesArg, 6), 1, 8);
+	return (latticeNoiseCost(d) + SeExprCost(6)) * (outputs * int(octaves));
+    }
+
+    //! voronoi: cellnoise jittered feature points in the 27 neighboring
+    //! cells (cached per node, counted as a miss), a distance to each,
+    //! and the optional fbm warp of the lookup point
+    template<int outputs, int scaleArg>
+    static SeExprCost voronoiCost(const SeExprFuncNode* node)
+    {
+	SeExprCost cost = (cellNoiseCost(3, 3) + SeExprCost(12)) * 27;
+	cost += SeExprCost(27 * 9, 2 * 27 * sizeof(SeVec3d));
+	cost += cellNoiseCost(3, outputs);
+	// the warp is off by default; assume a computed scale turns it on
+	if (scaleArg < node->numChildren() && constArg(node, scaleArg, 1) > 0) {
+	    double octaves = clamp(constArg(node, scaleArg+1, 4), 1, 8);
+	    cost += (latticeNoiseCost(3) + SeExprCost(6)) * (3 * int(octaves));
+	}
+	return cost;
+    }
+
+    //! hash: mixes each argument into the seed, then one permutation
+    static SeExprCost hashCost(const SeExprFuncNode* node)
+    {
+	return SeExprCost(LibCall * node->numChildren() + 16, 4);
+    }
+
+    //! pick: builds a cutoff table over the range, then a binary search,
+    //! unless the table was built at prep
+    static SeExprCost pickCost(const SeExprFuncNode* node)
+    {
+	if (node->getData()) return hashCost(node) + SeExprCost(8, 3*sizeof(double));
+	double range = constArg(node, 2, 1) - constArg(node, 1, 0) + 1;
+	if (range < node->numChildren() - 3) range = node->numChildren() - 3;
+	if (range < 1) range = 1;
+	return hashCost(node) + SeExprCost(3*range + 4*M_LOG2E*log(range+1), 2*range*sizeof(double));
+    }
+
+    //! wchoose: builds a cutoff table over the weights, then a binary search
+    static SeExprCost wchooseCost(const SeExprFuncNode* node)
+    {
+	if (node->getData()) return SeExprCost(8, 3*sizeof(double));
+	double nvals = std::max((node->numChildren() - 1) / 2, 1);
+	return SeExprCost(3*nvals + 4*M_LOG2E*log(nvals+1), 2*nvals*sizeof(double));
+    }
+
+    //! curve and ccurve: binary search of the control points, then interpolation
+    template<int outputs>
+    static SeExprCost curveCost(const SeExprFuncNode* node)
+    {
+	double npoints = std::max((node->numChildren() - 1) / 3, 1);
+	double steps = M_LOG2E*log(npoints+1);
+	return SeExprCost(4*steps + 20*outputs, steps * (sizeof(double) + sizeof(SeVec3d)));
+    }
+
     void defineBuiltins(SeExprFunc::Define /*define*/,SeExprFunc::Define3 define3)
     {
 	// functions from math.h (global namespace)
 //#define FUNC(func)	  define(#func, SeExprFunc(::func))
-#define FUNCADOC(name, func) define3(name, SeExprFunc(::func),func##_docstring)
-#define FUNCDOC(func)	  define3(#func, SeExprFunc(::func),func##_docstring)
-	FUNCADOC("abs", fabs);
-	FUNCDOC(acos);
-	FUNCDOC(asin);
-	FUNCDOC(atan);
-	FUNCDOC(atan2);
-	FUNCDOC(ceil);
-	FUNCDOC(cos);
-	FUNCDOC(cosh);
-	FUNCDOC(exp);
-	FUNCDOC(floor);
-	FUNCDOC(fmod);
-	FUNCDOC(log);
-	FUNCDOC(log10);
-	FUNCDOC(pow);
-	FUNCDOC(sin);
-	FUNCDOC(sinh);
-	FUNCDOC(sqrt);
-	FUNCDOC(tan);
-	FUNCDOC(tanh);
+#define FUNCADOC(name, func, cost) define3(name, SeExprFunc(::func).setCost(cost),func##_docstring)
+#define FUNCDOC(func, cost) define3(#func, SeExprFunc(::func).setCost(cost),func##_docstring)
+#define FUNCKDOC(func, cost) define3(#func, SeExprFunc(::func).setCost(cost).setKernel(func##Kernel),func##_docstring)
+	FUNCADOC("abs", fabs, Trivial);
+	FUNCDOC(acos, LibCall);
+	FUNCDOC(asin, LibCall);
+	FUNCDOC(atan, LibCall);
+	FUNCDOC(atan2, LibCall);
+	FUNCDOC(ceil, Trivial);
+	FUNCKDOC(cos, LibCall);
+	FUNCDOC(cosh, LibCall);
+	FUNCKDOC(exp, LibCall);
+	FUNCDOC(floor, Trivial);
+	FUNCDOC(fmod, LibCall);
+	FUNCKDOC(log, LibCall);
+	FUNCDOC(log10, LibCall);
+	FUNCKDOC(pow, LibCall);
+	FUNCKDOC(sin, LibCall);
+	FUNCDOC(sinh, LibCall);
+	FUNCDOC(sqrt, Cheap);
+	FUNCDOC(tan, LibCall);
+	FUNCDOC(tanh, LibCall);
 #ifndef SEEXPR_WIN32
-	FUNCDOC(cbrt);
-	FUNCDOC(asinh);
-	FUNCDOC(acosh);
-	FUNCDOC(atanh);
-	FUNCDOC(trunc);
+	FUNCDOC(cbrt, LibCall);
+	FUNCDOC(asinh, LibCall);
+	FUNCDOC(acosh, LibCall);
+	FUNCDOC(atanh, LibCall);
+	FUNCDOC(trunc, Trivial);
 #endif
 
 	// local functions (SeExpr namespace)
 //#undef FUNC
 #undef FUNCDOC
+#undef FUNCKDOC
 //#define FUNC(func)	      define(#func, SeExprFunc(SeExpr::func))
 //#define FUNCN(func, min, max) define(#func, SeExprFunc(SeExpr::func, min, max))
-#define FUNCDOC(func)	      define3(#func, SeExprFunc(SeExpr::func),func##_docstring)
-#define FUNCNDOC(func, min, max) define3(#func, SeExprFunc(SeExpr::func, min, max),func##_docstring)
+#define FUNCDOC(func, cost)   define3(#func, SeExprFunc(SeExpr::func).setCost(cost),func##_docstring)
+#define FUNCNDOC(func, min, max, cost) define3(#func, SeExprFunc(SeExpr::func, min, max).setCost(cost),func##_docstring)
+#define FUNCXDOC(func, funcx, min, max, cost) define3(#func, SeExprFunc(funcx, min, max).setCost(cost),func##_docstring)
+#define FUNCBDOC(func, batch, cost) define3(#func, SeExprFunc(SeExpr::func).setCost(cost).setBatch(batch),func##_docstring)
+#define FUNCNBDOC(func, batch, min, max, cost) define3(#func, SeExprFunc(SeExpr::func, min, max).setCost(cost).setBatch(batch),func##_docstring)
+#define FUNCKDOC(func, cost)  define3(#func, SeExprFunc(SeExpr::func).setCost(cost).setKernel(func##Kernel),func##_docstring)
 
 	// trig
-	FUNCDOC(deg);
-	FUNCDOC(rad);
-	FUNCDOC(cosd);
-	FUNCDOC(sind);
-	FUNCDOC(tand);
-	FUNCDOC(acosd);
-	FUNCDOC(asind);
-	FUNCDOC(atand);
-	FUNCDOC(atan2d);
+	FUNCDOC(deg, Trivial);
+	FUNCDOC(rad, Trivial);
+	FUNCDOC(cosd, LibCall);
+	FUNCDOC(sind, LibCall);
+	FUNCDOC(tand, LibCall);
+	FUNCDOC(acosd, LibCall);
+	FUNCDOC(asind, LibCall);
+	FUNCDOC(atand, LibCall);
+	FUNCDOC(atan2d, LibCall);
 
 	// clamping
-	FUNCDOC(clamp);
-	FUNCDOC(round);
-	FUNCDOC(max);
-	FUNCDOC(min);
+	FUNCDOC(clamp, Cheap);
+	FUNCDOC(round, Cheap);
+	FUNCDOC(max, Trivial);
+	FUNCDOC(min, Trivial);
 
 	// blending / remapping
-	FUNCDOC(invert);
-	FUNCDOC(compress);
-	FUNCDOC(expand);
-	FUNCDOC(fit);
-	FUNCDOC(gamma);
-	FUNCDOC(bias);
-	FUNCDOC(contrast);
-	FUNCDOC(boxstep);
-	FUNCDOC(linearstep);
-	FUNCDOC(smoothstep);
-	FUNCDOC(gaussstep);
-	FUNCDOC(remap);
-	FUNCDOC(mix);
-	FUNCNDOC(hsi, 4, 5);
-	FUNCNDOC(midhsi, 5, 7);
-	FUNCDOC(hsltorgb);
-	FUNCDOC(rgbtohsl);
-        FUNCNDOC(saturate, 2, 2);
+	FUNCDOC(invert, Trivial);
+	FUNCDOC(compress, Cheap);
+	FUNCDOC(expand, Cheap);
+	FUNCDOC(fit, Cheap);
+	FUNCKDOC(gamma, LibCall);
+	FUNCKDOC(bias, LibCall);
+	FUNCDOC(contrast, 2*LibCall);
+	FUNCDOC(boxstep, Trivial);
+	FUNCDOC(linearstep, Cheap);
+	FUNCKDOC(smoothstep, 2*Cheap);
+	FUNCKDOC(gaussstep, LibCall);
+	FUNCDOC(remap, 2*LibCall);
+	FUNCDOC(mix, Cheap);
+	FUNCNBDOC(hsi, hsiBatch, 4, 5, 120);
+	FUNCNBDOC(midhsi, midhsiBatch, 5, 7, 150);
+	FUNCBDOC(hsltorgb, hsltorgbBatch, 45);
+	FUNCBDOC(rgbtohsl, rgbtohslBatch, 30);
+        FUNCNBDOC(saturate, saturateBatch, 2, 2, 12);
 
 	// noise
-	FUNCNDOC(hash, 1, -1);
-	FUNCNDOC(noise, 1, 4);
-	FUNCDOC(snoise);
-	FUNCDOC(vnoise);
-	FUNCDOC(cnoise);
-	FUNCNDOC(snoise4,2,2);
-	FUNCNDOC(vnoise4,2,2);
-	FUNCNDOC(cnoise4,2,2);
-	FUNCNDOC(turbulence, 1, 4);
-	FUNCNDOC(vturbulence, 1, 4);
-	FUNCNDOC(cturbulence, 1, 4);
-	FUNCNDOC(fbm, 1, 4);
-	FUNCNDOC(vfbm, 1, 4);
-	FUNCNDOC(cfbm, 1, 4);
-	FUNCDOC(cellnoise);
-	FUNCDOC(ccellnoise);
-	FUNCDOC(pnoise);
-	FUNCNDOC(voronoi, 1, 7);
-	FUNCNDOC(cvoronoi, 1, 7);
-	FUNCNDOC(pvoronoi, 1, 6);
-	FUNCNDOC(fbm4, 2, 5);
-	FUNCNDOC(vfbm4, 2, 5);
-	FUNCNDOC(cfbm4, 2, 5);
+	FUNCNBDOC(hash, hashFuncBatch, 1, -1, hashCost);
+	FUNCNDOC(noise, 1, 4, noiseCost);
+	FUNCDOC(snoise, (fixedNoiseCost<3,1>));
+	FUNCDOC(vnoise, (fixedNoiseCost<3,3>));
+	FUNCDOC(cnoise, (fixedNoiseCost<3,3>));
+	FUNCNDOC(snoise4, 2, 2, (fixedNoiseCost<4,1>));
+	FUNCNDOC(vnoise4, 2, 2, (fixedNoiseCost<4,3>));
+	FUNCNDOC(cnoise4, 2, 2, (fixedNoiseCost<4,3>));
+	FUNCNDOC(turbulence, 1, 4, (fbmCost<3,1,1>));
+	FUNCNDOC(vturbulence, 1, 4, (fbmCost<3,3,1>));
+	FUNCNDOC(cturbulence, 1, 4, (fbmCost<3,3,1>));
+	FUNCNDOC(fbm, 1, 4, (fbmCost<3,1,1>));
+	FUNCNDOC(vfbm, 1, 4, (fbmCost<3,3,1>));
+	FUNCNDOC(cfbm, 1, 4, (fbmCost<3,3,1>));
+	FUNCBDOC(cellnoise, cellnoiseFuncBatch, (cellNoiseCost(3,1)));
+	FUNCBDOC(ccellnoise, ccellnoiseFuncBatch, (cellNoiseCost(3,3)));
+	FUNCDOC(pnoise, latticeNoiseCost(3));
+	FUNCNDOC(voronoi, 1, 7, (voronoiCost<1,3>));
+	FUNCNDOC(cvoronoi, 1, 7, (voronoiCost<3,3>));
+	FUNCNDOC(pvoronoi, 1, 6, (voronoiCost<0,2>));
+	FUNCNDOC(fbm4, 2, 5, (fbmCost<4,1,2>));
+	FUNCNDOC(vfbm4, 2, 5, (fbmCost<4,3,2>));
+	FUNCNDOC(cfbm4, 2, 5, (fbmCost<4,3,2>));
+	FUNCNDOC(simplex, 1, 4, simplexCost);
+	FUNCDOC(ssimplex, (fixedSimplexCost<3,1>));
+	FUNCDOC(vsimplex, (fixedSimplexCost<3,3>));
+	FUNCDOC(csimplex, (fixedSimplexCost<3,3>));
+	FUNCNDOC(ssimplex4, 2, 2, (fixedSimplexCost<4,1>));
+	FUNCNDOC(vsimplex4, 2, 2, (fixedSimplexCost<4,3>));
+	FUNCNDOC(csimplex4, 2, 2, (fixedSimplexCost<4,3>));
+	FUNCNDOC(simplexfbm, 1, 4, (simplexFbmCost<3,1,1>));
+	FUNCNDOC(vsimplexfbm, 1, 4, (simplexFbmCost<3,3,1>));
+	FUNCNDOC(csimplexfbm, 1, 4, (simplexFbmCost<3,3,1>));
+	FUNCNDOC(simplexfbm4, 2, 5, (simplexFbmCost<4,1,2>));
+	FUNCNDOC(vsimplexfbm4, 2, 5, (simplexFbmCost<4,3,2>));
+	FUNCNDOC(csimplexfbm4, 2, 5, (simplexFbmCost<4,3,2>));
 	// vectors
-	FUNCDOC(dist);
-	FUNCDOC(length);
-	FUNCDOC(hypot);
-	FUNCDOC(dot);
-	FUNCDOC(norm);
-	FUNCDOC(cross);
-	FUNCDOC(angle);
-	FUNCDOC(ortho);
-	FUNCNDOC(rotate, 3, 3);
-	FUNCDOC(up);
+	FUNCDOC(dist, 2*Cheap);
+	FUNCDOC(length, 2*Cheap);
+	FUNCDOC(hypot, 2*Cheap);
+	FUNCDOC(dot, Cheap);
+	FUNCDOC(norm, 3*Cheap);
+	FUNCDOC(cross, 2*Cheap);
+	FUNCDOC(angle, 2*LibCall);
+	FUNCDOC(ortho, 3*Cheap);
+	FUNCNDOC(rotate, 3, 3, 4*LibCall);
+	FUNCDOC(up, 4*LibCall);
 
 	// variations
-	FUNCDOC(cycle);
-	FUNCNDOC(pick, 3, -1);
-	FUNCNDOC(choose, 3, -1);
-	FUNCNDOC(wchoose, 4, -1);
-	FUNCNDOC(spline, 5, -1);
-	FUNCNDOC(curve, 1, -1);
-	FUNCNDOC(ccurve, 1, -1);
-        FUNCNDOC(printf,1,-1);
+	FUNCDOC(cycle, Cheap);
+	FUNCXDOC(pick, pickFunc, 3, -1, pickCost);
+	FUNCXDOC(choose, chooseFunc, 3, -1, Cheap);
+	FUNCXDOC(wchoose, wchooseFunc, 4, -1, wchooseCost);
+	FUNCNDOC(spline, 5, -1, LibCall);
+	FUNCNDOC(curve, 1, -1, curveCost<1>);
+	FUNCNDOC(ccurve, 1, -1, curveCost<3>);
+        FUNCNDOC(printf, 1, -1, 1000);
+	FUNCNDOC(baked, 3, 5, SeExprCost(8 * Cheap, 8 * 3 * sizeof(float)));
 
     }
 }
@@ -82,9 +82,17 @@ namespace SeExpr
     SeVec3d midhsi(int n, const SeVec3d* args);
     SeVec3d rgbtohsl(const SeVec3d& rgb);
     SeVec3d hsltorgb(const SeVec3d& hsl);
+    //! batch forms of the color functions (see SeExprFunc::FuncBatch)
+    void hsiBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results);
+    void midhsiBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results);
+    void rgbtohslBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results);
+    void hsltorgbBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results);
+    void saturateBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results);
 
     // noise
     double hash(int n, double* args);
+    //! hash of count calls at once, args holds n args for each call in turn
+    void hashBatch(int count, int n, const double* args, double* results);
     double noise(int n, const SeVec3d* args);
     double snoise(const SeVec3d& p);
     SeVec3d cnoise(const SeVec3d& p);
@@ -95,8 +103,18 @@ namespace SeExpr
     double fbm(int n, const SeVec3d* args);
     SeVec3d vfbm(int n, const SeVec3d* args);
     SeVec3d cfbm(int n, const SeVec3d* args);
+    double simplex(int n, const SeVec3d* args);
+    double ssimplex(const SeVec3d& p);
+    SeVec3d csimplex(const SeVec3d& p);
+    SeVec3d vsimplex(const SeVec3d& p);
+    double simplexfbm(int n, const SeVec3d* args);
+    SeVec3d vsimplexfbm(int n, const SeVec3d* args);
+    SeVec3d csimplexfbm(int n, const SeVec3d* args);
     double cellnoise(const SeVec3d& p);
     SeVec3d ccellnoise(const SeVec3d& p);
+    //! cellnoise and ccellnoise of n points at once
+    void cellnoiseBatch(int n, const SeVec3d* p, double* results);
+    void ccellnoiseBatch(int n, const SeVec3d* p, SeVec3d* results);
     double pnoise(const SeVec3d& p, const SeVec3d& period);
 
     // vectors
@@ -0,0 +1,427 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <climits>
+#include <string.h>
+#ifdef SEEXPR_ZLIB
+#include <zlib.h>
+#endif
+#include "SeExprCapture.h"
+#include "SeExpression.h"
+#include "SeExprNode.h"
+
+namespace {
+    const char magic[] = "SeExprCapture 2\n";
+
+    //! Gives the value of a variable, recording it in the capture
+    class CaptureVarRef : public SeExprVarRef
+    {
+    public:
+	CaptureVarRef(SeExprCapture& capture, int index, SeExprVarRef* ref)
+	    : _capture(capture), _index(index) { setRef(ref); }
+
+	void setRef(SeExprVarRef* ref)
+	{
+	    _ref = ref;
+	    _ptrVar = dynamic_cast<SeExprPtrVarRef*>(ref);
+	}
+
+	virtual bool isVec() { return _ref->isVec(); }
+
+	virtual void eval(const SeExprVarNode* node, SeVec3d& result)
+	{
+	    int lane = node ? node->expr()->batchLane() : -1;
+	    // unwrapped, host memory is read at the offset of the lane
+	    if (_ptrVar) _ptrVar->load(result, node ? node->expr()->batchOffset() : 0);
+	    else _ref->eval(node, result);
+	    _capture.record(_index, lane < 0 ? 0 : lane, result);
+	}
+
+    private:
+	SeExprCapture& _capture;
+	int _index;
+	SeExprVarRef* _ref;
+	SeExprPtrVarRef* _ptrVar;
+    };
+
+    //! How a column of a block is stored, its first byte
+    enum Codec {
+	//! a nibble per value giving its count of bytes, then the bytes,
+	//! lowest first
+	byteCodec,
+	//! byte k of value i at k*n+i, deflated
+	deflateCodec
+    };
+    //! Most rows a byte of a column can hold: deflate expands by at most
+    //! 1032 times, and a value is 8 bytes
+    const size_t maxRowsPerByte = 1032 / 8;
+
+    //! Each value's bits less a linear prediction from the two before,
+    //! zigzagged so small differences either way have leading zeros
+    void predict(const double* values, int n, std::vector<uint64_t>& out)
+    {
+	out.resize(n);
+	uint64_t p1 = 0, p2 = 0;
+	for (int i = 0; i < n; i++) {
+	    uint64_t bits;
+	    memcpy(&bits, &values[i], sizeof(bits));
+	    uint64_t d = bits - (i > 1 ? 2 * p1 - p2 : p1);
+	    out[i] = (d << 1) ^ (0 - (d >> 63));
+	    p2 = p1;
+	    p1 = bits;
+	}
+    }
+
+    //! Undo predict(), putting the values stride doubles apart
+    void unpredict(const uint64_t* in, int n, double* values, int stride)
+    {
+	uint64_t p1 = 0, p2 = 0;
+	for (int i = 0; i < n; i++) {
+	    uint64_t d = (in[i] >> 1) ^ (0 - (in[i] & 1));
+	    uint64_t bits = (i > 1 ? 2 * p1 - p2 : p1) + d;
+	    memcpy(&values[size_t(i) * stride], &bits, sizeof(bits));
+	    p2 = p1;
+	    p1 = bits;
+	}
+    }
+
+    void encode(const double* values, int n, std::vector<unsigned char>& out)
+    {
+	std::vector<uint64_t> x;
+	predict(values, n, x);
+#ifdef SEEXPR_ZLIB
+	std::vector<Bytef> shuffled(size_t(n) * 8);
+	for (int i = 0; i < n; i++)
+	    for (int k = 0; k < 8; k++) shuffled[size_t(k) * n + i] = (x[i] >> (8 * k)) & 0xff;
+	uLongf size = compressBound(shuffled.size());
+	out.resize(1 + size);
+	out[0] = deflateCodec;
+	// the fastest level, as capturing slows the renderer
+	if (compress2(&out[1], &size, &shuffled[0], shuffled.size(), 1) == Z_OK) {
+	    out.resize(1 + size);
+	    return;
+	}
+#endif
+	out.assign(1 + (n + 1) / 2, 0);
+	out[0] = byteCodec;
+	for (int i = 0; i < n; i++) {
+	    int k = 0;
+	    while (k < 8 && (x[i] >> (8 * k))) k++;
+	    out[1 + i / 2] |= k << (4 * (i & 1));
+	    for (int b = 0; b < k; b++) out.push_back((x[i] >> (8 * b)) & 0xff);
+	}
+    }
+
+    //! Undo encode(), putting the values stride doubles apart
+    bool decode(const unsigned char* data, size_t size, int n, double* values, int stride)
+    {
+	// (before allocating for n values)
+	if (!size || size_t(n) / maxRowsPerByte > size - 1) return false;
+	std::vector<uint64_t> x(n);
+	if (data[0] == deflateCodec) {
+#ifdef SEEXPR_ZLIB
+	    std::vector<Bytef> shuffled(size_t(n) * 8);
+	    uLongf length = shuffled.size();
+	    if (n && (uncompress(&shuffled[0], &length, data + 1, size - 1) != Z_OK ||
+		      length != shuffled.size())) return false;
+	    for (int i = 0; i < n; i++)
+		for (int k = 0; k < 8; k++) x[i] |= uint64_t(shuffled[size_t(k) * n + i]) << (8 * k);
+#else
+	    return false;
+#endif
+	} else if (data[0] == byteCodec) {
+	    data++;
+	    size--;
+	    size_t pos = (n + 1) / 2;
+	    if (pos > size) return false;
+	    for (int i = 0; i < n; i++) {
+		int k = (data[i / 2] >> (4 * (i & 1))) & 0xf;
+		if (k > 8 || pos + k > size) return false;
+		for (int b = 0; b < k; b++) x[i] |= uint64_t(data[pos++]) << (8 * b);
+	    }
+	    if (pos != size) return false;
+	} else return false;
+	if (n) unpredict(&x[0], n, values, stride);
+	return true;
+    }
+
+    //! Reads the fields of a capture file in memory
+    struct Reader
+    {
+	const std::vector<char>& data;
+	size_t pos;
+	Reader(const std::vector<char>& dataIn) : data(dataIn), pos(0) {}
+
+	bool atEnd() const { return pos == data.size(); }
+	bool bytes(void* out, size_t n)
+	{
+	    if (data.size() - pos < n) return false;
+	    memcpy(out, &data[pos], n);
+	    pos += n;
+	    return true;
+	}
+	bool uint32(uint32_t& value) { return bytes(&value, sizeof(value)); }
+	bool string(std::string& value)
+	{
+	    uint32_t n;
+	    if (!uint32(n) || data.size() - pos < n) return false;
+	    value.assign(data.begin() + pos, data.begin() + pos + n);
+	    pos += n;
+	    return true;
+	}
+    };
+}
+
+
+SeExprCapture::SeExprCapture(const std::string& path)
+    : _file(fopen(path.c_str(), "wb")), _wantVec(true), _started(false),
+      _columns(3), _rows(0), _evals(0)
+{
+    if (!_file) _error = "Cannot write " + path;
+    for (int c = 0; c < 3; c++) _columns[c].resize(blockRows + SeExprBatch::maxSize);
+}
+
+
+SeExprCapture::~SeExprCapture()
+{
+    if (_file) {
+	flush();
+	fclose(_file);
+    }
+    for (size_t i = 0; i < _wrappers.size(); i++) delete _wrappers[i];
+}
+
+
+SeExprVarRef*
+SeExprCapture::wrap(const std::string& name, SeExprVarRef* ref)
+{
+    if (!ref || !_file) return ref;
+    std::map<std::string, int>::iterator i = _varIndex.find(name);
+    if (i != _varIndex.end()) {
+	// resolved again (by another node, or on a new prep)
+	CaptureVarRef* wrapper = static_cast<CaptureVarRef*>(_wrappers[i->second]);
+	wrapper->setRef(ref);
+	return wrapper;
+    }
+    if (_started) return ref;
+
+    int index = int(_wrappers.size());
+    _varIndex[name] = index;
+    _wrappers.push_back(new CaptureVarRef(*this, index, ref));
+    _isVec.push_back(ref->isVec());
+    // the variable's components go before the result's
+    _columns.insert(_columns.begin() + 3 * index, 3, std::vector<double>(blockRows + SeExprBatch::maxSize));
+    _written.push_back(std::vector<char>(blockRows + SeExprBatch::maxSize));
+    return _wrappers.back();
+}
+
+
+void
+SeExprCapture::setExpression(const std::string& expr, bool wantVec)
+{
+    if (!_file || (expr == _expr && wantVec == _wantVec)) return;
+    // the header, written with the first block, names one expression
+    if (_evals) fail("Expression changed after evaluations were captured");
+    _expr = expr;
+    _wantVec = wantVec;
+}
+
+
+void
+SeExprCapture::record(int var, int lane, const SeVec3d& value)
+{
+    int row = _rows + lane;
+    _columns[3 * var][row] = value[0];
+    if (_isVec[var]) {
+	_columns[3 * var + 1][row] = value[1];
+	_columns[3 * var + 2][row] = value[2];
+    }
+    _written[var][row] = 1;
+}
+
+
+void
+SeExprCapture::endEvals(int n, const SeVec3d* results)
+{
+    if (!_file) return;
+    int vars = int(_wrappers.size());
+    for (int r = _rows; r < _rows + n; r++) {
+	for (int v = 0; v < vars; v++) {
+	    if (_written[v][r]) continue;
+	    for (int c = 3 * v; c < 3 * v + 3; c++)
+		_columns[c][r] = r ? _columns[c][r - 1] : _carry.empty() ? 0 : _carry[c];
+	}
+	for (int c = 0; c < 3; c++) _columns[3 * vars + c][r] = results[r - _rows][c];
+    }
+    _rows += n;
+    _evals += n;
+    if (_rows >= blockRows) flush();
+}
+
+
+void
+SeExprCapture::flush()
+{
+    if (!_file || !_rows) return;
+    if (!_started) writeHeader();
+    _started = true;
+
+    uint32_t rows = _rows;
+    fwrite(&rows, sizeof(rows), 1, _file);
+    std::vector<unsigned char> encoded;
+    int vars = int(_wrappers.size());
+    for (int c = 0; c < int(_columns.size()); c++) {
+	// scalar variables have one column
+	if (c < 3 * vars && c % 3 && !_isVec[c / 3]) continue;
+	encode(&_columns[c][0], _rows, encoded);
+	uint32_t size = encoded.size();
+	fwrite(&size, sizeof(size), 1, _file);
+	if (size) fwrite(&encoded[0], 1, size, _file);
+    }
+    if (ferror(_file)) fail("Error writing capture");
+
+    _carry.resize(_columns.size());
+    for (size_t c = 0; c < _columns.size(); c++) _carry[c] = _columns[c][_rows - 1];
+    for (int v = 0; v < vars; v++) std::fill(_written[v].begin(), _written[v].end(), 0);
+    _rows = 0;
+}
+
+
+void
+SeExprCapture::writeHeader()
+{
+    fwrite(magic, 1, sizeof(magic) - 1, _file);
+    uint32_t n = _expr.size();
+    fwrite(&n, sizeof(n), 1, _file);
+    fwrite(_expr.data(), 1, n, _file);
+    char wantVec = _wantVec;
+    fwrite(&wantVec, 1, 1, _file);
+    n = _wrappers.size();
+    fwrite(&n, sizeof(n), 1, _file);
+    std::vector<std::string> names(_wrappers.size());
+    for (std::map<std::string, int>::iterator i = _varIndex.begin(); i != _varIndex.end(); ++i)
+	names[i->second] = i->first;
+    for (size_t v = 0; v < names.size(); v++) {
+	n = names[v].size();
+	fwrite(&n, sizeof(n), 1, _file);
+	fwrite(names[v].data(), 1, n, _file);
+	char isVec = _isVec[v];
+	fwrite(&isVec, 1, 1, _file);
+    }
+}
+
+
+void
+SeExprCapture::fail(const std::string& error)
+{
+    _error = error;
+    fclose(_file);
+    _file = 0;
+}
+
+
+bool
+SeExprCapture::read(const std::string& path, Contents& contents, std::string& error)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+	error = "Cannot read " + path;
+	return false;
+    }
+    std::vector<char> data;
+    char buf[65536];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0;)
+	data.insert(data.end(), buf, buf + n);
+    fclose(file);
+
+    Reader in(data);
+    error = "Invalid capture " + path;
+    char header[sizeof(magic) - 1];
+    if (!in.bytes(header, sizeof(header)) || memcmp(header, magic, sizeof(header))) return false;
+    char wantVec;
+    uint32_t vars;
+    if (!in.string(contents.expr) || !in.bytes(&wantVec, 1) || !in.uint32(vars)) return false;
+    // each variable's name length and isVec
+    if (vars > (data.size() - in.pos) / 5) return false;
+    contents.wantVec = wantVec != 0;
+    contents.vars.clear();
+    contents.vars.resize(vars);
+    for (uint32_t v = 0; v < vars; v++) {
+	char isVec;
+	if (!in.string(contents.vars[v].name) || !in.bytes(&isVec, 1)) return false;
+	contents.vars[v].isVec = isVec != 0;
+    }
+
+    contents.results.clear();
+    contents.evals = 0;
+    while (!in.atEnd()) {
+	uint32_t rows;
+	if (!in.uint32(rows) || !rows || rows > INT_MAX) return false;
+	// no more rows than the rest of the file could hold, before allocating them
+	size_t columns = 3;
+	for (uint32_t v = 0; v < vars; v++) columns += contents.vars[v].isVec ? 3 : 1;
+	if (rows / maxRowsPerByte > (data.size() - in.pos) / columns) return false;
+	size_t first = contents.evals;
+	contents.evals += rows;
+	contents.results.resize(contents.evals);
+	for (uint32_t v = 0; v <= vars; v++) {
+	    // the result after the variables
+	    bool result = v == vars;
+	    int width = result || contents.vars[v].isVec ? 3 : 1;
+	    double* values;
+	    if (result) values = &contents.results[first][0];
+	    else {
+		std::vector<double>& column = contents.vars[v].values;
+		column.resize(contents.evals * width);
+		values = &column[first * width];
+	    }
+	    for (int c = 0; c < width; c++) {
+		uint32_t size;
+		if (!in.uint32(size) || data.size() - in.pos < size) return false;
+		const unsigned char* encoded = (const unsigned char*)&data[0] + in.pos;
+#ifndef SEEXPR_ZLIB
+		if (size && encoded[0] == deflateCodec) {
+		    error = "Capture " + path + " needs zlib, which SeExpr was built without";
+		    return false;
+		}
+#endif
+		if (!decode(encoded, size, rows, values + c, width)) return false;
+		in.pos += size;
+	    }
+	}
+    }
+    error = "";
+    return true;
+}
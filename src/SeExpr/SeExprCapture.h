@@ -0,0 +1,155 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprCapture_h
+#define SeExprCapture_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "SeVec3d.h"
+
+class SeExpression;
+class SeExprVarRef;
+class SeExprVarNode;
+
+//! Capture of the values an expression is evaluated with, to replay offline.
+/** A capture records, for each point an expression evaluates, the
+    values of its variables and the result, so a benchmark can replay
+    the points a renderer actually evaluated (see the sereplay demo).
+    The host wraps the variables it resolves and attaches the capture:
+
+        SeExprVarRef* resolveVar(const std::string& name) const
+        { return capture.wrap(name, lookUp(name)); }
+        ...
+        expr.setCapture(&capture);
+
+    Every evaluate(), and every point of evaluateBatch() and
+    evaluatePoints(), is then a row of the capture.  A variable a row
+    didn't read (in a branch not taken) repeats the row before.  Rows
+    are written in blocks of blockRows, a column per component of each
+    variable and of the result.  A column stores each value's
+    difference from a linear prediction off the two before it, which is
+    small for values that vary smoothly from point to point.  The
+    differences are deflated by zlib where SeExpr is built with it, and
+    otherwise stored without their leading zero bytes.
+
+    A capture belongs to one expression, and is used from the thread
+    evaluating it.  Its variables are fixed once the first block is
+    written; changing the expression's text after evaluations are
+    captured is an error.  The file is in the byte order of the machine writing it. */
+class SeExprCapture
+{
+public:
+    enum { blockRows = 4096 };
+
+    //! Capture to a file (check error())
+    explicit SeExprCapture(const std::string& path);
+    //! Writes the rows left and closes the file
+    ~SeExprCapture();
+
+    //! Wrap a variable so its values are captured under name.  The
+    //! capture owns the wrapper (not ref).  Returns ref itself once the
+    //! variables are fixed, or if ref is null.
+    SeExprVarRef* wrap(const std::string& name, SeExprVarRef* ref);
+
+    //! Rows captured so far
+    size_t evals() const { return _evals; }
+
+    //! Write the rows captured so far
+    void flush();
+
+    //! Why the file couldn't be written, empty if it could
+    const std::string& error() const { return _error; }
+
+    //! A capture read back with read()
+    struct Variable
+    {
+	std::string name;
+	bool isVec;
+	//! 1 or 3 values per row
+	std::vector<double> values;
+    };
+    struct Contents
+    {
+	std::string expr;
+	bool wantVec;
+	std::vector<Variable> vars;
+	std::vector<SeVec3d> results;
+	size_t evals;
+    };
+
+    //! Read a capture file, returning false with a message on error
+    static bool read(const std::string& path, Contents& contents, std::string& error);
+
+    /* internal */
+    //! Remember the expression captured (called by SeExpression when the
+    //! capture is set and when the expression changes)
+    void setExpression(const std::string& expr, bool wantVec);
+    //! Record the value a variable gave a lane of the evaluation
+    void record(int var, int lane, const SeVec3d& value);
+    //! End an evaluation of n lanes with the results given
+    void endEvals(int n, const SeVec3d* results);
+
+private:
+    SeExprCapture(const SeExprCapture&);
+    SeExprCapture& operator=(const SeExprCapture&);
+
+    void writeHeader();
+    void fail(const std::string& error);
+
+    FILE* _file;
+    std::string _error;
+    std::string _expr;
+    bool _wantVec;
+    bool _started;
+    //! variables by name, as indices into _wrappers
+    std::map<std::string, int> _varIndex;
+    std::vector<SeExprVarRef*> _wrappers;
+    std::vector<bool> _isVec;
+    //! rows of the block so far, for each variable component (3 per
+    //! variable) and the result components after them
+    std::vector<std::vector<double> > _columns;
+    //! whether each variable was read in each row of the block
+    std::vector<std::vector<char> > _written;
+    //! last row of the block before, for variables a row didn't read
+    std::vector<double> _carry;
+    int _rows;
+    size_t _evals;
+};
+
+#endif
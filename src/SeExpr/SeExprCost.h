@@ -0,0 +1,68 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprCost_h
+#define SeExprCost_h
+
+//! Static estimate of the work done by one evaluation.
+/** Returned by SeExpression::estimateCost() and attached to functions
+    with SeExprFunc::setCost().  Flops counts floating point and
+    comparable integer operations (hashing, table indexing); bytes counts
+    memory read or written beyond the values passed between nodes.  These
+    are estimates for scheduling, not measurements. */
+struct SeExprCost
+{
+    double flops;
+    double bytes;
+
+    SeExprCost() : flops(0), bytes(0) {}
+    SeExprCost(double flopsIn, double bytesIn=0) : flops(flopsIn), bytes(bytesIn) {}
+
+    SeExprCost& operator+=(const SeExprCost& c)
+    { flops += c.flops; bytes += c.bytes; return *this; }
+    SeExprCost operator+(const SeExprCost& c) const
+    { return SeExprCost(flops + c.flops, bytes + c.bytes); }
+    SeExprCost operator*(double s) const
+    { return SeExprCost(flops * s, bytes * s); }
+
+    //! component-wise maximum (the more expensive of two branches)
+    static SeExprCost max(const SeExprCost& a, const SeExprCost& b)
+    {
+        return SeExprCost(a.flops > b.flops ? a.flops : b.flops,
+                          a.bytes > b.bytes ? a.bytes : b.bytes);
+    }
+};
+
+#endif
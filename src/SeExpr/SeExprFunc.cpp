@@ -34,11 +34,19 @@
 */
 #include <string>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <sstream>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #ifndef SEEXPR_WIN32
 #include <dlfcn.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #endif
 
 #include "SeExpression.h"
@@ -46,36 +54,113 @@
 #include "SeExprNode.h"
 #include "SeExprBuiltins.h"
 
+#include "SeExprTrace.h"
 #include "SeMutex.h"
 
 namespace {
+    //! A builtin function.  Builtins are kept in a fixed table sorted by
+    //! name, pointing at their static names and docstrings, so defining
+    //! them allocates nothing.
+    struct Builtin {
+        const char* name;
+        const char* docString;
+        SeExprFunc func;
+    };
+
+    struct BuiltinLess {
+        bool operator()(const Builtin& a, const Builtin& b) const { return strcmp(a.name,b.name)<0; }
+        bool operator()(const Builtin& a, const char* b) const { return strcmp(a.name,b)<0; }
+    };
+
+    //! Lists the functions each plugin defines, so plugins need only be
+    //! loaded once one of their functions is used.  It is kept in the file
+    //! named by $SE_EXPR_PLUGIN_CACHE (by default plugins in the directory
+    //! SeExpr-<uid> of $TMPDIR or /tmp, made private to the user; empty to
+    //! load every plugin up front), one line per plugin giving its path,
+    //! modification time, size and function names.  A manifest that
+    //! others could have written is ignored.
+    class PluginManifest {
+    public:
+        PluginManifest() : _read(false), _dirty(false) {}
+
+        //! The functions of the plugin at path if they're known for its
+        //! current file
+        bool find(const std::string& path, long mtime, long size, std::vector<std::string>& names)
+        {
+            readIfNeeded();
+            std::map<std::string,Entry>::iterator i=_entries.find(path);
+            if (i==_entries.end() || i->second.mtime!=mtime || i->second.size!=size) return false;
+            names=i->second.names;
+            return true;
+        }
+
+        void set(const std::string& path, long mtime, long size, const std::vector<std::string>& names)
+        {
+            readIfNeeded();
+            Entry& entry=_entries[path];
+            entry.mtime=mtime;
+            entry.size=size;
+            entry.names=names;
+            _dirty=true;
+        }
+
+        void writeIfNeeded();
+
+    private:
+        struct Entry {
+            long mtime, size;
+            std::vector<std::string> names;
+        };
+
+        void readIfNeeded();
+        std::string path() const;
+
+        bool _read, _dirty;
+        std::map<std::string,Entry> _entries;
+    };
+
     // FuncTable - table of pre-defined functions
     class FuncTable {
     public:
         FuncTable()
-            :_inited(false)
+            :_inited(false), _numBuiltins(0), _recordNames(0), _keepNames(0)
         {}
 
         ~FuncTable(){
             funcmap.clear();
 #ifdef SEEXPR_WIN32
 #else
-            for(size_t i=0;i<dynamicLibraries.size();i++){
-                dlclose(dynamicLibraries[i]);
+            for(size_t i=0;i<plugins.size();i++){
+                if(plugins[i].handle) dlclose(plugins[i].handle);
             }
 #endif
         }
 
 	void define(const char* name, SeExprFunc f,const char* docString=0) {
+            if(_recordNames) _recordNames->push_back(name);
+            if(_keepNames && _keepNames->count(name)) return;
             if(docString) funcmap[name] = FuncMapItem(std::string(docString),f); 
             else funcmap[name] = FuncMapItem(name,f); 
         }
 
+        //! Add a builtin; name and docString must be static strings
+        void defineBuiltin(const char* name, SeExprFunc f,const char* docString) {
+            if(_numBuiltins==maxBuiltins){define(name,f,docString);return;}
+            Builtin& builtin=builtins[_numBuiltins++];
+            builtin.name=name;
+            builtin.docString=docString ? docString : name;
+            builtin.func=f;
+        }
+
 	const SeExprFunc* lookup(const std::string& name)
 	{
 	    FuncMap::iterator iter;
 	    if ((iter = funcmap.find(name)) != funcmap.end())
 		return &iter->second.second;
+            if (const Builtin* builtin=findBuiltin(name.c_str()))
+                return &builtin->func;
+            if (loadPluginDefining(name))
+                return lookup(name);
 	    return 0;
 	}
         void initIfNeeded();
@@ -83,28 +168,65 @@ namespace {
 
         void getFunctionNames(std::vector<std::string>& names)
         {
+            size_t first=names.size();
             for(FuncMap::iterator i=funcmap.begin();i!=funcmap.end();++i)
                 names.push_back(i->first);
+            for(int i=0;i<_numBuiltins;i++)
+                names.push_back(builtins[i].name);
+            for(LazyMap::iterator i=lazyFuncs.begin();i!=lazyFuncs.end();++i)
+                names.push_back(i->first);
+            std::sort(names.begin()+first,names.end());
+            names.erase(std::unique(names.begin()+first,names.end()),names.end());
         }
 
         std::string getDocString(const char* functionName)
         {
             FuncMap::iterator i=funcmap.find(functionName);
-            if(i==funcmap.end()) return "";
-            else return i->second.first;
+            if(i!=funcmap.end()) return i->second.first;
+            if(const Builtin* builtin=findBuiltin(functionName)) return builtin->docString;
+            if(loadPluginDefining(functionName)) return getDocString(functionName);
+            return "";
         }
 
-        void addLibraryReference(void* lib)
-        {
-            dynamicLibraries.push_back(lib);
-        }
+        //! Make a plugin's functions available, loading it when one is
+        //! first looked up if the manifest knows its functions
+        void addPlugin(const char* path);
+        //! Load a plugin and define its functions now
+        void loadPlugin(const char* path);
+        void writeManifest() { manifest.writeIfNeeded(); }
 	
     private:
+        struct Plugin {
+            std::string path;
+            void* handle;
+            bool loaded;
+        };
+
+        const Builtin* findBuiltin(const char* name) const
+        {
+            const Builtin* end=builtins+_numBuiltins;
+            const Builtin* i=std::lower_bound(builtins,end,name,BuiltinLess());
+            return i!=end && !strcmp(i->name,name) ? i : 0;
+        }
+        void sortBuiltins();
+        bool loadPluginDefining(const std::string& name);
+        bool loadPlugin(Plugin& plugin, std::vector<std::string>* names);
+
         bool _inited;
         typedef std::pair<std::string,SeExprFunc> FuncMapItem;
 	typedef std::map<std::string,FuncMapItem> FuncMap;
-        std::vector<void*> dynamicLibraries;
 	FuncMap funcmap;
+        static const int maxBuiltins=1024;
+        Builtin builtins[maxBuiltins];
+        int _numBuiltins;
+        std::vector<Plugin> plugins;
+        typedef std::map<std::string,size_t> LazyMap;
+        LazyMap lazyFuncs;
+        std::vector<std::string>* _recordNames;
+        //! names a lazily loaded plugin leaves to the definitions made
+        //! since it was added
+        const std::set<std::string>* _keepNames;
+        PluginManifest manifest;
     };
 
     FuncTable Functions;
@@ -125,6 +247,18 @@ defineInternal3(const char* name,SeExprFunc f,const char* docString)
     Functions.define(name,f,docString);
 }
 
+static void
+defineBuiltinInternal(const char* name,SeExprFunc f)
+{
+    Functions.defineBuiltin(name,f,0);
+}
+
+static void
+defineBuiltinInternal3(const char* name,SeExprFunc f,const char* docString)
+{
+    Functions.defineBuiltin(name,f,docString);
+}
+
 void FuncTable::initIfNeeded(){
     // THIS FUNCTION IS NOT THREAD SAFE, it assumes you have a mutex from callee
     // ALSO YOU MUST BE VERY CAREFUL NOT TO CALL ANYTHING THAT TRIES TO REACQUIRE MUTEX!
@@ -132,12 +266,201 @@ void FuncTable::initIfNeeded(){
     _inited=true;
     
     // TODO: make thread safe
-    SeExpr::defineBuiltins(defineInternal,defineInternal3);
+    {
+        SeExprTrace::Scope trace("defineBuiltins");
+        SeExpr::defineBuiltins(defineBuiltinInternal,defineBuiltinInternal3);
+        sortBuiltins();
+    }
     const char* path = getenv("SE_EXPR_PLUGINS");
     if (path) SeExprFunc::loadPlugins(path);
     
 }
 
+void FuncTable::sortBuiltins()
+{
+    // a later definition of a name replaces an earlier one
+    std::stable_sort(builtins,builtins+_numBuiltins,BuiltinLess());
+    int n=0;
+    for(int i=0;i<_numBuiltins;i++){
+        if(n && !strcmp(builtins[n-1].name,builtins[i].name)) builtins[n-1]=builtins[i];
+        else builtins[n++]=builtins[i];
+    }
+    _numBuiltins=n;
+}
+
+bool FuncTable::loadPluginDefining(const std::string& name)
+{
+#ifdef SEEXPR_WIN32
+    return false;
+#else
+    LazyMap::iterator i=lazyFuncs.find(name);
+    if(i==lazyFuncs.end()) return false;
+    size_t index=i->second;
+    // forget the plugin's names whether or not it defines them after all.
+    // Those defined since the plugin was added (by later plugins or the
+    // host) replaced its own, so loading it late mustn't undo that.
+    std::set<std::string> keep;
+    for(LazyMap::iterator j=lazyFuncs.begin();j!=lazyFuncs.end();){
+        if(j->second!=index){++j;continue;}
+        if(funcmap.count(j->first)) keep.insert(j->first);
+        lazyFuncs.erase(j++);
+    }
+    if(plugins[index].loaded) return false;
+    _keepNames=&keep;
+    bool loaded=loadPlugin(plugins[index],0);
+    _keepNames=0;
+    return loaded;
+#endif
+}
+
+#ifndef SEEXPR_WIN32
+
+std::string PluginManifest::path() const
+{
+    const char* path=getenv("SE_EXPR_PLUGIN_CACHE");
+    if(path) return path;
+    const char* tmp=getenv("TMPDIR");
+    if(!tmp || !*tmp) tmp="/tmp";
+    std::ostringstream dir;
+    dir<<tmp<<"/SeExpr-"<<getuid();
+    // the directory is shared with other users, so someone else may have
+    // made (or linked) it first; use it only if it's ours alone
+    mkdir(dir.str().c_str(),0700);
+    struct stat info;
+    if(lstat(dir.str().c_str(),&info) || !S_ISDIR(info.st_mode) ||
+       info.st_uid!=getuid() || (info.st_mode & 077)) return "";
+    return dir.str()+"/plugins";
+}
+
+void PluginManifest::readIfNeeded()
+{
+    if(_read) return;
+    _read=true;
+    std::string file=path();
+    if(file.empty()) return;
+    int fd=open(file.c_str(),O_RDONLY|O_NOFOLLOW);
+    if(fd<0) return;
+    // it names libraries to dlopen, so trust only what we wrote
+    struct stat info;
+    std::string contents;
+    if(!fstat(fd,&info) && info.st_uid==getuid() && !(info.st_mode & (S_IWGRP|S_IWOTH))){
+        char buffer[4096];
+        ssize_t n;
+        while((n=read(fd,buffer,sizeof(buffer)))>0) contents.append(buffer,n);
+    }
+    close(fd);
+    std::istringstream in(contents);
+    std::string line;
+    while(std::getline(in,line)){
+        // path<tab>mtime<tab>size<tab>names
+        size_t tab1=line.find('\t'),tab2=line.find('\t',tab1+1),tab3=line.find('\t',tab2+1);
+        if(tab1==std::string::npos || tab2==std::string::npos || tab3==std::string::npos) continue;
+        Entry& entry=_entries[line.substr(0,tab1)];
+        entry.mtime=atol(line.c_str()+tab1+1);
+        entry.size=atol(line.c_str()+tab2+1);
+        std::istringstream names(line.substr(tab3+1));
+        std::string name;
+        while(names>>name) entry.names.push_back(name);
+    }
+}
+
+void PluginManifest::writeIfNeeded()
+{
+    if(!_dirty) return;
+    _dirty=false;
+    std::string file=path();
+    if(file.empty()) return;
+    std::ostringstream out;
+    for(std::map<std::string,Entry>::iterator i=_entries.begin();i!=_entries.end();++i){
+        out<<i->first<<'\t'<<i->second.mtime<<'\t'<<i->second.size<<'\t';
+        for(size_t k=0;k<i->second.names.size();k++) out<<(k?" ":"")<<i->second.names[k];
+        out<<'\n';
+    }
+    std::string contents=out.str();
+    // write a new private file and rename it so concurrent readers never
+    // see a partial manifest
+    std::vector<char> temp(file.begin(),file.end());
+    const char suffix[]=".XXXXXX";
+    temp.insert(temp.end(),suffix,suffix+sizeof(suffix));
+    int fd=mkstemp(&temp[0]);
+    if(fd<0) return;
+    bool written=write(fd,contents.data(),contents.size())==ssize_t(contents.size());
+    if(close(fd)) written=false;
+    if(!written || rename(&temp[0],file.c_str())) remove(&temp[0]);
+}
+
+void FuncTable::addPlugin(const char* path)
+{
+    struct stat info;
+    if(stat(path,&info)){
+        std::cerr << "Error reading expression plugin: " << path << std::endl;
+        return;
+    }
+    size_t index=plugins.size();
+    Plugin plugin={path,0,false};
+    plugins.push_back(plugin);
+
+    std::vector<std::string> names;
+    bool known=manifest.find(path,info.st_mtime,info.st_size,names);
+    if(!known){
+        if(loadPlugin(plugins[index],&names))
+            manifest.set(path,info.st_mtime,info.st_size,names);
+        return;
+    }
+    for(size_t i=0;i<names.size();i++){
+        // plugins replace functions defined before them, so they're loaded
+        // right away to keep that order
+        if(findBuiltin(names[i].c_str()) || funcmap.count(names[i]) || lazyFuncs.count(names[i])){
+            loadPlugin(plugins[index],0);
+            return;
+        }
+    }
+    for(size_t i=0;i<names.size();i++) lazyFuncs[names[i]]=index;
+}
+
+void FuncTable::loadPlugin(const char* path)
+{
+    Plugin plugin={path,0,false};
+    plugins.push_back(plugin);
+    loadPlugin(plugins.back(),0);
+}
+
+bool FuncTable::loadPlugin(Plugin& plugin, std::vector<std::string>* names)
+{
+    plugin.loaded=true;
+    const char* path=plugin.path.c_str();
+    SeExprTrace::Scope trace("loadPlugin", path);
+    void* handle = dlopen(path, RTLD_LAZY);
+    if (!handle) {
+	std::cerr << "Error reading expression plugin: " << path << std::endl;
+	const char* err = dlerror();
+	if (err) std::cerr << err << std::endl;
+	return false;
+    }
+    typedef void (*initfn_v1) (SeExprFunc::Define);
+    initfn_v1 init_v1 = (initfn_v1) dlsym(handle, "SeExprPluginInit");
+    typedef void (*initfn_v2) (SeExprFunc::Define3);
+    initfn_v2 init_v2 = (initfn_v2) dlsym(handle, "SeExprPluginInitV2");
+
+    _recordNames=names;
+    if(init_v2){
+        init_v2(defineInternal3);
+    }else if(init_v1){
+        init_v1(defineInternal);
+    }else{
+	std::cerr << "Error reading expression plugin: " << path << std::endl;
+	std::cerr << "No function named SeExprPluginInit or SeExprPluginInitV2 found" << std::endl;
+	dlclose(handle);
+	_recordNames=0;
+	return false;
+    }
+    _recordNames=0;
+    plugin.handle=handle;
+    return true;
+}
+
+#endif
+
 } // namespace
 
 
@@ -206,6 +529,15 @@ SeExprFunc::getDocString(const char* functionName)
     return ret;
 }
 
+SeExprCost
+SeExprFunc::cost(const SeExprFuncNode* node) const
+{
+    if (_costFn) return _costFn(node);
+    if (_cost.flops || _cost.bytes) return _cost;
+    // nothing registered, assume a small math library call
+    return SeExprCost(10);
+}
+
 #ifndef SEEXPR_WIN32
 
 #ifdef __APPLE__
@@ -229,6 +561,7 @@ SeExprFunc::loadPlugins(const char* path)
 #ifdef SEEXPR_WIN32
 
 #else
+    SeExprTrace::Scope trace("loadPlugins", path);
     // first split path into individual entries
     char* pathdup = strdup(path);
     char* state = 0;
@@ -236,7 +569,7 @@ SeExprFunc::loadPlugins(const char* path)
     while (entry) {
 	// if entry ends with ".so", load directly
 	if ((!strcmp(entry+strlen(entry)-3, ".so")))
-	    loadPlugin(entry);
+	    Functions.addPlugin(entry);
 	else {
 	    // assume it's a dir - search it for plugins
 	    struct dirent** matches = 0;
@@ -244,7 +577,7 @@ SeExprFunc::loadPlugins(const char* path)
 	    for (int i = 0; i < numMatches; i++) {
 		std::string fullpath = entry; fullpath += "/"; 
 		fullpath += matches[i]->d_name;
-		loadPlugin(fullpath.c_str());
+		Functions.addPlugin(fullpath.c_str());
 			free(matches[i]);
 	    }
 	    if (matches) free(matches);
@@ -257,6 +590,7 @@ SeExprFunc::loadPlugins(const char* path)
 	entry = strtok_r(0, ":", &state);
     }
     free(pathdup);
+    Functions.writeManifest();
 #endif
 }
 
@@ -266,30 +600,7 @@ SeExprFunc::loadPlugin(const char* path)
 #ifdef SEEXPR_WIN32
     std::cerr<<"SeExpr: warning Plugins are not supported on windows currently"<<std::endl;
 #else
-    void* handle = dlopen(path, RTLD_LAZY);
-    if (!handle) {
-	std::cerr << "Error reading expression plugin: " << path << std::endl;
-	const char* err = dlerror();
-	if (err) std::cerr << err << std::endl;
-	return;
-    }
-    typedef void (*initfn_v1) (SeExprFunc::Define);
-    initfn_v1 init_v1 = (initfn_v1) dlsym(handle, "SeExprPluginInit");
-    typedef void (*initfn_v2) (SeExprFunc::Define3);
-    initfn_v2 init_v2 = (initfn_v2) dlsym(handle, "SeExprPluginInitV2");
-
-    if(init_v2){
-        init_v2(defineInternal3);
-        Functions.addLibraryReference(handle);
-    }else if(init_v1){
-        init_v1(defineInternal);
-        Functions.addLibraryReference(handle);
-    }else{
-	std::cerr << "Error reading expression plugin: " << path << std::endl;
-	std::cerr << "No function named SeExprPluginInit or SeExprPluginInitV2 found" << std::endl;
-	dlclose(handle);
-	return;
-    }
+    Functions.loadPlugin(path);
 #endif
 }
 
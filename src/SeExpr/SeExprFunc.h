@@ -36,6 +36,8 @@
 #define SeExprFunc_h
 
 #include "SeVec3d.h"
+#include "SeExprCost.h"
+#include "SeExprMath.h"
 #include <vector>
 
 class SeExpression;
@@ -54,8 +56,12 @@ public:
     //! in an expression then bool SeExpression::isThreadSafe() will return false
     //! and the controlling software should not attempt to run multiple threads
     //! of an expression.
-    SeExprFuncX(const bool threadSafe)
-        :_threadSafe(threadSafe)
+    //! A pure function's result depends only on its argument values (and
+    //! on what it set up in prep), and evaluating it has no side effects.
+    //! Calls to pure functions remember recent results and return them
+    //! again, without calling eval(), when the arguments repeat.
+    SeExprFuncX(const bool threadSafe, const bool pure=false)
+        :_threadSafe(threadSafe), _pure(pure)
     {}
 
     /** prep the expression by doing all type checking argument checking, etc. */
@@ -67,8 +73,10 @@ public:
     virtual ~SeExprFuncX(){}
 
     bool isThreadSafe() const {return _threadSafe;}
+    bool isPure() const {return _pure;}
 private:
     bool _threadSafe;
+    bool _pure;
 };
 
 //! Function Definition, used in parse tree and func table.  
@@ -91,7 +99,8 @@ public:
     /** In addition to initializing all builtins, this loads all plugins given in a
         a colon delimited SE_EXPR_PLUGINS environment variable **/
     static void init(); 
-    //! load all plugins in a given path
+    //! load all plugins in a given path.  Plugins whose functions are
+    //! listed in the plugin cache are loaded when one is first looked up.
     static void loadPlugins(const char* path);
     //! load a given plugin
     static void loadPlugin(const char* path);
@@ -128,6 +137,11 @@ public:
     typedef double Funcn(int n, double* params);
     typedef double Funcnv(int n, const SeVec3d* params);
     typedef SeVec3d Funcnvv(int n, const SeVec3d* params);
+    //! Batch form of a function, evaluating n calls at once.  args[i]
+    //! points to the n values of argument i (scalar args are broadcast
+    //! to all three components) and results receives the n results
+    //! (only x is used for a scalar result).
+    typedef void FuncBatch(int nargs, const SeVec3d* const* args, int n, SeVec3d* results);
 
     enum FuncType {
 	NONE=0, 
@@ -143,42 +157,42 @@ public:
     bool hasVecArgs() const { return _type >= VEC; }
     bool isVec() const { return _type >= VECVEC; }
 
-    SeExprFunc() : _type(NONE), _func(0), _minargs(0), _maxargs(0) {}
+    SeExprFunc() : _type(NONE), _func(0), _minargs(0), _maxargs(0), _costFn(0), _batch(0), _version(0), _kernel(0) {}
 
     //! No argument function
-    SeExprFunc(Func0* f) : _type(FUNC0), _func((void*)f), _minargs(0), _maxargs(0) {}
+    SeExprFunc(Func0* f) : _type(FUNC0), _func((void*)f), _minargs(0), _maxargs(0), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(double)
-    SeExprFunc(Func1* f) : _type(FUNC1), _func((void*)f), _minargs(1), _maxargs(1) {}
+    SeExprFunc(Func1* f) : _type(FUNC1), _func((void*)f), _minargs(1), _maxargs(1), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(double,double)
-    SeExprFunc(Func2* f) : _type(FUNC2), _func((void*)f), _minargs(2), _maxargs(2) {}
+    SeExprFunc(Func2* f) : _type(FUNC2), _func((void*)f), _minargs(2), _maxargs(2), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(double,double,double)
-    SeExprFunc(Func3* f) : _type(FUNC3), _func((void*)f), _minargs(3), _maxargs(3) {}
+    SeExprFunc(Func3* f) : _type(FUNC3), _func((void*)f), _minargs(3), _maxargs(3), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(double,double,double,double)
-    SeExprFunc(Func4* f) : _type(FUNC4), _func((void*)f), _minargs(4), _maxargs(4) {}
+    SeExprFunc(Func4* f) : _type(FUNC4), _func((void*)f), _minargs(4), _maxargs(4), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(double,double,double,double,double)
-    SeExprFunc(Func5* f) : _type(FUNC5), _func((void*)f), _minargs(5), _maxargs(5) {}
+    SeExprFunc(Func5* f) : _type(FUNC5), _func((void*)f), _minargs(5), _maxargs(5), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(double,double,double,double,double,double)
-    SeExprFunc(Func6* f) : _type(FUNC6), _func((void*)f), _minargs(6), _maxargs(6) {}
+    SeExprFunc(Func6* f) : _type(FUNC6), _func((void*)f), _minargs(6), _maxargs(6), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(vector)
-    SeExprFunc(Func1v* f) : _type(FUNC1V), _func((void*)f), _minargs(1), _maxargs(1) {}
+    SeExprFunc(Func1v* f) : _type(FUNC1V), _func((void*)f), _minargs(1), _maxargs(1), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype double f(vector,vector)
-    SeExprFunc(Func2v* f) : _type(FUNC2V), _func((void*)f), _minargs(2), _maxargs(2) {}
+    SeExprFunc(Func2v* f) : _type(FUNC2V), _func((void*)f), _minargs(2), _maxargs(2), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype vector f(vector)
-    SeExprFunc(Func1vv* f) : _type(FUNC1VV), _func((void*)f), _minargs(1), _maxargs(1) {}
+    SeExprFunc(Func1vv* f) : _type(FUNC1VV), _func((void*)f), _minargs(1), _maxargs(1), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with prototype vector f(vector,vector)
-    SeExprFunc(Func2vv* f) : _type(FUNC2VV), _func((void*)f), _minargs(2), _maxargs(2) {}
+    SeExprFunc(Func2vv* f) : _type(FUNC2VV), _func((void*)f), _minargs(2), _maxargs(2), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with arbitrary number of arguments double f(double,...)
     SeExprFunc(Funcn* f, int minargs, int maxargs)
-	: _type(FUNCN), _func((void*)f), _minargs(minargs), _maxargs(maxargs) {}
+	: _type(FUNCN), _func((void*)f), _minargs(minargs), _maxargs(maxargs), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with arbitrary number of arguments double f(vector,...)
     SeExprFunc(Funcnv* f, int minargs, int maxargs)
-	: _type(FUNCNV), _func((void*)f), _minargs(minargs), _maxargs(maxargs) {}
+	: _type(FUNCNV), _func((void*)f), _minargs(minargs), _maxargs(maxargs), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with arbitrary number of arguments vector f(vector,...)
     SeExprFunc(Funcnvv* f, int minargs, int maxargs)
-	: _type(FUNCNVV), _func((void*)f), _minargs(minargs), _maxargs(maxargs) {}
+	: _type(FUNCNVV), _func((void*)f), _minargs(minargs), _maxargs(maxargs), _costFn(0), _batch(0), _version(0), _kernel(0) {}
     //! User defined function with custom argument parsing
     SeExprFunc(SeExprFuncX& f, int minargs=1, int maxargs=1)
-	: _type(FUNCX), _func((void*)&f), _minargs(minargs), _maxargs(maxargs) {}
+	: _type(FUNCX), _func((void*)&f), _minargs(minargs), _maxargs(maxargs), _costFn(0), _batch(0), _version(0), _kernel(0) {}
 
     int type() const { return _type; }
     int minArgs() const { return _minargs; }
@@ -199,11 +213,53 @@ public:
     Funcnvv* funcnvv() const { return (Funcnvv*)_func; }
     SeExprFuncX* funcx() const { return (SeExprFuncX*)_func; }
 
+    //! Computes the cost of a call from its prepped node (e.g. from
+    //! constant arguments such as an octave count)
+    typedef SeExprCost CostFn(const SeExprFuncNode* node);
+
+    //! Set the cost of one call, used by SeExpression::estimateCost().
+    //! Returns *this so it can be given inline to define().
+    SeExprFunc& setCost(const SeExprCost& cost) { _cost = cost; _costFn = 0; return *this; }
+    SeExprFunc& setCost(CostFn* costFn) { _costFn = costFn; return *this; }
+
+    //! Estimated cost of one call at the given node (a small math library
+    //! call if no cost was set)
+    SeExprCost cost(const SeExprFuncNode* node) const;
+
+    //! Set a batch form of the function used by SeExpression::evaluateBatch().
+    //! It must give the same results as the function itself.  It is not
+    //! used for funcx or for a scalar function applied to vector args.
+    SeExprFunc& setBatch(FuncBatch* batch) { _batch = batch; return *this; }
+    FuncBatch* batch() const { return _batch; }
+
+    //! Array form of a function of scalar args (FUNC1 to FUNC6) at an
+    //! accuracy of SeExprMath.  args[i] points to the n values of
+    //! argument i and results receives the n results.  At exact accuracy
+    //! it must give the same results as the function itself.
+    typedef void FuncKernel(SeExprMath::Accuracy accuracy, int n, const double* const* args, double* results);
+
+    //! Set the array form of the function.  Calls use it for all three
+    //! components of vector args at once, in evaluateBatch(), and in
+    //! evaluate() when the expression's math accuracy is not exact.
+    SeExprFunc& setKernel(FuncKernel* kernel) { _kernel = kernel; return *this; }
+    FuncKernel* kernel() const { return _kernel; }
+
+    //! Set the version of the function's results.  Change it whenever
+    //! the function starts returning different results, so results
+    //! saved from expressions using it (such as bakes) are remade.
+    SeExprFunc& setVersion(int version) { _version = version; return *this; }
+    int version() const { return _version; }
+
 private:
     FuncType _type;
     void* _func;
     int _minargs;
     int _maxargs;
+    SeExprCost _cost;
+    CostFn* _costFn;
+    FuncBatch* _batch;
+    int _version;
+    FuncKernel* _kernel;
 };
 
 #endif
@@ -0,0 +1,411 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+/**
+   @file SeExprGraph.cpp
+*/
+#include <cstring>
+#include <set>
+#include "SeExpression.h"
+#include "SeExprGraph.h"
+#include "SeExprStats.h"
+#include "SeExprTrace.h"
+
+//! Values a node can read: an input or another node's results
+struct SeExprGraph::Source
+{
+    const double* ptr;
+    bool isVec;
+    int stride;
+    //! changes whenever the values do
+    unsigned int stamp;
+
+    Source() : ptr(0), isVec(false), stride(0), stamp(0) {}
+};
+
+
+//! Expression of a node, resolving variables to inputs and other nodes
+class SeExprGraph::NodeExpr : public SeExpression
+{
+ public:
+    struct Binding
+    {
+	SeExprPtrVarRef ref;
+	const Source* source;
+    };
+
+    NodeExpr(const SeExprGraph& graph, const std::string& expr)
+	: SeExpression(expr), _graph(graph)
+    {}
+
+    //! point the variables at the current memory of what they read
+    void bind()
+    {
+	for (std::map<std::string, Binding>::iterator i = bindings.begin();
+	     i != bindings.end(); ++i) {
+	    const Source& s = *i->second.source;
+	    i->second.ref.setPtr(s.ptr, s.isVec, s.stride);
+	}
+    }
+
+    mutable std::map<std::string, Binding> bindings;
+    //! every name the expression looked up, found or not
+    mutable std::set<std::string> reads;
+
+ private:
+    SeExprVarRef* resolveVar(const std::string& name) const
+    {
+	reads.insert(name);
+	const Source* source = _graph.resolve(name);
+	if (!source) return 0;
+	Binding& binding = bindings[name];
+	binding.source = source;
+	binding.ref.setPtr(source->ptr, source->isVec, source->stride);
+	return &binding.ref;
+    }
+
+    const SeExprGraph& _graph;
+};
+
+
+struct SeExprGraph::Node
+{
+    enum State { unprepped, prepping, prepped };
+
+    std::string name;
+    NodeExpr expr;
+    //! unprepped when the expression or something it reads changed
+    State state;
+    //! whether the expression was valid when last prepped
+    bool valid;
+    //! expression changed since the last evaluation
+    bool changed;
+    Source out;
+    //! results, and the buffer the next results are evaluated into
+    std::vector<SeVec3d> results, next;
+    //! points and stamps of the sources read at the last evaluation
+    int n;
+    std::vector<unsigned int> stamps;
+
+    Node(const SeExprGraph& graph, const std::string& nameIn, const std::string& exprIn)
+	: name(nameIn), expr(graph, exprIn), state(unprepped), valid(false), changed(true), n(-1)
+    {
+	out.stride = sizeof(SeVec3d);
+    }
+};
+
+
+SeExprGraph::SeExprGraph()
+    : _prepped(false), _clock(0), _numEvaluated(0)
+{}
+
+
+SeExprGraph::~SeExprGraph()
+{
+    for (std::map<std::string, Node*>::iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+	delete i->second;
+    for (std::map<std::string, Source*>::iterator i = _inputs.begin(); i != _inputs.end(); ++i)
+	delete i->second;
+}
+
+
+void
+SeExprGraph::setExpr(const std::string& name, const std::string& expr)
+{
+    Node*& node = _nodes[name];
+    if (!node) {
+	node = new Node(*this, name, expr);
+	// readers may have resolved name to an input, or failed to
+	markReaders(name);
+    } else if (node->expr.getExpr() == expr) return;
+    else {
+	node->expr.setExpr(expr);
+	node->state = Node::unprepped;
+	node->changed = true;
+    }
+    _prepped = false;
+}
+
+
+void
+SeExprGraph::remove(const std::string& name)
+{
+    std::map<std::string, Node*>::iterator i = _nodes.find(name);
+    if (i == _nodes.end()) return;
+    delete i->second;
+    _nodes.erase(i);
+    markReaders(name);
+    _prepped = false;
+}
+
+
+bool
+SeExprGraph::hasNode(const std::string& name) const
+{
+    return _nodes.find(name) != _nodes.end();
+}
+
+
+void
+SeExprGraph::setInput(const std::string& name, const double* ptr, bool isVec, int stride)
+{
+    Source*& input = _inputs[name];
+    if (!input) {
+	// may resolve names that failed before
+	input = new Source;
+	markReaders(name);
+    } else if (input->isVec != isVec) markReaders(name);
+    input->ptr = ptr;
+    input->isVec = isVec;
+    input->stride = stride ? stride : sizeof(double) * (isVec ? 3 : 1);
+    input->stamp = ++_clock;
+}
+
+
+void
+SeExprGraph::touchInput(const std::string& name)
+{
+    std::map<std::string, Source*>::iterator i = _inputs.find(name);
+    if (i != _inputs.end()) i->second->stamp = ++_clock;
+}
+
+
+SeExprGraph::Node*
+SeExprGraph::findNode(const std::string& name) const
+{
+    prepare();
+    std::map<std::string, Node*>::const_iterator i = _nodes.find(name);
+    return i == _nodes.end() ? 0 : i->second;
+}
+
+
+bool
+SeExprGraph::isValid(const std::string& name) const
+{
+    Node* node = findNode(name);
+    return node && node->expr.isValid();
+}
+
+
+const std::string&
+SeExprGraph::parseError(const std::string& name) const
+{
+    static const std::string noNode = "No node of that name";
+    Node* node = findNode(name);
+    return node ? node->expr.parseError() : noNode;
+}
+
+
+bool
+SeExprGraph::isVec(const std::string& name) const
+{
+    Node* node = findNode(name);
+    return node && node->out.isVec;
+}
+
+
+std::vector<std::string>
+SeExprGraph::order() const
+{
+    prepare();
+    // the order holds nodes, find their names
+    std::map<const Node*, std::string> names;
+    for (std::map<std::string, Node*>::const_iterator i = _nodes.begin(); i != _nodes.end(); ++i)
+	names[i->second] = i->first;
+    std::vector<std::string> result;
+    for (size_t i = 0; i < _order.size(); i++) result.push_back(names[_order[i]]);
+    return result;
+}
+
+
+const SeVec3d*
+SeExprGraph::result(const std::string& name) const
+{
+    Node* node = findNode(name);
+    return node && node->n > 0 ? &node->results[0] : 0;
+}
+
+
+void
+SeExprGraph::prepare() const
+{
+    if (_prepped) return;
+    // only the nodes that changed, or read something that changed, are
+    // prepped again; those whose validity or type changes in turn mark
+    // their readers, which may have been passed already
+    std::map<std::string, Node*>::const_iterator i;
+    for (bool again = true; again;) {
+	again = false;
+	for (i = _nodes.begin(); i != _nodes.end(); ++i) {
+	    if (i->second->state != Node::unprepped) continue;
+	    prepNode(*i->second);
+	    again = true;
+	}
+    }
+    if (!sortNodes()) {
+	// an edit closed a cycle through nodes that weren't prepped
+	// again; prepping all of them at once finds it
+	for (i = _nodes.begin(); i != _nodes.end(); ++i) i->second->state = Node::unprepped;
+	for (i = _nodes.begin(); i != _nodes.end(); ++i) prepNode(*i->second);
+	sortNodes();
+    }
+    _prepped = true;
+}
+
+
+bool
+SeExprGraph::prepNode(Node& node) const
+{
+    // a node being prepped is reached again only through a cycle
+    if (node.state == Node::prepping) return false;
+    if (node.state == Node::unprepped) {
+	node.state = Node::prepping;
+	node.expr.bindings.clear();
+	node.expr.reads.clear();
+	// reparse so names are looked up again; the prep data of the
+	// calls is kept
+	node.expr.setExpr(node.expr.getExpr());
+	bool valid = node.expr.isValid();
+	bool isVec = valid && node.expr.isVec();
+	// readers load a different number of components now
+	if (isVec != node.out.isVec) node.out.stamp = ++_clock;
+	bool readersChanged = valid != node.valid || isVec != node.out.isVec;
+	node.valid = valid;
+	node.out.isVec = isVec;
+	node.state = Node::prepped;
+	// its names may be bound to other sources now
+	node.changed = true;
+	if (readersChanged) markReaders(node.name);
+    }
+    return node.valid;
+}
+
+
+void
+SeExprGraph::markReaders(const std::string& name) const
+{
+    // (a reader being prepped will look at name itself)
+    for (std::map<std::string, Node*>::const_iterator i = _nodes.begin(); i != _nodes.end(); ++i) {
+	Node& node = *i->second;
+	if (node.state == Node::prepped && node.expr.reads.count(name)) {
+	    node.state = Node::unprepped;
+	    _prepped = false;
+	}
+    }
+}
+
+
+bool
+SeExprGraph::sortNodes() const
+{
+    // depth first, upstream first; only valid nodes read other nodes
+    // (a node reading an invalid one is invalid itself)
+    _order.clear();
+    std::map<const Node*, int> visits; // 1 while visiting, 2 once done
+    std::vector<std::pair<Node*, std::set<std::string>::const_iterator> > stack;
+    for (std::map<std::string, Node*>::const_iterator i = _nodes.begin(); i != _nodes.end(); ++i) {
+	if (visits[i->second]) continue;
+	visits[i->second] = 1;
+	stack.push_back(std::make_pair(i->second, i->second->expr.reads.begin()));
+	while (!stack.empty()) {
+	    Node& node = *stack.back().first;
+	    std::set<std::string>::const_iterator& read = stack.back().second;
+	    if (!node.valid || read == node.expr.reads.end()) {
+		visits[&node] = 2;
+		_order.push_back(&node);
+		stack.pop_back();
+		continue;
+	    }
+	    std::map<std::string, Node*>::const_iterator j = _nodes.find(*read++);
+	    if (j == _nodes.end()) continue;
+	    int& visit = visits[j->second];
+	    if (visit == 1) return false;
+	    if (visit == 0) {
+		visit = 1;
+		stack.push_back(std::make_pair(j->second, j->second->expr.reads.begin()));
+	    }
+	}
+    }
+    return true;
+}
+
+
+const SeExprGraph::Source*
+SeExprGraph::resolve(const std::string& name) const
+{
+    std::map<std::string, Node*>::const_iterator i = _nodes.find(name);
+    if (i != _nodes.end()) {
+	if (!prepNode(*i->second)) return 0;
+	return &i->second->out;
+    }
+    std::map<std::string, Source*>::const_iterator j = _inputs.find(name);
+    return j == _inputs.end() ? 0 : j->second;
+}
+
+
+void
+SeExprGraph::evaluate(int n)
+{
+    SeExprTrace::Scope trace("graphEvaluate");
+    prepare();
+    _numEvaluated = 0;
+    std::vector<unsigned int> stamps;
+    for (size_t k = 0; k < _order.size(); k++) {
+	Node& node = *_order[k];
+	NodeExpr& expr = node.expr;
+
+	stamps.clear();
+	for (std::map<std::string, NodeExpr::Binding>::const_iterator i = expr.bindings.begin();
+	     i != expr.bindings.end(); ++i)
+	    stamps.push_back(i->second.source->stamp);
+	if (!node.changed && node.n == n && stamps == node.stamps) continue;
+
+	node.next.resize(n);
+	if (n > 0) {
+	    expr.bind();
+	    expr.evaluateBatch(n, &node.next[0]);
+	}
+	bool same = node.n == n &&
+	    (n == 0 || !memcmp(&node.next[0], &node.results[0], n * sizeof(SeVec3d)));
+	node.results.swap(node.next);
+	node.out.ptr = n > 0 ? &node.results[0][0] : 0;
+	if (!same) node.out.stamp = ++_clock;
+	node.n = n;
+	node.stamps.swap(stamps);
+	node.changed = false;
+	_numEvaluated++;
+    }
+    if (SeExprStats::enabled())
+	SeExprStats::cache(SeExprStats::graphCache, _order.size(), _order.size() - _numEvaluated);
+}
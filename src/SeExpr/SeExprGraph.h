@@ -0,0 +1,118 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+#ifndef SeExprGraph_h
+#define SeExprGraph_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include "SeVec3d.h"
+
+//! A network of expressions that read each other's results by name.
+/** Each node of the graph is an expression whose result is available to
+    the other nodes as the variable $name.  Nodes can also read arrays of
+    host data bound as inputs.  evaluate() runs the nodes upstream first
+    over a whole array of points, each node writing into its own result
+    buffer which its readers then load from directly.
+
+    Results are kept between calls to evaluate().  A node is evaluated
+    again only if its expression changed or something it reads changed,
+    and when its new results are the same as before the nodes reading it
+    are not evaluated again either.  Hosts that rewrite the memory of an
+    input in place announce it with touchInput().
+
+    A node reading a node that is invalid, or reading itself through
+    other nodes, is invalid. */
+class SeExprGraph
+{
+ public:
+    SeExprGraph();
+    ~SeExprGraph();
+
+    //! Set the expression of node name, adding the node if needed
+    void setExpr(const std::string& name, const std::string& expr);
+    //! Remove node name
+    void remove(const std::string& name);
+    bool hasNode(const std::string& name) const;
+
+    //! Bind input name to host doubles (stride in bytes, 0 means tightly
+    //! packed).  Point i of an evaluation reads element i.
+    void setInput(const std::string& name, const double* ptr, bool isVec=false, int stride=0);
+    //! Note that the memory of input name was rewritten
+    void touchInput(const std::string& name);
+
+    bool isValid(const std::string& name) const;
+    const std::string& parseError(const std::string& name) const;
+    bool isVec(const std::string& name) const;
+
+    //! Names of the nodes in the order they evaluate, upstream first
+    std::vector<std::string> order() const;
+
+    //! Evaluate the graph at n points
+    void evaluate(int n);
+
+    //! Results of node name from the last evaluate(), or null
+    const SeVec3d* result(const std::string& name) const;
+
+    //! Nodes actually evaluated by the last evaluate(), the rest kept
+    //! their results
+    int numEvaluated() const { return _numEvaluated; }
+
+ private:
+    SeExprGraph(const SeExprGraph&);
+    SeExprGraph& operator=(const SeExprGraph&);
+
+    struct Source;
+    class NodeExpr;
+    struct Node;
+
+    void prepare() const;
+    bool prepNode(Node& node) const;
+    void markReaders(const std::string& name) const;
+    bool sortNodes() const;
+    const Source* resolve(const std::string& name) const;
+    Node* findNode(const std::string& name) const;
+
+    std::map<std::string, Node*> _nodes;
+    std::map<std::string, Source*> _inputs;
+    mutable std::vector<Node*> _order;
+    //! false while some node needs prepping
+    mutable bool _prepped;
+    //! source of the stamps marking each change of a result or input
+    mutable unsigned int _clock;
+    int _numEvaluated;
+};
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+/**
+   @file SeExprGrid.cpp
+   Adaptive evaluation of an expression over a grid of points.
+*/
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "SeExprGrid.h"
+#include "SeExpression.h"
+#include "SeExprTrace.h"
+
+namespace {
+    //! Cell of the grid, from lo to hi (inclusive) along each axis
+    struct Cell { int lo[3], hi[3]; };
+
+    //! Refines the cells of a grid level by level, evaluating the points
+    //! each level needs as one batch
+    class GridRefiner
+    {
+    public:
+	GridRefiner(const SeExpression& expr, const SeExprGrid& grid, SeVec3d* results)
+	    : _expr(expr), _grid(grid), _results(results), _numEvaluated(0)
+	{
+	    _numComponents = expr.isVec() ? 3 : 1;
+	    _n[0] = grid.nx; _n[1] = grid.ny; _n[2] = grid.nz;
+	    _state.assign(size_t(grid.nx) * grid.ny * grid.nz, unknown);
+	}
+
+	int run()
+	{
+	    // the coarse lattice, with the last point of each axis on it
+	    int step = std::max(1, _grid.coarseStep);
+	    std::vector<int> coords[3];
+	    for (int a = 0; a < 3; a++) {
+		for (int c = 0; c < _n[a] - 1; c += step) coords[a].push_back(c);
+		coords[a].push_back(_n[a] - 1);
+	    }
+	    std::vector<Cell> cells, next;
+	    for (size_t k = 0; k < std::max(size_t(1), coords[2].size() - 1); k++)
+		for (size_t j = 0; j < std::max(size_t(1), coords[1].size() - 1); j++)
+		    for (size_t i = 0; i < std::max(size_t(1), coords[0].size() - 1); i++) {
+			size_t index[3] = { i, j, k };
+			Cell cell;
+			for (int a = 0; a < 3; a++) {
+			    cell.lo[a] = coords[a][index[a]];
+			    cell.hi[a] = coords[a][std::min(index[a] + 1, coords[a].size() - 1)];
+			}
+			cells.push_back(cell);
+			int corner[3];
+			for (int c = 0; c < 8; c++) {
+			    for (int a = 0; a < 3; a++) corner[a] = c & (1 << a) ? cell.hi[a] : cell.lo[a];
+			    want(corner);
+			}
+		    }
+	    flush();
+
+	    while (!cells.empty()) {
+		// evaluate the corners of the subcells of every cell
+		for (size_t c = 0; c < cells.size(); c++) visit(cells[c], &GridRefiner::want);
+		flush();
+
+		next.clear();
+		for (size_t c = 0; c < cells.size(); c++) {
+		    _cell = &cells[c];
+		    _accurate = true;
+		    visit(cells[c], &GridRefiner::check);
+		    split(cells[c], next, _accurate);
+		}
+		cells.swap(next);
+	    }
+	    return _numEvaluated;
+	}
+
+    private:
+	enum State { unknown, interpolated, queued, evaluated };
+	typedef void (GridRefiner::*Visitor)(const int* p);
+
+	size_t index(const int* p) const
+	{
+	    return p[0] + size_t(_n[0]) * (p[1] + size_t(_n[1]) * p[2]);
+	}
+
+	//! queue a point to be evaluated, unless it has been
+	void want(const int* p)
+	{
+	    size_t i = index(p);
+	    if (_state[i] == evaluated || _state[i] == queued) return;
+	    _state[i] = queued;
+	    _points.push_back(int(i));
+	}
+
+	void flush()
+	{
+	    int n = int(_points.size());
+	    if (!n) return;
+	    _values.resize(n);
+	    _expr.evaluatePoints(n, &_points[0], &_values[0]);
+	    for (int i = 0; i < n; i++) {
+		_results[_points[i]] = _values[i];
+		_state[_points[i]] = evaluated;
+	    }
+	    _numEvaluated += n;
+	    _points.clear();
+	}
+
+	//! the cell's corners interpolated at p
+	SeVec3d interpolate(const Cell& cell, const int* p) const
+	{
+	    double t[3];
+	    for (int a = 0; a < 3; a++)
+		t[a] = cell.hi[a] == cell.lo[a] ? 0 :
+		    double(p[a] - cell.lo[a]) / (cell.hi[a] - cell.lo[a]);
+	    double result[3] = { 0, 0, 0 };
+	    int corner[3];
+	    for (int c = 0; c < 8; c++) {
+		double w = 1;
+		for (int a = 0; a < 3; a++) {
+		    bool hi = c & (1 << a);
+		    corner[a] = hi ? cell.hi[a] : cell.lo[a];
+		    w *= hi ? t[a] : 1 - t[a];
+		}
+		if (!w) continue;
+		const SeVec3d& value = _results[index(corner)];
+		for (int i = 0; i < 3; i++) result[i] += value[i] * w;
+	    }
+	    return SeVec3d(result);
+	}
+
+	//! whether the evaluated point p is close to the cell's interpolation
+	void check(const int* p)
+	{
+	    SeVec3d diff = _results[index(p)] - interpolate(*_cell, p);
+	    for (int i = 0; i < _numComponents; i++)
+		if (!(fabs(diff[i]) <= _grid.tolerance)) _accurate = false;
+	}
+
+	//! interpolate p from the current cell, unless it was evaluated
+	void fill(const int* p)
+	{
+	    size_t i = index(p);
+	    if (_state[i] == evaluated) return;
+	    _results[i] = interpolate(*_cell, p);
+	    _state[i] = interpolated;
+	}
+
+	//! the middle of a cell along an axis, or -1 if it has none
+	static int middle(const Cell& cell, int a)
+	{
+	    return cell.hi[a] - cell.lo[a] >= 2 ? (cell.lo[a] + cell.hi[a]) / 2 : -1;
+	}
+
+	//! call visitor for the corners of the cell's subcells
+	void visit(const Cell& cell, Visitor visitor)
+	{
+	    int p[3];
+	    for (int c = 0; c < 27; c++) {
+		int which[3] = { c % 3, c / 3 % 3, c / 9 };
+		bool corner = true;
+		bool valid = true;
+		for (int a = 0; a < 3; a++) {
+		    if (which[a] == 0) p[a] = cell.lo[a];
+		    else if (which[a] == 2) p[a] = cell.hi[a];
+		    else {
+			p[a] = middle(cell, a);
+			corner = false;
+			if (p[a] < 0) valid = false;
+		    }
+		}
+		// skip corners repeated where the cell is flat along an axis
+		for (int a = 0; a < 3; a++)
+		    if (which[a] == 2 && cell.hi[a] == cell.lo[a]) valid = false;
+		if (valid && !corner) (this->*visitor)(p);
+	    }
+	}
+
+	//! subdivide a cell that isn't accurate, or fill in its subcells
+	void split(const Cell& cell, std::vector<Cell>& next, bool accurate)
+	{
+	    for (int c = 0; c < 8; c++) {
+		Cell sub;
+		bool valid = true, inner = false;
+		for (int a = 0; a < 3; a++) {
+		    int m = middle(cell, a);
+		    bool hi = c & (1 << a);
+		    if (hi && m < 0) valid = false;
+		    sub.lo[a] = hi ? m : cell.lo[a];
+		    sub.hi[a] = hi || m < 0 ? cell.hi[a] : m;
+		    if (sub.hi[a] - sub.lo[a] >= 2) inner = true;
+		}
+		if (!valid) continue;
+		if (!accurate) {
+		    if (inner) next.push_back(sub);
+		    continue;
+		}
+		_cell = &sub;
+		int p[3];
+		for (p[2] = sub.lo[2]; p[2] <= sub.hi[2]; p[2]++)
+		    for (p[1] = sub.lo[1]; p[1] <= sub.hi[1]; p[1]++)
+			for (p[0] = sub.lo[0]; p[0] <= sub.hi[0]; p[0]++)
+			    fill(p);
+	    }
+	}
+
+	const SeExpression& _expr;
+	const SeExprGrid& _grid;
+	SeVec3d* _results;
+	int _n[3];
+	int _numComponents;
+	std::vector<char> _state;
+	std::vector<int> _points;
+	std::vector<SeVec3d> _values;
+	int _numEvaluated;
+	//! cell being checked or filled
+	const Cell* _cell;
+	bool _accurate;
+    };
+}
+
+
+int
+SeExpression::evaluateGrid(const SeExprGrid& grid, SeVec3d* results) const
+{
+    if (grid.nx <= 0 || grid.ny <= 0 || grid.nz <= 0) return 0;
+    SeExprTrace::Scope trace("evaluateGrid", getExpr().c_str());
+    GridRefiner refiner(*this, grid, results);
+    return refiner.run();
+}
@@ -0,0 +1,58 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprGrid_h
+#define SeExprGrid_h
+
+//! Regular grid of points for SeExpression::evaluateGrid().
+/** The grid has nx by ny by nz points (nz is 1 for a 2D grid).  It is
+    first evaluated every coarseStep points along each axis, then cells
+    of that lattice are halved until an interpolation of each cell's
+    corners is within tolerance of every component of the results at the
+    corners of its subcells, or the cell has no points left inside.  A
+    tolerance of zero only interpolates where the results are exactly
+    linear.  The error is measured only at those corners, so detail
+    finer than the coarse lattice can be missed entirely. */
+struct SeExprGrid
+{
+    int nx, ny, nz;
+    double tolerance;
+    int coarseStep;
+
+    SeExprGrid(int nxIn, int nyIn, int nzIn=1, double toleranceIn=0, int coarseStepIn=8)
+        : nx(nxIn), ny(nyIn), nz(nzIn), tolerance(toleranceIn), coarseStep(coarseStepIn) {}
+};
+
+#endif
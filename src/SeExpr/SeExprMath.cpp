@@ -0,0 +1,417 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include "SeExprMath.h"
+
+namespace {
+    SeExprMath::Accuracy globalAccuracy = SeExprMath::exact;
+
+    union Bits { double d; uint64_t i; };
+
+    // adding and then subtracting this rounds a double to an integer
+    const double shifter = 6755399441055744.0; // 1.5 * 2^52
+
+    inline double roundToInt(double x) { return (x + shifter) - shifter; }
+
+    //! 2^e for an integer e in [-1022,1023], from the integer bits that
+    //! e + shifter leaves in its mantissa
+    inline double pow2(double e)
+    {
+	Bits b;
+	b.d = e + shifter;
+	b.i = (b.i + 1023) << 52;
+	return b.d;
+    }
+
+    //! Error of the product p = a*b (Dekker)
+    inline double productError(double a, double b, double p)
+    {
+	const double split = 134217729.0; // 2^27 + 1
+	double ca = split * a, ah = ca - (ca - a), al = a - ah;
+	double cb = split * b, bh = cb - (cb - b), bl = b - bh;
+	return ((ah*bh - p) + ah*bl + al*bh) + al*bl;
+    }
+
+    // exp (fdlibm): e^x = 2^k * e^r, with ln2 split so k*ln2hi is exact
+    const double invln2 = 1.44269504088896338700e+00;
+    const double ln2hi = 6.93147180369123816490e-01;
+    const double ln2lo = 1.90821492927058770002e-10;
+    const double ln2tail = 2.31904681384629955842e-17; // ln2 - M_LN2
+    const double P1 = 1.66666666666666019037e-01;
+    const double P2 = -2.77777777770155933842e-03;
+    const double P3 = 6.61375632143793436117e-05;
+    const double P4 = -1.65339022054652515390e-06;
+    const double P5 = 4.13813679705723846039e-08;
+
+    //! e^(x+tail) * 2^scale, where x+tail is within [-708,709], tail is
+    //! tiny next to x, and the exponent of the result is in range
+    inline double expAccurate(double x, double tail, double scale)
+    {
+	double k = roundToInt(x * invln2);
+	double hi = x - k*ln2hi;
+	double lo = k*ln2lo - tail;
+	double r = hi - lo;
+	double t = r*r;
+	double c = r - t*(P1 + t*(P2 + t*(P3 + t*(P4 + t*P5))));
+	double y = 1 - ((lo - (r*c)/(2 - c)) - hi);
+	return y * pow2(k + scale);
+    }
+
+    //! e^x to about 1e-7, for x within [-708,709]
+    inline double expFast(double x)
+    {
+	double k = roundToInt(x * invln2);
+	double r = x - k*M_LN2;
+	double y = 1 + r*(1 + r*(1./2 + r*(1./6 + r*(1./24 + r*(1./120 + r*(1./720))))));
+	return y * pow2(k);
+    }
+
+    //! Inputs of the polynomial exp (and results of pow) the math library
+    //! handles instead
+    inline bool expOutOfRange(double x) { return !(x >= -708 && x <= 709); }
+
+    // log (fdlibm): x = 2^k * (1+f) with 1+f in [sqrt(2)/2,sqrt(2)), and
+    // log(1+f) = f - f^2/2 + s*(f^2/2+R(s^2)) where s = f/(2+f)
+    const double Lg1 = 6.666666666666735130e-01;
+    const double Lg2 = 3.999999999940941908e-01;
+    const double Lg3 = 2.857142874366239149e-01;
+    const double Lg4 = 2.222219843214978396e-01;
+    const double Lg5 = 1.818357216161805012e-01;
+    const double Lg6 = 1.531383769920937332e-01;
+    const double Lg7 = 1.479819860511658591e-01;
+
+    //! Splits a positive normal x into 2^k * (1+f)
+    inline void logReduce(double x, double& k, double& f)
+    {
+	Bits b;
+	b.d = x;
+	int hx = int(b.i >> 32);
+	int e = (hx >> 20) - 1023;
+	hx &= 0x000fffff;
+	// i is 0x100000 if the mantissa is at least sqrt(2), which halves it
+	int i = (hx + 0x95f64) & 0x100000;
+	b.i = (uint64_t(hx | (i ^ 0x3ff00000)) << 32) | (b.i & 0xffffffffu);
+	k = e + (i >> 20);
+	f = b.d - 1;
+    }
+
+    inline double logR(double z)
+    {
+	double w = z*z;
+	double t1 = w*(Lg2 + w*(Lg4 + w*Lg6));
+	double t2 = z*(Lg1 + w*(Lg3 + w*(Lg5 + w*Lg7)));
+	return t2 + t1;
+    }
+
+    inline double logAccurate(double x)
+    {
+	double k, f;
+	logReduce(x, k, f);
+	double s = f/(2 + f);
+	double R = logR(s*s);
+	double hfsq = 0.5*f*f;
+	return k*ln2hi - ((hfsq - (s*(hfsq + R) + k*ln2lo)) - f);
+    }
+
+    //! a+b as sum+err exactly (Knuth)
+    inline void twoSum(double a, double b, double& sum, double& err)
+    {
+	sum = a + b;
+	double bb = sum - a;
+	err = (a - (sum - bb)) + (b - bb);
+    }
+
+    // 2/3 as hi+lo, and 2/(2i+5) for i up to 10, the series of
+    // log(1+f) = 2*atanh(s) past its s^3 term to within 2^-75
+    const double twoThirds = 6.66666666666666629659e-01;
+    const double twoThirdsLo = 3.70074341541718826215e-17;
+    const double A5 = 2./5, A7 = 2./7, A9 = 2./9, A11 = 2./11, A13 = 2./13,
+	A15 = 2./15, A17 = 2./17, A19 = 2./19, A21 = 2./21, A23 = 2./23, A25 = 2./25;
+
+    //! log(x) as hi+lo, to about 2^-70 relative (for pow, whose error
+    //! is y times the error of log)
+    inline void logExtended(double x, double& hi, double& lo)
+    {
+	double k, f;
+	logReduce(x, k, f);
+	// s = f/(2+f) as s+slo, from d+dlo = 2+f exactly
+	double d = 2 + f, dlo = (2 - d) + f;
+	double s = f/d;
+	double sd = s*d;
+	double slo = (((f - sd) - productError(s, d, sd)) - s*dlo)/d;
+	// s^3 and 2/3*s^3 as hi+lo
+	double s2 = s*s, s2lo = productError(s, s, s2) + 2*s*slo;
+	double s3 = s2*s, s3lo = productError(s2, s, s3) + s2lo*s + s2*slo;
+	double t = twoThirds*s3;
+	double tlo = productError(twoThirds, s3, t) + twoThirds*s3lo + twoThirdsLo*s3;
+	// the rest of the series is small enough for doubles
+	double z = s2;
+	double rest = s3*z*(A5 + z*(A7 + z*(A9 + z*(A11 + z*(A13 + z*(A15 + z*(A17 + z*(A19 +
+		      z*(A21 + z*(A23 + z*A25))))))))));
+	// k*ln2hi + 2s + t exactly, then the small terms
+	double sum1, err1, sum2, err2;
+	twoSum(k*ln2hi, 2*s, sum1, err1);
+	twoSum(sum1, t, sum2, err2);
+	double err = err1 + err2 + 2*slo + tlo + rest + k*ln2lo;
+	hi = sum2 + err;
+	lo = err - (hi - sum2);
+    }
+
+    inline double logFast(double x)
+    {
+	double k, f;
+	logReduce(x, k, f);
+	double s = f/(2 + f);
+	double z = s*s;
+	double R = z*(Lg1 + z*(Lg2 + z*(Lg3 + z*Lg4)));
+	double hfsq = 0.5*f*f;
+	return k*M_LN2 + f - hfsq + s*(hfsq + R);
+    }
+
+    //! Inputs of the polynomial log the math library handles instead
+    inline bool logOutOfRange(double x) { return !(x >= DBL_MIN && x <= DBL_MAX); }
+
+    // sin and cos (fdlibm kernels on [-pi/4,pi/4]), after subtracting
+    // n*pi/2 with pi/2 split in three so each n*pio2 is exact
+    const double invpio2 = 6.36619772367581382433e-01;
+    const double pio2_1 = 1.57079632673412561417e+00;
+    const double pio2_2 = 6.07710050630396597660e-11;
+    const double pio2_3 = 2.02226624871116645580e-21;
+    const double S1 = -1.66666666666666324348e-01;
+    const double S2 = 8.33333333332248946124e-03;
+    const double S3 = -1.98412698298579493134e-04;
+    const double S4 = 2.75573137070700676789e-06;
+    const double S5 = -2.50507602534068634195e-08;
+    const double S6 = 1.58969099521155010221e-10;
+    const double C1 = 4.16666666666666019037e-02;
+    const double C2 = -1.38888888888741095749e-03;
+    const double C3 = 2.48015872894767294178e-05;
+    const double C4 = -2.75573143513906633035e-07;
+    const double C5 = 2.08757232129817482790e-09;
+    const double C6 = -1.13596475577881948265e-11;
+
+    //! sin and cos of x given the sin and cos of x - n*pi/2
+    inline double quadrant(int n, double s, double c)
+    {
+	// selected and negated with bit masks, which vectorize
+	Bits bs, bc;
+	bs.d = s;
+	bc.d = c;
+	uint64_t odd = -uint64_t(n & 1);
+	bs.i = (bc.i & odd) | (bs.i & ~odd);
+	bs.i ^= uint64_t(n & 2) << 62;
+	return bs.d;
+    }
+
+    //! x - n*pi/2 as r+rlo; x - n*pio2_1 and n*pio2_2 are exact, so
+    //! the remainder keeps its relative accuracy near multiples of pi/2
+    inline void sinCosReduce(double x, double n, double& r, double& rlo)
+    {
+	double t = x - n*pio2_1, w = n*pio2_2;
+	r = t - w;
+	rlo = ((t - r) - w) - n*pio2_3;
+    }
+
+    //! sin(x) if cosine is 0, cos(x) if 1
+    inline double sinCosAccurate(double x, int cosine)
+    {
+	double n = roundToInt(x * invpio2);
+	double r, rlo;
+	sinCosReduce(x, n, r, rlo);
+	double z = r*r, w = z*z;
+	double sr = S2 + z*(S3 + z*S4) + z*w*(S5 + z*S6);
+	double cr = z*(C1 + z*(C2 + z*C3)) + w*w*(C4 + z*(C5 + z*C6));
+	double hz = 0.5*z, cw = 1 - hz;
+	// sin(r+rlo) = sin(r) + rlo*cos(r), cos(r+rlo) = cos(r) - rlo*sin(r)
+	double s = r + (z*r*(S1 + z*sr) + rlo*cw);
+	double c = cw + (((1 - cw) - hz) + (z*cr - r*rlo));
+	return quadrant(int(n) + cosine, s, c);
+    }
+
+    inline double sinCosFast(double x, int cosine)
+    {
+	double n = roundToInt(x * invpio2);
+	double r, rlo;
+	sinCosReduce(x, n, r, rlo);
+	r += rlo;
+	double z = r*r;
+	double s = r + r*z*(-1./6 + z*(1./120 + z*(-1./5040)));
+	double c = 1 + z*(-1./2 + z*(1./24 + z*(-1./720 + z*(1./40320))));
+	return quadrant(int(n) + cosine, s, c);
+    }
+
+    //! Inputs of the polynomial sin and cos the math library handles
+    //! instead (the reduction loses accuracy beyond)
+    inline bool sinCosOutOfRange(double x) { return !(fabs(x) <= 1e5); }
+
+    void sinCos(SeExprMath::Accuracy accuracy, int cosine, int n, const double* x, double* r)
+    {
+	if (accuracy == SeExprMath::fast)
+	    for (int i = 0; i < n; i++) r[i] = sinCosFast(x[i], cosine);
+	else
+	    for (int i = 0; i < n; i++) r[i] = sinCosAccurate(x[i], cosine);
+	for (int i = 0; i < n; i++)
+	    if (sinCosOutOfRange(x[i])) r[i] = cosine ? ::cos(x[i]) : ::sin(x[i]);
+    }
+}
+
+
+void SeExprMath::setAccuracy(Accuracy accuracy)
+{
+    globalAccuracy = accuracy;
+}
+
+
+SeExprMath::Accuracy SeExprMath::accuracy()
+{
+    return globalAccuracy;
+}
+
+
+void SeExprMath::sin(Accuracy accuracy, int n, const double* x, double* r)
+{
+    if (accuracy == exact) {
+	for (int i = 0; i < n; i++) r[i] = ::sin(x[i]);
+	return;
+    }
+    sinCos(accuracy, 0, n, x, r);
+}
+
+
+void SeExprMath::cos(Accuracy accuracy, int n, const double* x, double* r)
+{
+    if (accuracy == exact) {
+	for (int i = 0; i < n; i++) r[i] = ::cos(x[i]);
+	return;
+    }
+    sinCos(accuracy, 1, n, x, r);
+}
+
+
+void SeExprMath::exp(Accuracy accuracy, int n, const double* x, double* r)
+{
+    if (accuracy == exact) {
+	for (int i = 0; i < n; i++) r[i] = ::exp(x[i]);
+	return;
+    }
+    if (accuracy == fast)
+	for (int i = 0; i < n; i++) r[i] = expFast(x[i]);
+    else
+	for (int i = 0; i < n; i++) r[i] = expAccurate(x[i], 0, 0);
+    for (int i = 0; i < n; i++)
+	if (expOutOfRange(x[i])) r[i] = ::exp(x[i]);
+}
+
+
+void SeExprMath::exp2(Accuracy accuracy, int n, const double* x, double* r)
+{
+    if (accuracy == exact) {
+	for (int i = 0; i < n; i++) r[i] = ::pow(2., x[i]);
+	return;
+    }
+    // 2^x = 2^k * e^(f*ln2), with f = x-k exact
+    if (accuracy == fast) {
+	for (int i = 0; i < n; i++) {
+	    double k = roundToInt(x[i]);
+	    r[i] = expFast((x[i] - k)*M_LN2) * pow2(k);
+	}
+    }
+    else {
+	for (int i = 0; i < n; i++) {
+	    double k = roundToInt(x[i]);
+	    double f = x[i] - k;
+	    double hi = f*M_LN2;
+	    double lo = productError(f, M_LN2, hi) + f*ln2tail;
+	    r[i] = expAccurate(hi, lo, k);
+	}
+    }
+    for (int i = 0; i < n; i++)
+	if (!(x[i] >= -1021 && x[i] <= 1022)) r[i] = ::pow(2., x[i]);
+}
+
+
+void SeExprMath::log(Accuracy accuracy, int n, const double* x, double* r)
+{
+    if (accuracy == exact) {
+	for (int i = 0; i < n; i++) r[i] = ::log(x[i]);
+	return;
+    }
+    if (accuracy == fast)
+	for (int i = 0; i < n; i++) r[i] = logFast(x[i]);
+    else
+	for (int i = 0; i < n; i++) r[i] = logAccurate(x[i]);
+    for (int i = 0; i < n; i++)
+	if (logOutOfRange(x[i])) r[i] = ::log(x[i]);
+}
+
+
+void SeExprMath::pow(Accuracy accuracy, int n, const double* x, const double* y, double* r)
+{
+    if (accuracy == exact) {
+	for (int i = 0; i < n; i++) r[i] = ::pow(x[i], y[i]);
+	return;
+    }
+    // pow(x,y) = e^(y*log(x)), done a chunk of each step at a time
+    const int chunk = 256;
+    double p[chunk], tail[chunk];
+    for (int start = 0; start < n; start += chunk) {
+	int m = n - start < chunk ? n - start : chunk;
+	const double* xs = x + start;
+	const double* ys = y + start;
+	double* rs = r + start;
+	if (accuracy == fast) {
+	    for (int i = 0; i < m; i++)
+		p[i] = ys[i] * logFast(xs[i]);
+	    for (int i = 0; i < m; i++)
+		rs[i] = expFast(p[i]);
+	}
+	else {
+	    for (int i = 0; i < m; i++) {
+		double hi, lo;
+		logExtended(xs[i], hi, lo);
+		p[i] = ys[i]*hi;
+		tail[i] = productError(ys[i], hi, p[i]) + ys[i]*lo;
+	    }
+	    for (int i = 0; i < m; i++)
+		rs[i] = expAccurate(p[i], tail[i], 0);
+	}
+	// a nan or infinite y leaves p out of range too
+	for (int i = 0; i < m; i++)
+	    if (expOutOfRange(p[i]) || logOutOfRange(xs[i])) rs[i] = ::pow(xs[i], ys[i]);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprMath_h
+#define SeExprMath_h
+
+//! Math library functions over arrays, at a selectable accuracy.
+/** Builtins built on sin, cos, exp, log and pow, and the ^ operator,
+    evaluate through these when an expression's accuracy is not exact
+    (see SeExpression::setMathAccuracy()), and evaluateBatch() uses them
+    at every accuracy.  Each computes r[i]=f(x[i]) for i<n.
+
+    exact gives the system math library's results.  accurate is within
+    about one ulp (pow too, as it takes the log to about 2^-70), and fast
+    within about 1e-6 relative error, for previews.  Both are branch free
+    polynomial loops that the compiler can vectorize, with inputs out of
+    their range (infinities, nans, zero and negative logs, huge angles)
+    passed on to the math library. */
+class SeExprMath
+{
+public:
+    enum Accuracy { exact, accurate, fast };
+
+    //! Set the accuracy of expressions that don't set their own.  It
+    //! applies to expressions prepped afterwards.
+    static void setAccuracy(Accuracy accuracy);
+    static Accuracy accuracy();
+
+    static void sin(Accuracy accuracy, int n, const double* x, double* r);
+    static void cos(Accuracy accuracy, int n, const double* x, double* r);
+    static void exp(Accuracy accuracy, int n, const double* x, double* r);
+    static void exp2(Accuracy accuracy, int n, const double* x, double* r);
+    static void log(Accuracy accuracy, int n, const double* x, double* r);
+    static void pow(Accuracy accuracy, int n, const double* x, const double* y, double* r);
+};
+
+#endif
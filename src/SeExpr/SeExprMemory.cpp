@@ -0,0 +1,237 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include "SeExprMemory.h"
+#include "SeExpression.h"
+#include "SeThreadLocal.h"
+
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
+namespace {
+    //! Expressions alive in the process, linked through the expressions
+    //! in one of several lists, so threads making and destroying
+    //! expressions at once seldom share a lock
+    struct Live
+    {
+	SeExprInternal::Mutex mutex;
+	SeExpression* head;
+	//! keeps the locks of neighbouring lists off a cache line
+	char padding[64];
+	Live() : head(0) {}
+    };
+    const int numLive = 64;
+
+    //! Leaked, so expressions destroyed at exit can still unlink
+    Live* live()
+    {
+	static Live* live = new Live[numLive];
+	return live;
+    }
+
+    SE_THREAD_LOCAL int threadLive = -1;
+
+    //! The list of the calling thread, one of them in turn per thread
+    int localLive()
+    {
+	if (threadLive < 0) {
+	    static SeExprInternal::Mutex mutex;
+	    static int next = 0;
+	    SeExprInternal::AutoMutex locker(mutex);
+	    threadLive = next++ % numLive;
+	}
+	return threadLive;
+    }
+
+    //! Demangled type names, by the compiler's name
+    struct TypeNames
+    {
+	SeExprInternal::Mutex mutex;
+	std::map<std::string, std::string> names;
+    };
+
+    TypeNames& typeNames()
+    {
+	static TypeNames* names = new TypeNames;
+	return *names;
+    }
+
+    std::string demangle(const char* mangled)
+    {
+	std::string name = mangled;
+#ifdef __GNUC__
+	int status = 0;
+	if (char* demangled = abi::__cxa_demangle(mangled, 0, 0, &status)) {
+	    name = demangled;
+	    free(demangled);
+	}
+#endif
+	// the builtins' data and the specialized nodes are file local
+	static const std::string anonymous = "(anonymous namespace)::";
+	for (size_t pos; (pos = name.find(anonymous)) != std::string::npos;)
+	    name.erase(pos, anonymous.size());
+	return name;
+    }
+
+    void writeString(std::ostream& out, const std::string& str)
+    {
+	out << '"';
+	for (size_t i = 0; i < str.size(); i++) {
+	    unsigned char c = str[i];
+	    switch (c) {
+	    case '"': out << "\\\""; break;
+	    case '\\': out << "\\\\"; break;
+	    default:
+		if (c < 0x20) {
+		    char buf[8];
+		    snprintf(buf, sizeof(buf), "\\u%04x", c);
+		    out << buf;
+		} else out << c;
+	    }
+	}
+	out << '"';
+    }
+
+    typedef std::pair<std::string, SeExprMemory::Entry> Kind;
+
+    bool largerKind(const Kind& a, const Kind& b)
+    {
+	if (a.second.bytes != b.second.bytes) return a.second.bytes > b.second.bytes;
+	return a.first < b.first;
+    }
+
+    void writeTable(std::ostream& out, const char* name, const SeExprMemory::Table& table)
+    {
+	std::vector<Kind> kinds(table.begin(), table.end());
+	std::sort(kinds.begin(), kinds.end(), largerKind);
+	out << ",\n  \"" << name << "\": [";
+	for (size_t i = 0; i < kinds.size(); i++) {
+	    out << (i ? "," : "") << "\n    {\"kind\": ";
+	    writeString(out, kinds[i].first);
+	    out << ", \"count\": " << kinds[i].second.count
+		<< ", \"bytes\": " << kinds[i].second.bytes << '}';
+	}
+	out << "\n  ]";
+    }
+}
+
+
+std::string
+SeExprMemory::typeName(const std::type_info& type)
+{
+    TypeNames& t = typeNames();
+    SeExprInternal::AutoMutex locker(t.mutex);
+    std::map<std::string, std::string>::iterator i = t.names.find(type.name());
+    if (i == t.names.end())
+	i = t.names.insert(std::make_pair(type.name(), demangle(type.name()))).first;
+    return i->second;
+}
+
+
+size_t
+SeExprMemory::stringBytes(const std::string& s)
+{
+    // short strings are kept in the string object itself
+    const char* data = s.data();
+    const char* object = reinterpret_cast<const char*>(&s);
+    if (data >= object && data < object + sizeof(s)) return 0;
+    return s.capacity() + 1;
+}
+
+
+SeExprMemory
+SeExprMemory::process()
+{
+    SeExprMemory usage;
+    for (int i = 0; i < numLive; i++) {
+	Live& l = live()[i];
+	SeExprInternal::AutoMutex locker(l.mutex);
+	for (SeExpression* expr = l.head; expr; expr = expr->_liveNext)
+	    expr->memoryUsage(usage);
+    }
+    return usage;
+}
+
+
+void
+SeExprMemory::writeJson(std::ostream& out) const
+{
+    out << "{\n  \"expressions\": " << expressions << ",\n  \"bytes\": " << bytes;
+    writeTable(out, "parts", parts);
+    writeTable(out, "nodes", nodes);
+    writeTable(out, "data", data);
+    out << "\n}\n";
+}
+
+
+std::string
+SeExprMemory::json() const
+{
+    std::ostringstream out;
+    writeJson(out);
+    return out.str();
+}
+
+
+void
+SeExprMemory::addLive(SeExpression* expr)
+{
+    // it's unlinked from the same list, perhaps by another thread
+    expr->_liveList = localLive();
+    Live& l = live()[expr->_liveList];
+    SeExprInternal::AutoMutex locker(l.mutex);
+    expr->_livePrev = 0;
+    expr->_liveNext = l.head;
+    if (l.head) l.head->_livePrev = expr;
+    l.head = expr;
+}
+
+
+void
+SeExprMemory::removeLive(SeExpression* expr)
+{
+    Live& l = live()[expr->_liveList];
+    SeExprInternal::AutoMutex locker(l.mutex);
+    if (expr->_livePrev) expr->_livePrev->_liveNext = expr->_liveNext;
+    else l.head = expr->_liveNext;
+    if (expr->_liveNext) expr->_liveNext->_livePrev = expr->_livePrev;
+}
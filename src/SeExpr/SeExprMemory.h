@@ -0,0 +1,110 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprMemory_h
+#define SeExprMemory_h
+
+#include <string>
+#include <map>
+#include <iosfwd>
+#include <typeinfo>
+
+class SeExpression;
+
+//! Memory held by parsed expressions, broken down by what holds it.
+/** SeExpression::memoryUsage() adds an expression to a breakdown: the
+    expression object with its text and tables, the nodes of its parse
+    tree by node type, and the prep data of its funcx calls by data type
+    (see SeExprFuncNode::Data::memoryUsage()).  process() adds up every
+    expression alive in the process.
+
+    Sizes are what the objects and the containers they own have
+    allocated, without the allocator's own overhead.  Containers of the
+    standard library are counted by their capacity, and std::set and
+    std::map by an estimate of their nodes.  The breakdown reads the
+    expressions without locking them, so take it while they aren't
+    being parsed, prepped or evaluated (between frames, say). */
+class SeExprMemory
+{
+public:
+    //! Number and total bytes of one kind of object
+    struct Entry
+    {
+	size_t count, bytes;
+	Entry() : count(0), bytes(0) {}
+    };
+    typedef std::map<std::string, Entry> Table;
+
+    SeExprMemory() : expressions(0), bytes(0) {}
+
+    //! Expressions counted, and the bytes of everything in the tables
+    size_t expressions, bytes;
+    //! Expression objects and their text and tables, by part
+    Table parts;
+    //! Parse tree nodes, by node type
+    Table nodes;
+    //! Prep data of funcx calls, by data type
+    Table data;
+
+    //! Count an object of a kind in one of the tables
+    void add(Table& table, const std::string& kind, size_t size)
+    {
+	Entry& entry = table[kind];
+	entry.count++;
+	entry.bytes += size;
+	bytes += size;
+    }
+
+    //! Name of a type as shown in the tables (demangled where the
+    //! compiler allows)
+    static std::string typeName(const std::type_info& type);
+
+    //! Heap bytes of a string, 0 if it fits in the string object
+    static size_t stringBytes(const std::string& s);
+
+    //! Memory of all the expressions alive in the process
+    static SeExprMemory process();
+
+    //! Write the breakdown as a JSON object, largest kinds first
+    void writeJson(std::ostream& out) const;
+    std::string json() const;
+
+    /* internal */
+    //! Track an expression from its construction to its destruction
+    static void addLive(SeExpression* expr);
+    static void removeLive(SeExpression* expr);
+};
+
+#endif
@@ -60,15 +60,36 @@
 
    If the prep method fails, an error string should be set and false
    should be returned.
+
+   3) SeExprNode::specialize - Once the whole tree has prepped
+   successfully, the owning expression calls specialize on the root.
+   Any node whose makeSpecialized returns a replacement is swapped out
+   of the tree for it.  The arithmetic operators use this to replace
+   themselves with a version compiled for their scalar/vector operand
+   shapes, so their eval does not test isVec at run time.  A
+   replacement derives from the node it replaces and takes over its
+   children, so code walking the tree still sees the same node types.
+
+   4) SeExprNode::evalBatch - Evaluates the active lanes of a batch of
+   points.  Nodes without an override fall back to eval() once per
+   lane, with the owning expression's batch lane set so variables read
+   the right point.  Nodes that branch narrow the active lanes passed to
+   each child and don't evaluate a child that has no lanes.  Function
+   calls use the function's batch form when it has one.
 */
 
 #ifndef MAKEDEPEND
 #include <math.h>
 #endif
+#include <cstring>
+#include <stdint.h>
+#include <typeinfo>
 #include "SeVec3d.h"
 #include "SeExpression.h"
 #include "SeExprNode.h"
 #include "SeExprFunc.h"
+#include "SeExprStats.h"
+#include "SeExprTrace.h"
 
 
 SeExprNode::SeExprNode(const SeExpression* expr)
@@ -154,6 +175,77 @@ SeExprNode::prep(bool wantVec)
 }
 
 
+SeExprNode*
+SeExprNode::specialize()
+{
+    for (int i = 0; i < numChildren(); i++)
+	_children[i] = _children[i]->specialize();
+
+    SeExprNode* node = makeSpecialized();
+    if (!node) return this;
+
+    // the replacement was constructed with our children
+    node->_parent = _parent;
+    node->_isVec = _isVec;
+    node->_startPos = _startPos;
+    node->_endPos = _endPos;
+    _children.clear();
+    delete this;
+    return node;
+}
+
+
+void
+SeExprNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    // evaluate the lanes one at a time
+    for (int i = 0; i < batch.numActive; i++) {
+	int lane = batch.active[i];
+	_expr->setBatchLane(lane);
+	eval(results[lane]);
+    }
+}
+
+
+namespace {
+    /// Split the active lanes of a batch on whether cond is nonzero.
+    void splitLanes(const SeExprBatch& batch, const SeVec3d* cond,
+		    SeExprBatch& trueBatch, int* trueLanes,
+		    SeExprBatch& falseBatch, int* falseLanes)
+    {
+	trueBatch.numActive = falseBatch.numActive = 0;
+	trueBatch.active = trueLanes;
+	falseBatch.active = falseLanes;
+	for (int i = 0; i < batch.numActive; i++) {
+	    int lane = batch.active[i];
+	    if (cond[lane][0]) trueLanes[trueBatch.numActive++] = lane;
+	    else falseLanes[falseBatch.numActive++] = lane;
+	}
+    }
+
+    /// Copy the x component into y and z for the active lanes.
+    void broadcastLanes(const SeExprBatch& batch, SeVec3d* results)
+    {
+	for (int i = 0; i < batch.numActive; i++) {
+	    SeVec3d& r = results[batch.active[i]];
+	    r[1] = r[2] = r[0];
+	}
+    }
+
+    /// Evaluate a list of assignments (or a chained if/else) for a batch.
+    void evalAssignsBatch(const SeExprNode* assigns, const SeExprBatch& batch)
+    {
+	SeVec3d scratch[SeExprBatch::maxSize];
+	if (dynamic_cast<const SeExprIfThenElseNode*>(assigns)) {
+	    assigns->evalBatch(batch, scratch);
+	    return;
+	}
+	for (int i = 0; i < assigns->numChildren(); i++)
+	    assigns->child(i)->evalBatch(batch, scratch);
+    }
+}
+
+
 void
 SeExprNode::eval(SeVec3d& result) const
 {
@@ -167,6 +259,35 @@ SeExprNode::eval(SeVec3d& result) const
 }
 
 
+SeExprCost
+SeExprNode::estimateCost() const
+{
+    SeExprCost cost(_isVec ? 3 : 1);
+    for (int i = 0; i < numChildren(); i++)
+	cost += child(i)->estimateCost();
+    return cost;
+}
+
+
+size_t
+SeExprNode::memoryUsage(SeExprMemory& usage) const
+{
+    size_t bytes = nodeMemoryUsage(usage);
+    for (int i = 0; i < numChildren(); i++)
+	bytes += child(i)->memoryUsage(usage);
+    return bytes;
+}
+
+
+size_t
+SeExprNode::addNodeMemory(SeExprMemory& usage, size_t size) const
+{
+    size_t bytes = size + _children.capacity() * sizeof(SeExprNode*);
+    usage.add(usage.nodes, SeExprMemory::typeName(typeid(*this)), bytes);
+    return bytes;
+}
+
+
 bool
 SeExprBlockNode::prep(bool wantVec)
 {
@@ -193,6 +314,21 @@ SeExprBlockNode::eval(SeVec3d& result) const
 }
 
 
+void
+SeExprBlockNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    evalAssignsBatch(child(0), batch);
+    child(1)->evalBatch(batch, results);
+}
+
+
+SeExprCost
+SeExprBlockNode::estimateCost() const
+{
+    return child(0)->estimateCost() + child(1)->estimateCost();
+}
+
+
 bool
 SeExprIfThenElseNode::prep(bool /*wantVec*/)
 {
@@ -222,6 +358,30 @@ SeExprIfThenElseNode::eval(SeVec3d& result) const
 }
 
 
+void
+SeExprIfThenElseNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    SeVec3d cond[SeExprBatch::maxSize];
+    int thenLanes[SeExprBatch::maxSize], elseLanes[SeExprBatch::maxSize];
+    SeExprBatch thenBatch, elseBatch;
+
+    child(0)->evalBatch(batch, cond);
+    splitLanes(batch, cond, thenBatch, thenLanes, elseBatch, elseLanes);
+    if (thenBatch.numActive) evalAssignsBatch(child(1), thenBatch);
+    if (elseBatch.numActive) evalAssignsBatch(child(2), elseBatch);
+    for (int i = 0; i < batch.numActive; i++)
+	results[batch.active[i]] = 0.0;
+}
+
+
+SeExprCost
+SeExprIfThenElseNode::estimateCost() const
+{
+    return child(0)->estimateCost() + SeExprCost(1) +
+	SeExprCost::max(child(1)->estimateCost(), child(2)->estimateCost());
+}
+
+
 bool
 SeExprAssignNode::prep(bool /*wantVec*/)
 {
@@ -241,15 +401,52 @@ SeExprAssignNode::eval(SeVec3d& result) const
 {
     if (_var) {
 	// eval expression and store in variable
+	// (the expression may read the variable, so don't write in place)
 	const SeExprNode* node = child(0);
-	node->eval(_var->val);
+	SeVec3d val(&_var->val[0]);
+	node->eval(val);
 	if (_var->isVec() && !node->isVec())
-	    _var->val[1] = _var->val[2] = _var->val[0];
+	    val[1] = val[2] = val[0];
+	_var->val = val;
+	int lane = _expr->batchLane();
+	if (lane >= 0) _var->lanes[lane] = _var->val;
     }
     else result = 0.0;
 }
 
 
+void
+SeExprAssignNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    if (!_var) {
+	SeExprNode::evalBatch(batch, results);
+	return;
+    }
+
+    // eval expression, then store in the variable's lanes
+    // (the expression may read the variable, so don't write in place)
+    const SeExprNode* node = child(0);
+    SeVec3d vals[SeExprBatch::maxSize];
+    node->evalBatch(batch, vals);
+    if (_var->isVec() && !node->isVec())
+	broadcastLanes(batch, vals);
+    for (int i = 0; i < batch.numActive; i++) {
+	int lane = batch.active[i];
+	_var->lanes[lane] = vals[lane];
+    }
+    if (batch.numActive)
+	_var->val = vals[batch.active[batch.numActive-1]];
+}
+
+
+SeExprCost
+SeExprAssignNode::estimateCost() const
+{
+    // expression plus storing the variable
+    return child(0)->estimateCost() + SeExprCost(0, sizeof(SeVec3d));
+}
+
+
 bool
 SeExprVecNode::prep(bool wantVec)
 {
@@ -299,6 +496,34 @@ SeExprCondNode::eval(SeVec3d& result) const
 }
 
 
+void
+SeExprCondNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    SeVec3d cond[SeExprBatch::maxSize];
+    int thenLanes[SeExprBatch::maxSize], elseLanes[SeExprBatch::maxSize];
+    SeExprBatch thenBatch, elseBatch;
+
+    child(0)->evalBatch(batch, cond);
+    splitLanes(batch, cond, thenBatch, thenLanes, elseBatch, elseLanes);
+    if (thenBatch.numActive) {
+	child(1)->evalBatch(thenBatch, results);
+	if (_isVec && !child(1)->isVec()) broadcastLanes(thenBatch, results);
+    }
+    if (elseBatch.numActive) {
+	child(2)->evalBatch(elseBatch, results);
+	if (_isVec && !child(2)->isVec()) broadcastLanes(elseBatch, results);
+    }
+}
+
+
+SeExprCost
+SeExprCondNode::estimateCost() const
+{
+    return child(0)->estimateCost() + SeExprCost(1) +
+	SeExprCost::max(child(1)->estimateCost(), child(2)->estimateCost());
+}
+
+
 bool
 SeExprAndNode::prep(bool /*wantVec*/)
 {
@@ -324,6 +549,34 @@ SeExprAndNode::eval(SeVec3d& result) const
 }
 
 
+void
+SeExprAndNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    // only evaluate the second operand where the first is true
+    SeVec3d b[SeExprBatch::maxSize];
+    int trueLanes[SeExprBatch::maxSize], falseLanes[SeExprBatch::maxSize];
+    SeExprBatch trueBatch, falseBatch;
+
+    child(0)->evalBatch(batch, results);
+    splitLanes(batch, results, trueBatch, trueLanes, falseBatch, falseLanes);
+    for (int i = 0; i < falseBatch.numActive; i++)
+	results[falseLanes[i]][0] = 0;
+    if (trueBatch.numActive) {
+	child(1)->evalBatch(trueBatch, b);
+	for (int i = 0; i < trueBatch.numActive; i++)
+	    results[trueLanes[i]][0] = (b[trueLanes[i]][0] != 0.0);
+    }
+}
+
+
+SeExprCost
+SeExprAndNode::estimateCost() const
+{
+    // assume the second operand is needed
+    return child(0)->estimateCost() + child(1)->estimateCost() + SeExprCost(2);
+}
+
+
 bool
 SeExprOrNode::prep(bool /*wantVec*/)
 {
@@ -349,6 +602,34 @@ SeExprOrNode::eval(SeVec3d& result) const
 }
 
 
+void
+SeExprOrNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    // only evaluate the second operand where the first is false
+    SeVec3d b[SeExprBatch::maxSize];
+    int trueLanes[SeExprBatch::maxSize], falseLanes[SeExprBatch::maxSize];
+    SeExprBatch trueBatch, falseBatch;
+
+    child(0)->evalBatch(batch, results);
+    splitLanes(batch, results, trueBatch, trueLanes, falseBatch, falseLanes);
+    for (int i = 0; i < trueBatch.numActive; i++)
+	results[trueLanes[i]][0] = 1;
+    if (falseBatch.numActive) {
+	child(1)->evalBatch(falseBatch, b);
+	for (int i = 0; i < falseBatch.numActive; i++)
+	    results[falseLanes[i]][0] = (b[falseLanes[i]][0] != 0.0);
+    }
+}
+
+
+SeExprCost
+SeExprOrNode::estimateCost() const
+{
+    // assume the second operand is needed
+    return child(0)->estimateCost() + child(1)->estimateCost() + SeExprCost(2);
+}
+
+
 bool
 SeExprSubscriptNode::prep(bool /*wantVec*/)
 {
@@ -672,6 +953,179 @@ SeExprExpNode::eval(SeVec3d& result) const
 }
 
 
+SeExprCost
+SeExprExpNode::estimateCost() const
+{
+    // pow is a library call per component
+    return child(0)->estimateCost() + child(1)->estimateCost() +
+	SeExprCost(_isVec ? 60 : 20);
+}
+
+
+namespace {
+    struct AddOp { static double apply(double a, double b) { return a + b; } };
+    struct SubOp { static double apply(double a, double b) { return a - b; } };
+    struct MulOp { static double apply(double a, double b) { return a * b; } };
+    struct DivOp { static double apply(double a, double b) { return a / b; } };
+    struct ModOp { static double apply(double a, double b) { return niceMod(a, b); } };
+    struct ExpOp { static double apply(double a, double b) { return pow(a, b); } };
+
+    /// Arithmetic node specialized on whether each operand is a vector.
+    /// Scalar operands are broadcast at compile time.
+    template<class Base, class Op, bool aVec, bool bVec>
+    class SeExprArithNode : public Base
+    {
+    public:
+	SeExprArithNode(const SeExpression* expr, SeExprNode* a, SeExprNode* b) :
+	    Base(expr, a, b) {}
+
+	virtual void eval(SeVec3d& result) const
+	{
+	    SeVec3d a, b;
+	    this->child(0)->eval(a);
+	    this->child(1)->eval(b);
+	    result[0] = Op::apply(a[0], b[0]);
+	    if (aVec || bVec) {
+		result[1] = Op::apply(a[aVec ? 1 : 0], b[bVec ? 1 : 0]);
+		result[2] = Op::apply(a[aVec ? 2 : 0], b[bVec ? 2 : 0]);
+	    }
+	}
+
+	virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+	{
+	    SeVec3d b[SeExprBatch::maxSize];
+	    this->child(0)->evalBatch(batch, results);
+	    this->child(1)->evalBatch(batch, b);
+	    for (int i = 0; i < batch.numActive; i++) {
+		int lane = batch.active[i];
+		SeVec3d& r = results[lane];
+		const SeVec3d& bl = b[lane];
+		if (aVec || bVec) {
+		    // write x last so a scalar a is still intact for y and z
+		    r[1] = Op::apply(r[aVec ? 1 : 0], bl[bVec ? 1 : 0]);
+		    r[2] = Op::apply(r[aVec ? 2 : 0], bl[bVec ? 2 : 0]);
+		}
+		r[0] = Op::apply(r[0], bl[0]);
+	    }
+	}
+
+    protected:
+	virtual SeExprNode* makeSpecialized() { return 0; }
+    };
+
+    /// ^ through SeExprMath::pow, for math accuracies other than exact
+    template<bool aVec, bool bVec>
+    class SeExprMathPowNode : public SeExprExpNode
+    {
+    public:
+	SeExprMathPowNode(const SeExpression* expr, SeExprNode* a, SeExprNode* b,
+			  SeExprMath::Accuracy accuracy) :
+	    SeExprExpNode(expr, a, b), _accuracy(accuracy) {}
+
+	virtual void eval(SeVec3d& result) const
+	{
+	    SeVec3d a, b;
+	    child(0)->eval(a);
+	    child(1)->eval(b);
+	    if (!aVec) a[1] = a[2] = a[0];
+	    if (!bVec) b[1] = b[2] = b[0];
+	    SeExprMath::pow(_accuracy, aVec || bVec ? 3 : 1, &a[0], &b[0], &result[0]);
+	}
+
+	virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+	{
+	    const int width = aVec || bVec ? 3 : 1;
+	    SeVec3d b[SeExprBatch::maxSize];
+	    child(0)->evalBatch(batch, results);
+	    child(1)->evalBatch(batch, b);
+	    double x[3 * SeExprBatch::maxSize], y[3 * SeExprBatch::maxSize];
+	    for (int i = 0; i < batch.numActive; i++) {
+		int lane = batch.active[i];
+		for (int c = 0; c < width; c++) {
+		    x[i*width + c] = results[lane][aVec ? c : 0];
+		    y[i*width + c] = b[lane][bVec ? c : 0];
+		}
+	    }
+	    double r[3 * SeExprBatch::maxSize];
+	    SeExprMath::pow(_accuracy, batch.numActive * width, x, y, r);
+	    for (int i = 0; i < batch.numActive; i++)
+		for (int c = 0; c < width; c++) results[batch.active[i]][c] = r[i*width + c];
+	}
+
+    protected:
+	virtual SeExprNode* makeSpecialized() { return 0; }
+	virtual size_t nodeMemoryUsage(SeExprMemory& usage) const
+	{ return addNodeMemory(usage, sizeof(*this)); }
+
+    private:
+	SeExprMath::Accuracy _accuracy;
+    };
+
+    template<class Base, class Op>
+    SeExprNode* makeArithNode(const SeExpression* expr, SeExprNode* a, SeExprNode* b)
+    {
+	if (a->isVec()) {
+	    if (b->isVec()) return new SeExprArithNode<Base, Op, true, true>(expr, a, b);
+	    return new SeExprArithNode<Base, Op, true, false>(expr, a, b);
+	}
+	if (b->isVec()) return new SeExprArithNode<Base, Op, false, true>(expr, a, b);
+	return new SeExprArithNode<Base, Op, false, false>(expr, a, b);
+    }
+}
+
+
+SeExprNode*
+SeExprAddNode::makeSpecialized()
+{
+    return makeArithNode<SeExprAddNode, AddOp>(_expr, child(0), child(1));
+}
+
+
+SeExprNode*
+SeExprSubNode::makeSpecialized()
+{
+    return makeArithNode<SeExprSubNode, SubOp>(_expr, child(0), child(1));
+}
+
+
+SeExprNode*
+SeExprMulNode::makeSpecialized()
+{
+    return makeArithNode<SeExprMulNode, MulOp>(_expr, child(0), child(1));
+}
+
+
+SeExprNode*
+SeExprDivNode::makeSpecialized()
+{
+    return makeArithNode<SeExprDivNode, DivOp>(_expr, child(0), child(1));
+}
+
+
+SeExprNode*
+SeExprModNode::makeSpecialized()
+{
+    return makeArithNode<SeExprModNode, ModOp>(_expr, child(0), child(1));
+}
+
+
+SeExprNode*
+SeExprExpNode::makeSpecialized()
+{
+    SeExprMath::Accuracy accuracy = _expr->mathAccuracy();
+    if (accuracy == SeExprMath::exact)
+	return makeArithNode<SeExprExpNode, ExpOp>(_expr, child(0), child(1));
+    SeExprNode* a = child(0);
+    SeExprNode* b = child(1);
+    if (a->isVec()) {
+	if (b->isVec()) return new SeExprMathPowNode<true, true>(_expr, a, b, accuracy);
+	return new SeExprMathPowNode<true, false>(_expr, a, b, accuracy);
+    }
+    if (b->isVec()) return new SeExprMathPowNode<false, true>(_expr, a, b, accuracy);
+    return new SeExprMathPowNode<false, false>(_expr, a, b, accuracy);
+}
+
+
 bool
 SeExprVarNode::prep(bool /*wantVec*/)
 {
@@ -683,6 +1137,7 @@ SeExprVarNode::prep(bool /*wantVec*/)
 	return 0;
     }
     _isVec = _var->isVec();
+    _ptrVar = dynamic_cast<const SeExprPtrVarRef*>(_var);
     return 1;
 }
 
@@ -690,11 +1145,175 @@ SeExprVarNode::prep(bool /*wantVec*/)
 void
 SeExprVarNode::eval(SeVec3d& result) const
 {
-    if (_var) _var->eval(this, result);
+    if (_ptrVar) _ptrVar->load(result, _expr->batchOffset());
+    else if (_var) _var->eval(this, result);
     else result = 0.0;
 }
 
 
+void
+SeExprVarNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    if (!_ptrVar) {
+	SeExprNode::evalBatch(batch, results);
+	return;
+    }
+    for (int i = 0; i < batch.numActive; i++) {
+	int lane = batch.active[i];
+	_ptrVar->load(results[lane], _expr->batchPoint(lane));
+    }
+}
+
+
+SeExprCost
+SeExprVarNode::estimateCost() const
+{
+    int n = _isVec ? 3 : 1;
+    if (_ptrVar) return SeExprCost(0, n * (_ptrVar->isDouble() ? sizeof(double) : sizeof(float)));
+    // virtual call plus reading the value
+    return SeExprCost(2, n * sizeof(double));
+}
+
+
+//! Direct mapped table of the recent results of a pure funcx call.
+/** The key is the bits of the arguments that are not constant.  After a
+    trial period the table is dropped if its hits don't save more than
+    computing the keys costs. */
+struct SeExprFuncNode::Memo
+{
+    enum { size = 64, trialLookups = 1024 };
+
+    //! arguments making up the key, and the doubles in a key
+    std::vector<int> args;
+    int width;
+    //! keys and results of each slot, and which slots are filled
+    std::vector<double> keys;
+    std::vector<SeVec3d> results;
+    std::vector<char> filled;
+    std::vector<double> key;
+    size_t lookups, hits;
+    bool enabled;
+    //! flops saved by a hit, spent on a lookup, and spent again on a
+    //! miss evaluating the key arguments a second time
+    double callCost, lookupCost, missCost;
+
+    Memo() : width(0), lookups(0), hits(0), enabled(true), callCost(0), lookupCost(0), missCost(0) {}
+};
+
+
+namespace {
+    //! literals and operators on literals
+    bool isConstantArg(const SeExprNode* node)
+    {
+	if (dynamic_cast<const SeExprVarNode*>(node) ||
+	    dynamic_cast<const SeExprFuncNode*>(node) ||
+	    dynamic_cast<const SeExprStrNode*>(node))
+	    return false;
+	for (int i = 0; i < node->numChildren(); i++)
+	    if (!isConstantArg(node->child(i))) return false;
+	return true;
+    }
+
+    //! hash of the bits of a key
+    inline uint64_t memoHash(const double* key, int width)
+    {
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < width; i++) {
+	    uint64_t bits;
+	    memcpy(&bits, &key[i], sizeof(bits));
+	    h = (h ^ bits) * 0xff51afd7ed558ccdULL;
+	    h ^= h >> 32;
+	}
+	return h;
+    }
+}
+
+
+SeExprFuncNode::~SeExprFuncNode()
+{
+    delete _data;
+    delete _memo;
+}
+
+
+bool
+SeExprFuncNode::isPureSubtree(const SeExprNode* node)
+{
+    const SeExprFuncNode* call = dynamic_cast<const SeExprFuncNode*>(node);
+    if (call && call->_func && call->_func->type() == SeExprFunc::FUNCX &&
+	!call->_func->funcx()->isPure())
+	return false;
+    for (int i = 0; i < node->numChildren(); i++)
+	if (!isPureSubtree(node->child(i))) return false;
+    return true;
+}
+
+
+void
+SeExprFuncNode::prepMemo()
+{
+    // the arguments are evaluated once for the key and again by eval()
+    // on a miss, so they must not have side effects either
+    if (!_func->funcx()->isPure() || !isPureSubtree(this)) return;
+
+    _memo = new Memo;
+    Memo& m = *_memo;
+    SeExprCost argCost;
+    for (int i = 0; i < _nargs; i++) {
+	const SeExprNode* arg = child(i);
+	if (isConstantArg(arg) || isStrArg(i)) continue;
+	m.args.push_back(i);
+	m.width += arg->isVec() ? 3 : 1;
+	argCost += arg->estimateCost();
+    }
+    m.keys.resize(Memo::size * m.width);
+    m.results.resize(Memo::size);
+    m.filled.assign(Memo::size, 0);
+    m.key.resize(m.width);
+    m.callCost = _func->cost(this).flops;
+    m.lookupCost = 4 * m.width + 8;
+    m.missCost = argCost.flops;
+    _evalFn = &SeExprFuncNode::evalFuncXMemo;
+}
+
+
+size_t
+SeExprFuncNode::memoLookups() const
+{
+    return _memo ? _memo->lookups : 0;
+}
+
+
+size_t
+SeExprFuncNode::memoHits() const
+{
+    return _memo ? _memo->hits : 0;
+}
+
+
+size_t
+SeExprFuncNode::nodeMemoryUsage(SeExprMemory& usage) const
+{
+    size_t size = sizeof(*this) + SeExprMemory::stringBytes(_name)
+	+ _scalarArgs.capacity() * sizeof(double)
+	+ _vecArgs.capacity() * sizeof(SeVec3d)
+	+ _batchArgs.capacity() * sizeof(SeVec3d)
+	+ _batchArgPtrs.capacity() * sizeof(const SeVec3d*)
+	+ _kernelArgs.capacity() * sizeof(double);
+    if (_memo)
+	size += sizeof(Memo) + _memo->args.capacity() * sizeof(int)
+	    + (_memo->keys.capacity() + _memo->key.capacity()) * sizeof(double)
+	    + _memo->results.capacity() * sizeof(SeVec3d) + _memo->filled.capacity();
+    size_t bytes = addNodeMemory(usage, size);
+    if (_data) {
+	size_t dataBytes = _data->memoryUsage();
+	usage.add(usage.data, SeExprMemory::typeName(typeid(*_data)), dataBytes);
+	bytes += dataBytes;
+    }
+    return bytes;
+}
+
+
 bool
 SeExprFuncNode::prep(bool wantVec)
 {
@@ -723,9 +1342,20 @@ SeExprFuncNode::prep(bool wantVec)
 
     // funcx is a catchall that does all its own processing
     if (_func->type() == SeExprFunc::FUNCX) {
+	SeExprTrace::Scope trace("funcxPrep", _name.c_str());
 	_isVec = 1; // assume vec result - funcx can override
         if(!_func->funcx()->isThreadSafe()) _expr->setThreadUnsafe(_name);
-	return _func->funcx()->prep(this, wantVec);
+	_evalFn = &SeExprFuncNode::evalFuncX;
+	delete _memo;
+	_memo = 0;
+	_statsId = -1;
+	if (SeExprStats::enabled()) {
+	    _statsId = SeExprStats::funcId(_name);
+	    SeExprStats::funcPrep(_statsId);
+	}
+	if (!_func->funcx()->prep(this, wantVec)) return 0;
+	prepMemo();
+	return 1;
     }
 
     // if a vector result is wanted or the function expects vector args,
@@ -743,9 +1373,153 @@ SeExprFuncNode::prep(bool wantVec)
 		if (child(i)->isVec()) { _isVec = 1; break; }
 	}
     }
+
+    // pick the evaluation routine for this function type
+    bool applyScalarToVec = _isVec && !_func->isVec();
+    switch (_func->type()) {
+    case SeExprFunc::FUNC0:   _evalFn = evalFuncFor<SeExprFunc::FUNC0>(applyScalarToVec); break;
+    case SeExprFunc::FUNC1:   _evalFn = evalFuncFor<SeExprFunc::FUNC1>(applyScalarToVec); break;
+    case SeExprFunc::FUNC2:   _evalFn = evalFuncFor<SeExprFunc::FUNC2>(applyScalarToVec); break;
+    case SeExprFunc::FUNC3:   _evalFn = evalFuncFor<SeExprFunc::FUNC3>(applyScalarToVec); break;
+    case SeExprFunc::FUNC4:   _evalFn = evalFuncFor<SeExprFunc::FUNC4>(applyScalarToVec); break;
+    case SeExprFunc::FUNC5:   _evalFn = evalFuncFor<SeExprFunc::FUNC5>(applyScalarToVec); break;
+    case SeExprFunc::FUNC6:   _evalFn = evalFuncFor<SeExprFunc::FUNC6>(applyScalarToVec); break;
+    case SeExprFunc::FUNCN:   _evalFn = evalFuncFor<SeExprFunc::FUNCN>(applyScalarToVec); break;
+    case SeExprFunc::FUNC1V:  _evalFn = evalFuncFor<SeExprFunc::FUNC1V>(applyScalarToVec); break;
+    case SeExprFunc::FUNC2V:  _evalFn = evalFuncFor<SeExprFunc::FUNC2V>(applyScalarToVec); break;
+    case SeExprFunc::FUNCNV:  _evalFn = evalFuncFor<SeExprFunc::FUNCNV>(applyScalarToVec); break;
+    case SeExprFunc::FUNC1VV: _evalFn = evalFuncFor<SeExprFunc::FUNC1VV>(applyScalarToVec); break;
+    case SeExprFunc::FUNC2VV: _evalFn = evalFuncFor<SeExprFunc::FUNC2VV>(applyScalarToVec); break;
+    case SeExprFunc::FUNCNVV: _evalFn = evalFuncFor<SeExprFunc::FUNCNVV>(applyScalarToVec); break;
+    default:                  _evalFn = evalFuncFor<SeExprFunc::NONE>(applyScalarToVec); break;
+    }
+
+    // use the array form for all components of a batch at once, and for
+    // all components of a vector when not evaluating exactly
+    _kernel = 0;
+    if (_func->kernel() && _func->type() >= SeExprFunc::FUNC1 && _func->type() <= SeExprFunc::FUNC6) {
+	_kernel = _func->kernel();
+	_accuracy = _expr->mathAccuracy();
+	if (_accuracy != SeExprMath::exact) _evalFn = &SeExprFuncNode::evalKernel;
+	_kernelArgs.resize(_nargs * 3 * SeExprBatch::maxSize);
+    }
+
+    // use the batch form if there is one and it yields the whole result
+    _useBatch = (_func->batch() && !applyScalarToVec) || _kernel;
+    if (_useBatch) {
+	_batchArgs.resize(_nargs * SeExprBatch::maxSize);
+	_batchArgPtrs.resize(_nargs);
+	for (int i = 0; i < _nargs; i++)
+	    _batchArgPtrs[i] = &_batchArgs[i * SeExprBatch::maxSize];
+    }
     return 1;
 }
 
+
+void
+SeExprFuncNode::evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    if (!_useBatch) {
+	SeExprNode::evalBatch(batch, results);
+	return;
+    }
+    if (_kernel) {
+	evalKernelBatch(batch, results);
+	return;
+    }
+
+    // evaluate each arg for the batch and pack its active lanes to the
+    // front (lanes are increasing, so packing in place is safe)
+    for (int a = 0; a < _nargs; a++) {
+	SeVec3d* vals = &_batchArgs[a * SeExprBatch::maxSize];
+	const SeExprNode* child = SeExprNode::child(a);
+	child->evalBatch(batch, vals);
+	bool bcast = !child->isVec();
+	for (int i = 0; i < batch.numActive; i++) {
+	    SeVec3d& v = vals[i];
+	    v = vals[batch.active[i]];
+	    if (bcast) v[1] = v[2] = v[0];
+	}
+    }
+
+    SeVec3d packed[SeExprBatch::maxSize];
+    _func->batch()(_nargs, _nargs ? &_batchArgPtrs[0] : 0, batch.numActive, packed);
+
+    for (int i = 0; i < batch.numActive; i++)
+	results[batch.active[i]] = packed[i];
+}
+
+
+void
+SeExprFuncNode::evalKernel(SeVec3d& result) const
+{
+    SeVec3d* a = evalArgs();
+    const double* args[6];
+    for (int i = 0; i < _nargs; i++) args[i] = &a[i][0];
+    _kernel(_accuracy, _isVec ? 3 : 1, args, &result[0]);
+}
+
+
+void
+SeExprFuncNode::evalKernelBatch(const SeExprBatch& batch, SeVec3d* results) const
+{
+    // lay out the active lanes of each arg (each component in turn for
+    // a vector result) as one array
+    const int width = _isVec ? 3 : 1;
+    const int stride = 3 * SeExprBatch::maxSize;
+    const double* args[6];
+    for (int a = 0; a < _nargs; a++) {
+	SeVec3d* vals = &_batchArgs[a * SeExprBatch::maxSize];
+	const SeExprNode* child = SeExprNode::child(a);
+	child->evalBatch(batch, vals);
+	bool isVec = child->isVec();
+	double* dst = &_kernelArgs[a * stride];
+	for (int i = 0; i < batch.numActive; i++) {
+	    const SeVec3d& v = vals[batch.active[i]];
+	    for (int c = 0; c < width; c++) dst[i*width + c] = v[isVec ? c : 0];
+	}
+	args[a] = dst;
+    }
+
+    double packed[3 * SeExprBatch::maxSize];
+    _kernel(_accuracy, batch.numActive * width, args, packed);
+
+    for (int i = 0; i < batch.numActive; i++) {
+	SeVec3d& r = results[batch.active[i]];
+	for (int c = 0; c < width; c++) r[c] = packed[i*width + c];
+    }
+}
+
+
+SeExprFuncNode::Data*
+SeExprFuncNode::takePrevData()
+{
+    Data* data = 0;
+    if (_prevCall && _prevCall->_func == _func) {
+	data = _prevCall->_data;
+	_prevCall->_data = 0;
+    }
+    _prevCall = 0;
+    return data;
+}
+
+
+SeExprCost
+SeExprFuncNode::estimateCost() const
+{
+    if (!_func) return SeExprCost();
+
+    SeExprCost cost;
+    for (int i = 0; i < numChildren(); i++)
+	cost += child(i)->estimateCost();
+
+    // a scalar function applied to a vector is called per component
+    SeExprCost call = _func->cost(this);
+    if (_func->type() != SeExprFunc::FUNCX && _isVec && !_func->isVec())
+	call = call * 3;
+    return cost + call;
+}
+
 SeVec3d*
 SeExprFuncNode::evalArgs() const
 {
@@ -784,25 +1558,27 @@ SeExprFuncNode::getStrArg(int n) const
 }
 
 
-void
-SeExprFuncNode::eval(SeVec3d& result) const
+template<int funcType>
+SeExprFuncNode::EvalFn
+SeExprFuncNode::evalFuncFor(bool applyScalarToVec)
 {
-    if (!_func) { result = 0.0; return; }
+    if (applyScalarToVec) return &SeExprFuncNode::evalFunc<funcType, true>;
+    return &SeExprFuncNode::evalFunc<funcType, false>;
+}
 
-    // funcx is a catchall that does all its own processing
-    if (_func->type() == SeExprFunc::FUNCX) {
-	_func->funcx()->eval(this, result);
-	return;
-    }
 
+template<int funcType, bool applyScalarToVec>
+void
+SeExprFuncNode::evalFunc(SeVec3d& result) const
+{
     // handle the case of a scalar func applied to a vector
-    bool applyScalarToVec = _isVec && !_func->isVec();
-    int niter = applyScalarToVec ? 3 : 1;
+    const int niter = applyScalarToVec ? 3 : 1;
 
     // eval args and call the function
+    // (funcType is a constant so the switch is resolved at compile time)
     SeVec3d* a = evalArgs();
     for (int i = 0; i < niter; i++) {
-	switch (_func->type()) {
+	switch (funcType) {
 	default: 
 	    result[i] = result[1] = result[2] = 0;
 	    break;
@@ -856,5 +1632,62 @@ SeExprFuncNode::eval(SeVec3d& result) const
 	    break;
 	}
     }
+}
+
+
+void
+SeExprFuncNode::evalFuncX(SeVec3d& result) const
+{
+    // funcx is a catchall that does all its own processing
+    _func->funcx()->eval(this, result);
+    if (_statsId >= 0 && SeExprStats::enabled()) SeExprStats::funcEval(_statsId);
+}
+
+
+void
+SeExprFuncNode::evalFuncXMemo(SeVec3d& result) const
+{
+    Memo& m = *_memo;
+    if (!m.enabled) {
+	evalFuncX(result);
+	return;
+    }
+
+    double* key = m.width ? &m.key[0] : 0;
+    int k = 0;
+    for (size_t i = 0; i < m.args.size(); i++) {
+	const SeExprNode* arg = child(m.args[i]);
+	SeVec3d val;
+	arg->eval(val);
+	key[k++] = val[0];
+	if (arg->isVec()) { key[k++] = val[1]; key[k++] = val[2]; }
+    }
 
+    int slot = int(memoHash(key, m.width) & (Memo::size - 1));
+    double* entry = m.width ? &m.keys[slot * m.width] : 0;
+    m.lookups++;
+    bool hit = m.filled[slot] && !memcmp(entry, key, m.width * sizeof(double));
+    if (SeExprStats::enabled()) SeExprStats::cache(SeExprStats::memoCache, 1, hit);
+    if (hit) {
+	m.hits++;
+	result = m.results[slot];
+    } else {
+	evalFuncX(result);
+	if (m.width) memcpy(entry, key, m.width * sizeof(double));
+	m.results[slot] = result;
+	m.filled[slot] = 1;
+    }
+
+    // stop looking up keys if the hits don't pay for the lookups and for
+    // evaluating the arguments twice on each miss
+    if (m.lookups == Memo::trialLookups &&
+	m.hits * m.callCost < m.lookups * m.lookupCost + (m.lookups - m.hits) * m.missCost)
+	m.enabled = false;
+}
+
+
+void
+SeExprFuncNode::evalUnbound(SeVec3d& result) const
+{
+    result = 0.0;
 }
@@ -43,10 +43,25 @@
 #endif
 
 #include "SeExpression.h"
+#include "SeExprFunc.h"
+#include "SeExprMemory.h"
 #include "SeVec3d.h"
 
 class SeExprFunc;
 
+/// Set of points evaluated together by SeExpression::evaluateBatch.
+/** A batch covers up to maxSize points, called lanes.  Result arrays
+    passed to evalBatch are indexed by lane, and only the lanes listed in
+    active (in increasing order) are evaluated; the others are left
+    untouched.  Branching nodes narrow the active list for each branch. */
+struct SeExprBatch
+{
+    enum { maxSize = 64 };
+
+    int numActive;
+    const int* active;
+};
+
 /// Expression node base class.  Always constructed by parser in SeExprParser.y
 class SeExprNode {
 public:
@@ -63,6 +78,21 @@ public:
     /// Evaluation method.  Note: v[1] and v[2] are undefined if !isVec
     virtual void eval(SeVec3d& v) const;
 
+    /** Batch evaluation method.  Sets results[lane] for each active lane
+        of the batch.  The default evaluates the lanes one at a time with
+        eval(); nodes that control flow or are cheap to run across many
+        lanes override it. */
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+
+    /** Static estimate of the cost of one eval() of this subtree (after
+        a successful prep).  The default is the children's cost plus one
+        operation per result component. */
+    virtual SeExprCost estimateCost() const;
+
+    /** Add the nodes of this subtree to usage by node type, with the
+        funcx data they hold, and return their bytes. */
+    size_t memoryUsage(SeExprMemory& usage) const;
+
     /// Access expression
     const SeExpression* expr() const { return _expr; }
 
@@ -84,15 +114,41 @@ public:
     */
     virtual bool prep(bool wantVec);
 
+    /** Replace nodes in this subtree with versions specialized for the
+        types found during prep (for expression use only, after a
+        successful prep).  Returns the node that takes this node's place,
+        which is this node if it has no specialization; a replaced node is
+        deleted.
+    */
+    SeExprNode* specialize();
+
     /// Remember the line and column position in the input string 
     inline void setPosition(const short int startPos,const short int endPos)
     {_startPos=startPos;_endPos=endPos;}
 
+    /// Position of the node's text in the input string
+    int startPos() const { return _startPos; }
+    int endPos() const { return _endPos; }
+
     /// Register error
     inline void addError(const std::string& error)
     {_expr->addError(error,_startPos,_endPos);}
 
 protected:
+    /** Build a replacement for this node specialized on the prepped
+        types, taking over this node's children, or return 0 if there is
+        none.  See specialize(). */
+    virtual SeExprNode* makeSpecialized() { return 0; }
+
+    /** Add this node alone to usage and return its bytes.  Node types
+        with members of their own override it, counting sizeof(*this)
+        with addNodeMemory(). */
+    virtual size_t nodeMemoryUsage(SeExprMemory& usage) const
+    { return addNodeMemory(usage, sizeof(SeExprNode)); }
+
+    /// Count this node in usage as size bytes plus its list of children
+    size_t addNodeMemory(SeExprMemory& usage, size_t size) const;
+
     /// Owning expression (node can't modify)
     const SeExpression* _expr;
 
@@ -119,6 +175,8 @@ public:
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
 };
 
 
@@ -132,6 +190,8 @@ public:
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
 };
 
 
@@ -144,6 +204,12 @@ public:
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
+
+protected:
+    virtual size_t nodeMemoryUsage(SeExprMemory& usage) const
+    { return addNodeMemory(usage, sizeof(*this)); }
 
 private:
     const char* _name; // this is owned by the SeExprNode's parent SeExpression
@@ -204,6 +270,8 @@ public:
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
 };
 
 
@@ -216,6 +284,8 @@ public:
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
 };
 
 
@@ -228,6 +298,8 @@ public:
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
 };
 
 
@@ -339,6 +411,9 @@ public:
 	SeExprNode(expr, a, b) {}
 
     virtual void eval(SeVec3d& result) const;
+
+protected:
+    virtual SeExprNode* makeSpecialized();
 };
 
 
@@ -350,6 +425,9 @@ public:
 	SeExprNode(expr, a, b) {}
 
     virtual void eval(SeVec3d& result) const;
+
+protected:
+    virtual SeExprNode* makeSpecialized();
 };
 
 
@@ -361,6 +439,9 @@ public:
 	SeExprNode(expr, a, b) {}
 
     virtual void eval(SeVec3d& result) const;
+
+protected:
+    virtual SeExprNode* makeSpecialized();
 };
 
 
@@ -372,6 +453,9 @@ public:
 	SeExprNode(expr, a, b) {}
 
     virtual void eval(SeVec3d& result) const;
+
+protected:
+    virtual SeExprNode* makeSpecialized();
 };
 
 
@@ -383,6 +467,9 @@ public:
 	SeExprNode(expr, a, b) {}
 
     virtual void eval(SeVec3d& result) const;
+
+protected:
+    virtual SeExprNode* makeSpecialized();
 };
 
 
@@ -394,6 +481,10 @@ public:
 	SeExprNode(expr, a, b) {}
 
     virtual void eval(SeVec3d& result) const;
+    virtual SeExprCost estimateCost() const;
+
+protected:
+    virtual SeExprNode* makeSpecialized();
 };
 
 /// Node that references a variable
@@ -401,11 +492,13 @@ class SeExprVarNode : public SeExprNode
 {
 public:
     SeExprVarNode(const SeExpression* expr, const char* name) :
-	SeExprNode(expr), _name(name), _var(0), _data(0) 
+	SeExprNode(expr), _name(name), _var(0), _ptrVar(0), _data(0) 
     { expr->addVar(name); }
 
     virtual bool prep(bool wantVec);
     virtual void eval(SeVec3d& result) const;
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
     const char* name() const { return _name; }
     
     /// base class for custom instance data
@@ -416,6 +509,7 @@ public:
 private:
     const char* _name; // this is owned by the SeExprNode's parent SeExpression
     SeExprVarRef* _var; // this is owned by somebody else
+    const SeExprPtrVarRef* _ptrVar; // _var if it reads host memory directly
     mutable Data* _data;
 };
 
@@ -428,6 +522,16 @@ public:
 	SeExprNode(expr), _val(val) {}
 
     virtual void eval(SeVec3d& result) const { result[0] = _val; }
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const
+    { for (int i = 0; i < batch.numActive; i++) results[batch.active[i]][0] = _val; }
+    virtual SeExprCost estimateCost() const { return SeExprCost(); }
+
+    /// The constant's value
+    double value() const { return _val; }
+
+protected:
+    virtual size_t nodeMemoryUsage(SeExprMemory& usage) const
+    { return addNodeMemory(usage, sizeof(*this)); }
 
 private:
     double _val;
@@ -445,8 +549,13 @@ public:
     { addError("Invalid string parameter: "+_str); return 0; }
 
     virtual void eval(SeVec3d& result) const { result[0] = 0; }
+    virtual SeExprCost estimateCost() const { return SeExprCost(); }
     const char* str() const { return _str.c_str(); }
 
+protected:
+    virtual size_t nodeMemoryUsage(SeExprMemory& usage) const
+    { return addNodeMemory(usage, sizeof(*this) + SeExprMemory::stringBytes(_str)); }
+
 private:
     std::string _str;
 };
@@ -457,14 +566,18 @@ class SeExprFuncNode : public SeExprNode
 {
 public:
     SeExprFuncNode(const SeExpression* expr, const char* name) :
-	SeExprNode(expr), _name(name), _func(0), _nargs(0), _data(0) 
+	SeExprNode(expr), _name(name), _func(0), _nargs(0), _data(0),
+	_evalFn(&SeExprFuncNode::evalUnbound), _useBatch(false), _kernel(0),
+	_accuracy(SeExprMath::exact), _prevCall(0), _memo(0), _statsId(-1)
     {
 	expr->addFunc(name);
     }
-    virtual ~SeExprFuncNode() { delete _data; }
+    virtual ~SeExprFuncNode();
 
     virtual bool prep(bool wantVec);
-    virtual void eval(SeVec3d& result) const;
+    virtual void eval(SeVec3d& result) const { (this->*_evalFn)(result); }
+    virtual void evalBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    virtual SeExprCost estimateCost() const;
     void setIsVec(bool isVec) { _isVec = isVec; }
     const char* name() const { return _name.c_str(); }
 
@@ -488,7 +601,12 @@ public:
     std::string getStrArg(int n) const;
 
     //! base class for custom instance data
-    struct Data { virtual ~Data() {} };
+    struct Data {
+	virtual ~Data() {}
+	//! Bytes held by the data, for SeExprMemory.  Data with members
+	//! override it to count sizeof(*this) and what the members allocate.
+	virtual size_t memoryUsage() const { return sizeof(Data); }
+    };
 
     //! associate blind data with this node (subsequently owned by this object)
     /***
@@ -507,13 +625,63 @@ public:
     */
     Data* getData() const { return _data; }
 
+    //! take the data this call had before the expression was last edited
+    /***
+        Returns 0 unless the call's text and structure are unchanged by
+        the edit and it resolves to the same function.  Use this in
+        SeExprFuncX::prep() to skip rebuilding expensive data (baked
+        curves, lookup tables), after checking that anything else the
+        data depends on is unchanged.  The caller owns the returned data.
+    */
+    Data* takePrevData();
+
+    //! times a pure funcx call looked for its arguments among its recent
+    //! calls, and found them.  The recent calls are kept per call node,
+    //! so each expression (and so each thread's expression) has its own.
+    size_t memoLookups() const;
+    size_t memoHits() const;
+
+protected:
+    virtual size_t nodeMemoryUsage(SeExprMemory& usage) const;
+
 private:
+    friend class SeExpression;
+
+    /// Evaluation routine chosen by prep for the function's type
+    typedef void (SeExprFuncNode::*EvalFn)(SeVec3d& result) const;
+    template<int funcType> static EvalFn evalFuncFor(bool applyScalarToVec);
+    template<int funcType, bool applyScalarToVec> void evalFunc(SeVec3d& result) const;
+    void evalKernel(SeVec3d& result) const;
+    void evalKernelBatch(const SeExprBatch& batch, SeVec3d* results) const;
+    void evalFuncX(SeVec3d& result) const;
+    void evalFuncXMemo(SeVec3d& result) const;
+    void prepMemo();
+    static bool isPureSubtree(const SeExprNode* node);
+    void evalUnbound(SeVec3d& result) const;
+
     std::string _name;
     const SeExprFunc* _func;
     int _nargs;
     mutable std::vector<double> _scalarArgs;
     mutable std::vector<SeVec3d> _vecArgs;
     mutable Data* _data;
+    EvalFn _evalFn;
+    /// Whether evalBatch can call the function's batch form
+    bool _useBatch;
+    mutable std::vector<SeVec3d> _batchArgs;
+    std::vector<const SeVec3d*> _batchArgPtrs;
+    /// Array form of the function, used for vectors and batches, and
+    /// the math accuracy of the expression when prepped
+    SeExprFunc::FuncKernel* _kernel;
+    SeExprMath::Accuracy _accuracy;
+    mutable std::vector<double> _kernelArgs;
+    /// Same call in the tree from before the last edit (only during prep)
+    SeExprFuncNode* _prevCall;
+    /// Recent results of a pure funcx call, by argument values
+    struct Memo;
+    Memo* _memo;
+    /// Id of a funcx in SeExprStats, if prepped with statistics on
+    int _statsId;
 };
 
 #endif
@@ -0,0 +1,342 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+/**
+   @file SeExprSampler.cpp
+*/
+#include <algorithm>
+#include <cmath>
+#include "SePlatform.h"
+#include "SeExpression.h"
+#include "SeExprSampler.h"
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+namespace {
+    //! Variable reading a value owned by the sampler
+    struct SamplerVar : public SeExprScalarVarRef
+    {
+	const double* val;
+	SamplerVar() : val(0) {}
+	void eval(const SeExprVarNode*, SeVec3d& result) { result[0] = *val; }
+    };
+
+    //! Expression of x and the sampler's variables
+    class SamplerExpr : public SeExpression
+    {
+    public:
+	SamplerExpr(const std::string& expr, const std::map<std::string, double>& vars)
+	    : SeExpression(expr), _vars(vars)
+	{}
+
+	//! Evaluate n values of x (at most chunkSize)
+	void evalChunk(int n, const double* x, double* y)
+	{
+	    _x.setPtr(x);
+	    _results.resize(chunkSize);
+	    for (int base = 0; base < n; base += chunkSize) {
+		int m = std::min(n - base, int(chunkSize));
+		_x.setIndex(base);
+		evaluateBatch(m, &_results[0]);
+		for (int i = 0; i < m; i++) y[base+i] = _results[i][0];
+	    }
+	}
+
+	enum { chunkSize = 256 };
+
+    private:
+	SeExprVarRef* resolveVar(const std::string& name) const
+	{
+	    if (name == "x") return &_x;
+	    std::map<std::string, double>::const_iterator i = _vars.find(name);
+	    if (i == _vars.end()) return 0;
+	    SamplerVar& var = _varRefs[name];
+	    var.val = &i->second;
+	    return &var;
+	}
+
+	const std::map<std::string, double>& _vars;
+	mutable SeExprPtrVarRef _x;
+	mutable std::map<std::string, SamplerVar> _varRefs;
+	std::vector<SeVec3d> _results;
+    };
+
+    //! Part of a batch evaluated by one thread
+    struct EvalTask
+    {
+	SamplerExpr* expr;
+	int n;
+	const double* x;
+	double* y;
+    };
+
+    void* runEvalTask(void* arg)
+    {
+	EvalTask& task = *(EvalTask*)arg;
+	task.expr->evalChunk(task.n, task.x, task.y);
+	return 0;
+    }
+
+    inline bool isUndefined(double y) { return y != y; }
+
+    //! Fewest points worth handing to another thread
+    const int minPointsPerThread = 128;
+    //! Finest subdivision, in pixels
+    const double minStep = 1./16;
+    //! Subdivide where the curve is further than this from a straight
+    //! line through its neighbors, in pixels
+    const double maxBend = .25;
+    //! Subdivide where the curve steps by more than this, in pixels
+    const double maxStepY = 1;
+}
+
+
+struct SeExprSampler::Curve
+{
+    std::string expr;
+    //! one copy of the expression per thread, made as needed
+    std::vector<SamplerExpr*> copies;
+    //! threads the expression may be evaluated on
+    int numThreads;
+    bool haveSamples;
+    View view;
+    std::vector<Sample> samples;
+
+    Curve() : numThreads(1), haveSamples(false) {}
+    ~Curve() { for (size_t i = 0; i < copies.size(); i++) delete copies[i]; }
+};
+
+
+SeExprSampler::SeExprSampler(int numThreads)
+    : _numThreads(numThreads)
+{
+    if (_numThreads <= 0) {
+#ifndef WINDOWS
+	_numThreads = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+#else
+	_numThreads = 1;
+#endif
+    }
+}
+
+
+SeExprSampler::~SeExprSampler()
+{
+    for (size_t i = 0; i < _curves.size(); i++) delete _curves[i];
+}
+
+
+void
+SeExprSampler::resetCurve(int curve)
+{
+    Curve* c = _curves[curve];
+    for (size_t i = 0; i < c->copies.size(); i++) delete c->copies[i];
+    c->copies.resize(1);
+    c->copies[0] = new SamplerExpr(c->expr, _vars);
+    c->numThreads = c->copies[0]->isValid() && c->copies[0]->isThreadSafe() ? _numThreads : 1;
+    c->haveSamples = false;
+    c->samples.clear();
+}
+
+
+bool
+SeExprSampler::setExpr(int curve, const std::string& expr)
+{
+    while (int(_curves.size()) <= curve) {
+	_curves.push_back(new Curve);
+	resetCurve(int(_curves.size()) - 1);
+    }
+    _curves[curve]->expr = expr;
+    resetCurve(curve);
+    return isValid(curve);
+}
+
+
+bool
+SeExprSampler::isValid(int curve) const
+{
+    return _curves[curve]->copies[0]->isValid();
+}
+
+
+const std::string&
+SeExprSampler::parseError(int curve) const
+{
+    return _curves[curve]->copies[0]->parseError();
+}
+
+
+void
+SeExprSampler::setVar(const std::string& name, double val)
+{
+    std::map<std::string, double>::iterator i = _vars.find(name);
+    if (i != _vars.end()) {
+	// existing expressions already read the value, just drop samples
+	i->second = val;
+	for (size_t c = 0; c < _curves.size(); c++) {
+	    _curves[c]->haveSamples = false;
+	    _curves[c]->samples.clear();
+	}
+	return;
+    }
+
+    // a new variable may resolve names that failed before
+    _vars[name] = val;
+    for (size_t c = 0; c < _curves.size(); c++) resetCurve(int(c));
+}
+
+
+double
+SeExprSampler::eval(int curve, double x) const
+{
+    double y;
+    _curves[curve]->copies[0]->evalChunk(1, &x, &y);
+    return y;
+}
+
+
+void
+SeExprSampler::eval(int curve, int n, const double* x, double* y) const
+{
+    Curve& c = *_curves[curve];
+    int numThreads = std::max(1, std::min(c.numThreads, n / minPointsPerThread));
+    while (int(c.copies.size()) < numThreads) {
+	c.copies.push_back(new SamplerExpr(c.expr, _vars));
+	c.copies.back()->isValid();
+    }
+
+    // split the points evenly, keeping the first part for this thread
+    std::vector<EvalTask> tasks(numThreads);
+    int perThread = (n + numThreads - 1) / numThreads;
+    for (int t = 0; t < numThreads; t++) {
+	int start = std::min(n, t * perThread);
+	tasks[t].expr = c.copies[t];
+	tasks[t].n = std::min(n, start + perThread) - start;
+	tasks[t].x = x + start;
+	tasks[t].y = y + start;
+    }
+#ifndef WINDOWS
+    std::vector<pthread_t> threads(numThreads);
+    std::vector<bool> started(numThreads, false);
+    for (int t = 1; t < numThreads; t++)
+	started[t] = pthread_create(&threads[t], 0, runEvalTask, &tasks[t]) == 0;
+    runEvalTask(&tasks[0]);
+    for (int t = 1; t < numThreads; t++) {
+	if (started[t]) pthread_join(threads[t], 0);
+	else runEvalTask(&tasks[t]);
+    }
+#else
+    for (int t = 0; t < numThreads; t++) runEvalTask(&tasks[t]);
+#endif
+}
+
+
+const std::vector<SeExprSampler::Sample>&
+SeExprSampler::sample(int curve, const View& view) const
+{
+    Curve& c = *_curves[curve];
+    if (c.haveSamples && c.view == view) return c.samples;
+    c.haveSamples = true;
+    c.view = view;
+    std::vector<Sample>& samples = c.samples;
+    samples.clear();
+    if (view.width <= 0 || view.height <= 0 || !(view.xmax > view.xmin)) return samples;
+
+    double xPerPixel = (view.xmax - view.xmin) / view.width;
+    double pixelsPerY = view.height / (view.ymax - view.ymin);
+
+    // start with a sample at each end and in the middle of each pixel
+    int n = view.width + 2;
+    std::vector<double> xs(n), ys(n);
+    xs[0] = view.xmin;
+    for (int i = 1; i <= view.width; i++) xs[i] = view.xmin + xPerPixel * (i - .5);
+    xs[n-1] = view.xmax;
+    eval(curve, n, &xs[0], &ys[0]);
+    samples.resize(n);
+    for (int i = 0; i < n; i++) { samples[i].x = xs[i]; samples[i].y = ys[i]; }
+
+    // subdivide where needed until nothing changes or the steps reach
+    // the finest size, evaluating all of the new points of a pass as
+    // one batch
+    std::vector<char> split;
+    std::vector<Sample> merged;
+    for (double step = xPerPixel; step > minStep * xPerPixel; step *= .5) {
+	int numIntervals = int(samples.size()) - 1;
+	split.assign(numIntervals, 0);
+	for (int i = 0; i < numIntervals; i++) {
+	    const Sample& a = samples[i];
+	    const Sample& b = samples[i+1];
+	    if (b.x - a.x <= 2 * minStep * xPerPixel) continue;
+
+	    // close in on points where the curve is undefined
+	    if (isUndefined(a.y) != isUndefined(b.y)) { split[i] = 1; continue; }
+
+	    // a visible step
+	    bool offscreen = (a.y > view.ymax && b.y > view.ymax) ||
+		(a.y < view.ymin && b.y < view.ymin);
+	    if (!offscreen && fabs(b.y - a.y) * pixelsPerY > maxStepY) split[i] = 1;
+
+	    // bend at a, from the line between its neighbors
+	    if (i > 0) {
+		const Sample& p = samples[i-1];
+		double t = (a.x - p.x) / (b.x - p.x);
+		double line = p.y + (b.y - p.y) * t;
+		if (fabs(a.y - line) * pixelsPerY > maxBend) split[i-1] = split[i] = 1;
+	    }
+	}
+
+	xs.clear();
+	for (int i = 0; i < numIntervals; i++)
+	    if (split[i]) xs.push_back(.5 * (samples[i].x + samples[i+1].x));
+	if (xs.empty()) break;
+	ys.resize(xs.size());
+	eval(curve, int(xs.size()), &xs[0], &ys[0]);
+
+	merged.clear();
+	merged.reserve(samples.size() + xs.size());
+	int k = 0;
+	for (int i = 0; i < numIntervals; i++) {
+	    merged.push_back(samples[i]);
+	    if (split[i]) {
+		Sample s = { xs[k], ys[k] };
+		merged.push_back(s);
+		k++;
+	    }
+	}
+	merged.push_back(samples.back());
+	samples.swap(merged);
+    }
+    return samples;
+}
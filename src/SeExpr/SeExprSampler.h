@@ -0,0 +1,105 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+#ifndef SeExprSampler_h
+#define SeExprSampler_h
+
+#include <string>
+#include <vector>
+#include <map>
+
+//! Samples scalar expressions of one variable x over a range, for graphing.
+/** Each curve is an expression string.  Points are evaluated in batches
+    split across threads, each thread using its own copy of the
+    expression.  A sampled range starts out with a sample per pixel and
+    is subdivided where the curve bends, steps by more than a pixel or
+    becomes undefined.  The samples of a curve are kept until its
+    expression, a variable, or the view asked for changes. */
+class SeExprSampler
+{
+ public:
+    //! A point on a curve
+    struct Sample { double x, y; };
+
+    //! Range of x and y covered by width x height pixels
+    struct View
+    {
+	double xmin, xmax, ymin, ymax;
+	int width, height;
+
+	View() : xmin(0), xmax(1), ymin(0), ymax(1), width(1), height(1) {}
+	View(double x0, double x1, double y0, double y1, int w, int h)
+	    : xmin(x0), xmax(x1), ymin(y0), ymax(y1), width(w), height(h) {}
+	bool operator==(const View& v) const
+	{
+	    return xmin == v.xmin && xmax == v.xmax && ymin == v.ymin &&
+		ymax == v.ymax && width == v.width && height == v.height;
+	}
+    };
+
+    //! numThreads of zero uses one thread per cpu
+    SeExprSampler(int numThreads=0);
+    ~SeExprSampler();
+
+    //! Set the expression of a curve, adding curves up to it as needed.
+    //! Returns whether the expression is valid.
+    bool setExpr(int curve, const std::string& expr);
+    int numCurves() const { return int(_curves.size()); }
+    bool isValid(int curve) const;
+    const std::string& parseError(int curve) const;
+
+    //! Set a variable the expressions can use besides x
+    void setVar(const std::string& name, double val);
+
+    //! Evaluate a curve at x
+    double eval(int curve, double x) const;
+    //! Evaluate a curve at n values of x, split across threads
+    void eval(int curve, int n, const double* x, double* y) const;
+
+    //! Samples of a curve over the view, in increasing x
+    const std::vector<Sample>& sample(int curve, const View& view) const;
+
+ private:
+    SeExprSampler(const SeExprSampler&);
+    SeExprSampler& operator=(const SeExprSampler&);
+
+    struct Curve;
+    void resetCurve(int curve);
+
+    int _numThreads;
+    std::vector<Curve*> _curves;
+    std::map<std::string, double> _vars;
+};
+
+#endif
@@ -0,0 +1,600 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "SeExprStats.h"
+#include "SeThreadLocal.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+bool SeExprStats::_enabled = false;
+bool SeExprStats::_hardware = false;
+
+namespace {
+    const char* counterNames[SeExprStats::numCounters] = {
+	"parses", "parseErrors", "preps", "prepErrors",
+	"evals", "batchEvals", "batchPoints", "unsafeEvals"
+    };
+    const char* histogramNames[SeExprStats::numHistograms] = {
+	"parseTime", "prepTime", "evalTime"
+    };
+    const char* cacheNames[SeExprStats::numCaches] = {
+	"memo", "prepReuse", "graph", "bake"
+    };
+    const char* eventNames[SeExprStats::numEvents] = {
+	"cycles", "instructions", "branchMisses", "llcMisses"
+    };
+
+    //! bucket b counts times under 2^b ns
+    const int numBuckets = 40;
+
+    struct ExprSlot
+    {
+	uint64_t evals, points, nanos;
+	//! hardware events, and the evaluations counting each
+	uint64_t events[SeExprStats::numEvents], eventEvals[SeExprStats::numEvents];
+    };
+    struct FuncSlot { uint64_t preps, evals; };
+
+    //! per-key slots are allocated in chunks by the thread owning them,
+    //! so readers never see them move
+    const int chunkSize = 256, maxChunks = 64;
+
+    template <class Slot>
+    struct Slots
+    {
+	Slot* chunks[maxChunks];
+
+	Slot* get(int id)
+	{
+	    Slot*& chunk = chunks[id / chunkSize];
+	    if (!chunk) {
+		Slot* fresh = new Slot[chunkSize];
+		memset(fresh, 0, chunkSize * sizeof(Slot));
+		SE_MEMORY_BARRIER();
+		chunk = fresh;
+	    }
+	    return chunk + id % chunkSize;
+	}
+
+	//! slot id, or null if the thread never touched it
+	const Slot* find(int id) const
+	{
+	    const Slot* chunk = chunks[id / chunkSize];
+	    return chunk ? chunk + id % chunkSize : 0;
+	}
+
+	void reset()
+	{
+	    for (int i = 0; i < maxChunks; i++)
+		if (chunks[i]) memset(chunks[i], 0, chunkSize * sizeof(Slot));
+	}
+    };
+
+    //! Statistics recorded by one thread.  Only that thread writes them.
+    struct ThreadStats
+    {
+	uint64_t counters[SeExprStats::numCounters];
+	uint64_t histograms[SeExprStats::numHistograms][numBuckets];
+	uint64_t histogramNanos[SeExprStats::numHistograms];
+	uint64_t cacheLookups[SeExprStats::numCaches];
+	uint64_t cacheHits[SeExprStats::numCaches];
+	Slots<ExprSlot> exprs;
+	Slots<FuncSlot> funcs;
+	//! hardware counters of the thread: a group led by the first open
+	//! event, event e being value perfIndex[e] of the group (counted
+	//! says which are open)
+	bool perfTried;
+	int perfFds[SeExprStats::numEvents];
+	int perfIndex[SeExprStats::numEvents];
+	unsigned int perfCounted;
+
+	void reset()
+	{
+	    memset(counters, 0, sizeof(counters));
+	    memset(histograms, 0, sizeof(histograms));
+	    memset(histogramNanos, 0, sizeof(histogramNanos));
+	    memset(cacheLookups, 0, sizeof(cacheLookups));
+	    memset(cacheHits, 0, sizeof(cacheHits));
+	    exprs.reset();
+	    funcs.reset();
+	}
+    };
+
+#ifdef __linux__
+    //! Open the counters of the calling thread as one group
+    void openCounters(ThreadStats& stats)
+    {
+	static const uint64_t configs[SeExprStats::numEvents] = {
+	    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	    PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+	};
+	stats.perfTried = true;
+	stats.perfCounted = 0;
+	int leader = -1, numOpen = 0;
+	for (int e = 0; e < SeExprStats::numEvents; e++) {
+	    perf_event_attr attr;
+	    memset(&attr, 0, sizeof(attr));
+	    attr.type = PERF_TYPE_HARDWARE;
+	    attr.size = sizeof(attr);
+	    attr.config = configs[e];
+	    attr.read_format = PERF_FORMAT_GROUP |
+		PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	    // user space only, which unprivileged processes may count
+	    attr.exclude_kernel = 1;
+	    attr.exclude_hv = 1;
+	    int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0));
+	    stats.perfFds[e] = fd;
+	    if (fd < 0) continue;
+	    if (leader < 0) leader = fd;
+	    stats.perfIndex[e] = numOpen++;
+	    stats.perfCounted |= 1u << e;
+	}
+    }
+
+    void closeCounters(ThreadStats& stats)
+    {
+	for (int e = 0; e < SeExprStats::numEvents; e++)
+	    if (stats.perfCounted & (1u << e)) close(stats.perfFds[e]);
+	stats.perfTried = false;
+	stats.perfCounted = 0;
+    }
+
+    //! Read the counters, and the times the group was enabled and running
+    bool readCounters(ThreadStats& stats, uint64_t* events, uint64_t& enabled, uint64_t& running)
+    {
+	if (!stats.perfTried) openCounters(stats);
+	if (!stats.perfCounted) return false;
+	// the group is read through its leader, the first open event
+	int leader = 0;
+	while (!(stats.perfCounted & (1u << leader))) leader++;
+	// number of values, time enabled, time running, then the values
+	uint64_t values[3 + SeExprStats::numEvents];
+	if (read(stats.perfFds[leader], values, sizeof(values)) <= 0) return false;
+	enabled = values[1];
+	running = values[2];
+	for (int e = 0; e < SeExprStats::numEvents; e++)
+	    if (stats.perfCounted & (1u << e)) events[e] = values[3 + stats.perfIndex[e]];
+	return true;
+    }
+#else
+    void closeCounters(ThreadStats&) {}
+    bool readCounters(ThreadStats&, uint64_t*, uint64_t&, uint64_t&) { return false; }
+#endif
+
+    void detachStats(ThreadStats* stats)
+    {
+	closeCounters(*stats);
+    }
+
+    //! Names given ids, and the statistics of every thread.  Threads
+    //! that exit leave their statistics to be reused by new threads.
+    struct Registry
+    {
+	SeExprInternal::Mutex mutex;
+	std::map<std::string, int> exprIds, funcIds;
+	std::vector<std::string> exprs, funcs;
+	SeExprInternal::ThreadBlocks<ThreadStats> threads;
+	Registry() : threads(mutex, detachStats) {}
+    };
+
+    Registry& registry()
+    {
+	static Registry* registry = new Registry;
+	return *registry;
+    }
+
+    SE_THREAD_LOCAL ThreadStats* threadStats = 0;
+
+    inline ThreadStats& local()
+    {
+	if (!threadStats) threadStats = registry().threads.attach();
+	return *threadStats;
+    }
+
+    int idOf(std::map<std::string, int>& ids, std::vector<std::string>& names, const std::string& name)
+    {
+	std::map<std::string, int>::iterator i = ids.find(name);
+	if (i != ids.end()) return i->second;
+	if (names.size() == size_t(chunkSize * maxChunks)) return -1;
+	int id = int(names.size());
+	ids[name] = id;
+	names.push_back(name);
+	return id;
+    }
+
+    void writeString(std::ostream& out, const std::string& str)
+    {
+	out << '"';
+	for (size_t i = 0; i < str.size(); i++) {
+	    unsigned char c = str[i];
+	    switch (c) {
+	    case '"': out << "\\\""; break;
+	    case '\\': out << "\\\\"; break;
+	    case '\n': out << "\\n"; break;
+	    case '\t': out << "\\t"; break;
+	    default:
+		if (c < 0x20) {
+		    char buf[8];
+		    snprintf(buf, sizeof(buf), "\\u%04x", c);
+		    out << buf;
+		} else out << c;
+	    }
+	}
+	out << '"';
+    }
+
+    //! Hardware events of an expression, with instructions per cycle and
+    //! misses per thousand instructions where both were counted
+    void writeEvents(std::ostream& out, const ExprSlot& slot)
+    {
+	for (int e = 0; e < SeExprStats::numEvents; e++)
+	    if (slot.eventEvals[e]) out << ", \"" << eventNames[e] << "\": " << slot.events[e];
+	const uint64_t* events = slot.events;
+	bool hasInstructions = slot.eventEvals[SeExprStats::instructions] && events[SeExprStats::instructions];
+	if (hasInstructions && slot.eventEvals[SeExprStats::cycles] && events[SeExprStats::cycles])
+	    out << ", \"ipc\": " << double(events[SeExprStats::instructions]) / events[SeExprStats::cycles];
+	if (hasInstructions && slot.eventEvals[SeExprStats::branchMisses])
+	    out << ", \"branchMissesPerKiloInstruction\": "
+		<< 1000. * events[SeExprStats::branchMisses] / events[SeExprStats::instructions];
+	if (hasInstructions && slot.eventEvals[SeExprStats::llcMisses])
+	    out << ", \"llcMissesPerKiloInstruction\": "
+		<< 1000. * events[SeExprStats::llcMisses] / events[SeExprStats::instructions];
+    }
+
+    struct ExprTotal
+    {
+	const std::string* expr;
+	ExprSlot slot;
+	bool operator<(const ExprTotal& other) const { return slot.nanos > other.slot.nanos; }
+    };
+
+    //! $SE_EXPR_STATS turns statistics on and names where they're written
+    //! at exit
+    std::string& exitPath()
+    {
+	static std::string path;
+	return path;
+    }
+
+    void writeAtExit()
+    {
+	const std::string& path = exitPath();
+	if (path == "-") SeExprStats::writeJson(std::cerr);
+	else {
+	    std::ofstream out(path.c_str());
+	    SeExprStats::writeJson(out);
+	}
+    }
+
+    struct EnvInit
+    {
+	EnvInit()
+	{
+	    const char* path = getenv("SE_EXPR_STATS");
+	    if (!path || !*path) return;
+	    exitPath() = path;
+	    SeExprStats::setEnabled(true);
+	    const char* counters = getenv("SE_EXPR_STATS_COUNTERS");
+	    if (counters && atoi(counters)) SeExprStats::setHardwareCounters(true);
+	    atexit(writeAtExit);
+	}
+    } envInit;
+}
+
+
+void
+SeExprStats::reset()
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    const std::vector<ThreadStats*>& threads = r.threads.all();
+    for (size_t i = 0; i < threads.size(); i++) threads[i]->reset();
+}
+
+
+bool
+SeExprStats::setHardwareCounters(bool on)
+{
+    uint64_t events[numEvents], enabled, running;
+    _hardware = on && readCounters(local(), events, enabled, running);
+    return _hardware == on;
+}
+
+
+void
+SeExprStats::begin(Sample& sample)
+{
+    sample.counted = _hardware &&
+	readCounters(local(), sample.events, sample.enabled, sample.running) ? local().perfCounted : 0;
+    // read the clock last and first so it leaves out reading counters
+    sample.nanos = now();
+}
+
+
+void
+SeExprStats::end(Sample& sample)
+{
+    sample.nanos = now() - sample.nanos;
+    uint64_t events[numEvents], enabled, running;
+    if (sample.counted && readCounters(local(), events, enabled, running)) {
+	sample.enabled = enabled - sample.enabled;
+	sample.running = running - sample.running;
+	// while the kernel multiplexed the counters they counted for part
+	// of the time only, and are scaled up to all of it; if they never
+	// ran there is nothing to report
+	if (!sample.running) sample.counted = 0;
+	double scale = sample.running ? double(sample.enabled) / sample.running : 0;
+	for (int e = 0; e < numEvents; e++)
+	    if (sample.counted & (1u << e)) {
+		uint64_t n = events[e] - sample.events[e];
+		sample.events[e] = sample.enabled == sample.running ? n : uint64_t(n * scale + .5);
+	    }
+    } else sample.counted = 0;
+}
+
+
+void
+SeExprStats::count(Counter counter, uint64_t n)
+{
+    local().counters[counter] += n;
+}
+
+
+void
+SeExprStats::record(Histogram histogram, uint64_t nanos)
+{
+    ThreadStats& stats = local();
+    int bucket = 0;
+    while (bucket < numBuckets - 1 && nanos >> bucket) bucket++;
+    stats.histograms[histogram][bucket]++;
+    stats.histogramNanos[histogram] += nanos;
+}
+
+
+void
+SeExprStats::cache(Cache cache, uint64_t lookups, uint64_t hits)
+{
+    ThreadStats& stats = local();
+    stats.cacheLookups[cache] += lookups;
+    stats.cacheHits[cache] += hits;
+}
+
+
+int
+SeExprStats::exprId(const std::string& expr)
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    return idOf(r.exprIds, r.exprs, expr);
+}
+
+
+int
+SeExprStats::funcId(const std::string& name)
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    return idOf(r.funcIds, r.funcs, name);
+}
+
+
+void
+SeExprStats::exprEval(int id, uint64_t points, const Sample& sample)
+{
+    if (id < 0) return;
+    ExprSlot* slot = local().exprs.get(id);
+    slot->evals++;
+    slot->points += points;
+    slot->nanos += sample.nanos;
+    for (int e = 0; e < numEvents; e++) {
+	if (!(sample.counted & (1u << e))) continue;
+	slot->events[e] += sample.events[e];
+	slot->eventEvals[e]++;
+    }
+}
+
+
+void
+SeExprStats::funcPrep(int id)
+{
+    if (id >= 0) local().funcs.get(id)->preps++;
+}
+
+
+void
+SeExprStats::funcEval(int id)
+{
+    if (id >= 0) local().funcs.get(id)->evals++;
+}
+
+
+uint64_t
+SeExprStats::now()
+{
+#ifdef WINDOWS
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    return uint64_t(count.QuadPart * (1e9 / frequency.QuadPart));
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+uint64_t
+SeExprStats::total(Counter counter)
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    uint64_t sum = 0;
+    const std::vector<ThreadStats*>& threads = r.threads.all();
+    for (size_t i = 0; i < threads.size(); i++) sum += threads[i]->counters[counter];
+    return sum;
+}
+
+
+void
+SeExprStats::cacheTotals(Cache cache, uint64_t& lookups, uint64_t& hits)
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    lookups = hits = 0;
+    const std::vector<ThreadStats*>& threads = r.threads.all();
+    for (size_t i = 0; i < threads.size(); i++) {
+	lookups += threads[i]->cacheLookups[cache];
+	hits += threads[i]->cacheHits[cache];
+    }
+}
+
+
+void
+SeExprStats::writeJson(std::ostream& out)
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    const std::vector<ThreadStats*>& threads = r.threads.all();
+
+    out << "{\n  \"hardwareCounters\": " << (_hardware ? "true" : "false");
+    out << ",\n  \"counters\": {";
+    for (int c = 0; c < numCounters; c++) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < threads.size(); i++) sum += threads[i]->counters[c];
+	out << (c ? ", " : "") << '"' << counterNames[c] << "\": " << sum;
+    }
+
+    out << "},\n  \"histograms\": {";
+    for (int h = 0; h < numHistograms; h++) {
+	uint64_t buckets[numBuckets] = {0}, count = 0, nanos = 0;
+	for (size_t i = 0; i < threads.size(); i++) {
+	    for (int b = 0; b < numBuckets; b++) buckets[b] += threads[i]->histograms[h][b];
+	    nanos += threads[i]->histogramNanos[h];
+	}
+	out << (h ? "," : "") << "\n    \"" << histogramNames[h] << "\": {\"buckets\": [";
+	bool first = true;
+	for (int b = 0; b < numBuckets; b++) {
+	    count += buckets[b];
+	    if (!buckets[b]) continue;
+	    // [upper bound in ns, count]
+	    out << (first ? "" : ", ") << '[' << (uint64_t(1) << b) << ", " << buckets[b] << ']';
+	    first = false;
+	}
+	out << "], \"count\": " << count << ", \"totalNs\": " << nanos << '}';
+    }
+
+    out << "\n  },\n  \"caches\": {";
+    for (int c = 0; c < numCaches; c++) {
+	uint64_t lookups = 0, hits = 0;
+	for (size_t i = 0; i < threads.size(); i++) {
+	    lookups += threads[i]->cacheLookups[c];
+	    hits += threads[i]->cacheHits[c];
+	}
+	out << (c ? "," : "") << "\n    \"" << cacheNames[c] << "\": {\"lookups\": " << lookups
+	    << ", \"hits\": " << hits << ", \"hitRate\": " << (lookups ? double(hits) / lookups : 0.0) << '}';
+    }
+
+    std::vector<ExprTotal> exprs;
+    for (size_t id = 0; id < r.exprs.size(); id++) {
+	ExprTotal total;
+	total.expr = &r.exprs[id];
+	memset(&total.slot, 0, sizeof(total.slot));
+	for (size_t i = 0; i < threads.size(); i++) {
+	    if (const ExprSlot* slot = threads[i]->exprs.find(int(id))) {
+		total.slot.evals += slot->evals;
+		total.slot.points += slot->points;
+		total.slot.nanos += slot->nanos;
+		for (int e = 0; e < numEvents; e++) {
+		    total.slot.events[e] += slot->events[e];
+		    total.slot.eventEvals[e] += slot->eventEvals[e];
+		}
+	    }
+	}
+	if (total.slot.evals) exprs.push_back(total);
+    }
+    std::stable_sort(exprs.begin(), exprs.end());
+    out << "\n  },\n  \"expressions\": [";
+    for (size_t e = 0; e < exprs.size(); e++) {
+	out << (e ? "," : "") << "\n    {\"expr\": ";
+	writeString(out, *exprs[e].expr);
+	const ExprSlot& slot = exprs[e].slot;
+	out << ", \"evals\": " << slot.evals << ", \"points\": " << slot.points
+	    << ", \"totalNs\": " << slot.nanos;
+	writeEvents(out, slot);
+	out << '}';
+    }
+
+    out << "\n  ],\n  \"functions\": [";
+    bool first = true;
+    for (std::map<std::string, int>::iterator f = r.funcIds.begin(); f != r.funcIds.end(); ++f) {
+	FuncSlot total = {0, 0};
+	for (size_t i = 0; i < threads.size(); i++) {
+	    if (const FuncSlot* slot = threads[i]->funcs.find(f->second)) {
+		total.preps += slot->preps;
+		total.evals += slot->evals;
+	    }
+	}
+	if (!total.preps && !total.evals) continue;
+	out << (first ? "" : ",") << "\n    {\"name\": ";
+	writeString(out, f->first);
+	out << ", \"preps\": " << total.preps << ", \"evals\": " << total.evals << '}';
+	first = false;
+    }
+    out << "\n  ]\n}\n";
+}
+
+
+std::string
+SeExprStats::json()
+{
+    std::ostringstream out;
+    writeJson(out);
+    return out.str();
+}
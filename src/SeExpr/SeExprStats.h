@@ -0,0 +1,168 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprStats_h
+#define SeExprStats_h
+
+#include <string>
+#include <iosfwd>
+#include <stdint.h>
+
+//! Opt-in statistics of what the library does: counts and latencies of
+//! parses, preps and evaluations, evaluations per expression, funcx preps
+//! and evaluations per function, and the hit rates of its caches.
+/** Statistics are off until setEnabled(true), or until the library is
+    loaded with $SE_EXPR_STATS set to a file name ("-" for stderr), in
+    which case the statistics are also written there as JSON when the
+    process exits.  While they are off recording costs a test of
+    enabled().
+
+    Each thread records into its own counters without locking; they are
+    summed when the statistics are read, so a read while other threads
+    are evaluating sees counts that are slightly out of date.
+    Expressions are counted by their text, and funcx calls in
+    expressions prepped while statistics are on.
+
+    On Linux, setHardwareCounters(true) (or $SE_EXPR_STATS_COUNTERS set
+    to 1) also counts cycles, instructions, branch misses and last level
+    cache misses across each expression's evaluations, with
+    perf_event_open.  Each evaluation then costs a few extra system
+    calls.  Where the kernel doesn't permit the counters (see
+    /proc/sys/kernel/perf_event_paranoid) or the machine lacks them,
+    they are left out and the rest of the statistics are unaffected.
+    When the kernel shares the counters with other events, counts are
+    scaled up from the part of each evaluation they ran for, and left
+    out of evaluations they didn't run for at all. */
+class SeExprStats
+{
+public:
+    enum Counter {
+	parses, parseErrors, preps, prepErrors,
+	//! calls of evaluate(), and of evaluateBatch()/evaluatePoints()
+	//! with the points they evaluated
+	evals, batchEvals, batchPoints,
+	//! evaluations of expressions that aren't thread safe, which hosts
+	//! must serialize
+	unsafeEvals,
+	numCounters
+    };
+
+    //! Latencies, in power of two buckets of nanoseconds
+    enum Histogram { parseTime, prepTime, evalTime, numHistograms };
+
+    enum Cache {
+	//! results of pure funcx calls (see SeExprFuncX)
+	memoCache,
+	//! prep data of calls unchanged by SeExpression::setExpr()
+	prepReuseCache,
+	//! results of SeExprGraph nodes kept between evaluations
+	graphCache,
+	//! tiles of SeExprBake found in the cache file
+	bakeCache,
+	numCaches
+    };
+
+    //! Hardware events counted in hardware counter mode
+    enum Event { cycles, instructions, branchMisses, llcMisses, numEvents };
+
+    static void setEnabled(bool enabled) { _enabled = enabled; }
+    static bool enabled() { return _enabled; }
+
+    //! Turn hardware counters on or off.  Returns whether they could be
+    //! opened on this thread; if not they stay off.
+    static bool setHardwareCounters(bool on);
+    static bool hardwareCounters() { return _hardware; }
+
+    //! Time and hardware events of an evaluation, from begin() to end()
+    struct Sample
+    {
+	uint64_t nanos;
+	uint64_t events[numEvents];
+	//! which events were counted
+	unsigned int counted;
+	//! nanoseconds the counters were enabled and counting, which
+	//! differ when the kernel multiplexes them with other events
+	uint64_t enabled, running;
+    };
+    static void begin(Sample& sample);
+    static void end(Sample& sample);
+
+    //! Zero all statistics
+    static void reset();
+
+    static void count(Counter counter, uint64_t n=1);
+    static void record(Histogram histogram, uint64_t nanos);
+    static void cache(Cache cache, uint64_t lookups, uint64_t hits);
+
+    //! Id of an expression's text, or of a function name, for exprEval()
+    //! and funcPrep()/funcEval(); -1 if there are too many to track
+    static int exprId(const std::string& expr);
+    static int funcId(const std::string& name);
+    static void exprEval(int id, uint64_t points, const Sample& sample);
+    static void funcPrep(int id);
+    static void funcEval(int id);
+
+    //! Monotonic clock in nanoseconds
+    static uint64_t now();
+
+    //! Records the time from its construction to its destruction, if
+    //! statistics were on when it was made
+    class Timer {
+    public:
+	Timer(Histogram histogram)
+	    : _histogram(histogram), _start(_enabled ? now() : 0) {}
+	~Timer() { if (_start) record(_histogram, now() - _start); }
+    private:
+	Histogram _histogram;
+	uint64_t _start;
+    };
+
+    //! Sums over all threads
+    static uint64_t total(Counter counter);
+    static void cacheTotals(Cache cache, uint64_t& lookups, uint64_t& hits);
+
+    //! Write all statistics as a JSON object, expressions ordered by
+    //! their total evaluation time.  Expressions give the hardware
+    //! events counted, their instructions per cycle and their misses per
+    //! thousand instructions.
+    static void writeJson(std::ostream& out);
+    static std::string json();
+
+private:
+    static bool _enabled;
+    static bool _hardware;
+};
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include "SeExprTrace.h"
+#include "SeExprStats.h"
+#include "SeThreadLocal.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
+bool SeExprTrace::_enabled = false;
+
+namespace {
+    const int ringSize = 8192, detailSize = 64;
+
+    struct Event
+    {
+	//! thread id, as threads share buffers in turn
+	int tid;
+	const char* name;
+	uint64_t start, duration;
+	char detail[detailSize];
+    };
+
+    //! The most recent events of a thread and those before it that used
+    //! the buffer: event i is in events[i % ringSize] for i from
+    //! max(0, count-ringSize) to count
+    struct ThreadTrace
+    {
+	int tid;
+	uint64_t count;
+	Event events[ringSize];
+    };
+
+    //! The buffers of every thread.  Threads that exit leave theirs to
+    //! be reused by new threads, so there are only as many as threads
+    //! tracing at once.
+    struct Registry
+    {
+	SeExprInternal::Mutex mutex;
+	SeExprInternal::ThreadBlocks<ThreadTrace> threads;
+	Registry() : threads(mutex) {}
+    };
+
+    Registry& registry()
+    {
+	static Registry* registry = new Registry;
+	return *registry;
+    }
+
+    SE_THREAD_LOCAL ThreadTrace* threadTrace = 0;
+
+    int threadId()
+    {
+#if defined(__linux__)
+	return int(syscall(SYS_gettid));
+#elif defined(WINDOWS)
+	return int(GetCurrentThreadId());
+#else
+	static int next = 0;
+	return __sync_add_and_fetch(&next, 1);
+#endif
+    }
+
+    int processId()
+    {
+#ifdef WINDOWS
+	return _getpid();
+#else
+	return getpid();
+#endif
+    }
+
+    inline ThreadTrace& local()
+    {
+	if (!threadTrace) {
+	    // kept after the thread exits, so its events can still be written
+	    threadTrace = registry().threads.attach();
+	    threadTrace->tid = threadId();
+	}
+	return *threadTrace;
+    }
+
+    void writeString(std::ostream& out, const char* str)
+    {
+	out << '"';
+	for (; *str; str++) {
+	    unsigned char c = *str;
+	    if (c == '"' || c == '\\') out << '\\' << c;
+	    else if (c < 0x20) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "\\u%04x", c);
+		out << buf;
+	    } else out << c;
+	}
+	out << '"';
+    }
+
+    std::string& exitPath()
+    {
+	static std::string path;
+	return path;
+    }
+
+    void writeAtExit()
+    {
+	std::ofstream out(exitPath().c_str());
+	SeExprTrace::writeJson(out);
+    }
+
+    //! $SE_EXPR_TRACE turns tracing on and names where it's written at exit
+    struct EnvInit
+    {
+	EnvInit()
+	{
+	    const char* path = getenv("SE_EXPR_TRACE");
+	    if (!path || !*path) return;
+	    exitPath() = path;
+	    SeExprTrace::setEnabled(true);
+	    atexit(writeAtExit);
+	}
+    } envInit;
+}
+
+
+void
+SeExprTrace::Scope::begin(const char* name, const char* detail)
+{
+    _name = name;
+    _detail = detail;
+    _start = SeExprStats::now();
+}
+
+
+void
+SeExprTrace::Scope::end()
+{
+    uint64_t now = SeExprStats::now();
+    ThreadTrace& trace = local();
+    Event& event = trace.events[trace.count % ringSize];
+    event.tid = trace.tid;
+    event.name = _name;
+    event.start = _start;
+    event.duration = now - _start;
+    event.detail[0] = 0;
+    if (_detail) {
+	strncpy(event.detail, _detail, detailSize - 1);
+	event.detail[detailSize - 1] = 0;
+	// don't leave part of a utf-8 character at the end
+	size_t len = strlen(event.detail);
+	if (len == size_t(detailSize - 1)) {
+	    while (len && (event.detail[len-1] & 0xc0) == 0x80) len--;
+	    if (len && (event.detail[len-1] & 0x80)) len--;
+	    event.detail[len] = 0;
+	}
+    }
+    // publish the event after writing it
+    SE_MEMORY_BARRIER();
+    trace.count++;
+}
+
+
+void
+SeExprTrace::clear()
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    const std::vector<ThreadTrace*>& threads = r.threads.all();
+    for (size_t i = 0; i < threads.size(); i++) threads[i]->count = 0;
+}
+
+
+void
+SeExprTrace::writeJson(std::ostream& out)
+{
+    Registry& r = registry();
+    SeExprInternal::AutoMutex locker(r.mutex);
+    int pid = processId();
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    bool first = true;
+    char buf[64];
+    const std::vector<ThreadTrace*>& threads = r.threads.all();
+    for (size_t t = 0; t < threads.size(); t++) {
+	const ThreadTrace& trace = *threads[t];
+	uint64_t count = trace.count;
+	uint64_t begin = count > uint64_t(ringSize) ? count - ringSize : 0;
+	for (uint64_t i = begin; i < count; i++) {
+	    const Event& event = trace.events[i % ringSize];
+	    out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name
+		<< "\", \"cat\": \"SeExpr\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << event.tid;
+	    // timestamps are in microseconds
+	    snprintf(buf, sizeof(buf), ", \"ts\": %.3f, \"dur\": %.3f",
+		     event.start * 1e-3, event.duration * 1e-3);
+	    out << buf;
+	    if (event.detail[0]) {
+		out << ", \"args\": {\"detail\": ";
+		writeString(out, event.detail);
+		out << '}';
+	    }
+	    out << '}';
+	    first = false;
+	}
+    }
+    out << "\n]}\n";
+}
+
+
+std::string
+SeExprTrace::json()
+{
+    std::ostringstream out;
+    writeJson(out);
+    return out.str();
+}
@@ -0,0 +1,97 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#ifndef SeExprTrace_h
+#define SeExprTrace_h
+
+#include <string>
+#include <iosfwd>
+#include <stdint.h>
+
+//! Timeline of what the library does, for Chrome's trace viewer or Perfetto.
+/** Tracing records a complete event for each scope the library marks:
+    parsing, prepping and batch evaluation of expressions, funcx preps,
+    loading builtins and plugins, graph evaluation and baking tiles.
+    (Single point evaluate() calls are left out, they would flood the
+    timeline.)  Each thread records into its own ring buffer of the most
+    recent events, without locking; a thread that exits leaves its
+    buffer, events and all, to the next thread to start tracing.  writeJson() writes them in the
+    Chrome trace event format, with the process and thread ids and the
+    monotonic clock a host's own traces use on the same machine.
+
+    Tracing is off by default, and then a scope costs one test of a
+    flag.  It is turned on with setEnabled(true), or by loading the
+    library with $SE_EXPR_TRACE set to a file name, which the trace is
+    written to when the process exits. */
+class SeExprTrace
+{
+public:
+    static void setEnabled(bool enabled) { _enabled = enabled; }
+    static bool enabled() { return _enabled; }
+
+    //! Records an event from its construction to its destruction, if
+    //! tracing was on when it was made.  name must be a static string;
+    //! detail (such as the expression) is copied, truncated, when the
+    //! scope ends.
+    class Scope {
+    public:
+	Scope(const char* name, const char* detail=0)
+	    : _start(0) { if (_enabled) begin(name, detail); }
+	~Scope() { if (_start) end(); }
+    private:
+	Scope(const Scope&);
+	Scope& operator=(const Scope&);
+	void begin(const char* name, const char* detail);
+	void end();
+
+	const char* _name;
+	const char* _detail;
+	uint64_t _start;
+    };
+
+    //! Drop the events recorded so far
+    static void clear();
+
+    //! Write the events of all threads as a Chrome trace JSON object.
+    //! Best called while the library is idle; events being recorded
+    //! meanwhile may be missed.
+    static void writeJson(std::ostream& out);
+    static std::string json();
+
+private:
+    static bool _enabled;
+};
+
+#endif
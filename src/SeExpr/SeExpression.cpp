@@ -38,31 +38,43 @@
 #include <stack>
 #include <algorithm>
 #include <sstream>
+#include <cstring>
 #endif
 
 #include "SeExprNode.h"
 #include "SeExprParser.h"
 #include "SeExprFunc.h"
 #include "SeExpression.h"
+#include "SeExprCapture.h"
+#include "SeExprStats.h"
+#include "SeExprTrace.h"
 
 using namespace std;
 
 SeExpression::SeExpression()
-    : _wantVec(true), _parseTree(0), _parsed(0), _prepped(0)
+    : _wantVec(true), _hasMathAccuracy(false), _mathAccuracy(SeExprMath::exact),
+      _parseTree(0), _parsed(0), _prepped(0),
+      _batchBase(0), _batchLane(-1), _batchPoints(0), _prevTree(0), _statsId(-1),
+      _capture(0)
 {
     SeExprFunc::init();
+    SeExprMemory::addLive(this);
 }
 
 
 SeExpression::SeExpression( const std::string &e, bool wantVec )
-    : _wantVec(wantVec),  _expression(e), _parseTree(0),
-      _parsed(0), _prepped(0)
+    : _wantVec(wantVec), _hasMathAccuracy(false), _mathAccuracy(SeExprMath::exact),
+      _expression(e), _parseTree(0),
+      _parsed(0), _prepped(0), _batchBase(0), _batchLane(-1), _batchPoints(0), _prevTree(0),
+      _statsId(-1), _capture(0)
 {
     SeExprFunc::init();
+    SeExprMemory::addLive(this);
 }
 
 SeExpression::~SeExpression()
 {
+    SeExprMemory::removeLive(this);
     reset();
 }
 
@@ -80,18 +92,166 @@ void SeExpression::reset()
     for(size_t i=0;i<_stringTokens.size();i++) free(_stringTokens[i]);
     _stringTokens.clear();
     _threadUnsafeFunctionCalls.clear();
+    delete _prevTree;
+    _prevTree = 0;
+    _prevCalls.clear();
+    _statsId = -1;
 }
 
 void SeExpression::setWantVec(bool wantVec)
 {
     reset();
     _wantVec = wantVec;
+    if (_capture) _capture->setExpression(_expression, _wantVec);
 }
 
+void SeExpression::setMathAccuracy(SeExprMath::Accuracy accuracy)
+{
+    reset();
+    _hasMathAccuracy = true;
+    _mathAccuracy = accuracy;
+}
+
+void SeExpression::setCapture(SeExprCapture* capture)
+{
+    _capture = capture;
+    if (capture) capture->setExpression(_expression, _wantVec);
+}
+
+namespace {
+    /// Record an evaluation of points (zero for one evaluate()) in
+    /// SeExprStats, giving the expression an id the first time
+    void recordEval(const SeExpression& expr, int& statsId, size_t points, SeExprStats::Sample& sample)
+    {
+	SeExprStats::end(sample);
+	if (points) {
+	    SeExprStats::count(SeExprStats::batchEvals);
+	    SeExprStats::count(SeExprStats::batchPoints, points);
+	} else SeExprStats::count(SeExprStats::evals);
+	if (!expr.isThreadSafe()) SeExprStats::count(SeExprStats::unsafeEvals);
+	SeExprStats::record(SeExprStats::evalTime, sample.nanos);
+	// -2 once the expression couldn't be given an id
+	if (statsId == -1) {
+	    int id = SeExprStats::exprId(expr.getExpr());
+	    statsId = id < 0 ? -2 : id;
+	}
+	SeExprStats::exprEval(statsId, points ? points : 1, sample);
+    }
+
+    /// Source text of a node, or empty if its position is out of range
+    std::string nodeText(const SeExprNode* node, const std::string& expr)
+    {
+	int start = node->startPos(), end = node->endPos();
+	if (start < 0 || end <= start || size_t(end) > expr.size()) return std::string();
+	return expr.substr(start, end - start);
+    }
+
+    inline size_t hashMix(size_t h, size_t x) { return (h ^ x) * 1000003; }
+
+    size_t hashString(size_t h, const char* str)
+    {
+	for (; *str; str++) h = hashMix(h, (unsigned char)*str);
+	return h;
+    }
+
+    /// Hash of the structure of a subtree: its shape and the names and
+    /// values it holds.  Function calls are added to calls with their
+    /// hash (only those with prep data if withDataOnly).  Operators
+    /// aren't told apart, the source text compared alongside the hash
+    /// does that.
+    size_t hashSubtree(const SeExprNode* node, bool withDataOnly,
+		       std::vector<std::pair<size_t, SeExprFuncNode*> >& calls)
+    {
+	size_t h = hashMix(0x5e, node->numChildren());
+	if (const SeExprFuncNode* f = dynamic_cast<const SeExprFuncNode*>(node))
+	    h = hashString(h, f->name());
+	else if (const SeExprVarNode* v = dynamic_cast<const SeExprVarNode*>(node))
+	    h = hashString(h, v->name());
+	else if (const SeExprStrNode* str = dynamic_cast<const SeExprStrNode*>(node))
+	    h = hashString(h, str->str());
+	else if (const SeExprNumNode* num = dynamic_cast<const SeExprNumNode*>(node)) {
+	    double val = num->value();
+	    unsigned char bytes[sizeof(double)];
+	    memcpy(bytes, &val, sizeof(double));
+	    for (size_t i = 0; i < sizeof(double); i++) h = hashMix(h, bytes[i]);
+	}
+	for (int i = 0; i < node->numChildren(); i++)
+	    h = hashMix(h, hashSubtree(node->child(i), withDataOnly, calls));
+
+	const SeExprFuncNode* f = dynamic_cast<const SeExprFuncNode*>(node);
+	if (f && (!withDataOnly || f->getData()))
+	    calls.push_back(std::make_pair(h, const_cast<SeExprFuncNode*>(f)));
+	return h;
+    }
+
+    /// Sum the memo lookups and hits of the calls in a subtree
+    void addMemoStats(const SeExprNode* node, size_t& lookups, size_t& hits)
+    {
+	if (const SeExprFuncNode* f = dynamic_cast<const SeExprFuncNode*>(node)) {
+	    lookups += f->memoLookups();
+	    hits += f->memoHits();
+	}
+	for (int i = 0; i < node->numChildren(); i++)
+	    addMemoStats(node->child(i), lookups, hits);
+    }
+
+    /// Estimated bytes of a node of a std::set or std::map besides its value
+    const size_t treeNodeBytes = 4 * sizeof(void*);
+
+    size_t stringSetBytes(const std::set<std::string>& strings)
+    {
+	size_t bytes = 0;
+	for (std::set<std::string>::const_iterator i = strings.begin(); i != strings.end(); ++i)
+	    bytes += treeNodeBytes + sizeof(*i) + SeExprMemory::stringBytes(*i);
+	return bytes;
+    }
+}
+
+
 void SeExpression::setExpr(const std::string& e)
 {
+    // keep the prepped tree until the next prep, so calls the edit
+    // leaves unchanged can take their prep data from it
+    SeExprNode* prevTree = 0;
+    PrevCallMap prevCalls;
+    if (_prepped && _parseTree) {
+	std::vector<std::pair<size_t, SeExprFuncNode*> > calls;
+	hashSubtree(_parseTree, true, calls);
+	for (size_t i = 0; i < calls.size(); i++)
+	    prevCalls.insert(std::make_pair(calls[i].first,
+		std::make_pair(nodeText(calls[i].second, _expression), calls[i].second)));
+	prevTree = _parseTree;
+	_parseTree = 0;
+    }
+
     reset();
     _expression = e;
+    _prevTree = prevTree;
+    _prevCalls.swap(prevCalls);
+    if (_capture) _capture->setExpression(_expression, _wantVec);
+}
+
+
+void SeExpression::matchPrevCalls(std::vector<SeExprFuncNode*>& matched) const
+{
+    if (_prevCalls.empty()) return;
+    std::vector<std::pair<size_t, SeExprFuncNode*> > calls;
+    hashSubtree(_parseTree, false, calls);
+    for (size_t i = 0; i < calls.size(); i++) {
+	std::string text;
+	std::pair<PrevCallMap::iterator, PrevCallMap::iterator> range =
+	    _prevCalls.equal_range(calls[i].first);
+	for (PrevCallMap::iterator it = range.first; it != range.second; ++it) {
+	    if (text.empty()) text = nodeText(calls[i].second, _expression);
+	    if (text.empty() || it->second.first != text) continue;
+	    calls[i].second->_prevCall = it->second.second;
+	    matched.push_back(calls[i].second);
+	    _prevCalls.erase(it);
+	    break;
+	}
+    }
+    if (SeExprStats::enabled())
+	SeExprStats::cache(SeExprStats::prepReuseCache, calls.size(), matched.size());
 }
 
 bool SeExpression::syntaxOK() const
@@ -129,12 +289,18 @@ SeExpression::parse() const
 {
     if (_parsed) return;
     _parsed = true;
+    SeExprTrace::Scope trace("parse", _expression.c_str());
+    SeExprStats::Timer timer(SeExprStats::parseTime);
     int tempStartPos,tempEndPos;
     SeExprParse(_parseTree, _parseError, tempStartPos, tempEndPos, 
         this, _expression.c_str(), &_stringTokens);
     if(!_parseTree){
         addError(_parseError,tempStartPos,tempEndPos);
     }
+    if (SeExprStats::enabled()) {
+	SeExprStats::count(SeExprStats::parses);
+	if (!_parseTree) SeExprStats::count(SeExprStats::parseErrors);
+    }
 }
 
 void
@@ -142,8 +308,31 @@ SeExpression::prep() const
 {
     if (_prepped) return;
     _prepped = true;
+    SeExprTrace::Scope trace("prep", _expression.c_str());
     parseIfNeeded();
-    if (_parseTree && !_parseTree->prep(wantVec())) {
+    if (!_parseTree) return;
+    SeExprStats::Timer timer(SeExprStats::prepTime);
+
+    // offer unchanged calls the prep data from before the last edit,
+    // and drop what they didn't take
+    std::vector<SeExprFuncNode*> matched;
+    matchPrevCalls(matched);
+    bool ok = _parseTree->prep(wantVec());
+    for (size_t i = 0; i < matched.size(); i++) matched[i]->_prevCall = 0;
+    delete _prevTree;
+    _prevTree = 0;
+    _prevCalls.clear();
+
+    if (SeExprStats::enabled()) {
+	SeExprStats::count(SeExprStats::preps);
+	if (!ok) SeExprStats::count(SeExprStats::prepErrors);
+    }
+
+    if (ok) {
+        // swap in nodes specialized for the types found by prep
+        _parseTree = _parseTree->specialize();
+    }
+    else {
         // build line lookup table
         std::vector<int> lines;
         const char* start=_expression.c_str();
@@ -181,6 +370,10 @@ SeExpression::evaluate() const
 {
     prepIfNeeded();
     if (_parseTree) {
+	SeExprStats::Sample sample;
+	bool stats = SeExprStats::enabled();
+	if (stats) SeExprStats::begin(sample);
+
 	// set all local vars to zero
 	for (LocalVarTable::iterator iter = _localVars.begin();
 	     iter != _localVars.end(); iter++)
@@ -190,7 +383,141 @@ SeExpression::evaluate() const
 	_parseTree->eval(vec);
 	if (_wantVec && !isVec())
 	    vec[1] = vec[2] = vec[0];
+	if (stats) recordEval(*this, _statsId, 0, sample);
+	if (_capture) _capture->endEvals(1, &vec);
 	return vec;
     }
     else return SeVec3d(0,0,0);
 }
+
+
+void
+SeExpression::evaluateBatch(int n, SeVec3d* results) const
+{
+    evaluateLanes(n, 0, results);
+}
+
+
+void
+SeExpression::evaluatePoints(int n, const int* points, SeVec3d* results) const
+{
+    evaluateLanes(n, points, results);
+}
+
+
+void
+SeExpression::evaluateLanes(int n, const int* points, SeVec3d* results) const
+{
+    prepIfNeeded();
+    if (!_parseTree) {
+	for (int i = 0; i < n; i++) results[i] = SeVec3d(0,0,0);
+	return;
+    }
+    SeExprTrace::Scope trace(points ? "evaluatePoints" : "evaluateBatch", _expression.c_str());
+    SeExprStats::Sample sample;
+    bool stats = SeExprStats::enabled();
+    if (stats) SeExprStats::begin(sample);
+
+    int active[SeExprBatch::maxSize];
+    for (int i = 0; i < SeExprBatch::maxSize; i++) active[i] = i;
+
+    for (int base = 0; base < n; base += SeExprBatch::maxSize) {
+	int size = std::min(n - base, int(SeExprBatch::maxSize));
+
+	// set all local vars to zero
+	for (LocalVarTable::iterator iter = _localVars.begin();
+	     iter != _localVars.end(); iter++) {
+	    iter->second.val = 0.0;
+	    iter->second.lanes.assign(size, SeVec3d(0.0));
+	}
+
+	SeExprBatch batch = { size, active };
+	SeVec3d* vec = results + base;
+	_batchBase = base;
+	_batchPoints = points;
+	_parseTree->evalBatch(batch, vec);
+	if (_wantVec && !isVec())
+	    for (int i = 0; i < size; i++) vec[i][1] = vec[i][2] = vec[i][0];
+	if (_capture) _capture->endEvals(size, vec);
+    }
+    _batchBase = 0;
+    _batchLane = -1;
+    _batchPoints = 0;
+    if (stats && n > 0) recordEval(*this, _statsId, n, sample);
+}
+
+
+SeExprCost
+SeExpression::estimateCost() const
+{
+    prepIfNeeded();
+    return _parseTree ? _parseTree->estimateCost() : SeExprCost();
+}
+
+
+void
+SeExpression::memoStats(size_t& lookups, size_t& hits) const
+{
+    lookups = hits = 0;
+    if (_prepped && _parseTree) addMemoStats(_parseTree, lookups, hits);
+}
+
+
+size_t
+SeExpression::memoryUsage() const
+{
+    SeExprMemory usage;
+    return memoryUsage(usage);
+}
+
+
+size_t
+SeExpression::memoryUsage(SeExprMemory& usage) const
+{
+    size_t start = usage.bytes;
+    usage.expressions++;
+    usage.add(usage.parts, "SeExpression", sizeof(SeExpression));
+    usage.add(usage.parts, "text",
+	SeExprMemory::stringBytes(_expression) + SeExprMemory::stringBytes(_parseError));
+
+    size_t errors = _errors.capacity() * sizeof(Error);
+    for (size_t i = 0; i < _errors.size(); i++)
+	errors += SeExprMemory::stringBytes(_errors[i].error);
+    usage.add(usage.parts, "errors", errors);
+
+    usage.add(usage.parts, "variables", stringSetBytes(_vars));
+    usage.add(usage.parts, "functions", stringSetBytes(_funcs));
+
+    size_t locals = 0;
+    for (LocalVarTable::const_iterator i = _localVars.begin(); i != _localVars.end(); ++i)
+	locals += treeNodeBytes + sizeof(*i) + SeExprMemory::stringBytes(i->first)
+	    + i->second.lanes.capacity() * sizeof(SeVec3d);
+    usage.add(usage.parts, "localVariables", locals);
+
+    size_t tokens = _stringTokens.capacity() * sizeof(char*);
+    for (size_t i = 0; i < _stringTokens.size(); i++)
+	tokens += strlen(_stringTokens[i]) + 1;
+    usage.add(usage.parts, "stringTokens", tokens);
+
+    size_t unsafe = _threadUnsafeFunctionCalls.capacity() * sizeof(std::string);
+    for (size_t i = 0; i < _threadUnsafeFunctionCalls.size(); i++)
+	unsafe += SeExprMemory::stringBytes(_threadUnsafeFunctionCalls[i]);
+    usage.add(usage.parts, "threadUnsafeCalls", unsafe);
+
+    size_t prevCalls = 0;
+    for (PrevCallMap::const_iterator i = _prevCalls.begin(); i != _prevCalls.end(); ++i)
+	prevCalls += treeNodeBytes + sizeof(*i) + SeExprMemory::stringBytes(i->second.first);
+    usage.add(usage.parts, "previousCalls", prevCalls);
+
+    if (_parseTree) _parseTree->memoryUsage(usage);
+    if (_prevTree) _prevTree->memoryUsage(usage);
+    return usage.bytes - start;
+}
+
+
+void
+SeExprLocalVarRef::eval(const SeExprVarNode* node, SeVec3d& result)
+{
+    int lane = node ? node->expr()->batchLane() : -1;
+    result = lane < 0 ? val : lanes[lane];
+}
@@ -39,13 +39,20 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <stdint.h>
 #include "SeVec3d.h"
+#include "SeExprCost.h"
+#include "SeExprMath.h"
 
 class SeExprNode;
 class SeExprVarNode;
+class SeExprFuncNode;
 class SeExprLocalVarRef;
 class SeExprFunc;
 class SeExpression;
+class SeExprCapture;
+class SeExprGrid;
+class SeExprMemory;
 
 //! abstract class for implementing variable references
 class SeExprVarRef
@@ -76,15 +83,82 @@ class SeExprScalarVarRef : public SeExprVarRef
     virtual bool isVec() { return 0; }
 };
 
+/// variable reference that reads its value straight from host memory.
+/** The host supplies a float or double pointer, whether the value is a
+    scalar or a vector, and optionally a byte stride and element index.
+    The value read is at ptr + index*stride, so a whole array of points can
+    be walked by calling setIndex() between evaluations.  The stride
+    defaults to tightly packed elements.  Variable nodes load these
+    directly instead of going through the virtual eval() call. */
+class SeExprPtrVarRef : public SeExprVarRef
+{
+ public:
+    SeExprPtrVarRef()
+        : _ptr(0), _stride(0), _index(0), _isVec(false), _isDouble(true) {}
+    SeExprPtrVarRef(const double* ptr, bool isVec=false, int stride=0)
+        : _index(0) { setPtr(ptr, isVec, stride); }
+    SeExprPtrVarRef(const float* ptr, bool isVec=false, int stride=0)
+        : _index(0) { setPtr(ptr, isVec, stride); }
+
+    //! bind to doubles, stride is in bytes (0 means tightly packed)
+    void setPtr(const double* ptr, bool isVec=false, int stride=0)
+    {
+        _ptr = (const char*)ptr; _isVec = isVec; _isDouble = true;
+        _stride = stride ? stride : sizeof(double) * (isVec ? 3 : 1);
+    }
+
+    //! bind to floats, stride is in bytes (0 means tightly packed)
+    void setPtr(const float* ptr, bool isVec=false, int stride=0)
+    {
+        _ptr = (const char*)ptr; _isVec = isVec; _isDouble = false;
+        _stride = stride ? stride : sizeof(float) * (isVec ? 3 : 1);
+    }
+
+    //! select the element subsequent evaluations read
+    void setIndex(size_t index) { _index = index; }
+    size_t index() const { return _index; }
+
+    const void* ptr() const { return _ptr; }
+    int stride() const { return _stride; }
+    bool isDouble() const { return _isDouble; }
+
+    virtual bool isVec() { return _isVec; }
+    virtual void eval(const SeExprVarNode*, SeVec3d& result) { load(result); }
+
+    //! read the current element, or the one offset elements past it
+    //! (non-virtual, used directly by the evaluator)
+    void load(SeVec3d& result, size_t offset=0) const
+    {
+        const char* p = _ptr + (_index + offset) * _stride;
+        if (_isDouble) {
+            const double* d = (const double*)p;
+            result[0] = d[0];
+            if (_isVec) { result[1] = d[1]; result[2] = d[2]; }
+        } else {
+            const float* f = (const float*)p;
+            result[0] = f[0];
+            if (_isVec) { result[1] = f[1]; result[2] = f[2]; }
+        }
+    }
+
+ private:
+    const char* _ptr;
+    int _stride;
+    size_t _index;
+    bool _isVec;
+    bool _isDouble;
+};
+
 /// uses internally to represent local variables
 class SeExprLocalVarRef : public SeExprVarRef
 {
  public:
     SeVec3d val;
+    //! per-lane values while the expression evaluates a batch
+    std::vector<SeVec3d> lanes;
     SeExprLocalVarRef() : _isVec(false) {}
     void setIsVec() { _isVec = true; }
-    virtual void eval(const SeExprVarNode*, SeVec3d& result) 
-    { result = val; }
+    virtual void eval(const SeExprVarNode* node, SeVec3d& result);
     virtual bool isVec() { return _isVec; }
  private:
     bool _isVec;
@@ -123,8 +197,29 @@ class SeExpression
         only a scalar is desired. */
     void setWantVec(bool wantVec);
 
+    /** Sets the accuracy of the math functions (see SeExprMath) called
+        by this expression, instead of the global SeExprMath::accuracy().
+        This forces a reparse. */
+    void setMathAccuracy(SeExprMath::Accuracy accuracy);
+
+    /** Accuracy of the math functions called by this expression */
+    SeExprMath::Accuracy mathAccuracy() const
+    { return _hasMathAccuracy ? _mathAccuracy : SeExprMath::accuracy(); }
+
+    /** Record the points the expression evaluates, and the results, in
+        a capture (see SeExprCapture), or stop recording if capture is
+        null.  The host's resolveVar() wraps the variables captured. */
+    void setCapture(SeExprCapture* capture);
+
+    /** Capture the expression records its evaluations in, if any */
+    SeExprCapture* capture() const { return _capture; }
+
     /** Set expression string to e.  
-        This invalidates all parsed state. */
+        This invalidates all parsed state: the new expression is parsed
+        and prepped in full on its next use, unchanged parts included.
+        Only the prep data of funcx calls left unchanged by the edit
+        (such as baked curves and choice tables) is carried over, for
+        functions that take it with SeExprFuncNode::takePrevData(). */
     void setExpr(const std::string& e);
 
     //! Get the string that this expression is currently set to evaluate
@@ -186,6 +281,52 @@ class SeExpression
     /** Evaluate the expression.  This will parse and bind if needed */
     SeVec3d evaluate() const;
 
+    /** Evaluate the expression at n points, storing them in results.
+        Point i reads the element i past the current index of every
+        SeExprPtrVarRef variable; other variables are evaluated as they
+        are by evaluate().  Conditionals, if/else blocks and the logical
+        operators only evaluate a branch for the points that take it,
+        and skip it entirely when no point does.  This will parse and
+        bind if needed */
+    void evaluateBatch(int n, SeVec3d* results) const;
+
+    /** Like evaluateBatch(), but result i is for the point points[i]
+        elements past the current index of each SeExprPtrVarRef. */
+    void evaluatePoints(int n, const int* points, SeVec3d* results) const;
+
+    /** Evaluate the expression over a grid of points, where it is
+        smooth enough evaluating only some of them and interpolating the
+        rest.  Point (i,j,k) is element i+nx*(j+ny*k) past the current
+        index of each SeExprPtrVarRef, and its result goes to the same
+        element of results.  Cells of the grid are refined where the
+        expression differs from an interpolation of the cell's corners
+        by more than the grid's tolerance at the corners of its
+        subcells.  Returns the number of points evaluated.  This will
+        parse and bind if needed */
+    int evaluateGrid(const SeExprGrid& grid, SeVec3d* results) const;
+
+    /** Static estimate of the floating point work and memory traffic of
+        one evaluate(), from the cost registered with each function.
+        Branches count as their more expensive side.  Useful for sizing
+        batches and deciding what to cache.  This will parse and bind if
+        needed; an invalid expression has no cost. */
+    SeExprCost estimateCost() const;
+
+    /** Times the calls of pure functions (see SeExprFuncX) looked for
+        their arguments among their recent calls, and found them, since
+        the expression was prepped.  A call stops looking when it finds
+        too few to be worth it. */
+    void memoStats(size_t& lookups, size_t& hits) const;
+
+    /** Bytes held by the expression: the object, its text and tables,
+        its parse trees and the prep data of its function calls.  This
+        doesn't parse or prep; see SeExprMemory for how it counts. */
+    size_t memoryUsage() const;
+
+    /** Add the expression to a breakdown of memory by part, node type
+        and funcx data type, and return its bytes. */
+    size_t memoryUsage(SeExprMemory& usage) const;
+
     /** Reset expr - force reparse/rebind */
     void reset();
 
@@ -220,9 +361,21 @@ class SeExpression
     /** Prepare, but only if not yet prepped */
     void prepIfNeeded() const { if (!_prepped) prep(); }
 
+    /** Evaluate n points, the elements listed in points or else the
+        elements 0 to n-1 */
+    void evaluateLanes(int n, const int* points, SeVec3d* results) const;
+
+    /** Point the calls in the parse tree at the same calls in the
+        previous tree, returning the calls matched */
+    void matchPrevCalls(std::vector<SeExprFuncNode*>& matched) const;
+
     /** True if the expression wants a vector */
     bool _wantVec;
 
+    /** Accuracy of math functions, if set for this expression */
+    bool _hasMathAccuracy;
+    SeExprMath::Accuracy _mathAccuracy;
+
     /** The expression. */
     std::string _expression;
     
@@ -253,6 +406,36 @@ class SeExpression
     /** String tokens allocated by lex */
     mutable std::vector<char*> _stringTokens;
 
+    /** First point of the batch being evaluated, and the lane within it
+        (-1 outside of evaluateBatch) */
+    mutable size_t _batchBase;
+    mutable int _batchLane;
+    /** Elements the points of the batch read, if not consecutive */
+    mutable const int* _batchPoints;
+
+    /** Parse tree from before the last setExpr, kept until the next prep
+        so unchanged calls can take their prep data from it */
+    mutable SeExprNode* _prevTree;
+
+    /** Calls in the previous tree that have prep data, by structural
+        hash, with their source text */
+    typedef std::multimap<size_t, std::pair<std::string, SeExprFuncNode*> > PrevCallMap;
+    mutable PrevCallMap _prevCalls;
+
+    /** Id of the expression in SeExprStats, once evaluated with
+        statistics on (-1 before, -2 if there were too many to track) */
+    mutable int _statsId;
+
+    /** Capture evaluations are recorded in, if any */
+    SeExprCapture* _capture;
+
+    /** Neighbours in SeExprMemory's lists of expressions alive, and
+        which list */
+    friend class SeExprMemory;
+    SeExpression* _livePrev;
+    SeExpression* _liveNext;
+    int _liveList;
+
     /* internal */ public:
 
     //! add local variable (this is for internal use)
@@ -273,6 +456,22 @@ class SeExpression
     SeExprLocalVarRef* getLocalVar(const char* n) const {
 	return &_localVars[n]; 
     }
+
+    //! first point of the batch being evaluated (this is for internal use)
+    size_t batchBase() const { return _batchBase; }
+
+    //! lane being evaluated one at a time, -1 if not in a batch (this is for internal use)
+    int batchLane() const { return _batchLane; }
+
+    //! element offset of a lane of the batch being evaluated (this is for internal use)
+    size_t batchPoint(int lane) const
+    { return _batchPoints ? _batchPoints[_batchBase + lane] : _batchBase + lane; }
+
+    //! element offset of the point being evaluated (this is for internal use)
+    size_t batchOffset() const { return _batchLane < 0 ? 0 : batchPoint(_batchLane); }
+
+    //! select the lane evaluated by eval() within a batch (this is for internal use)
+    void setBatchLane(int lane) const { _batchLane = lane; }
 };
 
 #endif
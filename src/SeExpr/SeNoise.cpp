@@ -34,6 +34,7 @@
 */
 
 #include <iostream>
+#include <algorithm>
 #include "SeExprBuiltins.h"
 namespace{
 #include "SeNoiseTables.h"
@@ -64,33 +65,52 @@ template<int d> unsigned char hashReduceChar(int index[d])
     return (((seed&0xff0000) >> 4)+(seed&0xff))&0xff;
 }
 
-//! Does a hash reduce to an integer
-template<int d> uint32_t hashReduce(uint32_t index[d])
+//! Blends one index into a hash seed (constants from Numerical Recipes, attrib. from Knuth)
+inline uint32_t hashBlend(uint32_t seed,uint32_t index)
+{
+    static const uint32_t M = 1664525, C = 1013904223;
+    return seed*M+index+C;
+}
+
+//! Tempers a hash seed (from Matsumoto)
+inline uint32_t hashTemper(uint32_t seed)
+{
+    seed ^= (seed >> 11);
+    seed ^= (seed << 7) & 0x9d2c5680U;
+    seed ^= (seed << 15) & 0xefc60000U;
+    seed ^= (seed >> 18);
+    return seed;
+}
+
+//! Computes one byte of a tempered seed by mixing its third and first bytes
+inline int hashReduceByte(uint32_t seed)
+{
+    return (((seed&0xff0000) >> 4)+(seed&0xff))&0xff;
+}
+
+//! Permutes the bytes of a tempered seed (shares perlin noise permutation table)
+inline uint32_t hashPermute(uint32_t seed)
 {
     union {
         uint32_t i;
         unsigned char c[4];
     } u1, u2;
-    // blend with seed (constants from Numerical Recipes, attrib. from Knuth)
-    u1.i=0;
-    for(int k=0;k<d;k++){
-        static const uint32_t M = 1664525, C = 1013904223;
-        u1.i=u1.i*M+index[k]+C;
-    }
-    // tempering (from Matsumoto)
-    u1.i ^= (u1.i >> 11);
-    u1.i ^= (u1.i << 7) & 0x9d2c5680U;
-    u1.i ^= (u1.i << 15) & 0xefc60000U;
-    u1.i ^= (u1.i >> 18);
-    // permute bytes (shares perlin noise permutation table)
+    u1.i=seed;
     u2.c[3] = p[u1.c[0]];
     u2.c[2] = p[u1.c[1]+u2.c[3]];
     u2.c[1] = p[u1.c[2]+u2.c[2]];
     u2.c[0] = p[u1.c[3]+u2.c[1]];
-    
     return u2.i;
 }
 
+//! Does a hash reduce to an integer
+template<int d> uint32_t hashReduce(uint32_t index[d])
+{
+    uint32_t seed=0;
+    for(int k=0;k<d;k++) seed=hashBlend(seed,index[k]);
+    return hashPermute(hashTemper(seed));
+}
+
 //! Computes cellular noise (non-interpolated piecewise constant cell random values)
 template<int d_in,int d_out,class T>
 void CellNoise(const T* in,T* out)
@@ -105,6 +125,38 @@ void CellNoise(const T* in,T* out)
     }
 }
 
+//! Computes cellular noise for n points at once, bit-identical to CellNoise.
+/** Points are processed in blocks and transposed so that the blend and
+    temper stages run as independent integer ops across the block (which
+    the compiler can vectorize), leaving only the table lookups of the
+    permutation per point. */
+template<int d_in,int d_out,class T>
+void CellNoiseBatch(int n,const T* in,T* out)
+{
+    const int block=64;
+    uint32_t index[d_in][block];
+    uint32_t seeds[block];
+    for(int start=0;start<n;start+=block){
+        int count=std::min(block,n-start);
+        const T* blockIn=in+start*d_in;
+        T* blockOut=out+start*d_out;
+        for(int k=0;k<d_in;k++)
+            for(int i=0;i<count;i++) index[k][i]=uint32_t(floor(blockIn[i*d_in+k]));
+        int dim=0;
+        while(1){
+            for(int i=0;i<count;i++) seeds[i]=0;
+            for(int k=0;k<d_in;k++)
+                for(int i=0;i<count;i++) seeds[i]=hashBlend(seeds[i],index[k][i]);
+            for(int i=0;i<count;i++) seeds[i]=hashTemper(seeds[i]);
+            for(int i=0;i<count;i++)
+                blockOut[i*d_out+dim]=hashPermute(seeds[i]) * (1.0/0xffffffffu);
+            if(++dim>=d_out) break;
+            for(int k=0;k<d_in;k++)
+                for(int i=0;i<count;i++) index[k][i]+=1000;
+        }
+    }
+}
+
 //! Noise with d_in dimensional domain, 1 dimensional abcissa
 template<int d,class T,bool periodic>
 T noiseHelper(const T* X,const int* period=0)
@@ -161,18 +213,146 @@ T noiseHelper(const T* X,const int* period=0)
     return vals[0];
 }
 
-//! Noise with d_in dimensional domain, d_out dimensional abcissa
-template<int d_in,int d_out,class T> void Noise(const T* in,T* out)
+//! Noise with d dimensional domain, d_out dimensional abcissa, computed together
+/** Channel c is the noise of the lattice shifted by 1000*c along the
+    first d_out axes.  The lattice cell, weights and interpolants are
+    found once for all channels (shifting the lattice indices rather than
+    the input, which would round it).  The blend stage of the hash is
+    linear in the indices, so each corner is blended once and a channel's
+    seed is that plus a constant; only tempering and the gradients are
+    done per channel. */
+template<int d,int d_out,class T>
+void noiseChannels(const T* X,T* out)
 {
-    T P[d_in];
-    for(int i=0;i<d_in;i++) P[i]=in[i];
+    // find lattice index
+    T weights[2][d]; // lower and upper weights
+    int index[d];
+    for(int k=0;k<d;k++){
+        T f=floor(X[k]);
+        index[k]=(int)f;
+        weights[0][k]=X[k]-f;
+        weights[1][k]=weights[0][k]-1; // dist to cell with index one above
+    }
+    // the blended seed added by each channel's shift of the lattice
+    uint32_t shift=0;
+    for(int k=0;k<d;k++) shift=shift*1664525+(k<d_out ? 1000 : 0);
 
-    int i=0;
-    while(1){
-        out[i]=noiseHelper<d_in,T,false>(P);
-        if(++i>=d_out) break;
-        for(int k=0;k<d_out;k++) P[k]+=(T)1000;
+    // compute function values propagated from zero from each node
+    const int num=1<<d;
+    T vals[d_out][num];
+    for(int dummy=0;dummy<num;dummy++){
+        int offset[d];
+        uint32_t seed=0;
+        for(int k=0;k<d;k++){
+            offset[k]=((dummy&(1<<k))!=0);
+            seed=hashBlend(seed,index[k]+offset[k]);
+        }
+        for(int c=0;c<d_out;c++){
+            // hash to get representative gradient vector
+            int lookup=hashReduceByte(hashTemper(seed+c*shift));
+            T val=0;
+            for(int k=0;k<d;k++){
+                double grad=NOISE_TABLES<d>::g[lookup][k];
+                double weight=weights[offset[k]][k];
+                val+=grad*weight;
+            }
+            vals[c][dummy]=val;
+        }
+    }
+    // compute linear interpolation coefficients
+    T alphas[d];
+    for(int k=0;k<d;k++) alphas[k]=s_curve(weights[0][k]);
+    // perform multilinear interpolation of each channel
+    for(int c=0;c<d_out;c++){
+        for(int newd=d-1;newd>=0;newd--){
+            int newnum=1<<newd;
+            for(int dummy=0;dummy<newnum;dummy++){
+                int index=dummy*(1<<(d-newd));
+                int k=(d-newd-1);
+                int otherIndex=index+(1<<k);
+                T alpha=alphas[k];
+                vals[c][index]=(1-alpha)*vals[c][index]+alpha*vals[c][otherIndex];
+            }
+        }
+        out[c]=vals[c][0];
+    }
+}
+
+//! Scales simplex noise of each dimension to the rms amplitude of Noise
+static const double simplexScale[5]={0,30.6,40.4,52.4,72.5};
+
+//! Simplex noise with d dimensional domain, d_out dimensional abcissa
+/** The input is skewed so the lattice cells split into d! simplices; the
+    sample's simplex is found by sorting the coordinates within its cell,
+    and only its d+1 corners contribute (2^d for Noise).  Each corner's
+    gradient is weighted by a radial falloff that reaches zero before the
+    neighboring corners, so the result is C2 continuous.  Gradients are
+    hashed as in noiseChannels, including the per channel shift. */
+template<int d,int d_out,class T>
+void simplexChannels(const T* X,T* out)
+{
+    const T F=(sqrt(T(d+1))-1)/d; // skews input onto the lattice
+    const T G=(1-1/sqrt(T(d+1)))/d; // unskews lattice back to input
+    // find lattice cell of skewed input and the offset within it
+    T skew=0;
+    for(int k=0;k<d;k++) skew+=X[k];
+    skew*=F;
+    int index[d];
+    T unskew=0;
+    for(int k=0;k<d;k++){
+        index[k]=(int)floor(X[k]+skew);
+        unskew+=index[k];
+    }
+    unskew*=G;
+    T x0[d],weights[2][d]; // offsets from the lower and upper lattice points
+    for(int k=0;k<d;k++){
+        x0[k]=X[k]-(index[k]-unskew);
+        weights[0][k]=x0[k];
+        weights[1][k]=x0[k]-1;
+    }
+    // rank axes by decreasing offset; corner j steps the j highest ranked
+    int rank[d];
+    for(int k=0;k<d;k++) rank[k]=0;
+    for(int k=1;k<d;k++)
+        for(int m=0;m<k;m++){
+            int below=x0[k]>x0[m];
+            rank[m]+=below;
+            rank[k]+=1-below;
+        }
+    uint32_t shift=0;
+    for(int k=0;k<d;k++) shift=shift*1664525+(k<d_out ? 1000 : 0);
+
+    T result[d_out];
+    for(int c=0;c<d_out;c++) result[c]=0;
+    T cornerUnskew=0;
+    for(int j=0;j<=d;j++,cornerUnskew+=G){
+        T x[d];
+        T falloff=.5;
+        uint32_t seed=0;
+        for(int k=0;k<d;k++){
+            int offset=rank[k]<j;
+            x[k]=weights[offset][k]+cornerUnskew;
+            falloff-=x[k]*x[k];
+            seed=hashBlend(seed,index[k]+offset);
+        }
+        // corners out of reach are weighted by zero rather than skipped
+        falloff=(falloff+fabs(falloff))*T(.5);
+        falloff*=falloff;
+        falloff*=falloff;
+        for(int c=0;c<d_out;c++){
+            int lookup=hashReduceByte(hashTemper(seed+c*shift));
+            T val=0;
+            for(int k=0;k<d;k++) val+=NOISE_TABLES<d>::g[lookup][k]*x[k];
+            result[c]+=falloff*val;
+        }
     }
+    for(int c=0;c<d_out;c++) out[c]=result[c]*simplexScale[d];
+}
+
+//! Noise with d_in dimensional domain, d_out dimensional abcissa
+template<int d_in,int d_out,class T> void Noise(const T* in,T* out)
+{
+    noiseChannels<d_in,d_out,T>(in,out);
 }
 
 //! Periodic Noise with d_in dimensional domain, d_out dimensional abcissa
@@ -189,10 +369,15 @@ template<int d_in,int d_out,class T> void PNoise(const T* in,const int* period,T
     }
 }
 
-//! Noise with d_in dimensional domain, d_out dimensional abcissa
-//! If turbulence is true then Perlin's turbulence is computed
-template<int d_in,int d_out,bool turbulence,class T>
-void FBM(const T* in,T* out,
+//! Simplex noise with d_in dimensional domain, d_out dimensional abcissa
+template<int d_in,int d_out,class T> void Simplex(const T* in,T* out)
+{
+    simplexChannels<d_in,d_out,T>(in,out);
+}
+
+//! Sums octaves of the given noise (see FBM)
+template<int d_in,int d_out,bool turbulence,class T,void (*noise)(const T*,T*)>
+void fbmHelper(const T* in,T* out,
     int octaves,T lacunarity,T gain)
 {
     T P[d_in];
@@ -203,7 +388,7 @@ void FBM(const T* in,T* out,
     int octave=0;
     while(1){
         T localResult[d_out];
-        Noise<d_in,d_out>(P,localResult);
+        noise(P,localResult);
         if(turbulence)
             for(int k=0;k<d_out;k++) out[k]+=fabs(localResult[k])*scale;
         else
@@ -217,9 +402,28 @@ void FBM(const T* in,T* out,
     }
 }
 
+//! Noise with d_in dimensional domain, d_out dimensional abcissa
+//! If turbulence is true then Perlin's turbulence is computed
+template<int d_in,int d_out,bool turbulence,class T>
+void FBM(const T* in,T* out,
+    int octaves,T lacunarity,T gain)
+{
+    fbmHelper<d_in,d_out,turbulence,T,Noise<d_in,d_out,T> >(in,out,octaves,lacunarity,gain);
+}
+
+//! FBM with octaves of simplex noise
+template<int d_in,int d_out,bool turbulence,class T>
+void SimplexFBM(const T* in,T* out,
+    int octaves,T lacunarity,T gain)
+{
+    fbmHelper<d_in,d_out,turbulence,T,Simplex<d_in,d_out,T> >(in,out,octaves,lacunarity,gain);
+}
+
 // Explicit instantiations
 template void CellNoise<3,1,double>(const double*,double*);
 template void CellNoise<3,3,double>(const double*,double*);
+template void CellNoiseBatch<3,1,double>(int,const double*,double*);
+template void CellNoiseBatch<3,3,double>(int,const double*,double*);
 template void Noise<1,1,double>(const double*,double*);
 template void Noise<2,1,double>(const double*,double*);
 template void Noise<3,1,double>(const double*,double*);
@@ -233,6 +437,16 @@ template void FBM<3,3,false,double>(const double*,double*,int,double,double);
 template void FBM<3,3,true,double>(const double*,double*,int,double,double);
 template void FBM<4,1,false,double>(const double*,double*,int,double,double);
 template void FBM<4,3,false,double>(const double*,double*,int,double,double);
+template void Simplex<1,1,double>(const double*,double*);
+template void Simplex<2,1,double>(const double*,double*);
+template void Simplex<3,1,double>(const double*,double*);
+template void Simplex<4,1,double>(const double*,double*);
+template void Simplex<3,3,double>(const double*,double*);
+template void Simplex<4,3,double>(const double*,double*);
+template void SimplexFBM<3,1,false,double>(const double*,double*,int,double,double);
+template void SimplexFBM<3,3,false,double>(const double*,double*,int,double,double);
+template void SimplexFBM<4,1,false,double>(const double*,double*,int,double,double);
+template void SimplexFBM<4,3,false,double>(const double*,double*,int,double,double);
 
 }
 
@@ -49,9 +49,22 @@ void PNoise(const T* in,const int* period,T* out);
 template<int d_in,int d_out,bool turbulence,class T> 
 void FBM(const T* in,T* out,int octaves,T lacunarity,T gain);
 
+//! One octave of simplex noise, cheaper than Noise in higher dimensions
+//! (d_in+1 lattice corners per sample instead of 2^d_in)
+template<int d_in,int d_out,class T>
+void Simplex(const T* in,T* out);
+
+//! Fractional Brownian Motion of simplex noise
+template<int d_in,int d_out,bool turbulence,class T>
+void SimplexFBM(const T* in,T* out,int octaves,T lacunarity,T gain);
+
 //! Cellular noise with input and output dimensionality
 template<int d_in,int d_out,class T>
 void CellNoise(const T* in,T* out);
 
+//! Cellular noise of n points (in and out hold n consecutive points)
+template<int d_in,int d_out,class T>
+void CellNoiseBatch(int n,const T* in,T* out);
+
 }
 #endif
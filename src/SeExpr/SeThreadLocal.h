@@ -0,0 +1,118 @@
+/* 
+SEEXPR SOFTWARE
+Copyright 2011 Disney Enterprises, Inc.  All rights reserved
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in
+    the documentation and/or other materials provided with the
+    distribution.
+
+  * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+    Studios" or the names of its contributors may NOT be used to
+    endorse or promote products derived from this software without
+    specific prior written permission from Walt Disney Pictures.
+
+Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+#ifndef SeThreadLocal_h
+#define SeThreadLocal_h
+
+#include <vector>
+#include "SeMutex.h"
+
+#ifdef WINDOWS
+#define SE_THREAD_LOCAL __declspec(thread)
+#define SE_MEMORY_BARRIER() MemoryBarrier()
+#else
+#define SE_THREAD_LOCAL __thread
+#define SE_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+/** For internal use only */
+namespace SeExprInternal {
+    /** Blocks of data kept per thread, as many as there are threads using
+	them at once.  A thread attaches to a block on first use and keeps
+	it in a SE_THREAD_LOCAL pointer.  When the thread exits, its block
+	is passed to onDetach and left for the next thread that attaches;
+	blocks are never freed, so they can be read (with the mutex held)
+	after their threads are gone.  Make one per type of block, and leak
+	it, as threads may exit during static destruction.  Threads don't
+	detach on Windows. */
+    template <class T>
+    class ThreadBlocks {
+    public:
+	typedef void (*DetachFn)(T* block);
+
+	ThreadBlocks(Mutex& mutex, DetachFn onDetach = 0)
+	    : _mutex(mutex), _onDetach(onDetach)
+	{
+	    _instance = this;
+#ifndef WINDOWS
+	    pthread_key_create(&_key, detach);
+#endif
+	}
+
+	//! A block for the calling thread: one a thread left, or else a
+	//! new zeroed one
+	T* attach()
+	{
+	    T* block;
+	    {
+		AutoMutex locker(_mutex);
+		if (!_unused.empty()) {
+		    block = _unused.back();
+		    _unused.pop_back();
+		} else {
+		    block = new T();
+		    _blocks.push_back(block);
+		}
+	    }
+#ifndef WINDOWS
+	    pthread_setspecific(_key, block);
+#endif
+	    return block;
+	}
+
+	//! Every block made, attached or not (with the mutex held)
+	const std::vector<T*>& all() const { return _blocks; }
+
+    private:
+	static void detach(void* block)
+	{
+	    ThreadBlocks& blocks = *_instance;
+	    if (blocks._onDetach) blocks._onDetach((T*)block);
+	    AutoMutex locker(blocks._mutex);
+	    blocks._unused.push_back((T*)block);
+	}
+
+	static ThreadBlocks* _instance;
+	Mutex& _mutex;
+	DetachFn _onDetach;
+	std::vector<T*> _blocks, _unused;
+#ifndef WINDOWS
+	pthread_key_t _key;
+#endif
+    };
+
+    template <class T> ThreadBlocks<T>* ThreadBlocks<T>::_instance = 0;
+}
+
+#endif
@@ -32,85 +32,50 @@
  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
 */
-#include <SeExpression.h>
+#include <SeExprGraph.h>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <sstream>
 
-#define STACK_DEPTH 256                                                                                                                                                                            
 /**
    @file asciiCalculator.cpp
 */
-//! Simple expression class to support our function calculator
-class CalculatorExpr : public SeExpression
+//! Calculator where each line is a node of an expression graph,
+//! so later lines can use earlier results as $_0, $_1, ...
+class Calculator
 {
 public:
-    //! Constructor that takes the expression to parse
-    CalculatorExpr(const std::string& expr)
-	:SeExpression(expr), _count(0)
-    {
-	for(int i = 0; i < STACK_DEPTH; i++) {
-	    stack[i].val = SeVec3d(0.0);
-	    fail_stack[i] = false;
-	};
-    };
+    Calculator()
+	:_count(0)
+    {}
     
-    //! Empty constructor
-    CalculatorExpr()
-	:SeExpression(), _count(0)
-    {
-	for(int i = 0; i < STACK_DEPTH; i++)
-	    fail_stack[i] = false;
+    //! Add a line, returning whether it is valid
+    bool push(const std::string& str) {
+	_name = lineName(_count++);
+	_graph.setExpr(_name, str);
+	if(!_graph.isValid(_name)) return false;
+	// earlier lines keep their results, only the new one is evaluated
+	_graph.evaluate(1);
+	return true;
     };
     
-    //! Push current result on stack
-    void push() {
-	stack[_count].val = evaluate();
-	_count++;
-    };
-    
-    //! Failed attempt; push 0 on stack
-    void fail_push() {
-	fail_stack[_count] = true;
-	stack[_count].val = SeVec3d(0.0);
-	_count++;
-    };
+    //! Result of the last line
+    const SeVec3d& result() const { return _graph.result(_name)[0]; };
+    const std::string& parseError() const { return _graph.parseError(_name); };
     
     int count() const { return _count; };
     
 private:
-    //! Simple variable that just returns its internal value
-    struct SimpleVar:public SeExprVectorVarRef
-    {
-	SimpleVar()
-	    :val(SeVec3d(0.0))
-	{}
-	
-	SeVec3d val; // independent variable
-	
-	void eval(const SeExprVarNode* /*node*/,SeVec3d& result)
-	{
-	    result = val;
-	}
+    static std::string lineName(int line) {
+	std::ostringstream name;
+	name << "_" << line;
+	return name.str();
     };
     
-    //! previous computations
-    mutable SimpleVar stack     [STACK_DEPTH];
-    mutable bool      fail_stack[STACK_DEPTH];
-    mutable int       _count;
-    
-    //! resolve function that only supports one external variable 'x'
-    SeExprVarRef* resolveVar(const std::string& name) const {
-	if(name[0] == '_') {
-	    int position = atoi(name.substr(1,name.size() - 1).c_str());
-	    if(position >= count())
-		std::cerr << "Use of unused result line." << std::endl;
-	    if(fail_stack[position])
-		std::cerr << "Use of invalid result line." << std::endl;
-	    return &(stack[position]);
-	};
-	return 0;
-    };
+    SeExprGraph _graph;
+    std::string _name;
+    int _count;
 };
 
 
@@ -123,13 +88,13 @@ void quit(const std::string & str) {
 
 int main()
 {
-    CalculatorExpr expr;
+    Calculator calc;
     std::string str;
     
     std::cout << "SeExpr Basic Calculator";
     
     while(true) {
-	std::cout << std::endl << expr.count() << "> ";
+	std::cout << std::endl << calc.count() << "> ";
 	//std::cin >> str;
 	getline(std::cin, str);
 	
@@ -139,15 +104,11 @@ int main()
 	};
 	
 	quit(str);
-	expr.setWantVec(true);
-	expr.setExpr(str);
 	
-	if(!expr.isValid()) {
-	    expr.fail_push();
-	    std::cerr << "Expression failed: " << expr.parseError() << std::endl;
+	if(!calc.push(str)) {
+	    std::cerr << "Expression failed: " << calc.parseError() << std::endl;
 	} else {
-	    expr.push();
-	    std::cout << "   " << expr.evaluate();
+	    std::cout << "   " << calc.result();
 	};
     };
     
@@ -33,47 +33,13 @@
  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
 */
 #include <SeExpression.h>
+#include <SeExprSampler.h>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 /**
    @file asciiGraph.cpp
 */
-//! Simple expression class to support our function grapher
-class GrapherExpr:public SeExpression
-{
-public:
-    //! Constructor that takes the expression to parse
-    GrapherExpr(const std::string& expr)
-        :SeExpression(expr)
-    {}
-
-    //! set the independent variable
-    void setX(double x_input)
-    {x.val=x_input;}
-
-private:
-    //! Simple variable that just returns its internal value
-    struct SimpleVar:public SeExprScalarVarRef
-    {
-        double val; // independent variable
-        void eval(const SeExprVarNode* /*node*/,SeVec3d& result)
-        {result[0]=val;}
-    };
-    
-    //! independent variable
-    mutable SimpleVar x;
-
-    //! resolve function that only supports one external variable 'x'
-    SeExprVarRef* resolveVar(const std::string& name) const
-    {
-        if(name == "x") return &x;
-        return 0;
-    }
-};
-
-
-
 int main(int argc,char *argv[])
 {
     std::string exprStr="\
@@ -83,10 +49,10 @@ int main(int argc,char *argv[])
     if(argc == 2){
         exprStr=argv[1];
     }
-    GrapherExpr expr(exprStr);
+    SeExprSampler sampler;
 
-    if(!expr.isValid()){
-        std::cerr<<"expression failed "<<expr.parseError()<<std::endl;
+    if(!sampler.setExpr(0,exprStr)){
+        std::cerr<<"expression failed "<<sampler.parseError(0)<<std::endl;
         exit(1);
     }
     double xmin=-10,xmax=10,ymin=-10,ymax=10;
@@ -109,25 +75,16 @@ int main(int argc,char *argv[])
         }
     }
 
-    // evaluate the graph
-    const int samplesPerPixel=10;
-    const double one_over_samples_per_pixel=1./samplesPerPixel;
-    for(int i=0;i<w;i++){
-        for(int sample=0;sample<samplesPerPixel;sample++){
-            // transform from device to logical coordinatex
-            double dx=double(sample)*one_over_samples_per_pixel;
-            double x=double(dx+i)/double(w)*(xmax-xmin)+xmin;
-            // prep the expression engine for evaluation
-            expr.setX(x);
-            // evaluate and pull scalar value
-            SeVec3d val=expr.evaluate();
-            double y=val[0];
-            // transform from logical to device coordinate
-            int j=(y-ymin)/(ymax-ymin)*h;
-            // store to the buffer
-            if(j>=0 && j<h)
-                buffer[i+j*w]='#';
-        }
+    // sample the graph, more finely where it is steep or curved
+    const std::vector<SeExprSampler::Sample>& samples=
+        sampler.sample(0,SeExprSampler::View(xmin,xmax,ymin,ymax,w,h));
+    for(size_t k=0;k<samples.size();k++){
+        // transform from logical to device coordinates
+        int i=(samples[k].x-xmin)/(xmax-xmin)*w;
+        int j=(samples[k].y-ymin)/(ymax-ymin)*h;
+        // store to the buffer
+        if(i>=0 && i<w && j>=0 && j<h)
+            buffer[i+j*w]='#';
     }
 
     // draw the graph from the buffer
@@ -36,12 +36,15 @@
    @file imageSynth.cpp
 */
 #include <map>
+#include <vector>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <SeExpression.h>
 #include <png.h>
 #include <fstream>
+#include <pthread.h>
+#include <unistd.h>
 
 //! Simple image synthesizer expression class to support our function grapher
 class ImageSynthExpr:public SeExpression
@@ -52,19 +55,12 @@ public:
         :SeExpression(expr)
     {}
 
-    //! Simple variable that just returns its internal value
-    struct Var:public SeExprScalarVarRef
-    {
-        Var(const double val):val(val){}
-        Var(){}
-        double val; // independent variable
-        void eval(const SeExprVarNode* /*node*/,SeVec3d& result)
-        {result[0]=val;}
-    };
+    //! Variables read directly from doubles owned by the caller
+    typedef SeExprPtrVarRef Var;
     //! variable map
     mutable std::map<std::string,Var> vars;
 
-    //! resolve function that only supports one external variable 'x'
+    //! resolve function that only supports the variables in the map
     SeExprVarRef* resolveVar(const std::string& name) const
     {
         std::map<std::string,Var>::iterator i=vars.find(name);
@@ -76,6 +72,100 @@ public:
 
 double clamp(double x){return std::max(0.,std::min(255.,x));}
 
+//! Ring of scanlines shared by the evaluating threads and the png writer.
+/** Rows are handed out to workers in order and written in order, and a
+    worker may only start a row once its slot has been written, so only
+    numSlots rows are ever held in memory. */
+struct RowQueue
+{
+    RowQueue(int width,int height,int numSlots)
+        :width(width),height(height),numSlots(numSlots),
+         pixels(size_t(width)*4*numSlots),done(numSlots,0),nextRow(0),written(0)
+    {
+        pthread_mutex_init(&mutex,0);
+        pthread_cond_init(&rowDone,0);
+        pthread_cond_init(&slotFree,0);
+    }
+    ~RowQueue()
+    {
+        pthread_cond_destroy(&slotFree);
+        pthread_cond_destroy(&rowDone);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    unsigned char* row(int r){return &pixels[size_t(width)*4*(r%numSlots)];}
+
+    int width,height,numSlots;
+    std::vector<unsigned char> pixels;
+    std::vector<char> done;  //!< per slot, whether its row is evaluated
+    int nextRow;             //!< next row to hand to a worker
+    int written;             //!< rows written to the png so far
+    pthread_mutex_t mutex;
+    pthread_cond_t rowDone,slotFree;
+};
+
+//! One evaluating thread with its own copy of the expression
+struct RowWorker
+{
+    RowWorker(RowQueue& queue,const std::string& exprStr)
+        :queue(queue),expr(exprStr),u(queue.width),v(queue.width),
+         w(queue.width,queue.width),h(queue.width,queue.height),results(queue.width)
+    {
+        // u only depends on the column, so it is the same for every row
+        for(int col=0;col<queue.width;col++) u[col]=(1./queue.width)*(col+.5);
+        // a scanline is evaluated as a batch, each variable reading one
+        // value per column
+        expr.vars["u"]=ImageSynthExpr::Var(&u[0]);
+        expr.vars["v"]=ImageSynthExpr::Var(&v[0]);
+        expr.vars["w"]=ImageSynthExpr::Var(&w[0]);
+        expr.vars["h"]=ImageSynthExpr::Var(&h[0]);
+    }
+
+    void evalRow(int row,unsigned char* pixel)
+    {
+        std::fill(v.begin(),v.end(),(1./queue.height)*(row+.5));
+        expr.evaluateBatch(queue.width,&results[0]);
+        for(int col=0;col<queue.width;col++){
+            const SeVec3d& result=results[col];
+            pixel[0]=clamp(result[0]*256.);
+            pixel[1]=clamp(result[1]*256.);
+            pixel[2]=clamp(result[2]*256.);
+            pixel[3]=255;
+            pixel+=4;
+        }
+    }
+
+    static void* run(void* arg)
+    {
+        RowWorker& worker=*(RowWorker*)arg;
+        RowQueue& queue=worker.queue;
+        for(;;){
+            pthread_mutex_lock(&queue.mutex);
+            int row=queue.nextRow;
+            if(row>=queue.height){
+                pthread_mutex_unlock(&queue.mutex);
+                return 0;
+            }
+            queue.nextRow++;
+            while(row>=queue.written+queue.numSlots)
+                pthread_cond_wait(&queue.slotFree,&queue.mutex);
+            pthread_mutex_unlock(&queue.mutex);
+
+            worker.evalRow(row,queue.row(row));
+
+            pthread_mutex_lock(&queue.mutex);
+            queue.done[row%queue.numSlots]=1;
+            pthread_cond_broadcast(&queue.rowDone);
+            pthread_mutex_unlock(&queue.mutex);
+        }
+    }
+
+    RowQueue& queue;
+    ImageSynthExpr expr;
+    std::vector<double> u,v,w,h;
+    std::vector<SeVec3d> results;
+};
+
 int main(int argc,char *argv[]){
     if(argc != 5){
         std::cerr<<"Usage: "<<argv[0]<<" <image file> <width> <height> <exprFile>"<<std::endl;
@@ -86,7 +176,7 @@ int main(int argc,char *argv[]){
     const char* imageFile=argv[1];
     const char* exprFile=argv[4];
     int width=atoi(argv[2]),height=atoi(argv[3]);
-    if(width<0 || height<0){
+    if(width<=0 || height<=0){
         std::cerr<<"invalid width/height"<<std::endl;
         return 1;
     }
@@ -97,43 +187,24 @@ int main(int argc,char *argv[]){
         return 1;
     }
     std::string exprStr((std::istreambuf_iterator<char>(istream)),std::istreambuf_iterator<char>());
-    ImageSynthExpr expr(exprStr);
-
-    // make variables
-    expr.vars["u"]=ImageSynthExpr::Var(0.);
-    expr.vars["v"]=ImageSynthExpr::Var(0.);
-    expr.vars["w"]=ImageSynthExpr::Var(width);
-    expr.vars["h"]=ImageSynthExpr::Var(height);
-    
+
+    // the rows are evaluated in parallel, with one thread per cpu
+    int numThreads=std::max(1,int(sysconf(_SC_NPROCESSORS_ONLN)));
+    RowQueue queue(width,height,4*numThreads);
+    std::vector<RowWorker*> workers;
+    workers.push_back(new RowWorker(queue,exprStr));
+
     // check if expression is valid
+    ImageSynthExpr& expr=workers[0]->expr;
     bool valid=expr.isValid();
     if(!valid){
         std::cerr<<"Invalid expression "<<std::endl;
         std::cerr<<expr.parseError()<<std::endl;
     }
+    if(valid && !expr.isThreadSafe()) numThreads=1;
+    for(int i=1;i<numThreads;i++) workers.push_back(new RowWorker(queue,exprStr));
 
-    // evaluate expression
-    std::cerr<<"Evaluating expresion...from "<<exprFile<<std::endl;
-    unsigned char* image=new unsigned char[width*height*4];
-    double one_over_width=1./width,one_over_height=1./height;
-    double& u=expr.vars["u"].val;
-    double& v=expr.vars["v"].val;
-    unsigned char* pixel=image;
-    for(int row=0;row<height;row++){
-        for(int col=0;col<width;col++){
-            u=one_over_width*(col+.5);
-            v=one_over_height*(row+.5);
-            SeVec3d result=expr.evaluate();
-            pixel[0]=clamp(result[0]*256.);
-            pixel[1]=clamp(result[1]*256.);
-            pixel[2]=clamp(result[2]*256.);
-            pixel[3]=255;
-            pixel+=4;
-        }
-    }
-
-    // write image as png
-    std::cerr<<"Writing image..."<<imageFile<<std::endl;
+    // open the png
     FILE *fp=fopen(imageFile,"wb");
     if(!fp){
         perror("fopen");
@@ -146,12 +217,41 @@ int main(int argc,char *argv[]){
     png_init_io(png_ptr,fp);
     int color_type=PNG_COLOR_TYPE_RGBA;
     png_set_IHDR(png_ptr,info_ptr,width,height,8,color_type,PNG_INTERLACE_NONE,PNG_COMPRESSION_TYPE_DEFAULT,PNG_FILTER_TYPE_DEFAULT);
-    const unsigned char *ptrs[height];
-    for(int i=0;i<height;i++){
-        ptrs[i]=&image[width*i*4];
+    png_write_info(png_ptr,info_ptr);
+
+    // evaluate expression, writing each row as soon as it is ready so
+    // compression overlaps evaluation of the following rows
+    std::cerr<<"Evaluating expresion...from "<<exprFile<<" into "<<imageFile<<std::endl;
+    std::vector<pthread_t> threads(workers.size());
+    size_t numStarted=0;
+    for(;numStarted<workers.size();numStarted++)
+        if(pthread_create(&threads[numStarted],0,RowWorker::run,workers[numStarted])) break;
+
+    for(int row=0;row<height;row++){
+        // evaluate here if no threads could be started
+        if(!numStarted){
+            workers[0]->evalRow(row,queue.row(row));
+            png_write_row(png_ptr,queue.row(row));
+            continue;
+        }
+
+        int slot=row%queue.numSlots;
+        pthread_mutex_lock(&queue.mutex);
+        while(!queue.done[slot]) pthread_cond_wait(&queue.rowDone,&queue.mutex);
+        pthread_mutex_unlock(&queue.mutex);
+
+        png_write_row(png_ptr,queue.row(row));
+
+        pthread_mutex_lock(&queue.mutex);
+        queue.done[slot]=0;
+        queue.written++;
+        pthread_cond_broadcast(&queue.slotFree);
+        pthread_mutex_unlock(&queue.mutex);
     }
-    png_set_rows(png_ptr,info_ptr,(png_byte**)ptrs);
-    png_write_png(png_ptr,info_ptr,PNG_TRANSFORM_IDENTITY,0);
-    
+    for(size_t i=0;i<numStarted;i++) pthread_join(threads[i],0);
+    for(size_t i=0;i<workers.size();i++) delete workers[i];
+
+    png_write_end(png_ptr,info_ptr);
+    png_destroy_write_struct(&png_ptr,&info_ptr);
     fclose(fp);
 }
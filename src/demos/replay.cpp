@@ -0,0 +1,178 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <SeExpression.h>
+#include <SeExprCapture.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <sys/time.h>
+
+/**
+   @file replay.cpp
+*/
+//! Expression reading the variables of a capture, a row at a time
+class ReplayExpression : public SeExpression
+{
+public:
+    ReplayExpression(const SeExprCapture::Contents& capture)
+	: SeExpression(capture.expr, capture.wantVec)
+    {
+	for (size_t v = 0; v < capture.vars.size(); v++) {
+	    const SeExprCapture::Variable& var = capture.vars[v];
+	    if (!var.values.empty()) _vars[var.name].setPtr(&var.values[0], var.isVec);
+	}
+    }
+
+    SeExprVarRef* resolveVar(const std::string& name) const
+    {
+	std::map<std::string, SeExprPtrVarRef>::iterator i = _vars.find(name);
+	return i == _vars.end() ? 0 : &i->second;
+    }
+
+    //! Select the row subsequent evaluations start at
+    void setRow(size_t row)
+    {
+	for (std::map<std::string, SeExprPtrVarRef>::iterator i = _vars.begin(); i != _vars.end(); ++i)
+	    i->second.setIndex(row);
+    }
+
+private:
+    mutable std::map<std::string, SeExprPtrVarRef> _vars;
+};
+
+//! Rows a thread replays, and its results
+struct Job
+{
+    const SeExprCapture::Contents* capture;
+    size_t begin, end;
+    bool batch;
+    int repeats;
+    std::vector<SeVec3d> results;
+};
+
+void* replay(void* arg)
+{
+    Job& job = *(Job*)arg;
+    ReplayExpression expr(*job.capture);
+    job.results.resize(job.end - job.begin);
+    if (!expr.isValid() || job.results.empty()) return 0;
+    for (int r = 0; r < job.repeats; r++) {
+	if (job.batch) {
+	    expr.setRow(job.begin);
+	    expr.evaluateBatch(int(job.end - job.begin), &job.results[0]);
+	} else {
+	    for (size_t i = job.begin; i < job.end; i++) {
+		expr.setRow(i);
+		job.results[i - job.begin] = expr.evaluate();
+	    }
+	}
+    }
+    return 0;
+}
+
+double now()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = 1, repeats = 1;
+    bool batch = false;
+    int arg = 1;
+    for (; arg < argc - 1; arg++) {
+	if (!strcmp(argv[arg], "-t") && arg < argc - 2) threads = atoi(argv[++arg]);
+	else if (!strcmp(argv[arg], "-r") && arg < argc - 2) repeats = atoi(argv[++arg]);
+	else if (!strcmp(argv[arg], "-b")) batch = true;
+	else break;
+    }
+    if (arg != argc - 1 || threads < 1 || repeats < 1) {
+	std::cerr << "Usage: " << argv[0] << " [-t threads] [-r repeats] [-b] <capture file>" << std::endl;
+	std::cerr << "Replays the points of a capture (see SeExprCapture), split between the" << std::endl;
+	std::cerr << "threads, one at a time with evaluate() or with evaluateBatch() (-b)" << std::endl;
+	return 1;
+    }
+
+    SeExprCapture::Contents capture;
+    std::string error;
+    if (!SeExprCapture::read(argv[arg], capture, error)) {
+	std::cerr << error << std::endl;
+	return 1;
+    }
+    ReplayExpression check(capture);
+    if (!check.isValid()) {
+	std::cerr << "Invalid expression: " << check.parseError() << std::endl;
+	return 1;
+    }
+
+    std::vector<Job> jobs(threads);
+    std::vector<pthread_t> ids(threads);
+    for (int t = 0; t < threads; t++) {
+	jobs[t].capture = &capture;
+	jobs[t].begin = capture.evals * t / threads;
+	jobs[t].end = capture.evals * (t + 1) / threads;
+	jobs[t].batch = batch;
+	jobs[t].repeats = repeats;
+    }
+    double start = now();
+    for (int t = 0; t < threads; t++) pthread_create(&ids[t], 0, replay, &jobs[t]);
+    for (int t = 0; t < threads; t++) pthread_join(ids[t], 0);
+    double seconds = now() - start;
+
+    // compare with the results captured
+    double maxDiff = 0;
+    for (int t = 0; t < threads; t++)
+	for (size_t i = jobs[t].begin; i < jobs[t].end; i++)
+	    for (int c = 0; c < 3; c++)
+		maxDiff = std::max(maxDiff, std::fabs(jobs[t].results[i - jobs[t].begin][c] - capture.results[i][c]));
+
+    double points = double(capture.evals) * repeats;
+    std::cout << "expression: " << capture.expr << std::endl;
+    std::cout << "points: " << capture.evals << ", variables: " << capture.vars.size() << std::endl;
+    std::cout << "threads: " << threads << ", repeats: " << repeats
+	      << ", mode: " << (batch ? "evaluateBatch" : "evaluate") << std::endl;
+    std::cout << "time: " << seconds << " s, throughput: " << (seconds > 0 ? points / seconds : 0)
+	      << " points/s" << std::endl;
+    std::cout << "largest difference from the captured results: " << maxDiff << std::endl;
+    return 0;
+}
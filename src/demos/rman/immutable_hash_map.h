@@ -39,8 +39,23 @@
 
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <vector>
 
+// hash function from Thomas Wang (wang@cup.hp.com)
+template<typename key_type>
+inline uint32_t hash_pointer(const key_type& key)
+{
+    uint32_t hash = intptr_t(key) ^ (intptr_t(key)>>32);
+    hash = ~hash + (hash << 15);
+    hash = hash ^ (hash >> 12);
+    hash = hash + (hash << 2);
+    hash = hash ^ (hash >> 4);
+    hash = hash * 2057;
+    hash = hash ^ (hash >> 16);
+    return hash;
+}
+
 template<typename key_type, typename value_type>
 class immutable_hash_map
 {
@@ -86,14 +101,7 @@ public:
 private:
     int find(const key_type& key) const
     {
-	uint32_t hash = intptr_t(key) ^ (intptr_t(key)>>32);
-	// hash function from Thomas Wang (wang@cup.hp.com)
-	hash = ~hash + (hash << 15);
-	hash = hash ^ (hash >> 12);
-	hash = hash + (hash << 2);
-	hash = hash ^ (hash >> 4);
-	hash = hash * 2057;
-	hash = hash ^ (hash >> 16);
+	uint32_t hash = hash_pointer(key);
 	while (1) {
 	    int pos = hash & _mask;
 	    const key_type& k = _keys[pos];
@@ -103,4 +111,121 @@ private:
     }
 };
 
+
+// an insert-only hash map from pointer keys to pointer values that can be
+// shared between threads.  Lookups take no locks; inserts lock only the shard
+// the key hashes to.  A published table is never rehashed in place - growing
+// copies into a new table and retires the old one until destruction - so a
+// reader can always finish probing whatever table it started with.
+template<typename key_type, typename value_type, int num_shards=16>
+class concurrent_hash_map
+{
+public:
+    concurrent_hash_map()
+    {
+	for (int i = 0; i < num_shards; i++) {
+	    pthread_mutex_init(&_shards[i].mutex, 0);
+	    _shards[i].current = new table(16);
+	}
+    }
+
+    ~concurrent_hash_map()
+    {
+	for (int i = 0; i < num_shards; i++) {
+	    shard& s = _shards[i];
+	    for (size_t j = 0; j < s.retired.size(); j++) delete s.retired[j];
+	    delete s.current;
+	    pthread_mutex_destroy(&s.mutex);
+	}
+    }
+
+    // returns the value stored for key, or 0 if there is none
+    value_type find(const key_type& key) const
+    {
+	uint32_t hash = hash_pointer(key);
+	const table* t = _shards[shard_index(hash)].current;
+	return t->values[t->find(key, hash)];
+    }
+
+    // stores value for key unless another value is already stored, and
+    // returns whichever value the map now holds for key
+    value_type insert(const key_type& key, const value_type& value)
+    {
+	uint32_t hash = hash_pointer(key);
+	shard& s = _shards[shard_index(hash)];
+	pthread_mutex_lock(&s.mutex);
+
+	table* t = s.current;
+	int pos = t->find(key, hash);
+	if (!t->keys[pos]) {
+	    if ((t->count+1)*2 > t->mask+1) {
+		// grow: build the new table completely before publishing it
+		table* grown = new table((t->mask+1)*2);
+		for (int i = 0; i <= t->mask; i++) {
+		    key_type k = t->keys[i];
+		    if (k) grown->add(k, t->values[i], hash_pointer(k));
+		}
+		__sync_synchronize();
+		s.current = grown;
+		s.retired.push_back(t);
+		t = grown;
+	    }
+	    t->add(key, value, hash);
+	    pos = t->find(key, hash);
+	}
+	value_type result = t->values[pos];
+
+	pthread_mutex_unlock(&s.mutex);
+	return result;
+    }
+
+private:
+    // shards are picked from the high bits, probing uses the low bits
+    static int shard_index(uint32_t hash) { return (hash >> 24) % num_shards; }
+
+    struct table
+    {
+	volatile key_type* keys;
+	value_type* values;
+	int mask;
+	int count;
+
+	table(int size) : mask(size-1), count(0)
+	{
+	    keys = new key_type[size];
+	    values = new value_type[size];
+	    for (int i = 0; i < size; i++) { keys[i] = 0; values[i] = 0; }
+	}
+	~table() { delete [] const_cast<key_type*>(keys); delete [] values; }
+
+	int find(const key_type& key, uint32_t hash) const
+	{
+	    while (1) {
+		int pos = hash & mask;
+		key_type k = keys[pos];
+		if (k == key || !k) return pos; // found key or blank
+		hash++; // collision, keep looking
+	    }
+	}
+
+	void add(const key_type& key, const value_type& value, uint32_t hash)
+	{
+	    int pos = find(key, hash);
+	    // the value must be visible before a reader can match the key
+	    values[pos] = value;
+	    __sync_synchronize();
+	    keys[pos] = key;
+	    count++;
+	}
+    };
+
+    struct shard
+    {
+	table* volatile current;
+	std::vector<table*> retired;
+	pthread_mutex_t mutex;
+    };
+    shard _shards[num_shards];
+};
+
 #endif
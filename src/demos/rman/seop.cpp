@@ -93,57 +93,70 @@ namespace{
             }
 	}
     };
-    typedef std::map<const char*, SeRmanVarMap*> SeRmanVarMapMap;
-    typedef std::map<const char*, int> SeRmanExprMap;
+    typedef concurrent_hash_map<const char*, SeRmanVarMap*> SeRmanVarMapMap;
     typedef std::vector<int> SeVarBinding;
 
     class SeRmanExpr;
 
+    //! Process wide record of an expression string, shared by all threads
+    struct SeRmanExprInfo {
+        int index;          // global handle, 0 if the expression is invalid
+        std::string error;  // parse/prep error (reported once)
+    };
+    typedef concurrent_hash_map<const char*, SeRmanExprInfo*> SeRmanExprMap;
+
+    // variable maps are immutable once built, so every thread shares them
+    SeRmanVarMapMap varmaps;
+    // expressions are registered once and keep the same handle in every thread
+    SeRmanExprMap exprmap;
+    int numExprs = 0;
+
+    SeRmanVarMap& getVarMap(const char* varMapHandle)
+    {
+        SeRmanVarMap* varmap = varmaps.find(varMapHandle);
+        if (varmap) return *varmap;
+
+        // parse var list and make a new varmap
+        char* varlist = strdup(varMapHandle);
+        std::vector<const char*> varnames;
+        std::vector<int> groupStarts;
+
+        // parse each var group (separated by spaces)
+        char* varlist_end = 0;
+        char* vargroup = strtok_r(varlist, " ", &varlist_end);
+        do {
+            // parse vars within var group (separated by commas)
+            int groupStart = varnames.size();
+            char* vargroup_end = 0;
+            char* var = strtok_r(vargroup, ",", &vargroup_end);
+            do {
+                varnames.push_back(tokenize(var));
+                groupStarts.push_back(groupStart);
+            } while (var = strtok_r(0, ",", &vargroup_end));
+        } while (vargroup = strtok_r(0, " ", &varlist_end));
+
+        // build new varmap
+        int nvars = varnames.size();
+        int* varindices = (int*) alloca(sizeof(int)*nvars);
+        for (int i = 0; i < nvars; i++){
+            varindices[i] = i;
+        }
+        varmap = new SeRmanVarMap(nvars, &varnames[0], &varindices[0], &groupStarts[0]);
+        free(varlist);
 
-    //! Store per thread caches of expressions and the variable bindings
+        // another thread may have built the same map in the meantime
+        SeRmanVarMap* shared = varmaps.insert(varMapHandle, varmap);
+        if (shared != varmap) delete varmap;
+        return *shared;
+    }
+
+
+    //! Store per thread expressions (indexed by global handle) and the current grid point
     struct ThreadData {
 
         // rix message interface
         RixMessages *msgs;
         
-	// all variable maps accessed by this thread
-	SeRmanVarMapMap varmaps;
-
-	SeRmanVarMap& getVarMap(const char* varMapHandle)
-	{
-	    SeRmanVarMap*& varmap = varmaps[varMapHandle];
-	    if (!varmap) {
-		// parse var list and make a new varmap
-		char* varlist = strdup(varMapHandle);
-		std::vector<const char*> varnames;
-		std::vector<int> groupStarts;
-
-		// parse each var group (separated by spaces)
-		char* varlist_end = 0;
-		char* vargroup = strtok_r(varlist, " ", &varlist_end);
-		do {
-		    // parse vars within var group (separated by commas)
-		    int groupStart = varnames.size();
-		    char* vargroup_end = 0;
-		    char* var = strtok_r(vargroup, ",", &vargroup_end);
-		    do {
-			varnames.push_back(tokenize(var));
-			groupStarts.push_back(groupStart);
-		    } while (var = strtok_r(0, ",", &vargroup_end));
-		} while (vargroup = strtok_r(0, " ", &varlist_end));
-
-		// build new varmap
-		int nvars = varnames.size();
-		int* varindices = (int*) alloca(sizeof(int)*nvars);
-		for (int i = 0; i < nvars; i++){
-                    varindices[i] = i;
-                }
-		varmap = new SeRmanVarMap(nvars, &varnames[0], &varindices[0], &groupStarts[0]);
-		free(varlist);
-	    }
-	    return *varmap;
-	}
-
         void ptError (char* fmt, ...) {
             static char strbuf[1024];
             va_list ap;
@@ -162,7 +175,9 @@ namespace{
             va_end(ap);
         }
 
-	SeRmanExprMap exprmap;
+	// this thread's instance of each registered expression (0 if not yet made);
+	// expressions carry local variable and function state while evaluating,
+	// so each thread evaluates its own copy
 	std::vector<SeRmanExpr*> exprs;
 
 	RtColor* varValues; // value of every var at current grid point
@@ -306,12 +321,13 @@ namespace{
 
 	SeVarBinding* bindVars(const char* varMapHandle)
 	{
-	    SeVarBinding*& binding = _bindings[varMapHandle];
+	    SeVarBinding* binding = _bindings.find(varMapHandle);
 	    if (!binding) {
 		binding = new SeVarBinding;
+		_bindings.insert(varMapHandle, binding);
 
 		// find varmap
-		SeRmanVarMap& varmap = _td.getVarMap(varMapHandle);
+		SeRmanVarMap& varmap = getVarMap(varMapHandle);
 		// bind varmap to expression
 		int nvars = _varnames.size();
 		binding->resize(nvars);
@@ -364,7 +380,7 @@ namespace{
 	mutable std::vector<const char*> _varnames;         // ordered, unique list of var names
 	mutable std::vector<SeRmanVar*> _varrefs;           // var refs corresponding to _varnames
         mutable std::vector<AttrVar*> _attrrefs;
-	mutable std::map<const char*, SeVarBinding*> _bindings; // bindings for each varmap
+	concurrent_hash_map<const char*, SeVarBinding*, 1> _bindings; // bindings for each varmap
 	mutable std::vector<SeVarBinding*> _bindstack;           // stack of active bindings
 	ThreadData& _td;
 	int _boundVarMap;
@@ -406,28 +422,40 @@ namespace{
 
         // see if we have this expr already
         ThreadData& td = getThreadData(ctx);
-        int& index = td.exprmap[exprstr];
-        if (!index) {
-            // parse expr (parser is not reentrant - use mutex)
-            static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-            pthread_mutex_lock(&mutex);
-            SeRmanExpr* expr = new SeRmanExpr(exprstr, td);
+        SeRmanExprInfo* info = exprmap.find(exprstr);
+        SeRmanExpr* expr = 0;
+        if (!info || (info->index && (info->index >= int(td.exprs.size()) || !td.exprs[info->index]))) {
+            // parse and prep this thread's copy; the library serializes
+            // only the (non reentrant) parser itself, so threads warming
+            // up the same expression prep it in parallel
+            expr = new SeRmanExpr(exprstr, td);
             bool valid = expr->isValid(); // triggers parse
-            pthread_mutex_unlock(&mutex);
-            if (!valid) {
-                char msg[] = "SeRmanExpr error: %s";
-                td.ptError(msg, expr->parseError().c_str());
-                index = 0;
+
+            if (!info) {
+                // first thread to see this expr registers it for everybody
+                SeRmanExprInfo* newInfo = new SeRmanExprInfo;
+                newInfo->index = valid ? __sync_add_and_fetch(&numExprs, 1) : 0;
+                if (!valid) newInfo->error = expr->parseError();
+                info = exprmap.insert(exprstr, newInfo);
+                if (info != newInfo) delete newInfo;
+                else if (!valid) {
+                    char msg[] = "SeRmanExpr error: %s";
+                    td.ptError(msg, info->error.c_str());
+                }
+            }
+
+            if (info->index) {
+                if (info->index >= int(td.exprs.size())) td.exprs.resize(info->index+1, 0);
+                td.exprs[info->index] = expr;
             }
-            else index = td.exprs.size();
-            // store expr object whether parse succeeded or not (so we don't parse again)
-            td.exprs.push_back(expr);
+            else delete expr;
         }
+        int index = info->index;
 
         *result = index;
         if (index) {
             // bind vars only if we have a valid expr
-            SeRmanExpr* expr = td.exprs[index];
+            expr = td.exprs[index];
             expr->lookupAttrs();
             SeVarBinding& binding = *expr->bindVars(varmapHandle);
             int nvars = binding.size();
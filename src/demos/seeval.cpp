@@ -0,0 +1,391 @@
+/*
+ SEEXPR SOFTWARE
+ Copyright 2011 Disney Enterprises, Inc. All rights reserved
+ 
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are
+ met:
+ 
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+ 
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in
+ the documentation and/or other materials provided with the
+ distribution.
+ 
+ * The names "Disney", "Walt Disney Pictures", "Walt Disney Animation
+ Studios" or the names of its contributors may NOT be used to
+ endorse or promote products derived from this software without
+ specific prior written permission from Walt Disney Pictures.
+ 
+ Disclaimer: THIS SOFTWARE IS PROVIDED BY WALT DISNEY PICTURES AND
+ CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+ FOR A PARTICULAR PURPOSE, NONINFRINGEMENT AND TITLE ARE DISCLAIMED.
+ IN NO EVENT SHALL WALT DISNEY PICTURES, THE COPYRIGHT HOLDER OR
+ CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND BASED ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGES.
+*/
+
+#include <SeExpression.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+   @file seeval.cpp
+*/
+//! A flat binary file of float or double elements, scalar or vec3,
+//! mapped a window at a time
+struct Column
+{
+    std::string name, path;
+    bool isDouble, isVec;
+    int fd;
+    size_t points;
+    dev_t dev; //!< identity of the opened file
+    ino_t ino;
+
+    Column() : isDouble(false), isVec(false), fd(-1), points(0), dev(0), ino(0) {}
+
+    size_t elementSize() const { return (isDouble ? sizeof(double) : sizeof(float)) * (isVec ? 3 : 1); }
+
+    //! Parse a type: f, d, f3 or d3
+    bool setType(const std::string& type)
+    {
+	if (type.empty() || (type[0] != 'f' && type[0] != 'd')) return false;
+	if (type.size() > 2 || (type.size() == 2 && type[1] != '3')) return false;
+	isDouble = type[0] == 'd';
+	isVec = type.size() == 2;
+	return true;
+    }
+};
+
+//! Pages of a column holding a range of points
+struct Window
+{
+    char* base;
+    size_t length;
+    char* data;
+
+    Window() : base(0), length(0), data(0) {}
+
+    bool map(const Column& column, size_t first, size_t n, bool write)
+    {
+	static const size_t page = sysconf(_SC_PAGESIZE);
+	size_t offset = first * column.elementSize();
+	size_t start = offset - offset % page;
+	length = offset - start + n * column.elementSize();
+	void* p = mmap(0, length, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, column.fd, start);
+	if (p == MAP_FAILED) return false;
+	base = (char*)p;
+	data = base + (offset - start);
+	if (!write) madvise(base, length, MADV_SEQUENTIAL);
+	return true;
+    }
+
+    void unmap()
+    {
+	if (base) munmap(base, length);
+	base = data = 0;
+    }
+};
+
+//! Expression reading its variables from the mapped columns
+class ColumnExpression : public SeExpression
+{
+public:
+    ColumnExpression(const std::string& expr, bool wantVec, const std::vector<Column>& columns)
+	: SeExpression(expr, wantVec)
+    {
+	// bound to their chunks later, but their types are needed to prep
+	for (size_t i = 0; i < columns.size(); i++) bind(columns[i], 0);
+    }
+
+    SeExprVarRef* resolveVar(const std::string& name) const
+    {
+	std::map<std::string, SeExprPtrVarRef>::iterator i = _vars.find(name);
+	return i == _vars.end() ? 0 : &i->second;
+    }
+
+    //! Point a variable at the first of the points evaluated next
+    void bind(const Column& column, const char* data)
+    {
+	SeExprPtrVarRef& var = _vars[column.name];
+	if (column.isDouble) var.setPtr((const double*)data, column.isVec);
+	else var.setPtr((const float*)data, column.isVec);
+    }
+
+    void setIndex(size_t index)
+    {
+	for (std::map<std::string, SeExprPtrVarRef>::iterator i = _vars.begin(); i != _vars.end(); ++i)
+	    i->second.setIndex(index);
+    }
+
+private:
+    mutable std::map<std::string, SeExprPtrVarRef> _vars;
+};
+
+//! Chunks of points handed out to the threads
+struct ChunkQueue
+{
+    pthread_mutex_t mutex;
+    size_t points, chunkSize, next;
+    bool failed;
+
+    ChunkQueue(size_t pointsIn, size_t chunkSizeIn)
+	: points(pointsIn), chunkSize(chunkSizeIn), next(0), failed(false)
+    { pthread_mutex_init(&mutex, 0); }
+    ~ChunkQueue() { pthread_mutex_destroy(&mutex); }
+
+    //! Take the next chunk, returning false when there are none left
+    bool take(size_t& first, size_t& n)
+    {
+	pthread_mutex_lock(&mutex);
+	first = next;
+	n = std::min(chunkSize, points - first);
+	next += n;
+	bool ok = n > 0 && !failed;
+	pthread_mutex_unlock(&mutex);
+	return ok;
+    }
+
+    void fail()
+    {
+	pthread_mutex_lock(&mutex);
+	failed = true;
+	pthread_mutex_unlock(&mutex);
+    }
+};
+
+//! A thread evaluating chunks: maps the chunk of each column, evaluates
+//! it in batches and converts the results into the output's window
+class Worker
+{
+public:
+    Worker(ChunkQueue& queue, const std::string& expr, const std::vector<Column>& inputs,
+	   const Column& output)
+	: _queue(queue), _expr(expr, output.isVec, inputs), _inputs(inputs), _output(output),
+	  _results(batchSize)
+    {}
+
+    ColumnExpression& expr() { return _expr; }
+
+    static void* run(void* arg)
+    {
+	Worker& worker = *(Worker*)arg;
+	size_t first, n;
+	while (worker._queue.take(first, n))
+	    if (!worker.evalChunk(first, n)) worker._queue.fail();
+	return 0;
+    }
+
+private:
+    enum { batchSize = 4096 };
+
+    bool evalChunk(size_t first, size_t n)
+    {
+	std::vector<Window> windows(_inputs.size());
+	Window out;
+	bool ok = out.map(_output, first, n, true);
+	for (size_t i = 0; ok && i < _inputs.size(); i++) {
+	    ok = windows[i].map(_inputs[i], first, n, false);
+	    if (ok) _expr.bind(_inputs[i], windows[i].data);
+	}
+	for (size_t done = 0; ok && done < n; done += batchSize) {
+	    int size = int(std::min(size_t(batchSize), n - done));
+	    _expr.setIndex(done);
+	    _expr.evaluateBatch(size, &_results[0]);
+	    store(out.data, done, size);
+	}
+	if (!ok) std::cerr << "Cannot map points " << first << " to " << first + n << std::endl;
+	for (size_t i = 0; i < windows.size(); i++) windows[i].unmap();
+	out.unmap();
+	return ok;
+    }
+
+    //! Convert a batch of results to the output's type
+    void store(char* data, size_t index, int n)
+    {
+	int width = _output.isVec ? 3 : 1;
+	if (_output.isDouble) {
+	    double* p = (double*)data + index * width;
+	    for (int i = 0; i < n; i++)
+		for (int c = 0; c < width; c++) *p++ = _results[i][c];
+	} else {
+	    float* p = (float*)data + index * width;
+	    for (int i = 0; i < n; i++)
+		for (int c = 0; c < width; c++) *p++ = float(_results[i][c]);
+	}
+    }
+
+    ChunkQueue& _queue;
+    ColumnExpression _expr;
+    const std::vector<Column>& _inputs;
+    const Column& _output;
+    std::vector<SeVec3d> _results;
+};
+
+double now()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [-t threads] [-c chunk] [-o type] [--] <expression | @file> <output file>"
+	      << " <name>=<file>:<type> ..." << std::endl;
+    std::cerr << "Evaluates an expression over flat binary column files, each variable $name" << std::endl;
+    std::cerr << "read from the elements of a file, and writes a column of results.  A type is" << std::endl;
+    std::cerr << "f or d (float or double), with 3 appended for vectors (f3, d3); the output" << std::endl;
+    std::cerr << "defaults to f3.  The files are memory mapped a chunk of points at a time" << std::endl;
+    std::cerr << "(default 1048576), and the chunks are evaluated in parallel.  Options end at" << std::endl;
+    std::cerr << "-- or the first argument that isn't one, so an expression may start with -." << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+    size_t chunkSize = 1 << 20;
+    Column output;
+    output.setType("f3");
+    int arg = 1;
+    for (; arg < argc; arg += 2) {
+	if (!strcmp(argv[arg], "--")) {
+	    arg++;
+	    break;
+	}
+	bool option = !strcmp(argv[arg], "-t") || !strcmp(argv[arg], "-c") || !strcmp(argv[arg], "-o");
+	if (!option) break;
+	if (arg == argc - 1) threads = 0;
+	else if (!strcmp(argv[arg], "-t")) threads = atoi(argv[arg + 1]);
+	else if (!strcmp(argv[arg], "-c")) chunkSize = strtoul(argv[arg + 1], 0, 10);
+	else if (!output.setType(argv[arg + 1])) threads = 0;
+    }
+    if (argc - arg < 2 || threads < 1 || chunkSize < 1) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    std::string exprStr = argv[arg++];
+    if (exprStr[0] == '@') {
+	std::ifstream istream(exprStr.c_str() + 1);
+	if (!istream) {
+	    std::cerr << "Cannot read file " << exprStr.c_str() + 1 << std::endl;
+	    return 1;
+	}
+	exprStr.assign(std::istreambuf_iterator<char>(istream), std::istreambuf_iterator<char>());
+    }
+    output.path = argv[arg++];
+
+    // open the input columns, which must have the same number of points
+    std::vector<Column> inputs;
+    for (; arg < argc; arg++) {
+	std::string spec = argv[arg];
+	size_t equals = spec.find('='), colon = spec.rfind(':');
+	Column column;
+	if (equals == std::string::npos || colon == std::string::npos || colon < equals
+	    || !column.setType(spec.substr(colon + 1))) {
+	    std::cerr << "Invalid column " << spec << ", expected <name>=<file>:<type>" << std::endl;
+	    return 1;
+	}
+	column.name = spec.substr(0, equals);
+	column.path = spec.substr(equals + 1, colon - equals - 1);
+	column.fd = open(column.path.c_str(), O_RDONLY);
+	struct stat st;
+	if (column.fd < 0 || fstat(column.fd, &st) < 0) {
+	    std::cerr << "Cannot read file " << column.path << std::endl;
+	    return 1;
+	}
+	column.points = st.st_size / column.elementSize();
+	column.dev = st.st_dev;
+	column.ino = st.st_ino;
+	if (size_t(st.st_size) % column.elementSize() || (!inputs.empty() && column.points != inputs[0].points)) {
+	    std::cerr << "File " << column.path << " doesn't hold a whole number of points, "
+		      << "or as many as the files before it" << std::endl;
+	    return 1;
+	}
+	inputs.push_back(column);
+    }
+    // with no inputs, evaluate a single point
+    output.points = inputs.empty() ? 1 : inputs[0].points;
+    // (so counting the chunks can't overflow)
+    chunkSize = std::min(chunkSize, std::max(output.points, size_t(1)));
+
+    ChunkQueue queue(output.points, chunkSize);
+    std::vector<Worker*> workers;
+    workers.push_back(new Worker(queue, exprStr, inputs, output));
+    if (!workers[0]->expr().isValid()) {
+	std::cerr << "Invalid expression" << std::endl;
+	std::cerr << workers[0]->expr().parseError() << std::endl;
+	return 1;
+    }
+
+    // not truncated until it's known not to be one of the inputs
+    output.fd = open(output.path.c_str(), O_RDWR | O_CREAT, 0666);
+    struct stat st;
+    if (output.fd < 0 || fstat(output.fd, &st) < 0) {
+	std::cerr << "Cannot write file " << output.path << std::endl;
+	return 1;
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+	if (inputs[i].dev == st.st_dev && inputs[i].ino == st.st_ino) {
+	    std::cerr << "Output file " << output.path << " is also the input " << inputs[i].path << std::endl;
+	    return 1;
+	}
+    }
+    // allocate the blocks up front: a full disk found while writing the
+    // mapped pages would be a SIGBUS
+    off_t size = output.points * output.elementSize();
+    if (ftruncate(output.fd, 0) < 0 || ftruncate(output.fd, size) < 0
+	|| (size > 0 && posix_fallocate(output.fd, 0, size) != 0)) {
+	std::cerr << "Cannot write file " << output.path << std::endl;
+	return 1;
+    }
+
+    // no more threads than chunks
+    threads = int(std::min(size_t(threads), (output.points + chunkSize - 1) / chunkSize));
+    if (threads < 1 && output.points > 0) {
+	std::cerr << "No threads to evaluate " << output.points << " points" << std::endl;
+	return 1;
+    }
+    for (int t = 1; t < threads; t++) workers.push_back(new Worker(queue, exprStr, inputs, output));
+    double start = now();
+    std::vector<pthread_t> ids(threads);
+    for (int t = 0; t < threads; t++) pthread_create(&ids[t], 0, Worker::run, workers[t]);
+    for (int t = 0; t < threads; t++) pthread_join(ids[t], 0);
+    double seconds = now() - start;
+
+    for (size_t t = 0; t < workers.size(); t++) delete workers[t];
+    for (size_t i = 0; i < inputs.size(); i++) close(inputs[i].fd);
+    if (close(output.fd) < 0 || queue.failed) {
+	std::cerr << "Error writing file " << output.path << std::endl;
+	return 1;
+    }
+
+    size_t bytes = output.points * output.elementSize();
+    for (size_t i = 0; i < inputs.size(); i++) bytes += inputs[i].points * inputs[i].elementSize();
+    std::cerr << output.points << " points on " << threads << " threads in " << seconds << " s: "
+	      << (seconds > 0 ? output.points / seconds : 0) << " points/s, "
+	      << (seconds > 0 ? bytes / seconds / (1 << 20) : 0) << " MB/s" << std::endl;
+    return 0;
+}
@@ -35,76 +35,39 @@
 #include "Functions.h"
 
 
-//! Simple expression class to support our function grapher
-class GrapherExpr:public SeExpression
-{
-    const std::map<std::string,SimpleVar>& vars;
-public:
-    //! Constructor that takes the expression to parse
-    GrapherExpr(const std::string& expr,const std::map<std::string,SimpleVar>& vars)
-        :SeExpression(expr),vars(vars)
-    {}
-
-    //! set the independent variable
-    void setX(double x_input)
-    {x.val=x_input;}
-
-private:
-    //! independent variable
-    mutable SimpleVar x;
-
-    //! resolve function that only supports one external variable 'x'
-    SeExprVarRef* resolveVar(const std::string& name) const
-    {
-        // check my internal variable
-        if(name == "x") return &x;
-        // check external variable table
-        std::map<std::string,SimpleVar>::const_iterator i=vars.find(name);
-        if(i!=vars.end()) return const_cast<SimpleVar*>(&i->second);
-        // nothing found
-        return 0;
-    }
-};
-
 void Functions::
 setVar(const std::string& name,const double val)
 {
-    variables[name].val=val;
+    sampler.setVar(name,val);
 }
 
 Functions::
 Functions()
 {
-    variables["t"].val=0.;
+    sampler.setVar("t",0.);
 }
 
 Functions::
 ~Functions()
 {
-    for(size_t i=0;i<functions.size();i++) delete functions[i];
 }
 
 void Functions::
-setupFunction(const std::string& s,GrapherExpr** exprDest)
+setupFunction(const std::string& s,int functionId)
 {
-    GrapherExpr* expr=new GrapherExpr(s,variables);
-    if(!expr->isValid()){
+    if(!sampler.setExpr(functionId,s)){
         std::cerr<<"parse error on '"<<s<<"'"<<std::endl;
-        std::cerr<<expr->parseError()<<std::endl;
-        delete expr;
-        expr=0;
+        std::cerr<<sampler.parseError(functionId)<<std::endl;
     }
-    *exprDest=expr; 
 }
 
 void Functions::
 addFunction(const QString& s)
 {
     strings.push_back(s);
-    functions.push_back(0);
     selected.push_back(false);
-    int newrow=functions.size()-1;
-    setupFunction(s.toStdString(),&functions[newrow]);
+    int newrow=strings.size()-1;
+    setupFunction(s.toStdString(),newrow);
     emit(layoutChanged());
 }
 
@@ -112,22 +75,31 @@ addFunction(const QString& s)
 bool Functions::
 isValid(int functionId) const
 {
-    return functions[functionId]!=0;
+    return sampler.isValid(functionId);
 }
 
 double Functions::
 eval(int functionId,double x) const
 {
-    functions[functionId]->setX(x);
-    SeVec3d val=functions[functionId]->evaluate();
-    //std::cerr<<"evaluating x="<<x<<" val is "<<val<<std::endl;
-    return val[0];
+    return sampler.eval(functionId,x);
+}
+
+void Functions::
+eval(int functionId,int n,const double* x,double* y) const
+{
+    sampler.eval(functionId,n,x,y);
+}
+
+const std::vector<SeExprSampler::Sample>& Functions::
+sample(int functionId,const SeExprSampler::View& view) const
+{
+    return sampler.sample(functionId,view);
 }
 
 bool Functions::
 isSelected(unsigned int functionId) const
 {
-    if(functionId>=functions.size()) return false;
+    if(functionId>=strings.size()) return false;
     return selected[functionId];
 }
 
@@ -135,7 +107,7 @@ isSelected(unsigned int functionId) const
 void Functions::
 setSelected(unsigned int functionId,bool val)
 {
-    if(functionId<functions.size()) selected[functionId]=val;
+    if(functionId<strings.size()) selected[functionId]=val;
 }
 
 //! Gets a list of all selection functions
@@ -154,7 +126,7 @@ getSelected(std::vector<int>& selectedFunctions) const
 int Functions::
 rowCount(const QModelIndex&) const
 {
-    return functions.size();
+    return strings.size();
 }
 
 int Functions::
@@ -198,9 +170,7 @@ setData(const QModelIndex& index,const QVariant& value,int role)
 {
     if(role==Qt::EditRole && index.column()==1 && index.isValid()){
         strings[index.row()]=value.toString();
-        if(functions[index.row()]) delete functions[index.row()];
-        functions[index.row()]=0;
-        setupFunction(value.toString().toStdString(),&functions[index.row()]);
+        setupFunction(value.toString().toStdString(),index.row());
         emit dataChanged(index,index);
 
         return true;
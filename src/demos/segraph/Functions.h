@@ -39,41 +39,35 @@
 #include <cfloat>
 
 #include <SeExpression.h>
-
-//! Simple variable that just returns its internal value
-struct SimpleVar:public SeExprScalarVarRef
-{
-    double val; // independent variable
-        void eval(const SeExprVarNode* /*node*/,SeVec3d& result)
-    {result[0]=val;}
-};
+#include <SeExprSampler.h>
 
 //! Model representing all the functions that the grapher handles
-class GrapherExpr;
 class Functions:public QAbstractTableModel
 {
     Q_OBJECT;
 
-    //! List of expression classes
-    std::vector<GrapherExpr*> functions;
+    //! Evaluates and samples the functions
+    SeExprSampler sampler;
     //! Expression strings
     std::vector<QString> strings;
     //! Whether item is selected
     std::vector<bool> selected;
-    //! Extra variables
-    std::map<std::string,SimpleVar> variables;
  
 public:
     Functions();
     ~Functions();
     //! Sets up a function for evaluation
-    void setupFunction(const std::string& s,GrapherExpr** exprDest);
+    void setupFunction(const std::string& s,int functionId);
     //! Adds a function given a qstring
     void addFunction(const QString& s);
     //! Evaluates functionId given at independent variable x
     bool isValid(int functionId) const;
     //! Evaluates functionId given at independent variable x
     double eval(int functionId,double x) const;
+    //! Evaluates functionId at n values of x at once
+    void eval(int functionId,int n,const double* x,double* y) const;
+    //! Samples functionId finely enough to draw it in the given view
+    const std::vector<SeExprSampler::Sample>& sample(int functionId,const SeExprSampler::View& view) const;
     //! Returns true if the given functionId is selected
     bool isSelected(unsigned int functionId) const;
     //! Sets if the given functionId is selected
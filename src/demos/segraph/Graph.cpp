@@ -37,6 +37,7 @@
 #  include <fenv.h>
 #endif
 #include <cmath>
+#include <QtCore/qnumeric.h>
 Graph::
 Graph(Functions* functions,QStatusBar* status)
     :funcs(*functions),operationCode(NONE),rootShow(false),minShow(false),dragging(false),scaling(false),
@@ -188,47 +189,25 @@ plot(QPainter& painter,int funcId)
     else
         curvepen.setWidth(2);
 
-    
-    float xold=xmin;
+    // samples are cached by the functions until the view or function changes
+    const std::vector<SeExprSampler::Sample>& samples=
+        funcs.sample(funcId,SeExprSampler::View(xmin,xmax,ymin,ymax,width(),height()));
     QPainterPath path;
-    bool first=false;
-
-    float yold=funcs.eval(funcId,xold);
-    float xd,yd;
-
-    const bool error=false;//isnan(yold);
-    xform(xold,yold,xd,yd);
-    if(error) first=true;
-    else{
-        path.moveTo(xd,yd);
-        first=false;
-    }
-
-    float x_per_pixel=(xmax-xmin)/width(),y_per_pixel=(ymax-ymin)/height();
-    int plotted=0;
-    float xrate=x_per_pixel*1;
-    //fedisableexcept(FE_ALL_EXCEPT);
-    while(xold<xmax){
-        bool disjoint=false;
-        float x=xold+xrate;
-        float y=funcs.eval(funcId,x);
-        if(!error){
-            if(fabs(y-yold)>y_per_pixel*100 && xrate>.1*x_per_pixel){xrate/=2;continue;}
-            if(fabs(y-yold)<y_per_pixel*5 && xrate<x_per_pixel){xrate*=2;}
-                
-            float xd,yd;
-            xform(x,y,xd,yd);
-            if(first || y>ymax || y<ymin){path.moveTo(xd,yd);disjoint=true;}
-            else path.lineTo(xd,yd);
+    // a gap in the curve (nan or inf) starts a new subpath after it
+    bool gap=true;
+    for(size_t i=0;i<samples.size();i++){
+        float x=samples[i].x,y=samples[i].y;
+        if(!qIsFinite(y)){
+            gap=true;
+            continue;
         }
-        first=false;
-        xold=x;
-        yold=y;
-        plotted++;
+        float xd,yd;
+        xform(x,y,xd,yd);
+        if(gap || y>ymax || y<ymin) path.moveTo(xd,yd);
+        else path.lineTo(xd,yd);
+        gap=false;
     }
     painter.strokePath(path,curvepen);
-    //std::cerr<<"Plottted "<<plotted<<std::endl;
-        
 }
 
 void Graph::
@@ -380,7 +359,18 @@ void Graph::
 solveMin(const int function,double xmin,double xmax,bool solveMax)
 {
     if(xmax<xmin) std::swap(xmin,xmax);
-    double xsolve=golden(function,xmin,.5*(xmin+xmax),xmax,solveMax,1e-5);
+
+    // bracket the extremum from a batch of evenly spaced samples, then
+    // refine it between the neighbors of the best one
+    const int n=64;
+    double xs[n],ys[n];
+    for(int i=0;i<n;i++) xs[i]=xmin+(xmax-xmin)*i/(n-1);
+    funcs.eval(function,n,xs,ys);
+    int best=0;
+    for(int i=1;i<n;i++)
+        if(solveMax ? ys[i]>ys[best] : ys[i]<ys[best]) best=i;
+    double lo=xs[std::max(best-1,0)],hi=xs[std::min(best+1,n-1)];
+    double xsolve=golden(function,lo,xs[best],hi,solveMax,1e-5);
     rootX=xsolve;
     rootY=funcs.eval(function,xsolve);
     rootShow=false;
@@ -34,7 +34,29 @@
 */
 #include <SeExpression.h>
 #include <SeExprFunc.h>
+#include <SeExprSampler.h>
+#include <SeExprGraph.h>
+#include <SeExprBake.h>
+#include <SeExprBuiltins.h>
+#include <SeExprCapture.h>
+#include <SeExprGrid.h>
+#include <SeCurve.h>
+#include <SeExprMemory.h>
+#include <SeExprStats.h>
+#include <SeExprTrace.h>
 #include <SeVec3d.h>
+#include <sstream>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#ifndef WINDOWS
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "SeTests.h"
 
@@ -75,6 +97,88 @@ struct SimpleExpression:public SeExpression
 
 };
 
+struct PtrExpression:public SeExpression
+{
+    // Variables that read straight from memory owned by the test
+    mutable std::map<std::string,SeExprPtrVarRef> vars;
+
+    SeExprVarRef* resolveVar(const std::string& name) const
+    {
+        std::map<std::string,SeExprPtrVarRef>::iterator i=vars.find(name);
+        if(i!=vars.end()) return &i->second;
+        return 0;
+    }
+
+    PtrExpression(const std::string& str)
+        :SeExpression(str)
+    {}
+};
+
+struct CapturedExpression:public PtrExpression
+{
+    // Variables read from memory, recorded in a capture
+    SeExprCapture& captured;
+
+    SeExprVarRef* resolveVar(const std::string& name) const
+    {
+        return captured.wrap(name,PtrExpression::resolveVar(name));
+    }
+
+    CapturedExpression(const std::string& str,SeExprCapture& capture)
+        :PtrExpression(str),captured(capture)
+    {
+        setCapture(&capture);
+    }
+};
+
+#ifndef WINDOWS
+// A new directory for the files a test writes
+std::string tempDir()
+{
+    const char* tmp=getenv("TMPDIR");
+    std::string pattern=std::string(tmp && *tmp ? tmp : "/tmp")+"/seexpr-basic-XXXXXX";
+    std::vector<char> name(pattern.begin(),pattern.end());
+    name.push_back(0);
+    return mkdtemp(&name[0]) ? &name[0] : ".";
+}
+
+// Lookups of a ramp bake from one of several threads
+struct BakeLookups
+{
+    SeExprBake* bake;
+    int thread,numThreads;
+    double maxError;
+};
+
+void* runBakeLookups(void* arg)
+{
+    BakeLookups& lookups=*(BakeLookups*)arg;
+    int size=lookups.bake->resolution();
+    for(int y=lookups.thread;y<size;y+=lookups.numThreads)
+        for(int x=0;x<size;x++){
+            double u=(x+.5)/size,v=(y+.5)/size;
+            SeVec3d error=lookups.bake->lookup(u,v)-SeVec3d(u*2+v,v,1);
+            lookups.maxError=std::max(lookups.maxError,error.length());
+            lookups.bake->lookup(u,v,2.5);
+        }
+    return 0;
+}
+
+// Prep an expression on a thread of its own
+void* runPrep(void* arg)
+{
+    SeExpression expr((const char*)arg);
+    expr.isValid();
+    return 0;
+}
+
+// Make an expression on a thread of its own, for another to delete
+void* runNew(void* arg)
+{
+    return new SeExpression((const char*)arg);
+}
+#endif
+
 int main()
 {
     // Basic constant expression
@@ -102,6 +206,684 @@ int main()
         SE_TEST_ASSERT_EQUAL(val[0],7);
     }
 
+    // Variables bound directly to host memory
+    {
+        double xs[3]={1,2,3};
+        float ys[6]={10,0,20,0,30,0};
+        PtrExpression expr("$x+$y");
+        expr.vars["x"].setPtr(xs);
+        expr.vars["y"].setPtr(ys,false,2*sizeof(float));
+        SE_TEST_ASSERT(expr.isValid());
+        SE_TEST_ASSERT(!expr.isVec());
+        for(int i=0;i<3;i++){
+            expr.vars["x"].setIndex(i);
+            expr.vars["y"].setIndex(i);
+            SE_TEST_ASSERT_EQUAL(expr.evaluate()[0],11*(i+1));
+        }
+
+        double P[3]={1,2,3};
+        PtrExpression vecExpr("$P*2");
+        vecExpr.vars["P"].setPtr(P,true);
+        SE_TEST_ASSERT(vecExpr.isVec());
+        SE_TEST_ASSERT_VECTOR_EQUAL(vecExpr.evaluate(),SeVec3d(2,4,6));
+    }
+
+    // Batch evaluation matches evaluating one point at a time
+    {
+        const int n=100;
+        double xs[n],P[3*n];
+        for(int i=0;i<n;i++){
+            xs[i]=i%7-3;
+            P[3*i]=i*.1;P[3*i+1]=-i*.2;P[3*i+2]=i%3;
+        }
+        const char* exprs[]={
+            "$x+1",
+            "$x>0 ? $P*2 : $x",
+            "$x>0 && $P[0]>2 || $x==-3",
+            "$a=$x; if($x>0){$a=$P[1];$b=$P;}else if($x<-1){$b=1;}else{$b=[$a,0,2];} $a+$b",
+            "$a=[$x,1,2]; $a=[$a[1],$a[0],$a[2]]; $a*($x%2 ? sin($P) : -$P)",
+            "$x<0 ? 0 : voronoi($P)",
+            "hsi($P/10,$x*40,$P[2],1.2,$x%2)+midhsi($P/-5,$x*30,2,.8,$P[0]/10,.5,1)",
+            "saturate($P,$x)+rgbtohsl(hsltorgb($P/10))+ccellnoise($P)+cellnoise($P*3)"};
+        for(unsigned int e=0;e<sizeof(exprs)/sizeof(exprs[0]);e++){
+            PtrExpression expr(exprs[e]);
+            expr.vars["x"].setPtr(xs);
+            expr.vars["P"].setPtr(P,true);
+            SE_TEST_ASSERT(expr.isValid());
+            SeVec3d results[n];
+            expr.evaluateBatch(n,results);
+            for(int i=0;i<n;i++){
+                expr.vars["x"].setIndex(i);
+                expr.vars["P"].setIndex(i);
+                SE_TEST_ASSERT_VECTOR_EQUAL(results[i],expr.evaluate());
+            }
+        }
+    }
+
+    // Static cost estimates
+    {
+        double x=0;
+        PtrExpression constant("1+2"),fbm2("fbm([$x,0,0],2)"),fbm8("fbm([$x,0,0],8)");
+        PtrExpression branch("$x>0 ? fbm([$x,0,0],8) : 0");
+        fbm2.vars["x"].setPtr(&x);
+        fbm8.vars["x"].setPtr(&x);
+        branch.vars["x"].setPtr(&x);
+        SE_TEST_ASSERT(constant.estimateCost().flops<fbm2.estimateCost().flops);
+        SE_TEST_ASSERT(fbm2.estimateCost().flops<fbm8.estimateCost().flops);
+        SE_TEST_ASSERT(fbm8.estimateCost().bytes>0);
+        SE_TEST_ASSERT(branch.estimateCost().flops>fbm8.estimateCost().flops);
+        PtrExpression invalid("$x+");
+        SE_TEST_ASSERT_EQUAL(invalid.estimateCost().flops,0);
+    }
+
+    // Simplex noise vanishes at lattice points, varies smoothly and is cheaper in 4D
+    {
+        SimpleExpression zero("ssimplex4([0,0,0],0)+ssimplex([0,0,0])");
+        SE_TEST_ASSERT_EQUAL(zero.evaluate()[0],0);
+        PtrExpression perlin("fbm4([$x,1,2],$x*.5,8)"),simplex("simplexfbm4([$x,1,2],$x*.5,8)");
+        double x=0;
+        perlin.vars["x"].setPtr(&x);
+        simplex.vars["x"].setPtr(&x);
+        SE_TEST_ASSERT(simplex.estimateCost().flops<perlin.estimateCost().flops);
+        double prev=simplex.evaluate()[0];
+        for(int i=1;i<1000;i++){
+            x=i*.001;
+            double val=simplex.evaluate()[0];
+            SE_TEST_ASSERT(val>0 && val<1);
+            SE_TEST_ASSERT(fabs(val-prev)<.05);
+            prev=val;
+        }
+    }
+
+    // Faster math accuracies stay close to the math library and batch the same
+    {
+        const int n=100;
+        double xs[n];
+        for(int i=0;i<n;i++) xs[i]=i*.07+.01;
+        const char* source="sin($x*3)+cos($x)*exp(-$x)+log($x)+$x^2.5+gamma($x,2.2)+bias($x/7,.3)+gaussstep($x,1,6)";
+        PtrExpression exact(source),accurate(source),fast(source);
+        accurate.setMathAccuracy(SeExprMath::accurate);
+        fast.setMathAccuracy(SeExprMath::fast);
+        PtrExpression* exprs[]={&exact,&accurate,&fast};
+        for(int e=0;e<3;e++) exprs[e]->vars["x"].setPtr(xs);
+        SeVec3d batch[n];
+        fast.evaluateBatch(n,batch);
+        for(int i=0;i<n;i++){
+            for(int e=0;e<3;e++) exprs[e]->vars["x"].setIndex(i);
+            double value=exact.evaluate()[0];
+            SE_TEST_ASSERT(fabs(accurate.evaluate()[0]-value)<=1e-14*(1+fabs(value)));
+            SE_TEST_ASSERT(fabs(fast.evaluate()[0]-value)<=1e-5*(1+fabs(value)));
+            SE_TEST_ASSERT_EQUAL(batch[i][0],fast.evaluate()[0]);
+        }
+    }
+
+    // pow stays within about an ulp for exponents up to 700, and the fast
+    // sine keeps its relative error next to multiples of pi/2
+    {
+        const int n=1000;
+        double xs[n],ys[n],rs[n];
+        for(int i=0;i<n;i++){
+            xs[i]=exp((i%100-49.5)/7);
+            ys[i]=(i*.7021-350)/fabs(log(xs[i]));
+        }
+        SeExprMath::pow(SeExprMath::accurate,n,xs,ys,rs);
+        for(int i=0;i<n;i++){
+            double value=pow(xs[i],ys[i]);
+            SE_TEST_ASSERT(fabs(rs[i]-value)<=2*DBL_EPSILON*value);
+        }
+        for(int i=0;i<n;i++) xs[i]=nextafter((i*63+1)*M_PI_2,0.);
+        SeExprMath::sin(SeExprMath::fast,n,xs,rs);
+        for(int i=0;i<n;i++){
+            double value=sin(xs[i]);
+            SE_TEST_ASSERT(fabs(rs[i]-value)<=1e-6*fabs(value));
+        }
+    }
+
+    // Weighted choices with constant weights never pick zero weights
+    {
+        double x=0;
+        PtrExpression pick("pick($x,0,3,1,0,1,0)"),wchoose("wchoose($x,10,0,20,1,30,0,40,2)");
+        pick.vars["x"].setPtr(&x);
+        wchoose.vars["x"].setPtr(&x);
+        for(int i=0;i<=100;i++){
+            x=i/100.;
+            double p=pick.evaluate()[0],w=wchoose.evaluate()[0];
+            SE_TEST_ASSERT(p==0 || p==2);
+            SE_TEST_ASSERT(w==20 || w==40);
+        }
+    }
+
+    // Weight tables built at prep choose as the original functions do,
+    // in batches as one point at a time, over random tables with zeros
+    {
+        unsigned int seed=1;
+        const int n=64;
+        double keys[n];
+        for(int i=0;i<n;i++) keys[i]=i<4 ? i*.5-.5 : i/double(n-1);
+        for(int trial=0;trial<200;trial++){
+            seed=seed*1103515245+12345;
+            int numWeights=2+(seed>>16)%7;
+            std::vector<double> weights(numWeights);
+            std::ostringstream w;
+            for(int i=0;i<numWeights;i++){
+                seed=seed*1103515245+12345;
+                // a third of the weights are zero, the rest quarters up to 4
+                int r=(seed>>16)%24;
+                weights[i]=r<8 ? 0 : (r-7)*.25;
+                w<<","<<weights[i];
+            }
+            int lo=trial%3,hi=lo+numWeights-1+trial%2;
+            std::ostringstream pickStr,chooseStr,wchooseStr;
+            pickStr<<"pick($x,"<<lo<<","<<hi<<w.str()<<")";
+            chooseStr<<"choose($x"<<w.str()<<",7)";
+            wchooseStr<<"wchoose($x";
+            for(int i=0;i<numWeights;i++) wchooseStr<<","<<10+i<<","<<weights[i];
+            wchooseStr<<")";
+            PtrExpression pick(pickStr.str()),choose(chooseStr.str()),wchoose(wchooseStr.str());
+            PtrExpression* exprs[3]={&pick,&choose,&wchoose};
+            SeVec3d batch[3][n];
+            for(int e=0;e<3;e++){
+                exprs[e]->vars["x"].setPtr(keys);
+                SE_TEST_ASSERT(exprs[e]->isValid());
+                exprs[e]->evaluateBatch(n,batch[e]);
+            }
+            for(int i=0;i<n;i++){
+                std::vector<double> params(1,keys[i]);
+                params.push_back(lo);
+                params.push_back(hi);
+                params.insert(params.end(),weights.begin(),weights.end());
+                std::vector<double> chooseParams(1,keys[i]);
+                chooseParams.insert(chooseParams.end(),weights.begin(),weights.end());
+                chooseParams.push_back(7);
+                std::vector<double> wchooseParams(1,keys[i]);
+                for(int j=0;j<numWeights;j++){
+                    wchooseParams.push_back(10+j);
+                    wchooseParams.push_back(weights[j]);
+                }
+                double expected[3]={SeExpr::pick(params.size(),&params[0]),
+                                    SeExpr::choose(chooseParams.size(),&chooseParams[0]),
+                                    SeExpr::wchoose(wchooseParams.size(),&wchooseParams[0])};
+                for(int e=0;e<3;e++){
+                    exprs[e]->vars["x"].setIndex(i);
+                    SE_TEST_ASSERT_EQUAL(exprs[e]->evaluate()[0],expected[e]);
+                    SE_TEST_ASSERT_EQUAL(batch[e][i][0],expected[e]);
+                }
+            }
+        }
+    }
+
+    // Batches of hashes and noise give the same bits as single points,
+    // including at zeros, infinities, nan and huge arguments
+    {
+        const double special[]={0,-0.,NAN,INFINITY,-INFINITY,1e300,-1e300,1e-310,
+                                4.5e15,-123456.75,.5,-.5,1,-1,3.25,DBL_MAX};
+        const int numSpecial=sizeof(special)/sizeof(special[0]),n=numSpecial*numSpecial;
+        std::vector<double> xs(n),ys(n);
+        for(int i=0;i<n;i++){
+            xs[i]=special[i%numSpecial];
+            ys[i]=special[i/numSpecial];
+        }
+        const char* strs[]={"hash($x)","hash($x,$y,7)","cellnoise([$x,$y,$x])",
+                            "ccellnoise([$y,$x,1])","noise($x,$y)","noise([$x,$y,.5])"};
+        for(size_t e=0;e<sizeof(strs)/sizeof(strs[0]);e++){
+            PtrExpression expr(strs[e]);
+            expr.vars["x"].setPtr(&xs[0]);
+            expr.vars["y"].setPtr(&ys[0]);
+            SE_TEST_ASSERT(expr.isValid());
+            std::vector<SeVec3d> batch(n);
+            expr.evaluateBatch(n,&batch[0]);
+            for(int i=0;i<n;i++){
+                expr.vars["x"].setIndex(i);
+                expr.vars["y"].setIndex(i);
+                SeVec3d single=expr.evaluate();
+                SE_TEST_ASSERT(memcmp(&single[0],&batch[i][0],sizeof(single))==0);
+            }
+        }
+    }
+
+    // Grid evaluation interpolates where the results are smooth
+    {
+        const int nx=65,ny=33,n=nx*ny;
+        std::vector<double> u(n),v(n);
+        for(int i=0;i<n;i++){u[i]=i%nx/double(nx-1);v[i]=i/nx/double(ny-1);}
+        const char* exprs[]={"$u*2+$v","[sin($u*3),$v*$v,0]","noise($u*9,$v*9)"};
+        for(int e=0;e<3;e++){
+            PtrExpression expr(exprs[e]);
+            expr.vars["u"].setPtr(&u[0]);
+            expr.vars["v"].setPtr(&v[0]);
+            std::vector<SeVec3d> exact(n),exactGrid(n),approx(n);
+            expr.evaluateBatch(n,&exact[0]);
+            SE_TEST_ASSERT_EQUAL(expr.evaluateGrid(SeExprGrid(nx,ny),&exactGrid[0])<n,e==0);
+            int evaluated=expr.evaluateGrid(SeExprGrid(nx,ny,1,1e-2),&approx[0]);
+            SE_TEST_ASSERT(evaluated<n/2 || e==2);
+            double err=0;
+            for(int i=0;i<n;i++){
+                for(int c=0;c<3;c++){
+                    err=std::max(err,fabs(approx[i][c]-exact[i][c]));
+                    if(e) SE_TEST_ASSERT_EQUAL(exactGrid[i][c],exact[i][c]);
+                }
+            }
+            SE_TEST_ASSERT(err<=1e-2 || e==2);
+        }
+    }
+
+#ifndef WINDOWS
+    // Bakes match the expression at texel centers and are reused from the cache file
+    {
+        const char* ramp="[$u*2+$v,$v,1]";
+        std::string dir=tempDir();
+        SeExprBake bake(dir,ramp,100);
+        SE_TEST_ASSERT(bake.isValid());
+        SE_TEST_ASSERT_EQUAL(bake.resolution(),128);
+        SE_TEST_ASSERT_EQUAL(bake.numLevels(),8);
+        SE_TEST_ASSERT_VECTOR_EQUAL(bake.lookup(10.5/128,3.5/128),SeVec3d(24.5/128,3.5/128,1));
+        SeVec3d coarse=bake.lookup(10.5/128,3.5/128,1)-SeVec3d(24.5/128,3.5/128,1);
+        SE_TEST_ASSERT(coarse.length()<1e-6);
+        bake.bakeAll(2);
+        SE_TEST_ASSERT_EQUAL(bake.numTilesMade(),11);
+        SeExprBake again(dir,ramp,128);
+        SE_TEST_ASSERT_EQUAL(again.path(),bake.path());
+        SE_TEST_ASSERT_VECTOR_EQUAL(again.lookup(.3,.7,2.5),bake.lookup(.3,.7,2.5));
+        SE_TEST_ASSERT_EQUAL(again.numTilesMade(),0);
+        // a file of another size at the path is replaced, not truncated in place
+        {
+            std::ofstream stale((bake.path()+".old").c_str());
+            stale << "stale";
+        }
+        SE_TEST_ASSERT(rename((bake.path()+".old").c_str(),bake.path().c_str())==0);
+        SeExprBake replaced(dir,ramp,128);
+        SE_TEST_ASSERT(replaced.isValid());
+        SE_TEST_ASSERT_VECTOR_EQUAL(replaced.lookup(.3,.7,2.5),bake.lookup(.3,.7,2.5));
+        SE_TEST_ASSERT(replaced.numTilesMade()>0);
+        SE_TEST_ASSERT(!SeExprBake(dir,"$P",64).isValid());
+        // resolutions past the largest are errors, not huge files
+        SE_TEST_ASSERT(!SeExprBake(dir,ramp,SeExprBake::maxResolution+1).isValid());
+        SE_TEST_ASSERT(!SeExpression("baked(\"$u\",.5,.5,0,5e6)").isValid());
+        SE_TEST_ASSERT(!SeExpression("baked(\"$u\",.5,.5,0,1e300)").isValid());
+        // threads looking up at once make each tile once
+        SeExprBake shared(dir,ramp,512);
+        const int numThreads=4;
+        BakeLookups lookups[numThreads];
+        pthread_t threads[numThreads];
+        for(int t=0;t<numThreads;t++){
+            BakeLookups l={&shared,t,numThreads,0};
+            lookups[t]=l;
+            pthread_create(&threads[t],0,runBakeLookups,&lookups[t]);
+        }
+        for(int t=0;t<numThreads;t++){
+            pthread_join(threads[t],0);
+            SE_TEST_ASSERT(lookups[t].maxError<1e-6);
+        }
+        SE_TEST_ASSERT_EQUAL(shared.numTilesMade(),64+16+4+1);
+        std::remove(bake.path().c_str());
+        std::remove(shared.path().c_str());
+        rmdir(dir.c_str());
+    }
+#endif
+
+    // Pure function calls remember results for repeated arguments
+    {
+        const int n=256;
+        double xs[n];
+        for(int i=0;i<n;i++) xs[i]=i/32;
+        PtrExpression memo("voronoi([$x,0,0])+curve($x/8,0,0,1,1,1,1)"),other("voronoi([$x,0,0])");
+        memo.vars["x"].setPtr(xs);
+        other.vars["x"].setPtr(xs);
+        SeVec3d results[n],expected[n];
+        memo.evaluateBatch(n,results);
+        other.evaluateBatch(n,expected);
+        for(int i=0;i<n;i++){
+            SE_TEST_ASSERT_VECTOR_EQUAL(results[i],expected[i]+SeVec3d(xs[i]/8));
+        }
+        size_t lookups,hits;
+        memo.memoStats(lookups,hits);
+        SE_TEST_ASSERT_EQUAL(lookups,size_t(2*n));
+        SE_TEST_ASSERT_EQUAL(hits,size_t(2*(n-8)));
+        // arguments that never repeat only cost a second evaluation, so the call stops looking
+        const int unique=4096;
+        std::vector<double> us(unique);
+        for(int i=0;i<unique;i++) us[i]=i;
+        std::vector<SeVec3d> uniqueResults(unique);
+        PtrExpression misses("voronoi([$x,0,0])");
+        misses.vars["x"].setPtr(&us[0]);
+        misses.evaluateBatch(unique,&uniqueResults[0]);
+        misses.memoStats(lookups,hits);
+        SE_TEST_ASSERT_EQUAL(hits,size_t(0));
+        SE_TEST_ASSERT(lookups<size_t(unique));
+    }
+
+    // Editing an expression keeps unchanged calls working and rebuilds changed ones
+    {
+        double x=0;
+        const char* edits[]={
+            "curve($x,0,0,4,1,1,4)+pick($x,0,3,1,0,1,0)",
+            "curve($x,0,0,4,1,1,4)*2+pick($x,0,3,1,0,1,0)",
+            "curve($x,0,0,4,1,3,4)*2+pick($x,0,3,1,0,1,0)",
+            "$a=$x*2; curve($a,0,0,4,1,3,4)*2+pick($x,0,3,1,0,1,0)"};
+        PtrExpression edited(edits[0]);
+        edited.vars["x"].setPtr(&x);
+        for(unsigned int e=0;e<sizeof(edits)/sizeof(edits[0]);e++){
+            PtrExpression fresh(edits[e]);
+            fresh.vars["x"].setPtr(&x);
+            if(e) edited.setExpr(edits[e]);
+            SE_TEST_ASSERT(edited.isValid());
+            for(int i=0;i<=10;i++){
+                x=i/10.;
+                SE_TEST_ASSERT_VECTOR_EQUAL(edited.evaluate(),fresh.evaluate());
+            }
+        }
+    }
+
+    // Expression graphs evaluate upstream first and only rerun what changed
+    {
+        const int n=50;
+        double xs[n];
+        for(int i=0;i<n;i++) xs[i]=i;
+        SeExprGraph graph;
+        graph.setExpr("c","[$a,$b,0]");
+        graph.setExpr("b","$a+1");
+        graph.setExpr("a","$x*2");
+        graph.setExpr("d","$e");
+        graph.setExpr("e","$d");
+        graph.setInput("x",xs);
+        SE_TEST_ASSERT(graph.isValid("c") && graph.isVec("c") && !graph.isVec("b"));
+        SE_TEST_ASSERT(!graph.isValid("d") && !graph.isValid("e"));
+        graph.evaluate(n);
+        const SeVec3d* c=graph.result("c");
+        for(int i=0;i<n;i++){
+            SE_TEST_ASSERT_VECTOR_EQUAL(c[i],SeVec3d(2*i,2*i+1,0));
+        }
+        graph.evaluate(n);
+        SE_TEST_ASSERT_EQUAL(graph.numEvaluated(),0);
+        graph.touchInput("x");
+        graph.evaluate(n);
+        SE_TEST_ASSERT_EQUAL(graph.numEvaluated(),1);
+        xs[3]=-1;
+        graph.touchInput("x");
+        graph.setExpr("b","$a-1");
+        graph.evaluate(n);
+        SE_TEST_ASSERT_EQUAL(graph.numEvaluated(),3);
+        SE_TEST_ASSERT_VECTOR_EQUAL(graph.result("c")[3],SeVec3d(-2,-3,0));
+        // edits prep again only the node and what reads it
+        SeExprStats::setEnabled(true);
+        SeExprStats::reset();
+        graph.setExpr("f","$c*2");
+        SE_TEST_ASSERT(graph.isValid("f"));
+        SE_TEST_ASSERT_EQUAL(SeExprStats::total(SeExprStats::parses),1);
+        graph.setExpr("b","$a");
+        SE_TEST_ASSERT(graph.isValid("f"));
+        SE_TEST_ASSERT_EQUAL(SeExprStats::total(SeExprStats::parses),2);
+        graph.remove("a");
+        SE_TEST_ASSERT(!graph.isValid("f") && !graph.isValid("b"));
+        SE_TEST_ASSERT_EQUAL(SeExprStats::total(SeExprStats::parses),5);
+        SeExprStats::setEnabled(false);
+        SeExprStats::reset();
+        graph.setExpr("a","$x*3");
+        SE_TEST_ASSERT(graph.isValid("f"));
+        // a cycle closed through nodes that weren't edited
+        graph.setExpr("a","$f");
+        SE_TEST_ASSERT(!graph.isValid("a") && !graph.isValid("c") && !graph.isValid("f"));
+        graph.setExpr("a","$x");
+        SE_TEST_ASSERT(graph.isValid("f"));
+        graph.evaluate(n);
+        SE_TEST_ASSERT_VECTOR_EQUAL(graph.result("f")[5],SeVec3d(10,10,0));
+    }
+
+    // Sampled curves are refined where they bend and match across threads
+    {
+        SeExprSampler::View view(-10,10,-10,10,600,300);
+        SeExprSampler one(1),four(4);
+        SE_TEST_ASSERT(one.setExpr(0,"x/2") && one.setExpr(1,"snoise([x*3,0,0])*5"));
+        SE_TEST_ASSERT(four.setExpr(1,"snoise([x*3,0,0])*5"));
+        SE_TEST_ASSERT(!one.setExpr(2,"x+"));
+        SE_TEST_ASSERT_EQUAL(one.sample(0,view).size(),size_t(602));
+        const std::vector<SeExprSampler::Sample>& a=one.sample(1,view);
+        const std::vector<SeExprSampler::Sample>& b=four.sample(1,view);
+        SE_TEST_ASSERT(a.size()>602);
+        SE_TEST_ASSERT_EQUAL(a.size(),b.size());
+        for(size_t i=0;i<a.size() && i<b.size();i++){
+            SE_TEST_ASSERT_EQUAL(a[i].x,b[i].x);
+            SE_TEST_ASSERT_EQUAL(a[i].y,b[i].y);
+        }
+    }
+
+    // Statistics count what happens while they're on
+    {
+        SeExprStats::setEnabled(true);
+        SeExprStats::reset();
+        double xs[10]={0,1,2,3,4,5,6,7,8,9};
+        PtrExpression expr("curve($x,0,0,4,1,1,4)*2");
+        expr.vars["x"].setPtr(xs);
+        for(int i=0;i<3;i++) expr.evaluate();
+        SeVec3d results[10];
+        expr.evaluateBatch(10,results);
+        SeExpression invalid("1+");
+        SE_TEST_ASSERT(!invalid.isValid());
+        SeExprStats::setEnabled(false);
+        expr.evaluate();
+        SE_TEST_ASSERT_EQUAL(SeExprStats::total(SeExprStats::evals),3);
+        SE_TEST_ASSERT_EQUAL(SeExprStats::total(SeExprStats::batchPoints),10);
+        SE_TEST_ASSERT_EQUAL(SeExprStats::total(SeExprStats::parseErrors),1);
+        uint64_t lookups,hits;
+        SeExprStats::cacheTotals(SeExprStats::memoCache,lookups,hits);
+        SE_TEST_ASSERT_EQUAL(lookups,13);
+        SE_TEST_ASSERT_EQUAL(hits,3);
+        std::string json=SeExprStats::json();
+        SE_TEST_ASSERT(json.find("{\"expr\": \"curve($x,0,0,4,1,1,4)*2\", \"evals\": 4, \"points\": 13")!=std::string::npos);
+        SE_TEST_ASSERT(json.find("{\"name\": \"curve\", \"preps\": 1, \"evals\": 10}")!=std::string::npos);
+        SE_TEST_ASSERT(json.find("\"instructions\"")==std::string::npos);
+        // hardware counters are added where the system permits them
+        SeExprStats::setEnabled(true);
+        bool counted=SeExprStats::setHardwareCounters(true);
+        SE_TEST_ASSERT_EQUAL(SeExprStats::hardwareCounters(),counted);
+        expr.evaluate();
+        SeExprStats::setHardwareCounters(false);
+        SeExprStats::setEnabled(false);
+        SE_TEST_ASSERT_EQUAL(SeExprStats::json().find("\"instructions\"")!=std::string::npos,counted);
+        SeExprStats::reset();
+    }
+
+    // Tracing records scopes while it's on
+    {
+        SeExprTrace::clear();
+        SeExprTrace::setEnabled(true);
+        SeExpression traced("curve(.5,0,0,4,1,1,4)");
+        SE_TEST_ASSERT(traced.isValid());
+        SeExprTrace::setEnabled(false);
+        SeExpression untraced("3*4");
+        SE_TEST_ASSERT(untraced.isValid());
+        std::string json=SeExprTrace::json();
+        SE_TEST_ASSERT(json.find("\"name\": \"prep\"")!=std::string::npos);
+        SE_TEST_ASSERT(json.find("{\"detail\": \"curve\"}")!=std::string::npos);
+        SE_TEST_ASSERT(json.find("3*4")==std::string::npos);
+#ifndef WINDOWS
+        // threads that trace in turn share a buffer, keeping their events
+        SeExprTrace::clear();
+        SeExprTrace::setEnabled(true);
+        const char* exprs[]={"7*6","8*6"};
+        for(int t=0;t<2;t++){
+            pthread_t thread;
+            pthread_create(&thread,0,runPrep,(void*)exprs[t]);
+            pthread_join(thread,0);
+        }
+        SeExprTrace::setEnabled(false);
+        json=SeExprTrace::json();
+        SE_TEST_ASSERT(json.find("7*6")!=std::string::npos && json.find("8*6")!=std::string::npos);
+#endif
+        SeExprTrace::clear();
+        SE_TEST_ASSERT(SeExprTrace::json().find("prep")==std::string::npos);
+    }
+
+#ifndef WINDOWS
+    // A capture records the variables and results of each point evaluated
+    {
+        double xs[10],ps[30];
+        for(int i=0;i<10;i++){
+            xs[i]=i*.1;
+            for(int c=0;c<3;c++) ps[3*i+c]=i+c;
+        }
+        std::string dir=tempDir(),file=dir+"/basic.secap";
+        const char* path=file.c_str();
+        SeVec3d results[10];
+        {
+            SeExprCapture capture(path);
+            // the header has the text the rows were captured with
+            CapturedExpression expr("$x",capture);
+            expr.setExpr("$x>.5 ? $P*2 : $x");
+            expr.vars["x"].setPtr(xs);
+            expr.vars["P"].setPtr(ps,true);
+            for(int i=0;i<3;i++){
+                expr.vars["x"].setIndex(i);
+                expr.vars["P"].setIndex(i);
+                results[i]=expr.evaluate();
+            }
+            expr.vars["x"].setIndex(3);
+            expr.vars["P"].setIndex(3);
+            expr.evaluateBatch(7,results+3);
+            SE_TEST_ASSERT(capture.error().empty());
+            SE_TEST_ASSERT_EQUAL(capture.evals(),10);
+        }
+        SeExprCapture::Contents contents;
+        std::string error;
+        SE_TEST_ASSERT(SeExprCapture::read(path,contents,error));
+        remove(path);
+        SE_TEST_ASSERT_EQUAL(contents.expr,std::string("$x>.5 ? $P*2 : $x"));
+        SE_TEST_ASSERT_EQUAL(contents.evals,10);
+        SE_TEST_ASSERT_EQUAL(contents.vars.size(),2);
+        for(size_t v=0;v<contents.vars.size();v++){
+            const SeExprCapture::Variable& var=contents.vars[v];
+            SE_TEST_ASSERT_EQUAL(var.isVec,var.name=="P");
+            // P is only read where x > .5
+            for(int i=0;i<10;i++){
+                if(var.name=="x"){SE_TEST_ASSERT_EQUAL(var.values[i],xs[i]);}
+                else if(xs[i]>.5){SE_TEST_ASSERT_EQUAL(var.values[3*i+2],ps[3*i+2]);}
+            }
+        }
+        for(int i=0;i<10;i++) SE_TEST_ASSERT(contents.results[i]==results[i]);
+        SE_TEST_ASSERT(results[9]==SeVec3d(18,20,22));
+        // blocks of smoothly varying values read back exactly, smaller
+        const int n=10000;
+        std::vector<double> us(n);
+        for(int i=0;i<n;i++) us[i]=(i%320+.5)/320;
+        {
+            SeExprCapture capture(path);
+            CapturedExpression expr("[$u*3,$u*$u,1]",capture);
+            expr.vars["u"].setPtr(&us[0]);
+            std::vector<SeVec3d> values(n);
+            expr.evaluateBatch(n,&values[0]);
+            SE_TEST_ASSERT_EQUAL(capture.evals(),n);
+            // the expression can't change once rows are captured
+            expr.setExpr("$u");
+            SE_TEST_ASSERT(!capture.error().empty());
+        }
+        std::vector<SeVec3d> values(n);
+        {
+            SeExprCapture capture(path);
+            CapturedExpression expr("[$u*3,$u*$u,1]",capture);
+            expr.vars["u"].setPtr(&us[0]);
+            expr.evaluateBatch(n,&values[0]);
+        }
+        struct stat info;
+        SE_TEST_ASSERT(stat(path,&info)==0 && size_t(info.st_size)<n*4*sizeof(double)/2);
+        SE_TEST_ASSERT(SeExprCapture::read(path,contents,error));
+        SE_TEST_ASSERT_EQUAL(contents.evals,n);
+        for(int i=0;i<n;i++){
+            SE_TEST_ASSERT_EQUAL(contents.vars[0].values[i],us[i]);
+            SE_TEST_ASSERT(contents.results[i]==values[i]);
+        }
+        // corrupt or truncated files are errors: no rows, too many rows, cut short
+        std::string bytes;
+        {
+            std::ifstream in(path,std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(in),std::istreambuf_iterator<char>());
+        }
+        size_t rowsAt=16+4+contents.expr.size()+1+4;
+        for(size_t v=0;v<contents.vars.size();v++) rowsAt+=4+contents.vars[v].name.size()+1;
+        const char* badRows[]={"\0\0\0\0","\xff\xff\xff\x7f"};
+        for(int b=0;b<3;b++){
+            std::string bad=b<2 ? bytes.substr(0,rowsAt)+std::string(badRows[b],4)+bytes.substr(rowsAt+4)
+                : bytes.substr(0,bytes.size()-7);
+            {
+                std::ofstream out(path,std::ios::binary);
+                out << bad;
+            }
+            SE_TEST_ASSERT(!SeExprCapture::read(path,contents,error));
+        }
+        remove(path);
+        rmdir(dir.c_str());
+    }
+#endif
+
+    // Memory is broken down by node type and funcx data type
+    {
+        SeExpression expr("curve(.5,0,0,4,1,1,4)+2");
+        size_t unparsed=expr.memoryUsage();
+        SE_TEST_ASSERT(expr.isValid());
+        SeExprMemory usage;
+        size_t bytes=expr.memoryUsage(usage);
+        SE_TEST_ASSERT(bytes>unparsed);
+        SE_TEST_ASSERT_EQUAL(bytes,usage.bytes);
+        SE_TEST_ASSERT_EQUAL(usage.nodes["SeExprFuncNode"].count,1);
+        SE_TEST_ASSERT_EQUAL(usage.nodes["SeExprNumNode"].count,8);
+        SE_TEST_ASSERT_EQUAL(usage.data["SeExpr::CurveData<double>"].count,1);
+        SE_TEST_ASSERT(usage.data["SeExpr::CurveData<double>"].bytes>=4*sizeof(SeExpr::SeCurve<double>::CV));
+        SeExprMemory process=SeExprMemory::process();
+        SE_TEST_ASSERT(process.expressions>=1 && process.bytes>=bytes);
+        SE_TEST_ASSERT(process.json().find("\"kind\": \"SeExpr::CurveData<double>\"")!=std::string::npos);
+#ifndef WINDOWS
+        // an expression made on one thread may be destroyed on another
+        pthread_t thread;
+        pthread_create(&thread,0,runNew,(void*)"1+2");
+        void* made=0;
+        pthread_join(thread,&made);
+        SE_TEST_ASSERT_EQUAL(SeExprMemory::process().expressions,process.expressions+1);
+        delete (SeExpression*)made;
+        SE_TEST_ASSERT_EQUAL(SeExprMemory::process().expressions,process.expressions);
+#endif
+    }
+
+    // Builtins are listed once each in order, and defined functions replace them
+    {
+        std::vector<std::string> names;
+        SeExprFunc::getFunctionNames(names);
+        SE_TEST_ASSERT(names.size()>100);
+        for(size_t i=1;i<names.size();i++) SE_TEST_ASSERT(names[i-1]<names[i]);
+        SE_TEST_ASSERT(SeExprFunc::lookup("noise") && !SeExprFunc::lookup("nosuchfunc"));
+        SE_TEST_ASSERT_EQUAL(SeExprFunc::getDocString("sin"),std::string("float sin(float angle)\nsine in radians"));
+        SeExprFunc::define("deg",SeExprFunc(SeExpr::rad),"replaced");
+        SE_TEST_ASSERT_EQUAL(SeExprFunc::getDocString("deg"),std::string("replaced"));
+        SeExpression expr("deg(180)");
+        SE_TEST_ASSERT_EQUAL(expr.evaluate()[0],M_PI);
+        SeExprFunc::define("deg",SeExprFunc(SeExpr::deg),"float deg(float angle)\nradians to degrees");
+    }
+
+#ifdef SE_TEST_PLUGINS
+    // Plugins listed in a manifest load when first used, yet a later one
+    // still replaces the functions of an earlier one
+    {
+        std::string dir=tempDir(),manifest=dir+"/manifest";
+        {
+            std::ofstream out(manifest.c_str());
+            const char* plugins[]={"SeExprTestPluginA.so\ttestfoo testbar","SeExprTestPluginB.so\ttestfoo"};
+            for(int i=0;i<2;i++){
+                std::string entry=plugins[i];
+                std::string path=std::string(SE_TEST_PLUGINS)+"/"+entry.substr(0,entry.find('\t'));
+                struct stat info;
+                SE_TEST_ASSERT(stat(path.c_str(),&info)==0);
+                out<<path<<'\t'<<info.st_mtime<<'\t'<<info.st_size<<entry.substr(entry.find('\t'))<<'\n';
+            }
+        }
+        chmod(manifest.c_str(),0600);
+        setenv("SE_EXPR_PLUGIN_CACHE",manifest.c_str(),1);
+        SeExprFunc::loadPlugins(SE_TEST_PLUGINS);
+        SeExpression expr("testbar(0)+testfoo(0)");
+        SE_TEST_ASSERT_EQUAL(expr.evaluate()[0],12);
+        unsetenv("SE_EXPR_PLUGIN_CACHE");
+        std::remove(manifest.c_str());
+        rmdir(dir.c_str());
+    }
+#endif
+
     // Simple expression with custom function
     {
         SimpleExpression expr("custom(1,2)");